@@ -0,0 +1,842 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include "calc_internal.h"
+
+// Microbenchmarks for the evaluator. Each benchmark is calibrated to run
+// for at least the target time, then measured BENCH_RUNS times; the median
+// run is reported. Inputs and the random seed are fixed, so results are
+// comparable between commits:
+//   bench --json base.json          (on the old commit)
+//   bench --compare base.json       (on the new one)
+
+#define BENCH_RUNS 5
+#define BENCH_MAX 256
+#define REGRESSION_THRESHOLD 0.10
+
+// Allocation counting, compiled in only with -DCALC_COUNT_ALLOCS (glibc
+// only): these definitions take the place of the C library's allocator
+// entry points for the whole program and forward to glibc's
+// implementations. Without it allocations are reported as 0.
+unsigned long alloc_count = 0;
+
+#ifdef CALC_COUNT_ALLOCS
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+void* malloc(size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+#endif
+
+// A benchmark runs its operation `iterations` times on prepared state
+typedef void (*BenchFunc)(void *state, long iterations);
+
+typedef struct {
+    char name[64];
+    long iterations;
+    double ns_per_op;
+    double ops_per_sec;
+    double allocs_per_op;
+} BenchResult;
+
+typedef struct {
+    double target_ms;
+    const char *filter;
+    BenchResult results[BENCH_MAX];
+    int result_count;
+} BenchSuite;
+
+// Sink that keeps results observable so the optimizer cannot drop work
+volatile double bench_sink;
+
+double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void bench_run(BenchSuite *suite, const char *name, BenchFunc func, void *state) {
+    if (suite->filter != NULL && strstr(name, suite->filter) == NULL) return;
+    if (suite->result_count == BENCH_MAX) return;
+
+    // Calibrate: double the iteration count until one run is long enough
+    long iterations = 1;
+    while (1) {
+        double start = now_ns();
+        func(state, iterations);
+        double elapsed = now_ns() - start;
+        if (elapsed >= suite->target_ms * 1e6 || iterations >= (1L << 40)) break;
+        long scaled = elapsed > 0 ? (long)(iterations * suite->target_ms * 1e6 / elapsed * 1.2) : iterations * 16;
+        iterations = scaled > iterations * 16 ? iterations * 16 : scaled > iterations ? scaled : iterations * 2;
+    }
+
+    double times[BENCH_RUNS];
+    unsigned long allocs = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        unsigned long before = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+        double start = now_ns();
+        func(state, iterations);
+        times[run] = (now_ns() - start) / iterations;
+        allocs += __atomic_load_n(&alloc_count, __ATOMIC_RELAXED) - before;
+    }
+    qsort(times, BENCH_RUNS, sizeof(double), compare_doubles);
+
+    BenchResult *result = &suite->results[suite->result_count++];
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->iterations = iterations;
+    result->ns_per_op = times[BENCH_RUNS / 2];
+    result->ops_per_sec = 1e9 / result->ns_per_op;
+    result->allocs_per_op = (double)allocs / ((double)iterations * BENCH_RUNS);
+    printf("%-28s %12.1f ns/op %14.0f ops/s %8.2f allocs/op\n", name,
+           result->ns_per_op, result->ops_per_sec, result->allocs_per_op);
+    fflush(stdout);
+}
+
+// Front-end phases on a fixed set of expressions
+const char *const bench_expressions[] = {
+    "2 + 3 * 4",
+    "sin(x)^2 + cos(x)^2",
+    "(x + 1) * (x - 1) / (x^2 + 3.5) - sqrt(abs(x))",
+    "max(1, x, 3) + factorial(5) % 7 - 2^-3",
+    "[1, 2, 3, x] * 2 + 1",
+};
+#define BENCH_EXPRESSION_COUNT (int)(sizeof(bench_expressions) / sizeof(bench_expressions[0]))
+
+typedef struct {
+    Calculator *calc;
+    Program *programs[BENCH_EXPRESSION_COUNT];
+} FrontEndState;
+
+void bench_tokenize(void *arg, long iterations) {
+    for (long i = 0; i < iterations; i++) {
+        int count = 0;
+        CalcError error = CALC_OK;
+        Token *tokens = tokenize(bench_expressions[i % BENCH_EXPRESSION_COUNT], &count, &error);
+        bench_sink = count;
+        free(tokens);
+    }
+    (void)arg;
+}
+
+void bench_compile(void *arg, long iterations) {
+    FrontEndState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        CalcError error = CALC_OK;
+        Program *prog = compile_expression(state->calc, bench_expressions[i % BENCH_EXPRESSION_COUNT], NULL, 0, &error);
+        bench_sink = prog->code_count;
+        program_free(prog);
+    }
+}
+
+void bench_program_run(void *arg, long iterations) {
+    FrontEndState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        CalcError error = CALC_OK;
+        Value result = program_run(state->calc, state->programs[i % BENCH_EXPRESSION_COUNT], NULL, &error);
+        bench_sink = result.real;
+        value_release(&result);
+    }
+}
+
+void bench_evaluate(void *arg, long iterations) {
+    FrontEndState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        CalcError error = CALC_OK;
+        Value result = evaluate_expression(state->calc, bench_expressions[i % BENCH_EXPRESSION_COUNT], &error);
+        bench_sink = result.real;
+        value_release(&result);
+    }
+}
+
+// One function_table entry called through call_function
+typedef struct {
+    Calculator *calc;
+    FunctionDef *func_def;
+    Value args[MAX_FUNC_ARGS];
+    int arg_count;
+} FunctionState;
+
+void bench_function(void *arg, long iterations) {
+    FunctionState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        CalcError error = CALC_OK;
+        Value result = call_function(state->calc, state->func_def, state->args, state->arg_count, &error);
+        bench_sink = result.real;
+        value_release(&result);
+    }
+}
+
+// Arguments for functions whose domain excludes the default 0.5; v is a
+// 1024-point vector, w a 64-point one, L the 1024 x 1024 Laplacian and
+// M a 32 x 32 covariance matrix
+const char *const function_args[][2] = {
+    {"atan2", "1, 2"}, {"acosh", "1.5"}, {"pow", "2, 10"},
+    {"min", "3, 1, 4, 1, 5"}, {"max", "3, 1, 4, 1, 5"}, {"sum", "3, 1, 4, 1, 5"},
+    {"mean", "3, 1, 4, 1, 5"}, {"median", "3, 1, 4, 1, 5"}, {"factorial", "10"},
+    {"gcd", "84, 36"}, {"lcm", "4, 6"}, {"perm", "10, 3"}, {"comb", "10, 3"},
+    {"rand", ""}, {"fft", "v"}, {"ifft", "v"},
+    {"rfft", "v"}, {"conv", "v, w"}, {"xcorr", "v, w"}, {"real", "3+4i"},
+    {"imag", "3+4i"}, {"conj", "3+4i"}, {"arg", "3+4i"}, {"polyval", "poly(w), v"},
+    {"roots", "poly(w)"}, {"polygcd", "poly(w), poly(v)"}, {"polyder", "poly(v)"},
+    {"coeffs", "poly(w)"}, {"degree", "poly(w)"}, {"sparse", "1, 1, 2"},
+    {"speye", "1000"}, {"nnz", "L"}, {"cg", "L, v"}, {"bicgstab", "L, v"},
+    {"det", "M"}, {"trace", "M"}, {"matrix", "v, 32"}, {"eye", "32"},
+    {"transpose", "M"}, {"full", "speye(32)"}, {"eig", "M"}, {"eigvals", "M"},
+    {"svd", "M"}, {"cond", "M"}, {"mpow", "M, 10"}, {"expm", "M"}, {"sqrtm", "M"},
+    {"logm", "M"}, {"lstsq", "v, v"}, {"polyfit", "v, v, 3"}, {"linfit", "v, v"},
+    {"sort", "v"}, {"argsort", "v"}, {"unique", "v"}, {"rank", "v"},
+    {"cumsum", "v"}, {"cumprod", "w"}, {"diff", "v"}, {"movmean", "v, 16"},
+    {"movstd", "v, 16"}, {"movmin", "v, 16"}, {"movmax", "v, 16"},
+};
+
+// Evaluate a comma-separated argument list into values
+int bench_arguments(Calculator *calc, const char *text, Value args[]) {
+    char buffer[256];
+    int count = 0;
+    snprintf(buffer, sizeof(buffer), "%s", text);
+    for (char *item = strtok(buffer, ","); item != NULL; item = strtok(NULL, ",")) {
+        CalcError error = CALC_OK;
+        args[count++] = evaluate_expression(calc, item, &error);
+        if (error != CALC_OK) {
+            fprintf(stderr, "bench: cannot evaluate argument '%s'\n", item);
+            exit(1);
+        }
+    }
+    return count;
+}
+
+void bench_functions(BenchSuite *suite, Calculator *calc) {
+    for (FunctionDef *func_def = function_table; func_def->name[0] != '\0'; func_def++) {
+        const char *text = "0.5";
+        for (size_t i = 0; i < sizeof(function_args) / sizeof(function_args[0]); i++) {
+            if (strcmp(function_args[i][0], func_def->name) == 0) text = function_args[i][1];
+        }
+
+        FunctionState state = {calc, func_def, {{0}}, 0};
+        state.arg_count = bench_arguments(calc, text, state.args);
+        CalcError error = CALC_OK;
+        Value check = call_function(calc, func_def, state.args, state.arg_count, &error);
+        value_release(&check);
+        char name[64];
+        snprintf(name, sizeof(name), "function/%s", func_def->name);
+        if (error == CALC_OK) {
+            bench_run(suite, name, bench_function, &state);
+        } else if (suite->filter == NULL || strstr(name, suite->filter) != NULL) {
+            printf("%-28s skipped: %s(%s) fails: %s\n", name, func_def->name, text, error_message(error));
+        }
+        for (int i = 0; i < state.arg_count; i++) {
+            value_release(&state.args[i]);
+        }
+    }
+}
+
+// Determinant of a diagonally dominant n x n matrix
+void bench_matrix_det(void *arg, long iterations) {
+    Matrix *m = arg;
+    for (long i = 0; i < iterations; i++) {
+        bench_sink = matrix_det(*m);
+    }
+}
+
+void bench_matrices(BenchSuite *suite) {
+    for (int n = 2; n <= MATRIX_SIZE; n += 2) {
+        Matrix m;
+        memset(&m, 0, sizeof(Matrix));
+        m.rows = m.cols = n;
+        for (int r = 0; r < n; r++) {
+            for (int c = 0; c < n; c++) {
+                m.data[r][c] = r == c ? n + 1 : 1.0 / (1 + r + c);
+            }
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "matrix_det/%dx%d", n, n);
+        bench_run(suite, name, bench_matrix_det, &m);
+    }
+}
+
+// Covariance X^T X / 2n of a random 2n x n matrix, symmetric positive
+// definite with a spread of eigenvalues
+DenseMatrix* bench_covariance(Calculator *calc, size_t n) {
+    size_t m = 2 * n;
+    double *x = malloc(m * n * sizeof(double));
+    double *xt = malloc(m * n * sizeof(double));
+    for (size_t i = 0; i < m * n; i++) x[i] = calculator_random(calc) - 0.5;
+    transpose_into(x, xt, m, n);
+    DenseMatrix *c = dense_new(n, n);
+    matrix_multiply(calc, xt, x, c->data, n, m, n);
+    for (size_t i = 0; i < n * n; i++) c->data[i] /= m;
+    free(x);
+    free(xt);
+    return c;
+}
+
+// Dense products, eigenvalues and matrix functions of covariance
+// matrices at 64x64 and 256x256, and 1000-step powers of a Markov chain
+// built from them
+typedef struct {
+    Calculator *calc;
+    Value a;
+    Value chain;
+    DenseMatrix *out;
+} DenseState;
+
+void bench_dense_multiply(void *arg, long iterations) {
+    DenseState *state = arg;
+    size_t n = state->a.matrix->rows;
+    for (long i = 0; i < iterations; i++) {
+        matrix_multiply(state->calc, state->a.matrix->data, state->a.matrix->data, state->out->data, n, n, n);
+        bench_sink = state->out->data[i % n];
+    }
+}
+
+void bench_dense_eigvals(void *arg, long iterations) {
+    DenseState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        CalcError error = CALC_OK;
+        Value result = func_eigvals(state->calc, &state->a, 1, &error);
+        bench_sink = result.vector->re[0];
+        value_release(&result);
+    }
+}
+
+void bench_dense_eig(void *arg, long iterations) {
+    DenseState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        CalcError error = CALC_OK;
+        Value result = func_eig(state->calc, &state->a, 1, &error);
+        bench_sink = result.matrix->data[0];
+        value_release(&result);
+    }
+}
+
+void bench_dense_mpow(void *arg, long iterations) {
+    DenseState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        CalcError error = CALC_OK;
+        Value result = matrix_pow(state->calc, state->chain, 1000, &error);
+        bench_sink = result.matrix->data[0];
+        value_release(&result);
+    }
+}
+
+void bench_dense_expm(void *arg, long iterations) {
+    DenseState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        CalcError error = CALC_OK;
+        Value result = func_expm(state->calc, &state->a, 1, &error);
+        bench_sink = result.matrix->data[0];
+        value_release(&result);
+    }
+}
+
+void bench_dense(BenchSuite *suite, Calculator *calc) {
+    for (size_t n = 64; n <= 256; n *= 4) {
+        DenseState state = {calc, value_matrix(bench_covariance(calc, n)), {0}, dense_new(n, n)};
+
+        // Transition probabilities proportional to the covariance magnitudes
+        DenseMatrix *chain = dense_new(n, n);
+        for (size_t i = 0; i < n; i++) {
+            double sum = 0;
+            for (size_t j = 0; j < n; j++) sum += fabs(state.a.matrix->data[i * n + j]);
+            for (size_t j = 0; j < n; j++) chain->data[i * n + j] = fabs(state.a.matrix->data[i * n + j]) / sum;
+        }
+        state.chain = value_matrix(chain);
+        char name[64];
+        snprintf(name, sizeof(name), "dense/multiply/%zux%zu", n, n);
+        bench_run(suite, name, bench_dense_multiply, &state);
+        snprintf(name, sizeof(name), "dense/eigvals/%zux%zu", n, n);
+        bench_run(suite, name, bench_dense_eigvals, &state);
+        snprintf(name, sizeof(name), "dense/eig/%zux%zu", n, n);
+        bench_run(suite, name, bench_dense_eig, &state);
+        snprintf(name, sizeof(name), "dense/mpow/%zux%zu", n, n);
+        bench_run(suite, name, bench_dense_mpow, &state);
+        snprintf(name, sizeof(name), "dense/expm/%zux%zu", n, n);
+        bench_run(suite, name, bench_dense_expm, &state);
+        value_release(&state.a);
+        value_release(&state.chain);
+        dense_release(state.out);
+    }
+}
+
+// A cubic fitted to a million noisy points, streamed through the QR
+// accumulator in cache-sized batches
+typedef struct {
+    Calculator *calc;
+    Value args[3];
+} FitState;
+
+void bench_polyfit(void *arg, long iterations) {
+    FitState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        CalcError error = CALC_OK;
+        Value result = func_polyfit(state->calc, state->args, 3, &error);
+        bench_sink = result.vector->re[0];
+        value_release(&result);
+    }
+}
+
+void bench_fit(BenchSuite *suite, Calculator *calc) {
+    size_t n = 1000000;
+    Vector *x = vector_new(n, 0), *y = vector_new(n, 0);
+    for (size_t i = 0; i < n; i++) {
+        x->re[i] = (double)i / n;
+        y->re[i] = ((2 * x->re[i] - 1) * x->re[i] + 3) * x->re[i] + calculator_random(calc) - 0.5;
+    }
+    FitState state = {calc, {value_vector(x), value_vector(y), value_real(3)}};
+    bench_run(suite, "lstsq/polyfit/1000000", bench_polyfit, &state);
+    value_release(&state.args[0]);
+    value_release(&state.args[1]);
+}
+
+// A million random doubles through the parallel radix sort, values only
+// and with their positions
+typedef struct {
+    Calculator *calc;
+    Value x;
+} SortState;
+
+void bench_sort_values(void *arg, long iterations) {
+    SortState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        CalcError error = CALC_OK;
+        Value result = func_sort(state->calc, &state->x, 1, &error);
+        bench_sink = result.vector->re[0];
+        value_release(&result);
+    }
+}
+
+void bench_argsort(void *arg, long iterations) {
+    SortState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        CalcError error = CALC_OK;
+        Value result = func_argsort(state->calc, &state->x, 1, &error);
+        bench_sink = result.vector->re[0];
+        value_release(&result);
+    }
+}
+
+void bench_sort(BenchSuite *suite, Calculator *calc) {
+    size_t n = 1000000;
+    Vector *x = vector_new(n, 0);
+    for (size_t i = 0; i < n; i++) {
+        x->re[i] = (calculator_random(calc) - 0.5) * 1e6;
+    }
+    SortState state = {calc, value_vector(x)};
+    bench_run(suite, "sort/sort/1000000", bench_sort_values, &state);
+    bench_run(suite, "sort/argsort/1000000", bench_argsort, &state);
+    value_release(&state.x);
+}
+
+// Moving statistics over a million random points with a 1000-point
+// window, which costs the same as any other window
+typedef struct {
+    Calculator *calc;
+    ValueFunc kernel;
+    Value args[2];
+} MovingState;
+
+void bench_moving_kernel(void *arg, long iterations) {
+    MovingState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        CalcError error = CALC_OK;
+        Value result = state->kernel(state->calc, state->args, 2, &error);
+        bench_sink = result.vector->re[0];
+        value_release(&result);
+    }
+}
+
+void bench_moving(BenchSuite *suite, Calculator *calc) {
+    size_t n = 1000000;
+    Vector *x = vector_new(n, 0);
+    for (size_t i = 0; i < n; i++) {
+        x->re[i] = calculator_random(calc);
+    }
+    MovingState state = {calc, func_movmean, {value_vector(x), value_real(1000)}};
+    bench_run(suite, "moving/movmean/1000000", bench_moving_kernel, &state);
+    state.kernel = func_movstd;
+    bench_run(suite, "moving/movstd/1000000", bench_moving_kernel, &state);
+    state.kernel = func_movmax;
+    bench_run(suite, "moving/movmax/1000000", bench_moving_kernel, &state);
+    value_release(&state.args[0]);
+}
+
+// Exact integers: 2000! (about 5700 digits) by repeated multiplication,
+// its decimal conversion, and comb(1000, 500) with integer arguments
+// through call_function, as the evaluator calls it
+typedef struct {
+    Calculator *calc;
+    Value n;
+    Value product;
+} IntegerState;
+
+void bench_integer_factorial(void *arg, long iterations) {
+    IntegerState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        CalcError error = CALC_OK;
+        Value result = func_ifactorial(state->calc, &state->n, 1, &error);
+        bench_sink = result.bigint->length;
+        value_release(&result);
+    }
+}
+
+void bench_integer_format(void *arg, long iterations) {
+    IntegerState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        char *digits = integer_format(state->product);
+        bench_sink = digits[0];
+        free(digits);
+    }
+}
+
+void bench_integers(BenchSuite *suite, Calculator *calc) {
+    CalcError error = CALC_OK;
+    IntegerState state = {calc, value_integer(2000), value_real(0)};
+    state.product = func_ifactorial(calc, &state.n, 1, &error);
+    bench_run(suite, "integer/factorial/2000", bench_integer_factorial, &state);
+    bench_run(suite, "integer/format/2000!", bench_integer_format, &state);
+    value_release(&state.product);
+    FunctionState comb = {calc, find_function("comb"), {value_integer(1000), value_integer(500)}, 2};
+    bench_run(suite, "integer/comb/1000,500", bench_function, &comb);
+}
+
+// Scripts: a 10000-iteration loop with a branch, exercising the jump,
+// comparison and loop opcodes
+typedef struct {
+    Calculator *calc;
+    Program *program;
+} ScriptState;
+
+void bench_script_loop(void *arg, long iterations) {
+    ScriptState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        CalcError error = CALC_OK;
+        Value result = program_run(state->calc, state->program, NULL, &error);
+        bench_sink = result.type;
+        value_release(&result);
+    }
+}
+
+void bench_scripts(BenchSuite *suite, Calculator *calc) {
+    CalcError error = CALC_OK;
+    int line = 0;
+    const char *source =
+        "s = 0\n"
+        "for n = 1..10000 {\n"
+        "    if n % 3 == 0 { continue }\n"
+        "    s = s + n * n\n"
+        "}\n";
+    ScriptState state = {calc, compile_script(calc, source, &line, &error)};
+    if (state.program == NULL) return;
+    bench_run(suite, "script/loop/10000", bench_script_loop, &state);
+    program_free(state.program);
+}
+
+// Five-point Laplacian on an m x m grid (4 on the diagonal, -1 for each
+// neighbour)
+SparseMatrix* bench_laplacian(int m) {
+    size_t n = (size_t)m * m, count = 0;
+    int *row = malloc(5 * n * sizeof(int));
+    int *col = malloc(5 * n * sizeof(int));
+    double *values = malloc(5 * n * sizeof(double));
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < m; j++) {
+            int r = i * m + j;
+            int neighbours[5] = {r, j > 0 ? r - 1 : -1, j < m - 1 ? r + 1 : -1,
+                                 i > 0 ? r - m : -1, i < m - 1 ? r + m : -1};
+            for (int k = 0; k < 5; k++) {
+                if (neighbours[k] < 0) continue;
+                row[count] = r;
+                col[count] = neighbours[k];
+                values[count++] = k == 0 ? 4 : -1;
+            }
+        }
+    }
+    CalcError error = CALC_OK;
+    SparseMatrix *a = sparse_from_triplets(n, n, count, row, col, values, &error);
+    free(row);
+    free(col);
+    free(values);
+    return a;
+}
+
+// Sparse matrix-vector products with the Laplacian on 64x64 and 512x512
+// grids (the larger one is split across the thread pool)
+typedef struct {
+    Calculator *calc;
+    SparseMatrix *a;
+    double *x;
+    double *y;
+} SparseState;
+
+void bench_spmv(void *arg, long iterations) {
+    SparseState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        sparse_multiply(state->calc, state->a, state->x, state->y, NULL);
+        bench_sink = state->y[i % state->a->rows];
+    }
+}
+
+void bench_sparse(BenchSuite *suite, Calculator *calc) {
+    for (int m = 64; m <= 512; m *= 8) {
+        SparseState state = {calc, bench_laplacian(m), NULL, NULL};
+        size_t n = state.a->rows;
+        state.x = malloc(n * sizeof(double));
+        state.y = malloc(n * sizeof(double));
+        for (size_t i = 0; i < n; i++) state.x[i] = sin(i * 0.1);
+        char name[64];
+        snprintf(name, sizeof(name), "sparse/spmv/%dx%d", m, m);
+        bench_run(suite, name, bench_spmv, &state);
+        sparse_release(state.a);
+        free(state.x);
+        free(state.y);
+    }
+}
+
+// Batch math kernels over 1024 elements in [0.5, 4), one op per array;
+// batch/<name>/scalar runs the scalar func_* over the same array
+#define BATCH_SIZE 1024
+
+typedef struct {
+    FunctionDef *func_def;
+    double x[BATCH_SIZE];
+    double y[BATCH_SIZE];
+    double out[BATCH_SIZE];
+} BatchState;
+
+void bench_batch(void *arg, long iterations) {
+    BatchState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        state->func_def->batch(BATCH_SIZE, state->x, state->y, state->out);
+        bench_sink = state->out[i % BATCH_SIZE];
+    }
+}
+
+void bench_batch_scalar(void *arg, long iterations) {
+    BatchState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        for (int k = 0; k < BATCH_SIZE; k++) {
+            double args[2] = {state->x[k], state->y[k]};
+            state->out[k] = state->func_def->func(args, state->func_def->max_args);
+        }
+        bench_sink = state->out[i % BATCH_SIZE];
+    }
+}
+
+void bench_batches(BenchSuite *suite) {
+    BatchState *state = malloc(sizeof(BatchState));
+    for (int k = 0; k < BATCH_SIZE; k++) {
+        state->x[k] = 0.5 + 3.5 * k / BATCH_SIZE;
+        state->y[k] = 2.5 - 5.0 * k / BATCH_SIZE;
+    }
+    for (FunctionDef *func_def = function_table; func_def->name[0] != '\0'; func_def++) {
+        if (func_def->batch == NULL) continue;
+        state->func_def = func_def;
+        char name[64];
+        snprintf(name, sizeof(name), "batch/%s", func_def->name);
+        bench_run(suite, name, bench_batch, state);
+        snprintf(name, sizeof(name), "batch/%s/scalar", func_def->name);
+        bench_run(suite, name, bench_batch_scalar, state);
+    }
+    free(state);
+}
+
+// Variable lookup by name in tables of several sizes
+typedef struct {
+    Calculator *calc;
+    char (*names)[32];
+    int count;
+} LookupState;
+
+void bench_lookup(void *arg, long iterations) {
+    LookupState *state = arg;
+    for (long i = 0; i < iterations; i++) {
+        Variable *var = find_variable(state->calc, state->names[i % state->count]);
+        bench_sink = var->value.real;
+    }
+}
+
+void bench_variables(BenchSuite *suite) {
+    static const int sizes[] = {10, 100, 10000};
+    for (int s = 0; s < 3; s++) {
+        Calculator *calc = calc_create();
+        LookupState state = {calc, malloc(sizes[s] * sizeof(*state.names)), sizes[s]};
+        for (int i = 0; i < sizes[s]; i++) {
+            snprintf(state.names[i], 32, "var_%d", i);
+            set_variable(calc, state.names[i], i, 0);
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "find_variable/%d", sizes[s]);
+        bench_run(suite, name, bench_lookup, &state);
+        free(state.names);
+        calc_destroy(calc);
+    }
+}
+
+// One result per line, so --compare can read files back with sscanf
+int write_json(const BenchSuite *suite, const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        return 0;
+    }
+    fprintf(out, "{\"runs\": %d, \"target_ms\": %g, \"benchmarks\": [\n", BENCH_RUNS, suite->target_ms);
+    for (int i = 0; i < suite->result_count; i++) {
+        const BenchResult *r = &suite->results[i];
+        fprintf(out, "{\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.3f, \"ops_per_sec\": %.1f, \"allocs_per_op\": %.3f}%s\n",
+                r->name, r->iterations, r->ns_per_op, r->ops_per_sec, r->allocs_per_op,
+                i + 1 < suite->result_count ? "," : "");
+    }
+    fprintf(out, "]}\n");
+    fclose(out);
+    return 1;
+}
+
+// Print the change against a previous --json file; returns the number of
+// benchmarks that slowed down by more than the threshold or allocate more
+int compare_json(const BenchSuite *suite, const char *path) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    int regressions = 0;
+    char line[512];
+    printf("\n%-28s %12s %12s %8s\n", "Compared to", "before", "after", "change");
+    while (fgets(line, sizeof(line), in)) {
+        char name[64];
+        double ns, allocs;
+        if (sscanf(line, "{\"name\": \"%63[^\"]\", \"iterations\": %*d, \"ns_per_op\": %lf, "
+                   "\"ops_per_sec\": %*f, \"allocs_per_op\": %lf", name, &ns, &allocs) != 3) {
+            continue;
+        }
+        for (int i = 0; i < suite->result_count; i++) {
+            const BenchResult *r = &suite->results[i];
+            if (strcmp(r->name, name) != 0) continue;
+            double change = r->ns_per_op / ns - 1;
+            int worse = change > REGRESSION_THRESHOLD || r->allocs_per_op > allocs + 0.005;
+            printf("%-28s %9.1f ns %9.1f ns %+7.1f%%%s\n", name, ns, r->ns_per_op, change * 100,
+                   worse ? "  REGRESSION" : "");
+            regressions += worse;
+        }
+    }
+    fclose(in);
+    return regressions;
+}
+
+int main(int argc, char *argv[]) {
+    BenchSuite suite;
+    memset(&suite, 0, sizeof(suite));
+    suite.target_ms = 100;
+    const char *json_path = NULL;
+    const char *compare_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            compare_path = argv[++i];
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            suite.filter = argv[++i];
+        } else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc) {
+            suite.target_ms = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: bench [--filter TEXT] [--time MS] [--json FILE] [--compare FILE]\n");
+            return 2;
+        }
+    }
+
+    Calculator *calc = calc_create();
+    calc_seed(calc, 42);
+    set_variable(calc, "x", 0.75, 0);
+    CalcError error = CALC_OK;
+
+    // 1024- and 64-point vectors for the signal functions
+    Vector *vec = vector_new(1024, 0);
+    Vector *kernel = vector_new(64, 0);
+    for (int i = 0; i < 1024; i++) vec->re[i] = sin(i * 0.1);
+    for (int i = 0; i < 64; i++) kernel->re[i] = 1.0 / (i + 1);
+    set_variable_value(calc, "v", value_vector(vec), 0);
+    set_variable_value(calc, "w", value_vector(kernel), 0);
+    set_variable_value(calc, "L", value_sparse(bench_laplacian(32)), 0);
+    set_variable_value(calc, "M", value_matrix(bench_covariance(calc, 32)), 0);
+
+    FrontEndState front = {calc, {NULL}};
+    for (int i = 0; i < BENCH_EXPRESSION_COUNT; i++) {
+        front.programs[i] = compile_expression(calc, bench_expressions[i], NULL, 0, &error);
+    }
+
+    bench_run(&suite, "tokenize", bench_tokenize, &front);
+    bench_run(&suite, "compile_expression", bench_compile, &front);
+    bench_run(&suite, "program_run", bench_program_run, &front);
+    bench_run(&suite, "evaluate_expression", bench_evaluate, &front);
+    size_t limit = calc->cache.byte_limit;
+    cache_clear(&calc->cache);
+    calc->cache.byte_limit = 0; // Every evaluation compiles
+    bench_run(&suite, "evaluate_expression/nocache", bench_evaluate, &front);
+    calc->cache.byte_limit = limit;
+    bench_functions(&suite, calc);
+    bench_matrices(&suite);
+    bench_dense(&suite, calc);
+    bench_fit(&suite, calc);
+    bench_sort(&suite, calc);
+    bench_moving(&suite, calc);
+    bench_integers(&suite, calc);
+    bench_scripts(&suite, calc);
+    bench_sparse(&suite, calc);
+    bench_batches(&suite);
+    bench_variables(&suite);
+
+    for (int i = 0; i < BENCH_EXPRESSION_COUNT; i++) {
+        program_free(front.programs[i]);
+    }
+    calc_destroy(calc);
+
+    if (json_path != NULL && !write_json(&suite, json_path)) return 1;
+    if (compare_path != NULL) {
+        int regressions = compare_json(&suite, compare_path);
+        if (regressions != 0) {
+            printf("%d regression(s)\n", regressions);
+            return 1;
+        }
+    }
+    return 0;
+}
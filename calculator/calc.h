@@ -0,0 +1,164 @@
+// libcalc: embeddable expression evaluator.
+//
+// A CalcContext holds variables, user functions, settings and caches, so
+// each thread can own its own context. The only state contexts share is
+// the worker thread pool for parallel jobs, one per process, sized to the
+// CPUs.
+// Expressions are compiled once with calc_compile and run any number of
+// times with calc_eval. Errors are returned as CalcError values; nothing
+// is printed.
+#ifndef CALC_H
+#define CALC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The functions below are the library's only exported symbols; the rest
+// of libcalc has hidden visibility
+#ifdef __GNUC__
+#define CALC_API __attribute__((visibility("default")))
+#else
+#define CALC_API
+#endif
+
+// Error codes
+typedef enum {
+    CALC_OK,
+    CALC_ERROR_SYNTAX,
+    CALC_ERROR_DIV_ZERO,
+    CALC_ERROR_UNDEFINED,
+    CALC_ERROR_OVERFLOW,
+    CALC_ERROR_MEMORY,
+    CALC_ERROR_UNKNOWN_FUNCTION,
+    CALC_ERROR_UNKNOWN_VARIABLE,
+    CALC_ERROR_ARG_COUNT,
+    CALC_ERROR_ARG_RANGE,
+    CALC_ERROR_MATRIX_DIM,
+    CALC_ERROR_COMPLEX_OP,
+    CALC_ERROR_TYPE,
+    CALC_ERROR_CYCLE,
+    CALC_ERROR_IO,
+    CALC_ERROR_FORMAT,
+    CALC_ERROR_CONVERGENCE,
+    CALC_ERROR_DATA,
+    CALC_ERROR_UNITS
+} CalcError;
+
+// Value types. A CALC_POLY value keeps its coefficients, highest power
+// first, in the vector member; CALC_MATRIX and CALC_SPARSE values are
+// real dense and sparse matrices, opaque to embedders. Integers are exact
+// inside the evaluator: CALC_INTEGER holds those that fit in 64 bits and
+// CALC_BIGINT (opaque, shared by reference count, readable through
+// calc_format) larger ones. calc_eval, calc_evaluate and calc_get return
+// integer results as CALC_REAL, as before exact integers existed, unless
+// the context was given calc_set_integers(ctx, 1).
+typedef enum {
+    CALC_REAL,
+    CALC_COMPLEX,
+    CALC_MATRIX,
+    CALC_VECTOR,
+    CALC_POLY,
+    CALC_SPARSE,
+    CALC_INTEGER,
+    CALC_BIGINT
+} CalcType;
+
+// Complex number
+typedef struct {
+    double real;
+    double imag;
+} CalcComplex;
+
+// Vector (split real/imaginary arrays, im is NULL for real vectors).
+// Vectors are shared by reference count; use calc_retain/calc_release.
+typedef struct {
+    int refcount;
+    size_t length;
+    double *re;
+    double *im;
+} CalcVector;
+
+// Tagged value
+typedef struct {
+    CalcType type;
+    union {
+        double real;
+        CalcComplex complex_num;
+        CalcVector *vector;
+        struct CalcSparse *sparse;
+        struct CalcMatrix *matrix;
+        long long integer;
+        struct CalcBigInt *bigint;
+    };
+} CalcValue;
+
+typedef struct Calculator CalcContext;
+typedef struct CalcProgram CalcProgram;
+
+// Contexts
+CALC_API CalcContext* calc_create(void);
+CALC_API void calc_destroy(CalcContext *ctx);
+CALC_API void calc_set_degrees(CalcContext *ctx, int degrees);
+CALC_API void calc_set_precision(CalcContext *ctx, int precision);
+CALC_API void calc_set_integers(CalcContext *ctx, int exact);
+CALC_API void calc_seed(CalcContext *ctx, unsigned long long seed);
+
+// Compile an expression. Identifiers listed in params are bound to the
+// values passed to calc_eval, in order. The program refers to its context
+// and must be freed before it.
+CALC_API CalcProgram* calc_compile(CalcContext *ctx, const char *expr, const char *const params[], int param_count, CalcError *error);
+
+// Run a compiled program with one binding per parameter. Programs that do
+// not assign variables may be run from several threads at once.
+CALC_API CalcValue calc_eval(const CalcProgram *prog, const CalcValue bindings[], CalcError *error);
+CALC_API void calc_program_free(CalcProgram *prog);
+
+// Compile (through the context's cache) and run an expression or
+// assignment, as the interactive calculator does
+CALC_API CalcValue calc_evaluate(CalcContext *ctx, const char *expr, CalcError *error);
+
+// Define a user function from "name(a, b) = body"
+CALC_API CalcError calc_define(CalcContext *ctx, const char *definition);
+
+// Variables
+CALC_API CalcError calc_set(CalcContext *ctx, const char *name, CalcValue value);
+CALC_API CalcValue calc_get(CalcContext *ctx, const char *name, CalcError *error);
+
+// Values. calc_vector copies the arrays; im may be NULL.
+CALC_API CalcValue calc_real(double x);
+CALC_API CalcValue calc_complex(double re, double im);
+CALC_API CalcValue calc_integer(long long x);
+CALC_API CalcValue calc_vector(const double *re, const double *im, size_t length, CalcError *error);
+CALC_API CalcValue calc_retain(CalcValue value);
+CALC_API void calc_release(CalcValue *value);
+
+// Sessions. calc_save writes variables, user functions, history and
+// settings to a snapshot file; calc_load replaces the context's session
+// with one, leaving it unchanged if the file cannot be used. Snapshots are
+// specific to the library version and machine that wrote them.
+CALC_API CalcError calc_save(CalcContext *ctx, const char *path);
+CALC_API CalcError calc_load(CalcContext *ctx, const char *path);
+
+// Read a sparse matrix from a Matrix Market file (coordinate or array,
+// real, integer or pattern) or from lines of 1-based "row column value"
+// triplets, and store it in the variable name
+CALC_API CalcError calc_load_sparse(CalcContext *ctx, const char *name, const char *path);
+
+// Memoization counters: results of pure functions (comb, perm, factorial,
+// lgamma and user functions that read no variables) looked up in and
+// missing from the context's memo cache
+CALC_API void calc_memo_stats(CalcContext *ctx, unsigned long *hits, unsigned long *misses);
+
+// Text output. calc_format returns a malloc'ed string using the context's
+// precision.
+CALC_API char* calc_format(CalcContext *ctx, CalcValue value);
+CALC_API const char* calc_error_message(CalcError error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
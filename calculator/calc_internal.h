@@ -0,0 +1,840 @@
+// Internal declarations shared by libcalc.c and the programs built on
+// it (the calculator CLI and the benchmarks). Embedders use calc.h.
+#ifndef CALC_INTERNAL_H
+#define CALC_INTERNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "calc.h"
+
+#define VAR_INITIAL_CAPACITY 64
+#define HISTORY_SIZE 50
+#define MAX_FUNC_ARGS 10
+#define MATRIX_SIZE 10
+#define EXPR_CACHE_BYTES (1 << 20)
+#define EXPR_CACHE_BUCKETS 1024
+#define MEMO_ENTRIES 4096
+#define MEMO_MAX_ARGS 4
+#define MEMO_BIG_ENTRIES 256
+#define FFT_PLAN_LIMIT 16         // Cached FFT plans kept per calculator
+#define FACTORIAL_TABLE_SIZE 171  // 170! is the largest finite double
+#define BINOMIAL_TABLE_SIZE 67     // C(66, 33) is the largest below 2^64
+
+// Mathematical constants
+#define PI 3.14159265358979323846
+#define E 2.71828182845904523536
+#define PHI 1.61803398874989484820
+#define GAMMA 0.57721566490153286060
+#define LIGHT_SPEED 299792458.0
+#define GRAVITATIONAL_CONSTANT 6.67430e-11
+#define PLANCK_CONSTANT 6.62607015e-34
+#define ELECTRON_CHARGE 1.602176634e-19
+#define AVOGADRO 6.02214076e23
+#define BOLTZMANN 1.380649e-23
+
+// Engine names for the public value types
+typedef CalcType DataType;
+typedef CalcComplex ComplexNumber;
+typedef CalcVector Vector;
+typedef CalcValue Value;
+
+// Matrix
+typedef struct {
+    int rows;
+    int cols;
+    double data[MATRIX_SIZE][MATRIX_SIZE];
+} Matrix;
+
+// Sparse matrix in compressed sparse row form: row r holds the entries
+// row_start[r] .. row_start[r+1]-1 of col and values, in increasing
+// column order with no duplicates or zeros. Shared by reference count
+// like Vector.
+typedef struct CalcSparse {
+    int refcount;
+    size_t rows;
+    size_t cols;
+    size_t *row_start;
+    int *col;
+    double *values;
+    size_t tasks;           // Row blocks for threaded products
+    size_t *task_start;     // Block t is rows task_start[t] .. task_start[t+1]-1
+} SparseMatrix;
+
+// Dense matrix of any size, row-major in one 64-byte aligned block of
+// rows * cols doubles. Shared by reference count like Vector.
+typedef struct CalcMatrix {
+    int refcount;
+    size_t rows;
+    size_t cols;
+    double *data;
+} DenseMatrix;
+
+// Integer too large for CALC_INTEGER: a sign and a magnitude in 32-bit
+// limbs, least significant first, with no leading zero limbs. Shared by
+// reference count like Vector.
+typedef struct CalcBigInt {
+    int refcount;
+    int sign;               // 1 or -1
+    size_t length;
+    uint32_t limbs[];
+} BigInt;
+
+// Sign and magnitude of either kind of integer value; a CALC_INTEGER
+// keeps its magnitude in small
+typedef struct {
+    int sign;
+    size_t length;
+    const uint32_t *limbs;
+    uint32_t small[2];
+} IntegerView;
+
+// Streaming least squares: the triangular factor of [A b] and room for
+// one batch of rows (see lsq_add)
+typedef struct {
+    size_t cols;
+    size_t rows;
+    size_t batch_rows;
+    double *r;
+    double *batch;
+} LeastSquares;
+
+// Group of a groupby hash table; count 0 marks an empty slot. a and b
+// hold the aggregate's state (see group_aggregates).
+typedef struct {
+    uint64_t bits;      // The key's bits, -0 as 0 and NaN as one value
+    uint64_t count;
+    double a;
+    double b;
+} GroupEntry;
+
+typedef struct {
+    GroupEntry *slots;
+    size_t mask;        // Capacity - 1, a power of two
+    int shift;          // 64 - log2(capacity), for the hash
+    int failed;         // Out of memory while adding
+    size_t size;
+} GroupTable;
+
+// A sort key with the position of the element it came from
+typedef struct {
+    uint64_t key;
+    uint64_t index;
+} SortItem;
+
+// Writes rows start.. start + count - 1 of [A b] into rows, row-major
+typedef void (*LsqFill)(const void *source, size_t start, size_t count, double *rows);
+
+// Token types
+typedef enum {
+    TOK_NUMBER,
+    TOK_IMAGINARY,
+    TOK_IDENTIFIER,
+    TOK_OPERATOR,
+    TOK_FUNCTION,
+    TOK_LPAREN,
+    TOK_RPAREN,
+    TOK_COMMA,
+    TOK_LBRACKET,
+    TOK_RBRACKET,
+    TOK_EQUAL,
+    TOK_LBRACE,
+    TOK_RBRACE,
+    TOK_SEMICOLON,
+    TOK_RANGE,      // .. in for loops
+    TOK_NEWLINE,    // Only produced while compiling scripts
+    TOK_EOF
+} TokenType;
+
+// Token structure. Operators keep one character in name: two-character
+// operators are coded as l (<=), g (>=), e (==), n (!=), & (&&) and | (||).
+typedef struct {
+    TokenType type;
+    int line;               // Source line in scripts
+    double value;
+    char name[32];
+    const char *digits;     // Integer literals: their digits in the source
+    size_t digit_count;     // 0 for other numbers
+    const char *start;      // Position in the source
+} Token;
+
+// Physical unit of a value as exponents of the SI base units m, kg, s, A,
+// K, mol and cd, four bits each (-8..7); 0 is dimensionless. Units are
+// checked while compiling: values are kept in base units, programs are
+// plain arithmetic on them, and only assignments record a unit.
+typedef uint32_t Unit;
+#define UNIT_BASES 7
+#define UNIT(m, kg, s, A, K, mol, cd) \
+    ((Unit)(((m) & 15) | ((kg) & 15) << 4 | ((s) & 15) << 8 | ((A) & 15) << 12 | \
+            ((K) & 15) << 16 | ((mol) & 15) << 20 | ((cd) & 15) << 24))
+
+typedef struct {
+    const char *name;
+    double value;
+    Unit unit;
+} NamedConstant;
+
+// Variable structure. In reactive mode a variable may keep the compiled
+// formula it was defined by; depends/dependents are the edges of the
+// dependency DAG as variable indices.
+typedef struct {
+    char name[32];
+    Value value;
+    int constant;
+    struct Program *definition;
+    char *formula;
+    int *depends;
+    int depend_count;
+    int *dependents;
+    int dependent_count;
+    int dependent_capacity;
+    int dirty;          // Formula inputs changed since value was computed
+    unsigned visit;     // Traversal stamp
+    Unit unit;          // Unit of the value it was last assigned
+} Variable;
+
+struct Calculator;
+
+// Function pointer types
+typedef double (*MathFunc)(double[], int);
+typedef Value (*ValueFunc)(struct Calculator *, Value[], int, CalcError *);
+typedef ComplexNumber (*ComplexFunc)(ComplexNumber);
+typedef void (*BatchFunc)(size_t n, const double *x, const double *y, double *out);
+typedef int (*SparseSolver)(struct Calculator *, const SparseMatrix *a, const double *b, double *x, const double *inverse, double *work, double limit, size_t iterations);
+
+// Function definition structure (func for scalar functions, vfunc for
+// functions that take or return vectors, cfunc for complex arguments).
+// Pure functions whose cost grows with their first argument set
+// memo_from: calls with real or 64-bit integer arguments and args[0] >=
+// memo_from go through the memo cache (0 = never). batch, when set,
+// computes func over whole arrays (x, and y for two-argument functions)
+// and is used for real vectors. ifunc is the exact version called when
+// every argument is an integer.
+typedef struct {
+    char name[32];
+    MathFunc func;
+    int min_args;
+    int max_args;
+    ValueFunc vfunc;
+    ComplexFunc cfunc;
+    int memo_from;
+    BatchFunc batch;
+    ValueFunc ifunc;
+} FunctionDef;
+
+// Calculation history
+typedef struct {
+    char *expression;
+    Value result;
+    Unit unit;          // Unit the result was shown with
+} HistoryEntry;
+
+// Bytecode operations. Registers are allocated by expression depth, so the
+// operands of an operator are always in consecutive registers.
+typedef enum {
+    OP_CONST,   // r[dst] = constants[a]
+    OP_LOAD,    // r[dst] = variable symbols[a]
+    OP_PARAM,   // r[dst] = params[a]
+    OP_NEG,     // r[dst] = -r[a]
+    OP_ADD,     // r[dst] = r[a] + r[b]
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_POW,
+    OP_CALL,    // r[dst] = function_table[c](r[a] .. r[a+b-1])
+    OP_UCALL,   // r[dst] = user function c (r[a] .. r[a+b-1])
+    OP_VECTOR,  // r[dst] = [r[a] .. r[a+b-1]]
+    OP_STORE,   // variable symbols[a] = r[b]; c is 1 for constants, plus
+                // the value's unit shifted left by 1
+    OP_LT,      // r[dst] = r[a] < r[b] as integer 0 or 1
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_NOT,     // r[dst] = 1 if r[a] is zero, else 0
+    OP_BOOL,    // r[dst] = 0 if r[a] is zero, else 1
+    OP_MOVE,    // r[dst] = r[a]
+    OP_JUMP,    // continue at instruction a
+    OP_JUMP_FALSE,  // r[a] = its truth value (0 or 1); continue at b if 0
+    OP_JUMP_TRUE,   // the same, continuing at b if 1
+    OP_FOR_PREP,    // continue at c unless r[a] <= r[b]
+    OP_FOR_LOOP,    // r[a] += 1; continue at c if r[a] <= r[b]
+    OP_PRINT        // write r[a] .. r[a+b-1] and the unit c >> 1 to the calculator's
+                    // output, then a space if c is odd, else a newline
+} OpCode;
+
+typedef struct {
+    OpCode op;
+    int dst;
+    int a;
+    int b;
+    int c;
+} Instruction;
+
+// Compiled expression
+typedef struct Program {
+    Instruction *code;
+    int code_count;
+    int code_capacity;
+    Value *constants;
+    int const_count;
+    int const_capacity;
+    char (*symbols)[32];
+    int symbol_count;
+    int symbol_capacity;
+    int register_count;
+    int result;         // Register holding the value, or -1 if none
+    Unit unit;          // Unit of the result
+    int *lines;         // Source line of each instruction (scripts only)
+    char *definitions;  // Function definitions a script made while compiling, one per line
+} Program;
+
+// User-defined function f(x, y) = body; the body is compiled with the
+// parameters bound to OP_PARAM slots
+typedef struct {
+    char name[32];
+    char params[MAX_FUNC_ARGS][32];
+    int param_count;
+    Program *body;
+    char *source;
+    int pure;           // Reads only parameters and constants, calls only pure functions
+    unsigned unit_epoch;    // Calculator.unit_epoch that body->unit was worked out for
+} UserFunction;
+
+// Compiled-expression cache: programs keyed by normalized source text in a
+// chained hash table, with an LRU list bounding their total size
+typedef struct CacheEntry {
+    char *key;
+    unsigned hash;
+    Program *prog;
+    size_t bytes;
+    struct CacheEntry *hash_next;
+    struct CacheEntry *lru_prev;
+    struct CacheEntry *lru_next;
+} CacheEntry;
+
+typedef struct {
+    CacheEntry *buckets[EXPR_CACHE_BUCKETS];
+    CacheEntry *lru_head;   // Most recently used
+    CacheEntry *lru_tail;
+    size_t entry_count;
+    size_t bytes;
+    size_t byte_limit;
+    unsigned long lookups;
+    unsigned long hits;
+    unsigned long evictions;
+    unsigned long invalidations;
+    double compile_ms;      // Time spent compiling on misses
+    double lookup_ms;       // Time spent hashing and probing
+    unsigned unit_epoch;    // Calculator.unit_epoch the entries were compiled under
+} ExprCache;
+
+// Results of pure functions with up to MEMO_MAX_ARGS real or integer
+// arguments, keyed by the argument bits in a direct-mapped table. Entries are read
+// and written without locking; each holds a checksum of its words, so an
+// entry torn by concurrent writers reads as a miss.
+typedef struct {
+    unsigned long long tag;     // Function, argument count and epoch; 0 if empty
+    unsigned long long args[MEMO_MAX_ARGS];
+    unsigned long long result;
+    unsigned long long type;    // CALC_REAL or CALC_INTEGER
+    unsigned long long check;
+} MemoEntry;
+
+// Exact results too large for 64 bits. Entries hold a reference to their
+// result, so this table is read and written under MemoCache.big_lock.
+typedef struct {
+    unsigned long long tag;     // 0 if empty
+    unsigned long long args[MEMO_MAX_ARGS];
+    Value result;               // CALC_BIGINT
+} MemoBigEntry;
+
+typedef struct {
+    MemoEntry *entries;     // MEMO_ENTRIES, allocated on first store
+    MemoBigEntry *big;      // MEMO_BIG_ENTRIES, allocated on first store
+    pthread_mutex_t big_lock;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned epoch;         // Advanced when user functions change
+} MemoCache;
+
+// Call counters filled in by program_run while the profile command runs.
+// Times include nested calls.
+typedef struct {
+    unsigned long *calls;       // Indexed like function_table
+    double *call_ms;
+    unsigned long *user_calls;  // Indexed like Calculator.functions
+    double *user_ms;
+} Profile;
+
+// Parser state while compiling one expression. Tokens are scanned on
+// demand with up to three tokens of lookahead.
+typedef struct {
+    struct Calculator *calc;
+    const char *next;           // Source position after the lookahead
+    Token lookahead[3];
+    int lookahead_count;
+    Program *prog;
+    int depth;                  // Next free register
+    const char *const *params;  // Names bound to OP_PARAM slots
+    int param_count;
+    CalcError *error;
+    int script;                 // Newlines end statements; see compile_script
+    int line;                   // Line of the last token consumed
+    int nesting;                // Open blocks
+    struct LoopScope *loop;     // Innermost enclosing loop
+    Unit *units;                // Unit of each register, NULL while all are dimensionless
+    int unit_capacity;
+    Unit *symbol_units;         // Unit of each symbol, NULL until one is assigned a unit
+} Compiler;
+
+// A loop being compiled: its counter (for loops) and the jumps out of and
+// back to the top of the body, whose targets are not known until the
+// loop ends. Unpatched jumps are chained through their target fields.
+typedef struct LoopScope {
+    char name[32];              // for loop variable, "" for while loops
+    int counter;                // Register holding the for loop variable
+    int break_chain;            // Last unpatched break jump, or -1
+    int continue_chain;
+    struct LoopScope *outer;
+} LoopScope;
+
+// Worker pool: tasks 0..count-1 are handed out through an atomic counter
+// and the calling thread works alongside the workers
+typedef void (*TaskFunc)(void *arg, size_t index, int worker);
+
+typedef struct {
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    TaskFunc task;
+    void *arg;
+    size_t task_count;
+    size_t next_task;
+    int active;
+    int busy;
+    unsigned long generation;
+    int shutdown;
+} ThreadPool;
+
+// FFT plan: mixed-radix (4/2/3/5) Stockham stages with precomputed twiddle
+// tables, or Bluestein's chirp-z convolution for lengths with other factors.
+// A calculator caches its plans most recently used first; users counts the
+// callers holding one (and a Bluestein plan holds its conv_plan), and only
+// plans nobody holds are freed when the cache is over FFT_PLAN_LIMIT.
+typedef struct FFTPlan {
+    size_t n;
+    int stage_count;
+    int radix[64];
+    size_t twiddle_offset[64];
+    double *twiddle_re;
+    double *twiddle_im;
+    double *real_re;            // exp(-2*pi*i*k/(2n)) for rfft post-processing
+    double *real_im;
+    int bluestein;
+    size_t conv_length;
+    struct FFTPlan *conv_plan;
+    double *chirp_re;
+    double *chirp_im;
+    double *kernel_re;
+    double *kernel_im;
+    double *scratch_re;         // Work buffers, n (conv_length for Bluestein) long
+    double *scratch_im;
+    int scratch_busy;           // Taken by a running transform; others allocate
+    int users;
+    struct FFTPlan *next;
+} FFTPlan;
+
+// Calculator state
+typedef struct Calculator {
+    Variable *variables;
+    int var_count;
+    int var_capacity;
+    int *var_table;     // Open-addressing index of variables by name
+    int var_table_size;
+    int reactive;       // Assignments keep their formulas
+    unsigned visit_epoch;
+    UserFunction *functions;
+    int function_count;
+    int function_capacity;
+    ExprCache cache;
+    MemoCache memo;
+    HistoryEntry history[HISTORY_SIZE];
+    int history_index;
+    int history_count;
+    int angle_mode; // 0 = radians, 1 = degrees
+    int precision;  // Number of decimal places to display
+    int exact_integers; // The API returns integers as such (calc_set_integers)
+    FFTPlan *fft_plans; // Plans are built once per size and reused
+    pthread_mutex_t plan_lock;
+    ThreadPool *pool;   // Shared pool, referenced on first parallel job
+    unsigned long long rng_state;
+    Profile *profile;   // Non-NULL while profiling
+    FILE *output;       // Destination of script print statements (NULL: none)
+    int error_line;     // Script line where the last script run failed
+    int unit_count;     // Variables with a unit
+    unsigned unit_epoch;    // Advances whenever a variable's unit changes
+    Unit result_unit;   // Unit of the last evaluate_expression result
+} Calculator;
+
+// Library functions
+void init_calculator(Calculator *calc);
+void free_calculator(Calculator *calc);
+void free_session(Calculator *calc);
+Value evaluate_expression(Calculator *calc, const char *expr, CalcError *error);
+const char* error_message(CalcError error);
+void add_history(Calculator *calc, const char *expr, Value result, Unit unit);
+int is_constant(const char *name);
+const NamedConstant* find_constant(const char *name);
+double get_constant_value(const char *name);
+double factorial(double n);
+FunctionDef* find_function(const char *name);
+Value calculate_function(Calculator *calc, const char *func_name, Value args[], int arg_count, CalcError *error);
+Value call_function(Calculator *calc, FunctionDef *func_def, Value args[], int arg_count, CalcError *error);
+Value call_integer_function(Calculator *calc, FunctionDef *func_def, Value args[], int arg_count, CalcError *error);
+int set_variable(Calculator *calc, const char *name, double value, int constant);
+int set_variable_value(Calculator *calc, const char *name, Value value, int constant);
+int assign_variable(Calculator *calc, int index, Value value);
+Variable* find_variable(Calculator *calc, const char *name);
+
+// User functions and the expression cache
+int find_user_function(Calculator *calc, const char *name);
+int is_function_definition(const char *input);
+int define_function(Calculator *calc, const char *input, CalcError *error);
+void cache_clear(ExprCache *cache);
+void update_function_purity(Calculator *calc);
+Value call_user_function(Calculator *calc, int index, Value args[], CalcError *error);
+Unit user_function_unit(Calculator *calc, int index, CalcError *error);
+int memo_lookup(Calculator *calc, unsigned long long tag, const unsigned long long key[], int count, Value *result);
+void memo_store(Calculator *calc, unsigned long long tag, const unsigned long long key[], int count, Value result);
+void memo_store_big(Calculator *calc, unsigned long long tag, const unsigned long long key[], int count, Value result);
+double elapsed_ms(const struct timespec *start);
+
+// Reactive variables
+int* collect_depends(Calculator *calc, const Program *definition, int *depend_count, CalcError *error);
+int forms_cycle(Calculator *calc, int index, const int *depends, int depend_count, CalcError *error);
+int attach_depends(Calculator *calc, int index, int *depends, int depend_count, CalcError *error);
+int attach_definition(Calculator *calc, int index, Program *definition, const char *formula, int *depends, int depend_count, CalcError *error);
+int redepend_variable(Calculator *calc, int index, CalcError *error);
+int define_variable(Calculator *calc, const char *name, struct Program *definition, const char *formula, CalcError *error);
+void detach_depends(Calculator *calc, int index);
+void drop_definition(Calculator *calc, int index);
+void mark_dependents_dirty(Calculator *calc, int index);
+int refresh_variable(Calculator *calc, int index, CalcError *error);
+
+// Session snapshots
+int session_save(Calculator *calc, const char *path, CalcError *error);
+int session_load(Calculator *calc, const char *path, CalcError *error);
+
+// Value operations
+Vector* vector_new(size_t length, int complex);
+void vector_release(Vector *v);
+Value value_real(double x);
+Value value_complex(double re, double im);
+Value value_integer(long long x);
+Value value_vector(Vector *v);
+Value value_poly(Vector *coeffs);
+Value value_binary(Calculator *calc, char op, Value a, Value b, CalcError *error);
+Value value_compare(char op, Value a, Value b, CalcError *error);
+int value_truth(Value v, CalcError *error);
+Value value_retain(Value v);
+void value_release(Value *v);
+double calculator_random(Calculator *calc);
+void fprint_value(FILE *out, Calculator *calc, Value v);
+void fprint_unit(FILE *out, Unit unit);
+
+// Exact integers
+BigInt* bigint_new(size_t length);
+void bigint_release(BigInt *b);
+Value value_bigint(BigInt *b, CalcError *error);
+int value_is_integer(Value v);
+double value_to_double(Value v);
+void integer_view(Value v, IntegerView *view);
+double integer_frexp(Value v, int *exponent);
+int integer_sign(Value v);
+int integer_compare(Value a, Value b);
+int integer_compare_real(Value a, double x);
+char* integer_format(Value v);
+Value integer_parse(const char *digits, size_t count, CalcError *error);
+int mag_compare(const uint32_t *a, size_t na, const uint32_t *b, size_t nb);
+void mag_add(uint32_t *out, const uint32_t *a, size_t na, const uint32_t *b, size_t nb);
+void mag_sub(uint32_t *out, const uint32_t *a, size_t na, const uint32_t *b, size_t nb);
+void mag_mul(uint32_t *out, const uint32_t *a, size_t na, const uint32_t *b, size_t nb);
+uint32_t mag_div_small(uint32_t *q, const uint32_t *a, size_t n, uint32_t d);
+void mag_divmod(uint32_t *q, uint32_t *r, const uint32_t *a, size_t na, const uint32_t *b, size_t nb, uint32_t *work);
+Value integer_add(const IntegerView *x, const IntegerView *y, int negate, CalcError *error);
+Value integer_multiply(const IntegerView *x, const IntegerView *y, CalcError *error);
+int integer_divide(const IntegerView *x, const IntegerView *y, Value *quotient, Value *remainder, CalcError *error);
+Value integer_power(Calculator *calc, Value a, Value b, CalcError *error);
+Value integer_binary(Calculator *calc, char op, Value a, Value b, CalcError *error);
+Value integer_gcd(Calculator *calc, Value a, Value b, CalcError *error);
+Value integer_falling(Calculator *calc, Value n, long long k, CalcError *error);
+double integer_falling_bits(double n, double k);
+Value func_iabs(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_iround(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_imin(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_imax(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_isum(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_ifactorial(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_igcd(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_ilcm(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_iperm(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_icomb(Calculator *calc, Value args[], int count, CalcError *error);
+
+// Complex number operations
+ComplexNumber complex_add(ComplexNumber a, ComplexNumber b);
+ComplexNumber complex_sub(ComplexNumber a, ComplexNumber b);
+ComplexNumber complex_mul(ComplexNumber a, ComplexNumber b);
+ComplexNumber complex_div(ComplexNumber a, ComplexNumber b);
+ComplexNumber complex_pow(ComplexNumber a, ComplexNumber b);
+double complex_abs(ComplexNumber a);
+ComplexNumber complex_sqrt(ComplexNumber a);
+ComplexNumber complex_exp(ComplexNumber a);
+ComplexNumber complex_log(ComplexNumber a);
+ComplexNumber complex_sin(ComplexNumber a);
+ComplexNumber complex_cos(ComplexNumber a);
+ComplexNumber complex_tan(ComplexNumber a);
+
+// Matrix operations
+Matrix matrix_add(Matrix a, Matrix b);
+Matrix matrix_sub(Matrix a, Matrix b);
+Matrix matrix_mul(Matrix a, Matrix b);
+Matrix matrix_scalar_mul(Matrix a, double scalar);
+double matrix_det(Matrix a);
+Matrix matrix_inv(Matrix a);
+Matrix matrix_transpose(Matrix a);
+
+// FFT operations
+size_t fft_next_size(size_t n);
+FFTPlan* fft_get_plan(Calculator *calc, size_t n, CalcError *error);
+void fft_release_plan(Calculator *calc, FFTPlan *plan);
+FFTPlan* fft_find_plan(Calculator *calc, size_t n, CalcError *error);
+void fft_trim_plans(Calculator *calc);
+void fft_free_plan(FFTPlan *plan);
+int fft_scratch(FFTPlan *plan, size_t length, double **re, double **im);
+void fft_scratch_done(FFTPlan *plan, double *re, double *im);
+int fft_execute(FFTPlan *plan, double *re, double *im);
+void fft_free_plans(Calculator *calc);
+
+// Tokenizer and parser
+const char* next_token(const char *p, Token *token, CalcError *error);
+Token* tokenize(const char *expr, int *token_count, CalcError *error);
+int parse_expression(Compiler *comp);
+int parse_statements(Compiler *comp);
+
+// Compiler and bytecode interpreter
+Program* compile_expression(Calculator *calc, const char *expr, const char *const params[], int param_count, CalcError *error);
+Value program_run(Calculator *calc, const Program *prog, const Value params[], CalcError *error);
+Value make_vector(Value elements[], int count, CalcError *error);
+void program_free(Program *prog);
+
+// Scripts
+Program* compile_script(Calculator *calc, const char *source, int *line, CalcError *error);
+Program* load_script(Calculator *calc, const char *path, int *line, CalcError *error);
+char* script_cache_path(const char *path);
+Program* script_cache_load(Calculator *calc, const char *cache_path, uint64_t hash, size_t source_size);
+int script_cache_save(Calculator *calc, const Program *prog, const char *cache_path, uint64_t hash, size_t source_size);
+int is_script_statement(const char *input);
+
+// Thread pool
+ThreadPool* threadpool_new(int thread_count);
+void threadpool_run(ThreadPool *pool, TaskFunc task, void *arg, size_t count);
+void threadpool_free(ThreadPool *pool);
+ThreadPool* calculator_pool(Calculator *calc);
+void calculator_pool_release(ThreadPool *pool);
+
+// Mathematical functions
+double func_sin(double args[], int count);
+double func_cos(double args[], int count);
+double func_tan(double args[], int count);
+double func_asin(double args[], int count);
+double func_acos(double args[], int count);
+double func_atan(double args[], int count);
+double func_atan2(double args[], int count);
+double func_sinh(double args[], int count);
+double func_cosh(double args[], int count);
+double func_tanh(double args[], int count);
+double func_asinh(double args[], int count);
+double func_acosh(double args[], int count);
+double func_atanh(double args[], int count);
+double func_log(double args[], int count);
+double func_log10(double args[], int count);
+double func_log2(double args[], int count);
+double func_exp(double args[], int count);
+double func_sqrt(double args[], int count);
+double func_cbrt(double args[], int count);
+double func_pow(double args[], int count);
+double func_abs(double args[], int count);
+double func_floor(double args[], int count);
+double func_ceil(double args[], int count);
+double func_round(double args[], int count);
+double func_min(double args[], int count);
+double func_max(double args[], int count);
+double func_sum(double args[], int count);
+double func_mean(double args[], int count);
+double func_median(double args[], int count);
+double func_factorial(double args[], int count);
+double func_gcd(double args[], int count);
+double func_lcm(double args[], int count);
+double func_deg2rad(double args[], int count);
+double func_rad2deg(double args[], int count);
+double func_perm(double args[], int count);
+double func_comb(double args[], int count);
+double func_lgamma(double args[], int count);
+double func_det(double args[], int count);
+double func_trace(double args[], int count);
+
+// Batch math kernels
+size_t batch_first_nonfinite(const double *v, size_t n);
+void batch_vector_function(Calculator *calc, FunctionDef *func_def, const Vector *in, Vector *out, CalcError *error);
+
+// Vector functions
+Value func_fft(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_ifft(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_rfft(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_conv(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_xcorr(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_vabs(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_vpow(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_real(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_imag(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_conj(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_arg(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_rand(Calculator *calc, Value args[], int count, CalcError *error);
+
+// Polynomials
+Vector* poly_trim(Vector *p, CalcError *error);
+Vector* poly_coeffs(Value v, CalcError *error);
+Value poly_binary(Calculator *calc, char op, Value a, Value b, CalcError *error);
+Value poly_evaluate(Calculator *calc, const Vector *p, Value x, CalcError *error);
+Value func_poly(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_polyval(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_roots(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_polygcd(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_polyder(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_coeffs(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_degree(Calculator *calc, Value args[], int count, CalcError *error);
+
+// Sparse matrices
+SparseMatrix* sparse_new(size_t rows, size_t cols, size_t nnz);
+void sparse_release(SparseMatrix *m);
+Value value_sparse(SparseMatrix *m);
+SparseMatrix* sparse_partition(SparseMatrix *m, CalcError *error);
+SparseMatrix* sparse_from_triplets(size_t rows, size_t cols, size_t count, const int *row, const int *col, const double *values, CalcError *error);
+SparseMatrix* sparse_load(const char *path, CalcError *error);
+double sparse_multiply(Calculator *calc, const SparseMatrix *a, const double *x, double *y, const double *u);
+Value sparse_binary(Calculator *calc, char op, Value a, Value b, CalcError *error);
+int cg_solve(Calculator *calc, const SparseMatrix *a, const double *b, double *x, const double *inverse, double *work, double limit, size_t iterations);
+int bicgstab_solve(Calculator *calc, const SparseMatrix *a, const double *b, double *x, const double *inverse, double *work, double limit, size_t iterations);
+Value sparse_solve(Calculator *calc, Value args[], int count, SparseSolver solve, size_t work_vectors, CalcError *error);
+Value func_sparse(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_speye(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_nnz(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_cg(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_bicgstab(Calculator *calc, Value args[], int count, CalcError *error);
+
+// Dense matrices
+DenseMatrix* dense_new(size_t rows, size_t cols);
+void dense_release(DenseMatrix *m);
+Value value_matrix(DenseMatrix *m);
+Value make_matrix(Value rows[], int count, CalcError *error);
+void fprint_matrix(FILE *out, Calculator *calc, const DenseMatrix *m);
+void matrix_multiply_add(Calculator *calc, const double *a, const double *b, double *c, size_t rows, size_t inner, size_t cols);
+void matrix_multiply(Calculator *calc, const double *a, const double *b, double *c, size_t rows, size_t inner, size_t cols);
+Value matrix_binary(Calculator *calc, char op, Value a, Value b, CalcError *error);
+DenseMatrix* matrix_arg(Value v, CalcError *error);
+double* square_matrix_copy(Value v, size_t *n, CalcError *error);
+int lu_factor(double *a, size_t n, size_t *pivots);
+void lu_solve(const double *lu, const size_t *pivots, size_t n, double *b, size_t cols);
+double lu_determinant(double *a, size_t n);
+void transpose_into(const double *a, double *t, size_t rows, size_t cols);
+double householder(double *x, size_t n, double *beta);
+void reflector_product(Calculator *calc, const double *v, const double *tau, size_t n, double *z, double *work);
+int hessenberg_qr(double *h, size_t size, double *wr, double *wi, double *z);
+void schur_vectors(double *h, size_t n, const double *wr);
+double* singular_values(Value arg, size_t *count, CalcError *error);
+Value func_matrix_det(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_matrix_trace(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_matrix(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_eye(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_transpose(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_full(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_eigvals(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_eig(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_svd(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_cond(Calculator *calc, Value args[], int count, CalcError *error);
+void dense_identity(double *a, size_t n);
+double matrix_norm1(const double *a, size_t n, double shift);
+double* matrix_power(Calculator *calc, size_t n, unsigned long long p, double *base, double *result, double *temp);
+Value matrix_pow(Calculator *calc, Value a, double p, CalcError *error);
+double* matrix_exp(Calculator *calc, double *a, size_t n, double *work, size_t *pivots, CalcError *error);
+int symmetric_function(Calculator *calc, double *a, size_t n, double (*f)(double), double *out, CalcError *error);
+int matrix_sqrt(Calculator *calc, const double *a, size_t n, double *y, double *work, size_t *pivots, CalcError *error);
+int matrix_log(Calculator *calc, double *a, size_t n, double *out, double *work, size_t *pivots, CalcError *error);
+Value matrix_function(Calculator *calc, Value arg, char kind, CalcError *error);
+Value func_mpow(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_expm(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_sqrtm(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_logm(Calculator *calc, Value args[], int count, CalcError *error);
+
+// Least squares
+LeastSquares* lsq_new(size_t p);
+void lsq_free(LeastSquares *ls);
+void lsq_add(LeastSquares *ls, LsqFill fill, const void *source, size_t start, size_t count);
+void lsq_merge(LeastSquares *ls, LeastSquares *other);
+int lsq_solve(const LeastSquares *ls, double *x, double *residual, CalcError *error);
+int lsq_fit(Calculator *calc, LsqFill fill, const void *source, size_t rows, size_t p, double *x, double *residual, CalcError *error);
+void lsq_fill_matrix(const void *source, size_t start, size_t count, double *rows);
+void lsq_fill_poly(const void *source, size_t start, size_t count, double *rows);
+const Vector* lsq_vector(Value v, CalcError *error);
+int poly_fit(Calculator *calc, Value xs, Value ys, size_t d, double *c, double *residual, CalcError *error);
+Value func_lstsq(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_polyfit(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_linfit(Calculator *calc, Value args[], int count, CalcError *error);
+
+// Grouping
+int group_aggregate(const char *name);
+int group_table_init(GroupTable *table, size_t expected);
+int group_table_grow(GroupTable *table);
+void group_add(GroupTable *table, int aggregate, const double *key, const double *value, size_t start, size_t count);
+void group_merge(GroupTable *table, const GroupTable *part, int aggregate);
+size_t group_estimate(const double *key, size_t n);
+Value func_groupby(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_hist(Calculator *calc, Value args[], int count, CalcError *error);
+
+// Sorting
+void insertion_sort_items(SortItem *items, size_t n);
+int partial_insertion_sort_items(SortItem *items, size_t n);
+void heapsort_items(SortItem *items, size_t n);
+size_t partition_items(SortItem *items, size_t n, int *already);
+void pdqsort_items(SortItem *items, size_t n, int bad_allowed);
+void sort_items(SortItem *items, size_t n);
+uint64_t* sort_reals(ThreadPool *pool, const double *x, size_t n, uint64_t **index);
+int sort_doubles(double *x, size_t n);
+Value func_sort(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_argsort(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_unique(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_rank(Calculator *calc, Value args[], int count, CalcError *error);
+
+// Cumulative and moving-window kernels
+int kernel_finite(const double *x, size_t n, CalcError *error);
+const Vector* kernel_vector(Value v, CalcError *error);
+Value func_cumsum(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_cumprod(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_diff(Calculator *calc, Value args[], int count, CalcError *error);
+Value moving_kernel(Calculator *calc, Value args[], int kind, CalcError *error);
+Value func_movmean(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_movstd(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_movmin(Calculator *calc, Value args[], int count, CalcError *error);
+Value func_movmax(Calculator *calc, Value args[], int count, CalcError *error);
+
+// Function table
+extern FunctionDef function_table[];
+extern const NamedConstant constant_table[];
+
+#endif
@@ -4,325 +4,101 @@
 #include <math.h>
 #include <ctype.h>
 #include <errno.h>
-#include <stdarg.h>
 #include <time.h>
-
-#define MAX_INPUT 1024
-#define MAX_VARS 100
-#define HISTORY_SIZE 50
-#define MAX_TOKENS 200
-#define MAX_FUNC_ARGS 10
-#define MATRIX_SIZE 10
-
-// Mathematical constants
-#define PI 3.14159265358979323846
-#define E 2.71828182845904523536
-#define PHI 1.61803398874989484820
-#define GAMMA 0.57721566490153286060
-#define LIGHT_SPEED 299792458.0
-#define GRAVITATIONAL_CONSTANT 6.67430e-11
-#define PLANCK_CONSTANT 6.62607015e-34
-#define ELECTRON_CHARGE 1.602176634e-19
-#define AVOGADRO 6.02214076e23
-#define BOLTZMANN 1.380649e-23
-
-// Error codes
-typedef enum {
-    CALC_OK,
-    CALC_ERROR_SYNTAX,
-    CALC_ERROR_DIV_ZERO,
-    CALC_ERROR_UNDEFINED,
-    CALC_ERROR_OVERFLOW,
-    CALC_ERROR_MEMORY,
-    CALC_ERROR_UNKNOWN_FUNCTION,
-    CALC_ERROR_UNKNOWN_VARIABLE,
-    CALC_ERROR_ARG_COUNT,
-    CALC_ERROR_ARG_RANGE,
-    CALC_ERROR_MATRIX_DIM,
-    CALC_ERROR_COMPLEX_OP
-} CalcError;
-
-// Data types
-typedef enum {
-    DATA_REAL,
-    DATA_COMPLEX,
-    DATA_MATRIX
-} DataType;
-
-// Complex number
-typedef struct {
-    double real;
-    double imag;
-} ComplexNumber;
-
-// Matrix
-typedef struct {
-    int rows;
-    int cols;
-    double data[MATRIX_SIZE][MATRIX_SIZE];
-} Matrix;
-
-// Token types
-typedef enum {
-    TOK_NUMBER,
-    TOK_IDENTIFIER,
-    TOK_OPERATOR,
-    TOK_FUNCTION,
-    TOK_LPAREN,
-    TOK_RPAREN,
-    TOK_COMMA,
-    TOK_EQUAL,
-    TOK_EOF
-} TokenType;
-
-// Token structure
-typedef struct {
-    TokenType type;
-    double value;
-    char name[32];
-} Token;
-
-// Variable structure
-typedef struct {
-    char name[32];
-    DataType type;
-    union {
-        double real;
-        ComplexNumber complex_num;
-        Matrix matrix;
-    } value;
-    int constant;
-} Variable;
-
-// Function pointer type
-typedef double (*MathFunc)(double[], int);
-
-// Function definition structure
-typedef struct {
-    char name[32];
-    MathFunc func;
-    int min_args;
-    int max_args;
-} FunctionDef;
-
-// Calculation history
-typedef struct {
-    char expression[MAX_INPUT];
-    double result;
-} HistoryEntry;
-
-// Calculator state
-typedef struct {
-    Variable variables[MAX_VARS];
-    int var_count;
-    HistoryEntry history[HISTORY_SIZE];
-    int history_index;
-    int history_count;
-    int angle_mode; // 0 = radians, 1 = degrees
-    int precision;  // Number of decimal places to display
-} Calculator;
-
-// Function declarations
-void init_calculator(Calculator *calc);
-double evaluate_expression(Calculator *calc, const char *expr, CalcError *error);
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "calc_internal.h"
+
+#define GRID_TILE 64
+#define SERVER_READ_CHUNK 65536
+#define SERVER_MAX_REQUEST (64 << 20)
+#define PROFILE_DEFAULT_RUNS 1000
+#define PROFILE_MAX_RUNS 1000000
+
+// Command-line front end
 void print_error(CalcError error);
+void print_value(Calculator *calc, Value v);
+void print_user_function(FILE *out, const UserFunction *fn);
 void show_help(void);
 void show_functions(void);
 void show_constants(void);
 void show_variables(Calculator *calc);
 void show_history(Calculator *calc);
+void show_stats(Calculator *calc);
+void default_session_path(char *path, size_t size);
+int handle_session(Calculator *calc, const char *args, int save);
+int handle_spload(Calculator *calc, const char *args);
 int handle_command(Calculator *calc, const char *input);
-void add_history(Calculator *calc, const char *expr, double result);
-int is_constant(const char *name);
-double get_constant_value(const char *name);
-double factorial(double n);
-double calculate_function(Calculator *calc, const char *func_name, double args[], int arg_count, CalcError *error);
-int set_variable(Calculator *calc, const char *name, double value, int constant);
 
-// Complex number operations
-ComplexNumber complex_add(ComplexNumber a, ComplexNumber b);
-ComplexNumber complex_sub(ComplexNumber a, ComplexNumber b);
-ComplexNumber complex_mul(ComplexNumber a, ComplexNumber b);
-ComplexNumber complex_div(ComplexNumber a, ComplexNumber b);
-ComplexNumber complex_pow(ComplexNumber a, ComplexNumber b);
-double complex_abs(ComplexNumber a);
-ComplexNumber complex_sqrt(ComplexNumber a);
-ComplexNumber complex_exp(ComplexNumber a);
-ComplexNumber complex_log(ComplexNumber a);
-ComplexNumber complex_sin(ComplexNumber a);
-ComplexNumber complex_cos(ComplexNumber a);
-ComplexNumber complex_tan(ComplexNumber a);
+// Scripts
+int run_script(Calculator *calc, Program *prog, const char *name, int line, CalcError error);
+int handle_run(Calculator *calc, const char *args);
 
-// Matrix operations
-Matrix matrix_add(Matrix a, Matrix b);
-Matrix matrix_sub(Matrix a, Matrix b);
-Matrix matrix_mul(Matrix a, Matrix b);
-Matrix matrix_scalar_mul(Matrix a, double scalar);
-double matrix_det(Matrix a);
-Matrix matrix_inv(Matrix a);
-Matrix matrix_transpose(Matrix a);
+// Profiling
+int handle_profile(Calculator *calc, const char *args);
 
-// Tokenizer functions
-Token* tokenize(const char *expr, int *token_count, CalcError *error);
-double parse_expression(Calculator *calc, Token *tokens, int *pos, CalcError *error);
-double parse_term(Calculator *calc, Token *tokens, int *pos, CalcError *error);
-double parse_factor(Calculator *calc, Token *tokens, int *pos, CalcError *error);
+// Grid rendering
+int handle_grid(Calculator *calc, const char *args);
 
-// Mathematical functions
-double func_sin(double args[], int count);
-double func_cos(double args[], int count);
-double func_tan(double args[], int count);
-double func_asin(double args[], int count);
-double func_acos(double args[], int count);
-double func_atan(double args[], int count);
-double func_atan2(double args[], int count);
-double func_sinh(double args[], int count);
-double func_cosh(double args[], int count);
-double func_tanh(double args[], int count);
-double func_asinh(double args[], int count);
-double func_acosh(double args[], int count);
-double func_atanh(double args[], int count);
-double func_log(double args[], int count);
-double func_log10(double args[], int count);
-double func_log2(double args[], int count);
-double func_exp(double args[], int count);
-double func_sqrt(double args[], int count);
-double func_cbrt(double args[], int count);
-double func_pow(double args[], int count);
-double func_abs(double args[], int count);
-double func_floor(double args[], int count);
-double func_ceil(double args[], int count);
-double func_round(double args[], int count);
-double func_min(double args[], int count);
-double func_max(double args[], int count);
-double func_sum(double args[], int count);
-double func_mean(double args[], int count);
-double func_median(double args[], int count);
-double func_factorial(double args[], int count);
-double func_gcd(double args[], int count);
-double func_lcm(double args[], int count);
-double func_deg2rad(double args[], int count);
-double func_rad2deg(double args[], int count);
-double func_perm(double args[], int count);
-double func_comb(double args[], int count);
-double func_rand(double args[], int count);
-double func_det(double args[], int count);
-double func_trace(double args[], int count);
+// Evaluation daemon
+void default_socket_path(char *path, size_t size);
+int run_server(const char *path);
+int run_client(const char *path);
 
-// Function table
-FunctionDef function_table[] = {
-    {"sin", func_sin, 1, 1},
-    {"cos", func_cos, 1, 1},
-    {"tan", func_tan, 1, 1},
-    {"asin", func_asin, 1, 1},
-    {"acos", func_acos, 1, 1},
-    {"atan", func_atan, 1, 1},
-    {"atan2", func_atan2, 2, 2},
-    {"sinh", func_sinh, 1, 1},
-    {"cosh", func_cosh, 1, 1},
-    {"tanh", func_tanh, 1, 1},
-    {"asinh", func_asinh, 1, 1},
-    {"acosh", func_acosh, 1, 1},
-    {"atanh", func_atanh, 1, 1},
-    {"log", func_log, 1, 1},
-    {"log10", func_log10, 1, 1},
-    {"log2", func_log2, 1, 1},
-    {"exp", func_exp, 1, 1},
-    {"sqrt", func_sqrt, 1, 1},
-    {"cbrt", func_cbrt, 1, 1},
-    {"pow", func_pow, 2, 2},
-    {"abs", func_abs, 1, 1},
-    {"floor", func_floor, 1, 1},
-    {"ceil", func_ceil, 1, 1},
-    {"round", func_round, 1, 1},
-    {"min", func_min, 1, 0},
-    {"max", func_max, 1, 0},
-    {"sum", func_sum, 1, 0},
-    {"mean", func_mean, 1, 0},
-    {"median", func_median, 1, 0},
-    {"factorial", func_factorial, 1, 1},
-    {"gcd", func_gcd, 2, 0},
-    {"lcm", func_lcm, 2, 0},
-    {"deg2rad", func_deg2rad, 1, 1},
-    {"rad2deg", func_rad2deg, 1, 1},
-    {"perm", func_perm, 2, 2},
-    {"comb", func_comb, 2, 2},
-    {"rand", func_rand, 0, 2},
-    {"det", func_det, 1, 1},
-    {"trace", func_trace, 1, 1},
-    {"", NULL, 0, 0}  // Sentinel
-};
+// Heap allocation counter for the profile command, compiled in only with
+// -DCALC_COUNT_ALLOCS (glibc only). These definitions take the place of
+// the C library's allocator entry points and forward to glibc's
+// implementations. That gets in the way of sanitizers and of other
+// allocators, so normal builds leave it out.
+unsigned long alloc_count = 0;
 
-// Initialize calculator with default variables and constants
-void init_calculator(Calculator *calc) {
-    calc->var_count = 0;
-    calc->history_index = 0;
-    calc->history_count = 0;
-    calc->angle_mode = 0; // Default to radians
-    calc->precision = 10; // Default precision
-    
-    // Add constants
-    set_variable(calc, "pi", PI, 1);
-    set_variable(calc, "e", E, 1);
-    set_variable(calc, "phi", PHI, 1);
-    set_variable(calc, "gamma", GAMMA, 1);
-    set_variable(calc, "c", LIGHT_SPEED, 1);
-    set_variable(calc, "G", GRAVITATIONAL_CONSTANT, 1);
-    set_variable(calc, "h", PLANCK_CONSTANT, 1);
-    set_variable(calc, "q", ELECTRON_CHARGE, 1);
-    set_variable(calc, "Na", AVOGADRO, 1);
-    set_variable(calc, "k", BOLTZMANN, 1);
-    set_variable(calc, "inf", INFINITY, 1);
-    set_variable(calc, "i", 0, 1); // Complex unit (special handling)
+#ifdef CALC_COUNT_ALLOCS
+#define ALLOC_COUNTING 1
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+void* malloc(size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
 }
 
-// Find a variable by name
-Variable* find_variable(Calculator *calc, const char *name) {
-    for (int i = 0; i < calc->var_count; i++) {
-        if (strcmp(calc->variables[i].name, name) == 0) {
-            return &calc->variables[i];
-        }
-    }
-    return NULL;
+void* calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
 }
 
-// Add or update a variable
-int set_variable(Calculator *calc, const char *name, double value, int constant) {
-    Variable *var = find_variable(calc, name);
-    
-    if (var != NULL) {
-        if (var->constant) {
-            return 0; // Cannot modify constant
-        }
-        var->value.real = value;
-        return 1;
-    }
-    
-    if (calc->var_count >= MAX_VARS) {
-        return 0; // Too many variables
-    }
-    
-    strncpy(calc->variables[calc->var_count].name, name, 31);
-    calc->variables[calc->var_count].name[31] = '\0';
-    calc->variables[calc->var_count].value.real = value;
-    calc->variables[calc->var_count].type = DATA_REAL;
-    calc->variables[calc->var_count].constant = constant;
-    calc->var_count++;
-    return 1;
+void* realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
 }
 
-// Add entry to history
-void add_history(Calculator *calc, const char *expr, double result) {
-    strncpy(calc->history[calc->history_index].expression, expr, MAX_INPUT - 1);
-    calc->history[calc->history_index].expression[MAX_INPUT - 1] = '\0';
-    calc->history[calc->history_index].result = result;
-    
-    calc->history_index = (calc->history_index + 1) % HISTORY_SIZE;
-    if (calc->history_count < HISTORY_SIZE) {
-        calc->history_count++;
-    }
+void* aligned_alloc(size_t alignment, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
 }
 
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+#else
+#define ALLOC_COUNTING 0
+#endif
+
 // Show calculation history
 void show_history(Calculator *calc) {
     printf("\nCalculation History:\n");
@@ -336,10 +112,10 @@ void show_history(Calculator *calc) {
     int start_index = (calc->history_index - calc->history_count + HISTORY_SIZE) % HISTORY_SIZE;
     for (int i = 0; i < calc->history_count; i++) {
         int index = (start_index + i) % HISTORY_SIZE;
-        printf("%d: %s = %.*g\n", i + 1, 
-               calc->history[index].expression, 
-               calc->precision,
-               calc->history[index].result);
+        printf("%d: %s = ", i + 1, calc->history[index].expression);
+        print_value(calc, calc->history[index].result);
+        fprint_unit(stdout, calc->history[index].unit);
+        printf("\n");
     }
 }
 
@@ -354,7 +130,17 @@ void show_variables(Calculator *calc) {
     }
     
     for (int i = 0; i < calc->var_count; i++) {
-        printf("%s = %.*g", calc->variables[i].name, calc->precision, calc->variables[i].value.real);
+        CalcError error = CALC_OK;
+        printf("%s = ", calc->variables[i].name);
+        if (refresh_variable(calc, i, &error)) {
+            print_value(calc, calc->variables[i].value);
+            fprint_unit(stdout, calc->variables[i].unit);
+        } else {
+            printf("(error)");
+        }
+        if (calc->variables[i].formula) {
+            printf(" := %s", calc->variables[i].formula);
+        }
         if (calc->variables[i].constant) {
             printf(" (constant)");
         }
@@ -371,9 +157,18 @@ void show_functions() {
     printf("Exponential:      exp, log, log10, log2, pow, sqrt, cbrt\n");
     printf("Rounding:         abs, floor, ceil, round\n");
     printf("Statistical:      min, max, sum, mean, median\n");
-    printf("Combinatorics:    factorial, perm, comb, gcd, lcm\n");
+    printf("Regression:       lstsq, polyfit, linfit\n");
+    printf("Aggregation:      groupby, hist\n");
+    printf("Sorting:          sort, argsort, unique, rank\n");
+    printf("Time series:      cumsum, cumprod, diff, movmean, movstd, movmin, movmax\n");
+    printf("Combinatorics:    factorial, perm, comb, lgamma, gcd, lcm\n");
     printf("Unit Conversion:  deg2rad, rad2deg\n");
-    printf("Matrix Operations: det, trace\n");
+    printf("Matrix Operations: det, trace, matrix, eye, transpose, full, eig, eigvals, svd, cond,\n");
+    printf("                   mpow, expm, sqrtm, logm\n");
+    printf("Signal:           fft, ifft, rfft, conv, xcorr\n");
+    printf("Polynomials:      poly, polyval, roots, polygcd, polyder, coeffs, degree\n");
+    printf("Sparse:           sparse, speye, nnz, cg, bicgstab\n");
+    printf("Complex:          real, imag, conj, arg (abs, sqrt, exp, log, sin, cos, tan, pow accept complex)\n");
     printf("Random:           rand\n");
 }
 
@@ -400,13 +195,30 @@ void show_help() {
     printf("\nCalculator Help:\n");
     printf("================\n");
     printf("Basic operations: +, -, *, /, ^ (power), %% (modulo), ! (factorial)\n");
+    printf("                  Operators work element-wise on vectors\n");
     printf("Assignment:       x = 5 (create variable), const x = 10 (create constant)\n");
+    printf("User functions:   f(x, y) = x^2 + y (listed under 'functions')\n");
     printf("Grouping:         Use parentheses () for complex expressions\n");
     printf("Functions:        func(arg1, arg2, ...) - see 'functions' for list\n");
     printf("Constants:        Predefined mathematical constants - see 'constants'\n");
     printf("Angle mode:       Use 'deg' for degrees mode, 'rad' for radians mode\n");
     printf("Precision:        Use 'precision n' to set decimal places (0-15)\n");
+    printf("Exact integers:   Whole numbers stay exact (e.g., 2^100, factorial(30))\n");
     printf("Complex numbers:  Use 'i' for imaginary unit (e.g., 3+4i)\n");
+    printf("Vectors:          [1, 2, 3] (e.g., fft([1, 0, 0, 0]), conv(a, b))\n");
+    printf("Polynomials:      p = poly([1, -3, 2]) is x^2 - 3x + 2; + - * / %% ^ apply,\n");
+    printf("                  polyval(p, x), roots(p)\n");
+    printf("Matrices:         A = [[1, 2], [3, 4]]; A * B, A * v, A ^ n, eig(A), expm(A)\n");
+    printf("Least squares:    x = lstsq(A, b), p = polyfit(x, y, 2), linfit(x, y)\n");
+    printf("Group-by:         groupby(key, value, mean) (count sum mean min max std), hist(x, 20)\n");
+    printf("Sorting:          sort(v), argsort(v), unique(v), rank(v); NaN sorts last\n");
+    printf("Time series:      cumsum(v), diff(v), movmean(v, 5), movstd, movmin, movmax (window 5)\n");
+    printf("Sparse matrices:  A = sparse(i, j, v) or 'spload A file.mtx'; A * v,\n");
+    printf("                  cg(A, b), bicgstab(A, b)\n");
+    printf("Comparisons:      < <= > >= == != give 1 or 0; && || ! (e.g., x > 0 && x < 1)\n");
+    printf("Units:            3 m, 9.81 m/s^2, 5 km/h; checked when compiled (2 m + 3 s is an error)\n");
+    printf("Scripts:          if c { ... } else { ... }, while c { ... }, for n = 1..10 { ... },\n");
+    printf("                  break, continue, print a, b; 'run file' or 'calculator run file'\n");
     printf("\nCommands:\n");
     printf("---------\n");
     printf("help       - Show this help message\n");
@@ -417,790 +229,1144 @@ void show_help() {
     printf("deg        - Set angle mode to degrees\n");
     printf("rad        - Set angle mode to radians\n");
     printf("precision n- Set display precision to n decimal places\n");
+    printf("reactive on|off - Keep assignment formulas and recompute dependents\n");
+    printf("stats      - Show expression and memo cache statistics ('stats reset' to clear)\n");
+    printf("save [file]- Save variables, functions and history (default ~/.calculator_session)\n");
+    printf("load [file]- Restore a saved session\n");
+    printf("spload name file - Read a sparse matrix (Matrix Market or triplets) into name\n");
+    printf("profile f [n] - Time n runs of f (default %d) by phase and function\n", PROFILE_DEFAULT_RUNS);
+    printf("run file   - Run a script (statements on separate lines, # comments)\n");
+    printf("grid ... f - Evaluate f(x, y, z, c) over a grid (z = c = x+yi); options\n");
+    printf("             size=WxH x=a:b y=c:d iter=N bailout=R scale=log out=FILE\n");
+    printf("             (.pgm, .pfm or raw float32); iter=N iterates z = f(z, c)\n");
     printf("clear      - Clear the screen\n");
     printf("exit, quit - Exit the calculator\n");
 }
 
 // Print error message
 void print_error(CalcError error) {
-    switch (error) {
-        case CALC_ERROR_SYNTAX:
-            printf("Error: Syntax error in expression\n");
-            break;
-        case CALC_ERROR_DIV_ZERO:
-            printf("Error: Division by zero\n");
-            break;
-        case CALC_ERROR_UNDEFINED:
-            printf("Error: Undefined result (e.g., sqrt of negative number)\n");
-            break;
-        case CALC_ERROR_OVERFLOW:
-            printf("Error: Numerical overflow\n");
-            break;
-        case CALC_ERROR_MEMORY:
-            printf("Error: Memory allocation failed\n");
-            break;
-        case CALC_ERROR_UNKNOWN_FUNCTION:
-            printf("Error: Unknown function\n");
-            break;
-        case CALC_ERROR_UNKNOWN_VARIABLE:
-            printf("Error: Unknown variable\n");
-            break;
-        case CALC_ERROR_ARG_COUNT:
-            printf("Error: Incorrect number of arguments for function\n");
-            break;
-        case CALC_ERROR_ARG_RANGE:
-            printf("Error: Argument out of valid range\n");
-            break;
-        case CALC_ERROR_MATRIX_DIM:
-            printf("Error: Matrix dimension mismatch\n");
-            break;
-        case CALC_ERROR_COMPLEX_OP:
-            printf("Error: Complex number operation not supported\n");
-            break;
-        default:
-            printf("Error: Unknown error\n");
-            break;
-    }
-}
-
-// Check if a string is a known constant
-int is_constant(const char *name) {
-    const char *constants[] = {"pi", "e", "phi", "gamma", "c", "G", "h", "q", "Na", "k", "inf", "i", NULL};
-    
-    for (int i = 0; constants[i] != NULL; i++) {
-        if (strcmp(name, constants[i]) == 0) {
-            return 1;
-        }
-    }
-    return 0;
+    printf("%s\n", error_message(error));
 }
 
-// Get value of a constant
-double get_constant_value(const char *name) {
-    if (strcmp(name, "pi") == 0) return PI;
-    if (strcmp(name, "e") == 0) return E;
-    if (strcmp(name, "phi") == 0) return PHI;
-    if (strcmp(name, "gamma") == 0) return GAMMA;
-    if (strcmp(name, "c") == 0) return LIGHT_SPEED;
-    if (strcmp(name, "G") == 0) return GRAVITATIONAL_CONSTANT;
-    if (strcmp(name, "h") == 0) return PLANCK_CONSTANT;
-    if (strcmp(name, "q") == 0) return ELECTRON_CHARGE;
-    if (strcmp(name, "Na") == 0) return AVOGADRO;
-    if (strcmp(name, "k") == 0) return BOLTZMANN;
-    if (strcmp(name, "inf") == 0) return INFINITY;
-    if (strcmp(name, "i") == 0) return 0; // Special case for complex unit
-    return 0.0;
+void print_value(Calculator *calc, Value v) {
+    fprint_value(stdout, calc, v);
 }
 
-// Find function definition by name
-FunctionDef* find_function(const char *name) {
-    for (int i = 0; function_table[i].func != NULL; i++) {
-        if (strcmp(function_table[i].name, name) == 0) {
-            return &function_table[i];
-        }
+void print_user_function(FILE *out, const UserFunction *fn) {
+    fprintf(out, "%s(", fn->name);
+    for (int i = 0; i < fn->param_count; i++) {
+        fprintf(out, "%s%s", i ? ", " : "", fn->params[i]);
     }
-    return NULL;
+    fprintf(out, ") = %s\n", fn->source);
 }
 
-// Calculate factorial
-double factorial(double n) {
-    if (n < 0 || n != floor(n)) {
-        return NAN;
-    }
+// Expression cache statistics. The time saved is estimated as the mean
+// compile time of a miss times the number of hits, less lookup overhead;
+// with few hits the lookups can cost more, which shows as none saved.
+void show_stats(Calculator *calc) {
+    ExprCache *cache = &calc->cache;
+    unsigned long misses = cache->lookups - cache->hits;
+    double mean_compile = misses ? cache->compile_ms / misses : 0;
+    double saved = cache->hits * mean_compile - cache->lookup_ms;
     
-    double result = 1;
-    for (int i = 2; i <= n; i++) {
-        result *= i;
-        if (isinf(result)) {
-            return INFINITY;
-        }
+    printf("\nExpression cache:\n");
+    printf("-----------------\n");
+    printf("Entries:       %zu (%.1f of %.0f KB)\n", cache->entry_count,
+           cache->bytes / 1024.0, cache->byte_limit / 1024.0);
+    printf("Lookups:       %lu (%lu hits, %lu misses", cache->lookups, cache->hits, misses);
+    if (cache->lookups > 0) {
+        printf(", %.1f%% hit rate", 100.0 * cache->hits / cache->lookups);
     }
-    return result;
-}
-
-// Calculate GCD of two integers
-long long gcd(long long a, long long b) {
-    a = llabs(a);
-    b = llabs(b);
+    printf(")\n");
+    printf("Evictions:     %lu (%lu invalidated by redefinitions)\n", cache->evictions, cache->invalidations);
+    printf("Compile time:  %.3f ms (%.2f us per miss)\n", cache->compile_ms, mean_compile * 1e3);
+    printf("Lookup time:   %.3f ms\n", cache->lookup_ms);
+    printf("Time saved:    %.3f ms\n", saved > 0 ? saved : 0);
     
-    while (b != 0) {
-        long long temp = b;
-        b = a % b;
-        a = temp;
+    MemoCache *memo = &calc->memo;
+    unsigned long calls = memo->hits + memo->misses;
+    printf("\nMemoized function results:\n");
+    printf("--------------------------\n");
+    printf("Lookups:       %lu (%lu hits, %lu misses", calls, memo->hits, memo->misses);
+    if (calls > 0) {
+        printf(", %.1f%% hit rate", 100.0 * memo->hits / calls);
     }
-    return a;
+    printf(")\n");
 }
 
-// Calculate LCM of two integers
-long long lcm(long long a, long long b) {
-    if (a == 0 || b == 0) return 0;
-    return llabs(a * b) / gcd(a, b);
+// Default snapshot file for save and load
+void default_session_path(char *path, size_t size) {
+    const char *home = getenv("HOME");
+    snprintf(path, size, "%s/.calculator_session", home && *home ? home : ".");
 }
 
-// Matrix determinant
-double matrix_det(Matrix a) {
-    if (a.rows != a.cols) return NAN;
-    
-    if (a.rows == 1) return a.data[0][0];
-    if (a.rows == 2) return a.data[0][0] * a.data[1][1] - a.data[0][1] * a.data[1][0];
-    
-    double det = 0;
-    for (int col = 0; col < a.cols; col++) {
-        Matrix submatrix;
-        submatrix.rows = a.rows - 1;
-        submatrix.cols = a.cols - 1;
-        
-        for (int i = 1; i < a.rows; i++) {
-            int subcol = 0;
-            for (int j = 0; j < a.cols; j++) {
-                if (j == col) continue;
-                submatrix.data[i-1][subcol++] = a.data[i][j];
-            }
-        }
-        
-        double sign = (col % 2 == 0) ? 1 : -1;
-        det += sign * a.data[0][col] * matrix_det(submatrix);
+// save [FILE] / load [FILE]
+int handle_session(Calculator *calc, const char *args, int save) {
+    char path[4096];
+    while (isspace(*args)) args++;
+    if (*args == '=') return 0;  // Assignment to a variable named save/load
+    if (*args) {
+        snprintf(path, sizeof(path), "%s", args);
+        path[strcspn(path, " \t")] = '\0';
+    } else {
+        default_session_path(path, sizeof(path));
     }
     
-    return det;
+    CalcError error = CALC_OK;
+    if (save ? session_save(calc, path, &error) : session_load(calc, path, &error)) {
+        printf("Session %s %s (%d variables, %d functions, %d history entries)\n",
+               save ? "saved to" : "loaded from", path, calc->var_count, calc->function_count, calc->history_count);
+    } else {
+        print_error(error);
+    }
+    return 1;
 }
 
-// Matrix trace
-double matrix_trace(Matrix a) {
-    if (a.rows != a.cols) return NAN;
+// spload NAME FILE: read a sparse matrix into a variable
+int handle_spload(Calculator *calc, const char *args) {
+    char name[32], path[4096];
+    int length = 0;
+    while (isspace(*args)) args++;
+    if (*args == '=') return 0;  // Assignment to a variable named spload
+    while ((isalnum(args[length]) || args[length] == '_') && length < 31) length++;
+    if (length == 0 || isdigit(*args) || !isspace(args[length])) {
+        print_error(CALC_ERROR_SYNTAX);
+        return 1;
+    }
+    memcpy(name, args, length);
+    name[length] = '\0';
+    args += length;
+    while (isspace(*args)) args++;
+    snprintf(path, sizeof(path), "%s", args);
+    path[strcspn(path, " \t")] = '\0';
+    if (*path == '\0') {
+        print_error(CALC_ERROR_SYNTAX);
+        return 1;
+    }
     
-    double trace = 0;
-    for (int i = 0; i < a.rows; i++) {
-        trace += a.data[i][i];
+    CalcError error = CALC_OK;
+    SparseMatrix *m = sparse_load(path, &error);
+    if (m == NULL) {
+        print_error(error);
+        return 1;
     }
-    return trace;
-}
-
-// Mathematical function implementations
-double func_sin(double args[], int count) {
-    return sin(args[0]);
-}
-
-double func_cos(double args[], int count) {
-    return cos(args[0]);
-}
-
-double func_tan(double args[], int count) {
-    return tan(args[0]);
-}
-
-double func_asin(double args[], int count) {
-    if (args[0] < -1 || args[0] > 1) return NAN;
-    return asin(args[0]);
-}
-
-double func_acos(double args[], int count) {
-    if (args[0] < -1 || args[0] > 1) return NAN;
-    return acos(args[0]);
-}
-
-double func_atan(double args[], int count) {
-    return atan(args[0]);
-}
-
-double func_atan2(double args[], int count) {
-    return atan2(args[0], args[1]);
-}
-
-double func_sinh(double args[], int count) {
-    return sinh(args[0]);
-}
-
-double func_cosh(double args[], int count) {
-    return cosh(args[0]);
-}
-
-double func_tanh(double args[], int count) {
-    return tanh(args[0]);
-}
-
-double func_asinh(double args[], int count) {
-    return asinh(args[0]);
-}
-
-double func_acosh(double args[], int count) {
-    if (args[0] < 1) return NAN;
-    return acosh(args[0]);
-}
-
-double func_atanh(double args[], int count) {
-    if (args[0] <= -1 || args[0] >= 1) return NAN;
-    return atanh(args[0]);
-}
-
-double func_log(double args[], int count) {
-    if (args[0] <= 0) return NAN;
-    return log(args[0]);
-}
-
-double func_log10(double args[], int count) {
-    if (args[0] <= 0) return NAN;
-    return log10(args[0]);
-}
-
-double func_log2(double args[], int count) {
-    if (args[0] <= 0) return NAN;
-    return log2(args[0]);
-}
-
-double func_exp(double args[], int count) {
-    return exp(args[0]);
-}
-
-double func_sqrt(double args[], int count) {
-    if (args[0] < 0) return NAN;
-    return sqrt(args[0]);
-}
-
-double func_cbrt(double args[], int count) {
-    return cbrt(args[0]);
+    Value v = value_sparse(m);
+    Variable *var = find_variable(calc, name);
+    if (var != NULL && var->constant) {
+        print_error(CALC_ERROR_ARG_RANGE);
+    } else if (!set_variable_value(calc, name, v, 0)) {
+        print_error(CALC_ERROR_MEMORY);
+    } else {
+        printf("%s = ", name);
+        print_value(calc, v);
+        printf("\n");
+    }
+    value_release(&v);
+    return 1;
 }
 
-double func_pow(double args[], int count) {
-    return pow(args[0], args[1]);
+// Run a compiled script (prog is NULL if compiling failed with error at
+// line). The value of a final expression is printed as at the prompt;
+// errors in scripts read from a file give the file and line. Returns 0 on
+// error.
+int run_script(Calculator *calc, Program *prog, const char *name, int line, CalcError error) {
+    if (prog != NULL) {
+        Value result = program_run(calc, prog, NULL, &error);
+        if (error == CALC_OK && prog->result >= 0) {
+            printf("= ");
+            print_value(calc, result);
+            fprint_unit(stdout, prog->unit);
+            printf("\n");
+        } else if (error != CALC_OK) {
+            line = calc->error_line;
+        }
+        value_release(&result);
+        program_free(prog);
+    }
+    if (error == CALC_OK) return 1;
+    if (name != NULL && line > 0) {
+        printf("%s:%d: ", name, line);
+    } else if (name != NULL) {
+        printf("%s: ", name);
+    }
+    print_error(error);
+    return 0;
 }
 
-double func_abs(double args[], int count) {
-    return fabs(args[0]);
+// run FILE: run a script file
+int handle_run(Calculator *calc, const char *args) {
+    char path[4096];
+    while (isspace(*args)) args++;
+    if (*args == '=') return 0;  // Assignment to a variable named run
+    snprintf(path, sizeof(path), "%s", args);
+    size_t length = strlen(path);
+    while (length > 0 && isspace(path[length - 1])) path[--length] = '\0';
+    if (length == 0) {
+        printf("Usage: run <file>\n");
+        return 1;
+    }
+    CalcError error = CALC_OK;
+    int line = 0;
+    Program *prog = load_script(calc, path, &line, &error);
+    run_script(calc, prog, path, line, error);
+    return 1;
 }
 
-double func_floor(double args[], int count) {
-    return floor(args[0]);
-}
+// Profile an expression: run it n times, timing a separate tokenizing
+// pass, compiling (which lexes as it parses) and evaluation, and count
+// heap allocations and calls per function. The expression cache is
+// bypassed so every run compiles; the total is compile plus evaluate.
+enum { PHASE_TOKENIZE, PHASE_COMPILE, PHASE_EVALUATE, PHASE_COUNT };
 
-double func_ceil(double args[], int count) {
-    return ceil(args[0]);
+// The allocations per run column of the profile, "-" when not counted
+void print_allocs(unsigned long allocs, long runs) {
+    if (ALLOC_COUNTING) {
+        printf(" %11.1f\n", (double)allocs / runs);
+    } else {
+        printf(" %11s\n", "-");
+    }
 }
 
-double func_round(double args[], int count) {
-    return round(args[0]);
+int compare_latency(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
 }
 
-double func_min(double args[], int count) {
-    double min_val = args[0];
-    for (int i = 1; i < count; i++) {
-        if (args[i] < min_val) min_val = args[i];
+int handle_profile(Calculator *calc, const char *args) {
+    static const char *const phase_names[PHASE_COUNT] = {"Tokenize", "Compile", "Evaluate"};
+    
+    // A trailing integer after a complete operand is the run count
+    while (isspace(*args)) args++;
+    size_t len = strlen(args);
+    while (len > 0 && isspace(args[len - 1])) len--;
+    long runs = PROFILE_DEFAULT_RUNS;
+    size_t digits = len;
+    while (digits > 0 && isdigit(args[digits - 1])) digits--;
+    size_t operand_end = digits;
+    while (operand_end > 0 && isspace(args[operand_end - 1])) operand_end--;
+    if (digits < len && operand_end < digits && operand_end > 0 &&
+        (isalnum(args[operand_end - 1]) || strchr("_)]!", args[operand_end - 1]))) {
+        runs = atol(args + digits);
+        len = operand_end;
     }
-    return min_val;
-}
-
-double func_max(double args[], int count) {
-    double max_val = args[0];
-    for (int i = 1; i < count; i++) {
-        if (args[i] > max_val) max_val = args[i];
+    if (len == 0 || runs < 1 || runs > PROFILE_MAX_RUNS) {
+        printf("Usage: profile <expression> [runs], 1 <= runs <= %d\n", PROFILE_MAX_RUNS);
+        return 1;
     }
-    return max_val;
-}
-
-double func_sum(double args[], int count) {
-    double sum = 0;
-    for (int i = 0; i < count; i++) {
-        sum += args[i];
+    char *expr = strndup(args, len);
+    
+    CalcError error = CALC_OK;
+    Program *prog = compile_expression(calc, expr, NULL, 0, &error);
+    if (prog == NULL) {
+        print_error(error);
+        free(expr);
+        return 1;
+    }
+    for (int i = 0; i < prog->code_count; i++) {
+        if (prog->code[i].op == OP_STORE) {
+            printf("Error: profile does not run assignments\n");
+            program_free(prog);
+            free(expr);
+            return 1;
+        }
+    }
+    program_free(prog);
+    
+    int table_size = 0;
+    while (function_table[table_size].name[0] != '\0') table_size++;
+    Profile profile;
+    profile.calls = calloc(table_size, sizeof(unsigned long));
+    profile.call_ms = calloc(table_size, sizeof(double));
+    profile.user_calls = calloc(calc->function_count + 1, sizeof(unsigned long));
+    profile.user_ms = calloc(calc->function_count + 1, sizeof(double));
+    double *latency = malloc(runs * sizeof(double));
+    if (!profile.calls || !profile.call_ms || !profile.user_calls || !profile.user_ms || !latency) {
+        print_error(CALC_ERROR_MEMORY);
+        runs = 0;
     }
-    return sum;
-}
-
-double func_mean(double args[], int count) {
-    if (count == 0) return 0;
-    return func_sum(args, count) / count;
-}
-
-double func_median(double args[], int count) {
-    if (count == 0) return 0;
     
-    // Sort the arguments
-    for (int i = 0; i < count - 1; i++) {
-        for (int j = i + 1; j < count; j++) {
-            if (args[i] > args[j]) {
-                double temp = args[i];
-                args[i] = args[j];
-                args[j] = temp;
+    double phase_ms[PHASE_COUNT] = {0};
+    unsigned long phase_allocs[PHASE_COUNT] = {0};
+    long completed = 0;
+    for (; completed < runs && error == CALC_OK; completed++) {
+        struct timespec start;
+        unsigned long allocs = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+        double run_ms = 0;  // Compile and evaluate, as an uncached evaluation
+        
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int token_count = 0;
+        free(tokenize(expr, &token_count, &error));
+        double ms = elapsed_ms(&start);
+        phase_ms[PHASE_TOKENIZE] += ms;
+        unsigned long now = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+        phase_allocs[PHASE_TOKENIZE] += now - allocs;
+        allocs = now;
+        
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        prog = compile_expression(calc, expr, NULL, 0, &error);
+        ms = elapsed_ms(&start);
+        phase_ms[PHASE_COMPILE] += ms;
+        run_ms += ms;
+        now = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+        phase_allocs[PHASE_COMPILE] += now - allocs;
+        allocs = now;
+        if (prog == NULL) break;
+        
+        calc->profile = &profile;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        Value result = program_run(calc, prog, NULL, &error);
+        ms = elapsed_ms(&start);
+        calc->profile = NULL;
+        phase_ms[PHASE_EVALUATE] += ms;
+        run_ms += ms;
+        phase_allocs[PHASE_EVALUATE] += __atomic_load_n(&alloc_count, __ATOMIC_RELAXED) - allocs;
+        value_release(&result);
+        program_free(prog);
+        latency[completed] = run_ms;
+    }
+    
+    if (error != CALC_OK) {
+        print_error(error);
+    } else if (completed > 0) {
+        double total_ms = phase_ms[PHASE_COMPILE] + phase_ms[PHASE_EVALUATE];
+        unsigned long total_allocs = phase_allocs[PHASE_COMPILE] + phase_allocs[PHASE_EVALUATE];
+        qsort(latency, completed, sizeof(double), compare_latency);
+        
+        printf("\nProfile of %s (%ld runs):\n", expr, completed);
+        printf("-----------------------------\n");
+        printf("%-14s %12s %10s %7s %11s\n", "Phase", "total ms", "us/run", "share", "allocs/run");
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            printf("%-14s %12.3f %10.3f ", phase_names[i], phase_ms[i], phase_ms[i] * 1e3 / completed);
+            if (i == PHASE_TOKENIZE) {
+                printf("%7s", "-");  // Not part of the total
+            } else {
+                printf("%6.1f%%", total_ms > 0 ? 100 * phase_ms[i] / total_ms : 0);
             }
+            print_allocs(phase_allocs[i], completed);
+        }
+        printf("%-14s %12.3f %10.3f %6.1f%%", "Total", total_ms, total_ms * 1e3 / completed, 100.0);
+        print_allocs(total_allocs, completed);
+        printf("Latency per run: p50 %.3f us, p99 %.3f us, max %.3f us\n",
+               latency[completed / 2] * 1e3, latency[(completed - 1) * 99 / 100] * 1e3,
+               latency[completed - 1] * 1e3);
+        
+        // Calls by time, which includes nested user function calls
+        int printed = 0;
+        for (int i = 0; i < table_size; i++) {
+            if (profile.calls[i] == 0) continue;
+            if (printed++ == 0) printf("\n%-14s %12s %12s %7s\n", "Function", "calls/run", "ms", "of eval");
+            printf("%-14s %12.1f %12.3f %6.1f%%\n", function_table[i].name, (double)profile.calls[i] / completed,
+                   profile.call_ms[i], phase_ms[PHASE_EVALUATE] > 0 ? 100 * profile.call_ms[i] / phase_ms[PHASE_EVALUATE] : 0);
+        }
+        for (int i = 0; i < calc->function_count; i++) {
+            if (profile.user_calls[i] == 0) continue;
+            if (printed++ == 0) printf("\n%-14s %12s %12s %7s\n", "Function", "calls/run", "ms", "of eval");
+            printf("%-14s %12.1f %12.3f %6.1f%%\n", calc->functions[i].name, (double)profile.user_calls[i] / completed,
+                   profile.user_ms[i], phase_ms[PHASE_EVALUATE] > 0 ? 100 * profile.user_ms[i] / phase_ms[PHASE_EVALUATE] : 0);
         }
     }
     
-    if (count % 2 == 1) {
-        return args[count / 2];
-    } else {
-        return (args[count / 2 - 1] + args[count / 2]) / 2;
-    }
-}
-
-double func_factorial(double args[], int count) {
-    return factorial(args[0]);
-}
-
-double func_gcd(double args[], int count) {
-    long long a = (long long)args[0];
-    long long b = (long long)args[1];
-    return (double)gcd(a, b);
-}
-
-double func_lcm(double args[], int count) {
-    long long a = (long long)args[0];
-    long long b = (long long)args[1];
-    return (double)lcm(a, b);
-}
-
-double func_deg2rad(double args[], int count) {
-    return args[0] * PI / 180.0;
+    free(profile.calls);
+    free(profile.call_ms);
+    free(profile.user_calls);
+    free(profile.user_ms);
+    free(latency);
+    free(expr);
+    return 1;
 }
 
-double func_rad2deg(double args[], int count) {
-    return args[0] * 180.0 / PI;
+// Grid evaluation job. Plain mode evaluates f(x, y, z, c) once per pixel;
+// escape mode iterates z = f(z, c) from z = c and records the (smoothed)
+// iteration at which |z| exceeds the bailout radius, 0 if it never does.
+// Element-wise programs run over a whole tile at once, with the
+// parameters as vectors; the others run pixel by pixel, so that sum, max
+// and the like see one point's values rather than the tile's.
+typedef struct {
+    Calculator *calc;
+    Program *prog;
+    int width;
+    int height;
+    double x0, x1, y0, y1;
+    int iterations;
+    double bailout;
+    int tiles_x;
+    int elementwise;
+    float *out;
+    CalcError error;
+} GridJob;
+
+// Does prog compute each element of its result from the same elements of
+// vector parameters alone? Arithmetic and functions mapped element-wise
+// do; reductions, vector functions, literals, comparisons and control
+// flow do not. User functions are checked through their bodies, depth
+// levels deep at most.
+int grid_elementwise(Calculator *calc, const Program *prog, int depth) {
+    for (int pc = 0; pc < prog->code_count; pc++) {
+        const Instruction *ins = &prog->code[pc];
+        switch (ins->op) {
+            case OP_CONST: case OP_LOAD: case OP_PARAM: case OP_NEG: case OP_ADD: case OP_SUB:
+            case OP_MUL: case OP_DIV: case OP_MOD: case OP_POW: case OP_MOVE:
+                break;
+            case OP_CALL: {
+                const FunctionDef *f = &function_table[ins->c];
+                ValueFunc v = f->vfunc;
+                int mapped = f->func != NULL && f->max_args > 0 && (v == NULL || v == func_vabs || v == func_vpow);
+                if (!mapped && v != func_real && v != func_imag && v != func_conj && v != func_arg) return 0;
+                break;
+            }
+            case OP_UCALL:
+                if (depth == 0 || !grid_elementwise(calc, calc->functions[ins->c].body, depth - 1)) return 0;
+                break;
+            default:
+                return 0;
+        }
+    }
+    return 1;
 }
 
-double func_perm(double args[], int count) {
-    long long n = (long long)args[0];
-    long long k = (long long)args[1];
-    
-    if (n < 0 || k < 0 || k > n) return NAN;
-    
-    long long result = 1;
-    for (long long i = 0; i < k; i++) {
-        result *= (n - i);
-        if (result < 0) return INFINITY; // Overflow
+// Real and imaginary parts of a scalar result; 0 if it is not a scalar
+int grid_scalar(Value v, double *re, double *im) {
+    *im = 0;
+    if (v.type == CALC_COMPLEX) {
+        *re = v.complex_num.real;
+        *im = v.complex_num.imag;
+        return 1;
     }
-    return (double)result;
+    if (v.type != CALC_REAL && v.type != CALC_INTEGER && v.type != CALC_BIGINT) return 0;
+    *re = value_to_double(v);
+    return 1;
 }
 
-double func_comb(double args[], int count) {
-    long long n = (long long)args[0];
-    long long k = (long long)args[1];
-    
-    if (n < 0 || k < 0 || k > n) return NAN;
-    
-    // Use smaller of k and n-k
-    if (k > n - k) k = n - k;
-    
-    long long result = 1;
-    for (long long i = 1; i <= k; i++) {
-        result = result * (n - k + i) / i;
-        if (result < 0) return INFINITY; // Overflow
+// Smoothed escape iteration of a point whose |z|^2 passed the bailout at
+// iteration it
+float grid_escape(const GridJob *job, int it, double mag2) {
+    double smooth = it + 1;
+    if (mag2 > 1 && isfinite(mag2)) {
+        smooth -= log2(log(mag2) / (2 * log(job->bailout > 1 ? job->bailout : 2)));
+    }
+    return (float)(smooth > 0 ? smooth : 0);
+}
+
+// Evaluate one pixel with scalar parameters
+float grid_point(GridJob *job, double x, double y, CalcError *error) {
+    Value params[4] = {value_real(x), value_real(y), value_complex(x, y), value_complex(x, y)};
+    double limit = job->bailout * job->bailout;
+    int steps = job->iterations > 0 ? job->iterations : 1;
+    for (int it = 0; it < steps; it++) {
+        double re = 0, im = 0;
+        Value result = program_run(job->calc, job->prog, params, error);
+        if (*error == CALC_OK && !grid_scalar(result, &re, &im)) *error = CALC_ERROR_TYPE;
+        value_release(&result);
+        if (*error != CALC_OK) return 0;
+        if (job->iterations == 0) return (float)(im == 0 ? re : hypot(re, im));
+        
+        double mag2 = re * re + im * im;
+        if (mag2 > limit || isnan(mag2)) return grid_escape(job, it, mag2);
+        params[2] = value_complex(re, im);
     }
-    return (double)result;
+    return 0;
 }
 
-double func_rand(double args[], int count) {
-    if (count == 0) {
-        return (double)rand() / RAND_MAX;
-    } else if (count == 1) {
-        return (double)rand() / RAND_MAX * args[0];
-    } else {
-        return args[0] + (double)rand() / RAND_MAX * (args[1] - args[0]);
+// Store one tile's result values (vector, or scalar broadcast) as floats
+void grid_store(float *out, const int *index, size_t n, Value v) {
+    for (size_t k = 0; k < n; k++) {
+        double re, im = 0;
+        if (v.type == CALC_VECTOR) {
+            re = v.vector->re[k];
+            if (v.vector->im) im = v.vector->im[k];
+        } else if (v.type == CALC_COMPLEX) {
+            re = v.complex_num.real;
+            im = v.complex_num.imag;
+        } else {
+            re = value_to_double(v);
+        }
+        out[index[k]] = (float)(im == 0 ? re : hypot(re, im));
     }
 }
 
-double func_det(double args[], int count) {
-    // For simplicity, assume a 2x2 matrix with 4 elements
-    if (count != 4) return NAN;
+void grid_tile(void *arg, size_t tile, int worker) {
+    GridJob *job = arg;
+    if (__atomic_load_n(&job->error, __ATOMIC_RELAXED) != CALC_OK) return;
     
-    Matrix m;
-    m.rows = 2;
-    m.cols = 2;
-    m.data[0][0] = args[0];
-    m.data[0][1] = args[1];
-    m.data[1][0] = args[2];
-    m.data[1][1] = args[3];
+    int tx = (int)(tile % job->tiles_x) * GRID_TILE;
+    int ty = (int)(tile / job->tiles_x) * GRID_TILE;
+    int tw = job->width - tx < GRID_TILE ? job->width - tx : GRID_TILE;
+    int th = job->height - ty < GRID_TILE ? job->height - ty : GRID_TILE;
+    size_t n = (size_t)tw * th;
     
-    return matrix_det(m);
-}
-
-double func_trace(double args[], int count) {
-    // For simplicity, assume a 2x2 matrix with 4 elements
-    if (count != 4) return NAN;
+    double dx = job->width > 1 ? (job->x1 - job->x0) / (job->width - 1) : 0;
+    double dy = job->height > 1 ? (job->y1 - job->y0) / (job->height - 1) : 0;
     
-    Matrix m;
-    m.rows = 2;
-    m.cols = 2;
-    m.data[0][0] = args[0];
-    m.data[0][1] = args[1];
-    m.data[1][0] = args[2];
-    m.data[1][1] = args[3];
+    int index[GRID_TILE * GRID_TILE];
+    Vector *xv = NULL, *yv = NULL, *zv = NULL, *cv = NULL;
+    CalcError error = CALC_OK;
+    if (!job->elementwise) {
+        for (int j = 0; j < th && error == CALC_OK; j++) {
+            for (int i = 0; i < tw && error == CALC_OK; i++) {
+                job->out[(ty + j) * job->width + tx + i] =
+                    grid_point(job, job->x0 + (tx + i) * dx, job->y1 - (ty + j) * dy, &error);
+            }
+        }
+        goto done;
+    }
     
-    return matrix_trace(m);
-}
-
-// Calculate a function with error checking
-double calculate_function(Calculator *calc, const char *func_name, double args[], int arg_count, CalcError *error) {
-    FunctionDef *func_def = find_function(func_name);
-    if (func_def == NULL) {
-        *error = CALC_ERROR_UNKNOWN_FUNCTION;
-        return 0;
+    xv = vector_new(n, 0);
+    yv = vector_new(n, 0);
+    zv = vector_new(n, 1);
+    cv = vector_new(n, 1);
+    if (xv == NULL || yv == NULL || zv == NULL || cv == NULL) {
+        error = CALC_ERROR_MEMORY;
+        goto done;
     }
     
-    if (arg_count < func_def->min_args || (func_def->max_args > 0 && arg_count > func_def->max_args)) {
-        *error = CALC_ERROR_ARG_COUNT;
-        return 0;
+    // Row 0 is the top of the image (largest y)
+    size_t k = 0;
+    for (int j = 0; j < th; j++) {
+        for (int i = 0; i < tw; i++, k++) {
+            index[k] = (ty + j) * job->width + tx + i;
+            xv->re[k] = job->x0 + (tx + i) * dx;
+            yv->re[k] = job->y1 - (ty + j) * dy;
+        }
+    }
+    memcpy(zv->re, xv->re, n * sizeof(double));
+    memcpy(zv->im, yv->re, n * sizeof(double));
+    memcpy(cv->re, xv->re, n * sizeof(double));
+    memcpy(cv->im, yv->re, n * sizeof(double));
+    Value params[4] = {value_vector(xv), value_vector(yv), value_vector(zv), value_vector(cv)};
+    
+    if (job->iterations == 0) {
+        Value result = program_run(job->calc, job->prog, params, &error);
+        if (error == CALC_OK && (result.type == CALC_POLY || result.type == CALC_SPARSE || result.type == CALC_MATRIX)) error = CALC_ERROR_TYPE;
+        if (error == CALC_OK) grid_store(job->out, index, n, result);
+        value_release(&result);
+        goto done;
     }
     
-    // Handle angle conversion for trigonometric functions
-    if (calc->angle_mode == 1) { // Degrees mode
-        if (strcmp(func_name, "sin") == 0 || strcmp(func_name, "cos") == 0 || 
-            strcmp(func_name, "tan") == 0 || strcmp(func_name, "asin") == 0 ||
-            strcmp(func_name, "acos") == 0 || strcmp(func_name, "atan") == 0) {
-            if (strcmp(func_name, "sin") == 0 || strcmp(func_name, "cos") == 0 || 
-                strcmp(func_name, "tan") == 0) {
-                args[0] = args[0] * PI / 180.0;
+    // Escape-time iteration over the still-active points, compacted as
+    // points escape so later iterations only touch the interior
+    double limit = job->bailout * job->bailout;
+    for (k = 0; k < n; k++) job->out[index[k]] = 0;
+    for (int it = 0; it < job->iterations && n > 0; it++) {
+        Value result = program_run(job->calc, job->prog, params, &error);
+        if (error == CALC_OK && (result.type == CALC_POLY || result.type == CALC_SPARSE || result.type == CALC_MATRIX)) error = CALC_ERROR_TYPE;
+        if (error != CALC_OK) {
+            value_release(&result);
+            break;
+        }
+        
+        size_t live = 0;
+        for (k = 0; k < n; k++) {
+            double re, im = 0;
+            if (result.type == CALC_VECTOR) {
+                re = result.vector->re[k];
+                if (result.vector->im) im = result.vector->im[k];
+            } else if (result.type == CALC_COMPLEX) {
+                re = result.complex_num.real;
+                im = result.complex_num.imag;
             } else {
-                double result = func_def->func(args, arg_count);
-                if (!isnan(result)) {
-                    result = result * 180.0 / PI;
-                }
-                return result;
+                re = value_to_double(result);
             }
+            
+            double mag2 = re * re + im * im;
+            if (mag2 > limit || isnan(mag2)) {
+                job->out[index[k]] = grid_escape(job, it, mag2);
+                continue;
+            }
+            index[live] = index[k];
+            xv->re[live] = xv->re[k];
+            yv->re[live] = yv->re[k];
+            cv->re[live] = cv->re[k];
+            cv->im[live] = cv->im[k];
+            zv->re[live] = re;
+            zv->im[live] = im;
+            live++;
         }
+        value_release(&result);
+        n = live;
+        xv->length = yv->length = zv->length = cv->length = n;
     }
     
-    double result = func_def->func(args, arg_count);
-    if (isnan(result)) {
-        *error = CALC_ERROR_UNDEFINED;
-    } else if (isinf(result)) {
-        *error = CALC_ERROR_OVERFLOW;
+done:
+    vector_release(xv);
+    vector_release(yv);
+    vector_release(zv);
+    vector_release(cv);
+    if (error != CALC_OK) {
+        CalcError expected = CALC_OK;
+        __atomic_compare_exchange_n(&job->error, &expected, error, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
     }
-    
-    return result;
 }
 
-// Tokenize the input expression
-Token* tokenize(const char *expr, int *token_count, CalcError *error) {
-    Token *tokens = malloc(MAX_TOKENS * sizeof(Token));
-    if (tokens == NULL) {
-        *error = CALC_ERROR_MEMORY;
-        return NULL;
+// Parse "a:b" into a range
+int parse_range(const char *text, double *lo, double *hi) {
+    char *end;
+    *lo = strtod(text, &end);
+    if (end == text || *end != ':') return 0;
+    const char *rest = end + 1;
+    *hi = strtod(rest, &end);
+    return end != rest && *end == '\0' && *lo != *hi;
+}
+
+// Write the rendered values; the extension picks the format
+int write_grid(const char *path, const float *values, int width, int height, int log_scale) {
+    const char *ext = strrchr(path, '.');
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        printf("Error: Cannot open %s: %s\n", path, strerror(errno));
+        return 0;
     }
     
-    *token_count = 0;
-    const char *p = expr;
-    
-    while (*p && *token_count < MAX_TOKENS) {
-        // Skip whitespace
-        if (isspace(*p)) {
-            p++;
-            continue;
-        }
-        
-        // Number
-        if (isdigit(*p) || (*p == '.' && isdigit(*(p+1))) || 
-            (*p == '-' && (isdigit(*(p+1)) || *(p+1) == '.'))) {
-            char *end;
-            double value = strtod(p, &end);
-            
-            tokens[*token_count].type = TOK_NUMBER;
-            tokens[*token_count].value = value;
-            *token_count += 1;
-            
-            p = end;
-            continue;
-        }
-        
-        // Identifier or function
-        if (isalpha(*p) || *p == '_') {
-            int i = 0;
-            while ((isalnum(*p) || *p == '_') && i < 31) {
-                tokens[*token_count].name[i++] = *p++;
-            }
-            tokens[*token_count].name[i] = '\0';
-            
-            // Check if it's followed by '(' - then it's a function
-            const char *next = p;
-            while (isspace(*next)) next++;
-            
-            if (*next == '(') {
-                tokens[*token_count].type = TOK_FUNCTION;
-            } else {
-                tokens[*token_count].type = TOK_IDENTIFIER;
+    size_t count = (size_t)width * height;
+    if (ext != NULL && strcmp(ext, ".pgm") == 0) {
+        double lo = INFINITY, hi = -INFINITY;
+        for (size_t k = 0; k < count; k++) {
+            double v = log_scale ? log10(values[k]) : values[k];
+            if (isfinite(v)) {
+                if (v < lo) lo = v;
+                if (v > hi) hi = v;
             }
-            
-            *token_count += 1;
-            continue;
         }
-        
-        // Operators
-        if (strchr("+-*/^!%", *p) != NULL) {
-            tokens[*token_count].type = TOK_OPERATOR;
-            tokens[*token_count].name[0] = *p;
-            tokens[*token_count].name[1] = '\0';
-            *token_count += 1;
-            p++;
-            continue;
-        }
-        
-        // Parentheses and comma
-        if (*p == '(') {
-            tokens[*token_count].type = TOK_LPAREN;
-            *token_count += 1;
-            p++;
-            continue;
-        }
-        
-        if (*p == ')') {
-            tokens[*token_count].type = TOK_RPAREN;
-            *token_count += 1;
-            p++;
-            continue;
-        }
-        
-        if (*p == ',') {
-            tokens[*token_count].type = TOK_COMMA;
-            *token_count += 1;
-            p++;
-            continue;
+        double scale = hi > lo ? 255.0 / (hi - lo) : 0;
+        unsigned char *row = malloc(width);
+        fprintf(f, "P5\n%d %d\n255\n", width, height);
+        for (int j = 0; row != NULL && j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                double v = values[(size_t)j * width + i];
+                if (log_scale) v = log10(v);
+                row[i] = isfinite(v) ? (unsigned char)((v - lo) * scale + 0.5) : 0;
+            }
+            fwrite(row, 1, width, f);
         }
-        
-        if (*p == '=') {
-            tokens[*token_count].type = TOK_EQUAL;
-            *token_count += 1;
-            p++;
-            continue;
+        free(row);
+    } else if (ext != NULL && strcmp(ext, ".pfm") == 0) {
+        // Portable float map: little-endian, rows stored bottom to top
+        fprintf(f, "Pf\n%d %d\n-1.0\n", width, height);
+        for (int j = height - 1; j >= 0; j--) {
+            fwrite(values + (size_t)j * width, sizeof(float), width, f);
         }
-        
-        // Unknown character
-        *error = CALC_ERROR_SYNTAX;
-        free(tokens);
-        return NULL;
+    } else {
+        fwrite(values, sizeof(float), count, f);
     }
     
-    // Add EOF token
-    tokens[*token_count].type = TOK_EOF;
-    *token_count += 1;
+    int ok = !ferror(f);
+    if (fclose(f) != 0) ok = 0;
+    if (!ok) printf("Error: Failed writing %s\n", path);
+    return ok;
+}
+
+// Print an ASCII heatmap using a 10-level brightness ramp
+void print_heatmap(const float *values, int width, int height, int log_scale) {
+    static const char ramp[] = " .:-=+*#%@";
+    double lo = INFINITY, hi = -INFINITY;
+    size_t count = (size_t)width * height;
+    for (size_t k = 0; k < count; k++) {
+        double v = log_scale ? log10(values[k]) : values[k];
+        if (isfinite(v)) {
+            if (v < lo) lo = v;
+            if (v > hi) hi = v;
+        }
+    }
     
-    return tokens;
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            double v = values[(size_t)j * width + i];
+            if (log_scale) v = log10(v);
+            int level = 0;
+            if (isfinite(v) && hi > lo) {
+                level = (int)((v - lo) / (hi - lo) * 9 + 0.5);
+            }
+            putchar(ramp[level]);
+        }
+        putchar('\n');
+    }
+    printf("range [%.*g, %.*g]%s\n", 6, lo, 6, hi, log_scale ? " (log10)" : "");
 }
 
-// Parse factor (numbers, identifiers, functions, parentheses)
-double parse_factor(Calculator *calc, Token *tokens, int *pos, CalcError *error) {
-    Token token = tokens[*pos];
-    
-    if (token.type == TOK_NUMBER) {
-        (*pos)++;
-        return token.value;
-    }
+// grid [size=WxH] [x=a:b] [y=c:d] [iter=N] [bailout=R] [scale=log] [out=FILE] expr
+int handle_grid(Calculator *calc, const char *args) {
+    static const char *const params[] = {"x", "y", "z", "c"};
+    GridJob job = {calc, NULL, 72, 24, -2, 2, -2, 2, 0, 2, 0, 0, NULL, CALC_OK};
+    char out_path[256] = "";
+    int log_scale = 0;
     
-    if (token.type == TOK_IDENTIFIER) {
-        (*pos)++;
+    // Leading key=value options, then the expression
+    const char *p = args;
+    while (1) {
+        while (isspace(*p)) p++;
+        const char *eq = p;
+        while (isalpha(*eq)) eq++;
+        if (*eq != '=' || eq == p) break;
         
-        // Check if it's a constant
-        if (is_constant(token.name)) {
-            return get_constant_value(token.name);
-        }
+        char key[16], value[256];
+        size_t key_len = eq - p;
+        const char *end = eq + 1;
+        while (*end && !isspace(*end)) end++;
+        size_t value_len = end - eq - 1;
+        if (key_len >= sizeof(key) || value_len >= sizeof(value)) break;
+        memcpy(key, p, key_len);
+        key[key_len] = '\0';
+        memcpy(value, eq + 1, value_len);
+        value[value_len] = '\0';
         
-        // Check if it's a variable
-        Variable *var = find_variable(calc, token.name);
-        if (var != NULL) {
-            return var->value.real;
+        int ok = 1;
+        if (strcmp(key, "size") == 0) {
+            ok = sscanf(value, "%dx%d", &job.width, &job.height) == 2 &&
+                 job.width > 0 && job.height > 0 && job.width <= 65536 && job.height <= 65536;
+        } else if (strcmp(key, "x") == 0) {
+            ok = parse_range(value, &job.x0, &job.x1);
+        } else if (strcmp(key, "y") == 0) {
+            ok = parse_range(value, &job.y0, &job.y1);
+        } else if (strcmp(key, "iter") == 0) {
+            ok = sscanf(value, "%d", &job.iterations) == 1 && job.iterations >= 0;
+        } else if (strcmp(key, "bailout") == 0) {
+            ok = sscanf(value, "%lf", &job.bailout) == 1 && job.bailout > 0;
+        } else if (strcmp(key, "scale") == 0) {
+            ok = strcmp(value, "log") == 0 || strcmp(value, "linear") == 0;
+            log_scale = strcmp(value, "log") == 0;
+        } else if (strcmp(key, "out") == 0) {
+            strcpy(out_path, value);
+        } else {
+            break; // Not an option: the expression starts here
         }
-        
-        *error = CALC_ERROR_UNKNOWN_VARIABLE;
-        return 0;
+        if (!ok) {
+            printf("Invalid grid option '%s=%s'\n", key, value);
+            return 1;
+        }
+        p = end;
     }
     
-    if (token.type == TOK_FUNCTION) {
-        (*pos)++;
-        
-        // Check for opening parenthesis
-        if (tokens[*pos].type != TOK_LPAREN) {
-            *error = CALC_ERROR_SYNTAX;
-            return 0;
-        }
-        (*pos)++;
-        
-        // Parse function arguments
-        double args[MAX_FUNC_ARGS];
-        int arg_count = 0;
-        
-        while (tokens[*pos].type != TOK_RPAREN && arg_count < MAX_FUNC_ARGS) {
-            if (arg_count > 0) {
-                if (tokens[*pos].type != TOK_COMMA) {
-                    *error = CALC_ERROR_SYNTAX;
-                    return 0;
-                }
-                (*pos)++;
+    if (*p == '\0') {
+        printf("Usage: grid [size=WxH] [x=a:b] [y=c:d] [iter=N] [bailout=R] [scale=log] [out=FILE] expr\n");
+        return 1;
+    }
+    
+    CalcError error = CALC_OK;
+    job.prog = compile_expression(calc, p, params, 4, &error);
+    if (job.prog != NULL) {
+        // Workers only read variables, so bring formulas up to date first
+        for (int pc = 0; pc < job.prog->code_count && error == CALC_OK; pc++) {
+            Instruction *ins = &job.prog->code[pc];
+            if (ins->op == OP_STORE) {
+                error = CALC_ERROR_SYNTAX;
+            } else if (ins->op == OP_LOAD) {
+                Variable *var = find_variable(calc, job.prog->symbols[ins->a]);
+                if (var != NULL) refresh_variable(calc, (int)(var - calc->variables), &error);
             }
-            
-            args[arg_count] = parse_expression(calc, tokens, pos, error);
-            if (*error != CALC_OK) return 0;
-            arg_count++;
-        }
-        
-        // Check for closing parenthesis
-        if (tokens[*pos].type != TOK_RPAREN) {
-            *error = CALC_ERROR_SYNTAX;
-            return 0;
         }
-        (*pos)++;
-        
-        return calculate_function(calc, token.name, args, arg_count, error);
+    }
+    job.elementwise = error == CALC_OK && grid_elementwise(calc, job.prog, 8);
+    size_t pixels = (size_t)job.width * job.height;
+    job.out = error == CALC_OK ? malloc(pixels * sizeof(float)) : NULL;
+    if (error == CALC_OK && job.out == NULL) error = CALC_ERROR_MEMORY;
+    if (error != CALC_OK) {
+        print_error(error);
+        program_free(job.prog);
+        return 1;
     }
     
-    if (token.type == TOK_LPAREN) {
-        (*pos)++;
-        double result = parse_expression(calc, tokens, pos, error);
-        
-        if (tokens[*pos].type != TOK_RPAREN) {
-            *error = CALC_ERROR_SYNTAX;
-            return 0;
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    job.tiles_x = (job.width + GRID_TILE - 1) / GRID_TILE;
+    size_t tiles = (size_t)job.tiles_x * ((job.height + GRID_TILE - 1) / GRID_TILE);
+    ThreadPool *pool = calculator_pool(calc);
+    threadpool_run(pool, grid_tile, &job, tiles);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double ms = (stop.tv_sec - start.tv_sec) * 1e3 + (stop.tv_nsec - start.tv_nsec) / 1e6;
+    
+    if (job.error != CALC_OK) {
+        print_error(job.error);
+    } else if (out_path[0] != '\0') {
+        if (write_grid(out_path, job.out, job.width, job.height, log_scale)) {
+            printf("Wrote %dx%d grid to %s (%.1f ms, %d threads)\n", job.width, job.height,
+                   out_path, ms, pool ? pool->thread_count + 1 : 1);
         }
-        (*pos)++;
-        
-        return result;
+    } else {
+        print_heatmap(job.out, job.width, job.height, log_scale);
     }
     
-    if (token.type == TOK_OPERATOR && token.name[0] == '-') {
-        (*pos)++;
-        return -parse_factor(calc, tokens, pos, error);
+    free(job.out);
+    program_free(job.prog);
+    return 1;
+}
+
+// Evaluation daemon. Each connection gets its own Calculator session and
+// is owned by one worker thread, which waits on its own epoll set, so
+// sessions need no locking. Requests are newline-delimited; a connection
+// whose first byte is zero instead uses frames of a 4-byte big-endian
+// length followed by that many bytes, for requests and responses alike.
+// Responses are written in request order, so clients may pipeline.
+typedef struct {
+    int fd;
+    int worker_epoll;
+    Calculator calc;
+    char *in;
+    size_t in_len;
+    size_t in_capacity;
+    FILE *out;              // Pending responses (memory stream)
+    char *out_data;
+    size_t out_size;
+    size_t out_sent;
+    int framed;             // -1 until the first byte arrives
+    int peer_closed;
+} Session;
+
+volatile sig_atomic_t server_stop = 0;
+
+void server_signal(int sig) {
+    (void)sig;
+    server_stop = 1;
+}
+
+// $XDG_RUNTIME_DIR/calculator.sock, else /tmp/calculator-<uid>.sock
+void default_socket_path(char *path, size_t size) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (dir != NULL && dir[0] != '\0') {
+        snprintf(path, size, "%s/calculator.sock", dir);
+    } else {
+        snprintf(path, size, "/tmp/calculator-%u.sock", (unsigned)getuid());
+    }
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+int socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) return 0;
+    strcpy(addr->sun_path, path);
+    return 1;
+}
+
+Session* session_new(int fd) {
+    Session *session = calloc(1, sizeof(Session));
+    if (session == NULL) return NULL;
+    session->out = open_memstream(&session->out_data, &session->out_size);
+    if (session->out == NULL) {
+        free(session);
+        return NULL;
+    }
+    session->fd = fd;
+    session->framed = -1;
+    init_calculator(&session->calc);
+    return session;
+}
+
+void session_free(Session *session) {
+    close(session->fd);
+    free_calculator(&session->calc);
+    fclose(session->out);
+    free(session->out_data);
+    free(session->in);
+    free(session);
+}
+
+// Evaluate one request and append its response
+void session_request(Session *session, char *request) {
+    FILE *out = session->out;
+    long start = ftell(out);
+    if (session->framed) {
+        fwrite("\0\0\0\0", 1, 4, out);
     }
     
-    if (token.type == TOK_OPERATOR && token.name[0] == '+') {
-        (*pos)++;
-        return parse_factor(calc, tokens, pos, error);
+    CalcError error = CALC_OK;
+    if (is_function_definition(request)) {
+        int index = define_function(&session->calc, request, &error);
+        if (index >= 0) {
+            fprintf(out, "Defined ");
+            print_user_function(out, &session->calc.functions[index]);
+        }
+    } else {
+        Value result = evaluate_expression(&session->calc, request, &error);
+        if (error == CALC_OK) {
+            fprintf(out, "= ");
+            fprint_value(out, &session->calc, result);
+            fprint_unit(out, session->calc.result_unit);
+            fprintf(out, "\n");
+            add_history(&session->calc, request, result, session->calc.result_unit);
+            value_release(&result);
+        }
+    }
+    if (error != CALC_OK) {
+        fprintf(out, "%s\n", error_message(error));
     }
     
-    *error = CALC_ERROR_SYNTAX;
-    return 0;
+    if (session->framed) {
+        // Patch in the frame length (the trailing newline is not sent)
+        fseek(out, -1, SEEK_CUR);
+        long end = ftell(out);
+        fflush(out);
+        unsigned length = (unsigned)(end - start - 4);
+        unsigned char *header = (unsigned char *)session->out_data + start;
+        header[0] = length >> 24;
+        header[1] = length >> 16;
+        header[2] = length >> 8;
+        header[3] = length;
+    }
 }
 
-// Parse term (multiplication, division, modulo)
-double parse_term(Calculator *calc, Token *tokens, int *pos, CalcError *error) {
-    double result = parse_factor(calc, tokens, pos, error);
-    if (*error != CALC_OK) return 0;
+// Evaluate every complete request in the input buffer. Returns 0 if the
+// stream is malformed.
+int session_process(Session *session) {
+    size_t pos = 0;
+    if (session->framed < 0 && session->in_len > 0) {
+        session->framed = session->in[0] == '\0';
+    }
     
-    while (1) {
-        Token token = tokens[*pos];
+    while (pos < session->in_len) {
+        char *request = session->in + pos;
+        size_t available = session->in_len - pos;
         
-        if (token.type == TOK_OPERATOR) {
-            if (token.name[0] == '*') {
-                (*pos)++;
-                result *= parse_factor(calc, tokens, pos, error);
-                if (*error != CALC_OK) return 0;
-            } else if (token.name[0] == '/') {
-                (*pos)++;
-                double divisor = parse_factor(calc, tokens, pos, error);
-                if (*error != CALC_OK) return 0;
-                
-                if (divisor == 0) {
-                    *error = CALC_ERROR_DIV_ZERO;
-                    return 0;
-                }
-                
-                result /= divisor;
-            } else if (token.name[0] == '%') {
-                (*pos)++;
-                double divisor = parse_factor(calc, tokens, pos, error);
-                if (*error != CALC_OK) return 0;
-                
-                if (divisor == 0) {
-                    *error = CALC_ERROR_DIV_ZERO;
-                    return 0;
-                }
-                
-                result = fmod(result, divisor);
-            } else {
+        if (session->framed) {
+            if (available < 4) break;
+            unsigned char *header = (unsigned char *)request;
+            size_t length = (size_t)header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3];
+            if (length > SERVER_MAX_REQUEST) return 0;
+            if (available < 4 + length) break;
+            // The buffer always has a spare byte for the terminator
+            char saved = request[4 + length];
+            request[4 + length] = '\0';
+            session_request(session, request + 4);
+            request[4 + length] = saved;
+            pos += 4 + length;
+        } else {
+            char *newline = memchr(request, '\n', available);
+            if (newline == NULL) {
+                if (available > SERVER_MAX_REQUEST) return 0;
                 break;
             }
-        } else {
-            break;
+            *newline = '\0';
+            if (newline > request && newline[-1] == '\r') newline[-1] = '\0';
+            if (request[0] != '\0') session_request(session, request);
+            pos = newline - session->in + 1;
         }
     }
     
-    return result;
+    memmove(session->in, session->in + pos, session->in_len - pos);
+    session->in_len -= pos;
+    return 1;
+}
+
+// Send pending responses. Returns 1 once everything has been sent, 0 if
+// the socket is full and -1 on error.
+int session_flush(Session *session) {
+    fflush(session->out);
+    while (session->out_sent < session->out_size) {
+        ssize_t sent = send(session->fd, session->out_data + session->out_sent,
+                            session->out_size - session->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        session->out_sent += sent;
+    }
+    fseek(session->out, 0, SEEK_SET);
+    session->out_sent = 0;
+    return 1;
 }
 
-// Parse expression (addition, subtraction)
-double parse_expression(Calculator *calc, Token *tokens, int *pos, CalcError *error) {
-    double result = parse_term(calc, tokens, pos, error);
-    if (*error != CALC_OK) return 0;
+// Handle readiness on a connection: send what is pending, then read one
+// chunk, evaluate it and send the responses. Input is not read while
+// responses are pending, so a client that stops reading is throttled.
+// Returns 0 when the session should be closed.
+int session_service(Session *session) {
+    int flushed = session_flush(session);
+    if (flushed <= 0) return flushed == 0;
     
-    while (1) {
-        Token token = tokens[*pos];
-        
-        if (token.type == TOK_OPERATOR) {
-            if (token.name[0] == '+') {
-                (*pos)++;
-                result += parse_term(calc, tokens, pos, error);
-                if (*error != CALC_OK) return 0;
-            } else if (token.name[0] == '-') {
-                (*pos)++;
-                result -= parse_term(calc, tokens, pos, error);
-                if (*error != CALC_OK) return 0;
-            } else {
-                break;
-            }
+    if (!session->peer_closed) {
+        if (session->in_capacity - session->in_len < SERVER_READ_CHUNK + 1) {
+            size_t capacity = session->in_len + SERVER_READ_CHUNK + 1;
+            char *grown = realloc(session->in, capacity);
+            if (grown == NULL) return 0;
+            session->in = grown;
+            session->in_capacity = capacity;
+        }
+        ssize_t received = recv(session->fd, session->in + session->in_len, SERVER_READ_CHUNK, 0);
+        if (received == 0) {
+            session->peer_closed = 1;
+        } else if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return 0;
         } else {
-            break;
+            session->in_len += received;
+            if (!session_process(session)) return 0;
         }
     }
     
-    return result;
+    flushed = session_flush(session);
+    if (flushed < 0) return 0;
+    
+    // Wait for the socket to drain before reading more
+    struct epoll_event event = {.events = flushed ? EPOLLIN : EPOLLOUT, .data.ptr = session};
+    epoll_ctl(session->worker_epoll, EPOLL_CTL_MOD, session->fd, &event);
+    return !(session->peer_closed && flushed);
 }
 
-// Parse assignment or expression
-double parse_assignment(Calculator *calc, Token *tokens, int *pos, CalcError *error) {
-    // Check if this is an assignment
-    if (tokens[*pos].type == TOK_IDENTIFIER && tokens[*pos + 1].type == TOK_EQUAL) {
-        char var_name[32];
-        strcpy(var_name, tokens[*pos].name);
-        *pos += 2; // Skip identifier and equals
-        
-        double value = parse_expression(calc, tokens, pos, error);
-        if (*error != CALC_OK) return 0;
-        
-        // Check if it's a constant assignment
-        int is_constant = 0;
-        if (strcmp(var_name, "const") == 0) {
-            is_constant = 1;
-            if (tokens[*pos].type != TOK_IDENTIFIER) {
-                *error = CALC_ERROR_SYNTAX;
-                return 0;
-            }
-            strcpy(var_name, tokens[*pos].name);
-            *pos += 1;
-            
-            if (tokens[*pos].type != TOK_EQUAL) {
-                *error = CALC_ERROR_SYNTAX;
-                return 0;
+void* server_worker(void *arg) {
+    int epoll_fd = *(int *)arg;
+    struct epoll_event events[64];
+    
+    while (1) {
+        int count = epoll_wait(epoll_fd, events, 64, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            Session *session = events[i].data.ptr;
+            if (!session_service(session)) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session->fd, NULL);
+                session_free(session);
             }
-            *pos += 1;
-            
-            value = parse_expression(calc, tokens, pos, error);
-            if (*error != CALC_OK) return 0;
         }
-        
-        if (!set_variable(calc, var_name, value, is_constant)) {
-            *error = CALC_ERROR_MEMORY;
-            return 0;
+    }
+    return NULL;
+}
+
+// Listen on a Unix socket and serve sessions until SIGINT or SIGTERM
+int run_server(const char *path) {
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 1;
+    }
+    
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    int bound = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (!bound && errno == EADDRINUSE) {
+        // Replace a stale socket file, but not a live daemon
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        int live = connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(probe);
+        if (live) {
+            fprintf(stderr, "A server is already listening on %s\n", path);
+            close(listen_fd);
+            return 1;
+        }
+        unlink(path);
+        bound = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    }
+    if (!bound || listen(listen_fd, SOMAXCONN) < 0) {
+        perror(path);
+        close(listen_fd);
+        return 1;
+    }
+    
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = server_signal;  // No SA_RESTART: accept must return
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int worker_count = cpus > 0 ? (int)cpus : 1;
+    int *epoll_fds = malloc(worker_count * sizeof(int));
+    pthread_t *threads = malloc(worker_count * sizeof(pthread_t));
+    if (epoll_fds == NULL || threads == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < worker_count; i++) {
+        epoll_fds[i] = epoll_create1(0);
+        pthread_create(&threads[i], NULL, server_worker, &epoll_fds[i]);
+        pthread_detach(threads[i]);
+    }
+    printf("Listening on %s with %d workers\n", path, worker_count);
+    fflush(stdout);
+    
+    // Hand connections to workers round-robin
+    for (int next = 0; !server_stop; next = (next + 1) % worker_count) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            break;
+        }
+        Session *session = set_nonblocking(fd) ? session_new(fd) : NULL;
+        if (session == NULL) {
+            close(fd);
+            continue;
+        }
+        session->worker_epoll = epoll_fds[next];
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = session};
+        if (epoll_ctl(epoll_fds[next], EPOLL_CTL_ADD, fd, &event) < 0) {
+            session_free(session);
         }
-        
-        return value;
     }
     
-    // Regular expression
-    return parse_expression(calc, tokens, pos, error);
+    // Workers and their sessions end with the process
+    close(listen_fd);
+    unlink(path);
+    printf("Server stopped\n");
+    return 0;
 }
 
-// Evaluate expression with proper parsing
-double evaluate_expression(Calculator *calc, const char *expr, CalcError *error) {
-    int token_count = 0;
-    Token *tokens = tokenize(expr, &token_count, error);
-    if (*error != CALC_OK) {
-        return 0;
+// Forward stdin to a server and copy its responses to stdout. Input and
+// output are interleaved with poll so requests stay pipelined.
+int run_client(const char *path) {
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 1;
     }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        return 1;
+    }
+    set_nonblocking(fd);
+    signal(SIGPIPE, SIG_IGN);
     
-    int pos = 0;
-    double result = parse_assignment(calc, tokens, &pos, error);
+    static char pending[SERVER_READ_CHUNK];
+    static char received[SERVER_READ_CHUNK];
+    size_t pending_len = 0, pending_sent = 0;
+    int input_done = 0;
     
-    // Check if we parsed the entire expression
-    if (pos < token_count - 1 && tokens[pos].type != TOK_EOF) {
-        *error = CALC_ERROR_SYNTAX;
+    while (1) {
+        struct pollfd fds[2] = {
+            {input_done || pending_len > 0 ? -1 : STDIN_FILENO, POLLIN, 0},
+            {fd, POLLIN | (pending_len > 0 ? POLLOUT : 0), 0}
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        
+        if (fds[0].revents) {
+            ssize_t n = read(STDIN_FILENO, pending, sizeof(pending));
+            if (n <= 0) {
+                input_done = 1;
+                shutdown(fd, SHUT_WR);
+            } else {
+                pending_len = n;
+                pending_sent = 0;
+            }
+        }
+        if (fds[1].revents & POLLOUT) {
+            ssize_t n = send(fd, pending + pending_sent, pending_len - pending_sent, MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) break;
+            if (n > 0) pending_sent += n;
+            if (pending_sent == pending_len) pending_len = 0;
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(fd, received, sizeof(received), 0);
+            if (n == 0) break;
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EINTR) continue;
+                break;
+            }
+            fwrite(received, 1, n, stdout);
+            fflush(stdout);
+        }
     }
-    
-    free(tokens);
-    return result;
+    close(fd);
+    return 0;
 }
 
 // Handle special commands
@@ -1210,6 +1376,12 @@ int handle_command(Calculator *calc, const char *input) {
         return 1;
     } else if (strcmp(input, "functions") == 0) {
         show_functions();
+        if (calc->function_count > 0) {
+            printf("\nUser functions:\n");
+            for (int i = 0; i < calc->function_count; i++) {
+                print_user_function(stdout, &calc->functions[i]);
+            }
+        }
         return 1;
     } else if (strcmp(input, "constants") == 0) {
         show_constants();
@@ -1237,6 +1409,53 @@ int handle_command(Calculator *calc, const char *input) {
             printf("Invalid precision. Use 'precision n' where n is 0-15\n");
         }
         return 1;
+    } else if (strcmp(input, "reactive") == 0) {
+        printf("Reactive mode is %s\n", calc->reactive ? "on" : "off");
+        return 1;
+    } else if (strcmp(input, "reactive on") == 0) {
+        calc->reactive = 1;
+        printf("Reactive mode on: assignments keep their formulas\n");
+        return 1;
+    } else if (strcmp(input, "reactive off") == 0) {
+        // Freeze every formula at its current value
+        for (int i = 0; i < calc->var_count; i++) {
+            CalcError error = CALC_OK;
+            refresh_variable(calc, i, &error);
+        }
+        for (int i = 0; i < calc->var_count; i++) {
+            drop_definition(calc, i);
+        }
+        calc->reactive = 0;
+        printf("Reactive mode off: formulas replaced by their values\n");
+        return 1;
+    } else if (strcmp(input, "stats") == 0) {
+        show_stats(calc);
+        return 1;
+    } else if (strcmp(input, "stats reset") == 0) {
+        ExprCache *cache = &calc->cache;
+        cache->lookups = cache->hits = cache->evictions = cache->invalidations = 0;
+        cache->compile_ms = cache->lookup_ms = 0;
+        calc->memo.hits = calc->memo.misses = 0;
+        printf("Statistics reset\n");
+        return 1;
+    } else if (strncmp(input, "save", 4) == 0 && (input[4] == ' ' || input[4] == '\0')) {
+        return handle_session(calc, input + 4, 1);
+    } else if (strncmp(input, "load", 4) == 0 && (input[4] == ' ' || input[4] == '\0')) {
+        return handle_session(calc, input + 4, 0);
+    } else if (strncmp(input, "spload", 6) == 0 && (input[6] == ' ' || input[6] == '\0')) {
+        return handle_spload(calc, input + 6);
+    } else if (strncmp(input, "profile ", 8) == 0) {
+        return handle_profile(calc, input + 8);
+    } else if (strncmp(input, "grid", 4) == 0 && (input[4] == ' ' || input[4] == '\0')) {
+        return handle_grid(calc, input + 4);
+    } else if (strncmp(input, "run", 3) == 0 && (input[3] == ' ' || input[3] == '\0')) {
+        return handle_run(calc, input + 3);
+    } else if (is_script_statement(input)) {
+        CalcError error = CALC_OK;
+        int line = 0;
+        Program *prog = compile_script(calc, input, &line, &error);
+        run_script(calc, prog, NULL, line, error);
+        return 1;
     } else if (strcmp(input, "clear") == 0) {
         #ifdef _WIN32
             system("cls");
@@ -1246,15 +1465,58 @@ int handle_command(Calculator *calc, const char *input) {
         return 1;
     } else if (strcmp(input, "exit") == 0 || strcmp(input, "quit") == 0) {
         return -1;
+    } else if (is_function_definition(input)) {
+        CalcError error = CALC_OK;
+        int index = define_function(calc, input, &error);
+        if (index >= 0) {
+            printf("Defined ");
+            print_user_function(stdout, &calc->functions[index]);
+        } else {
+            print_error(error);
+        }
+        return 1;
     }
     return 0;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     Calculator calc;
-    char input[MAX_INPUT];
+    char *input = NULL;
+    size_t input_size = 0;
+    
+    // Daemon modes: --serve [socket] and --client [socket]
+    if (argc > 1 && (strcmp(argv[1], "--serve") == 0 || strcmp(argv[1], "--client") == 0)) {
+        char path[108];
+        if (argc > 2) {
+            snprintf(path, sizeof(path), "%s", argv[2]);
+        } else {
+            default_socket_path(path, sizeof(path));
+        }
+        return strcmp(argv[1], "--serve") == 0 ? run_server(path) : run_client(path);
+    }
     
     init_calculator(&calc);
+    calc.output = stdout;
+    
+    // run FILE: run a script and exit
+    if (argc > 2 && strcmp(argv[1], "run") == 0) {
+        CalcError error = CALC_OK;
+        int line = 0;
+        Program *prog = load_script(&calc, argv[2], &line, &error);
+        int ok = run_script(&calc, prog, argv[2], line, error);
+        free_calculator(&calc);
+        return ok ? 0 : 1;
+    }
+    
+    // --session FILE: restore FILE if it exists and save to it on exit
+    const char *session_path = NULL;
+    if (argc > 2 && strcmp(argv[1], "--session") == 0) {
+        session_path = argv[2];
+        CalcError error = CALC_OK;
+        if (access(session_path, F_OK) == 0 && !session_load(&calc, session_path, &error)) {
+            print_error(error);
+        }
+    }
     
     printf("=============================================\n");
     printf("    Advanced Scientific Calculator\n");
@@ -1262,13 +1524,11 @@ int main() {
     printf("Type 'help' for available commands and functions\n");
     printf("Type 'exit' or 'quit' to exit the calculator\n\n");
     
-    // Seed random number generator
-    srand(time(NULL));
-    
     while (1) {
         printf(">> ");
         
-        if (!fgets(input, MAX_INPUT, stdin)) {
+        // Lines of any length (generated expressions can be many MB)
+        if (getline(&input, &input_size, stdin) < 0) {
             break;
         }
         
@@ -1290,16 +1550,28 @@ int main() {
         
         // Evaluate expression
         CalcError error = CALC_OK;
-        double result = evaluate_expression(&calc, input, &error);
+        Value result = evaluate_expression(&calc, input, &error);
         
         if (error == CALC_OK) {
-            printf("= %.*g\n", calc.precision, result);
-            add_history(&calc, input, result);
+            printf("= ");
+            print_value(&calc, result);
+            fprint_unit(stdout, calc.result_unit);
+            printf("\n");
+            add_history(&calc, input, result, calc.result_unit);
+            value_release(&result);
         } else {
             print_error(error);
         }
     }
     
+    free(input);
+    if (session_path != NULL) {
+        CalcError error = CALC_OK;
+        if (!session_save(&calc, session_path, &error)) {
+            print_error(error);
+        }
+    }
+    free_calculator(&calc);
     printf("Goodbye!\n");
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,12359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "calc_internal.h"
+
+// Everything defined here is internal unless calc.h declares it CALC_API:
+// a shared libcalc exports only the API, and a static one whose hidden
+// symbols are localized (see COMPILATION in docs.txt) leaves the
+// embedder's names free
+#pragma GCC visibility push(hidden)
+
+// Small helpers on hot paths (the VM loop, the batch kernels, sorting and
+// hashing) are always inlined
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+// Kernels compiled for several instruction sets (BATCH_CLONES). They are
+// static because GCC exports the dispatchers of non-static clones whatever
+// their visibility.
+static void batch_sin(size_t n, const double *x, const double *y, double *out);
+static void batch_cos(size_t n, const double *x, const double *y, double *out);
+static void batch_tan(size_t n, const double *x, const double *y, double *out);
+static void batch_atan(size_t n, const double *x, const double *y, double *out);
+static void batch_tanh(size_t n, const double *x, const double *y, double *out);
+static void batch_exp(size_t n, const double *x, const double *y, double *out);
+static void batch_log(size_t n, const double *x, const double *y, double *out);
+static void batch_log2(size_t n, const double *x, const double *y, double *out);
+static void batch_log10(size_t n, const double *x, const double *y, double *out);
+static void batch_pow(size_t n, const double *x, const double *y, double *out);
+static void batch_sqrt(size_t n, const double *x, const double *y, double *out);
+static void batch_polyval(const double *c4, size_t count, size_t n, const double *x, double *out);
+static void matrix_multiply_rows(const double *a, const double *b, double *c, size_t rows, size_t inner, size_t cols);
+static void tridiagonalize(double *a, size_t n, double *d, double *e, double *tau, double *work);
+static void hessenberg(double *a, size_t n, double *tau, double *reflectors, double *work);
+static void pivoted_lq(double **w, size_t n, size_t m, double *scratch);
+static void lsq_absorb(double *r, double *rows, size_t count, size_t cols, double *w);
+
+// Function table
+FunctionDef function_table[] = {
+    {"sin", func_sin, 1, 1, NULL, complex_sin, 0, batch_sin},
+    {"cos", func_cos, 1, 1, NULL, complex_cos, 0, batch_cos},
+    {"tan", func_tan, 1, 1, NULL, complex_tan, 0, batch_tan},
+    {"asin", func_asin, 1, 1},
+    {"acos", func_acos, 1, 1},
+    {"atan", func_atan, 1, 1, NULL, NULL, 0, batch_atan},
+    {"atan2", func_atan2, 2, 2},
+    {"sinh", func_sinh, 1, 1},
+    {"cosh", func_cosh, 1, 1},
+    {"tanh", func_tanh, 1, 1, NULL, NULL, 0, batch_tanh},
+    {"asinh", func_asinh, 1, 1},
+    {"acosh", func_acosh, 1, 1},
+    {"atanh", func_atanh, 1, 1},
+    {"log", func_log, 1, 1, NULL, complex_log, 0, batch_log},
+    {"log10", func_log10, 1, 1, NULL, NULL, 0, batch_log10},
+    {"log2", func_log2, 1, 1, NULL, NULL, 0, batch_log2},
+    {"exp", func_exp, 1, 1, NULL, complex_exp, 0, batch_exp},
+    {"sqrt", func_sqrt, 1, 1, NULL, complex_sqrt, 0, batch_sqrt},
+    {"cbrt", func_cbrt, 1, 1},
+    {"pow", func_pow, 2, 2, func_vpow, NULL, 0, batch_pow},
+    {"abs", func_abs, 1, 1, func_vabs, NULL, 0, NULL, func_iabs},
+    {"floor", func_floor, 1, 1, NULL, NULL, 0, NULL, func_iround},
+    {"ceil", func_ceil, 1, 1, NULL, NULL, 0, NULL, func_iround},
+    {"round", func_round, 1, 1, NULL, NULL, 0, NULL, func_iround},
+    {"min", func_min, 1, 0, NULL, NULL, 0, NULL, func_imin},
+    {"max", func_max, 1, 0, NULL, NULL, 0, NULL, func_imax},
+    {"sum", func_sum, 1, 0, NULL, NULL, 0, NULL, func_isum},
+    {"mean", func_mean, 1, 0},
+    {"median", func_median, 1, 0},
+    {"factorial", func_factorial, 1, 1, NULL, NULL, 21, NULL, func_ifactorial},
+    {"gcd", func_gcd, 2, 0, NULL, NULL, 0, NULL, func_igcd},
+    {"lcm", func_lcm, 2, 0, NULL, NULL, 0, NULL, func_ilcm},
+    {"deg2rad", func_deg2rad, 1, 1},
+    {"rad2deg", func_rad2deg, 1, 1},
+    {"perm", func_perm, 2, 2, NULL, NULL, 64, NULL, func_iperm},
+    {"comb", func_comb, 2, 2, NULL, NULL, BINOMIAL_TABLE_SIZE, NULL, func_icomb},
+    {"lgamma", func_lgamma, 1, 1, NULL, NULL, 1},
+    {"rand", NULL, 0, 2, func_rand},
+    {"det", func_det, 1, 4, func_matrix_det},
+    {"trace", func_trace, 1, 4, func_matrix_trace},
+    {"fft", NULL, 1, 2, func_fft},
+    {"ifft", NULL, 1, 2, func_ifft},
+    {"rfft", NULL, 1, 2, func_rfft},
+    {"conv", NULL, 2, 2, func_conv},
+    {"xcorr", NULL, 2, 2, func_xcorr},
+    {"real", NULL, 1, 1, func_real},
+    {"imag", NULL, 1, 1, func_imag},
+    {"conj", NULL, 1, 1, func_conj},
+    {"arg", NULL, 1, 1, func_arg},
+    {"poly", NULL, 1, 0, func_poly},
+    {"polyval", NULL, 2, 2, func_polyval},
+    {"roots", NULL, 1, 1, func_roots},
+    {"polygcd", NULL, 2, 2, func_polygcd},
+    {"polyder", NULL, 1, 1, func_polyder},
+    {"coeffs", NULL, 1, 1, func_coeffs},
+    {"degree", NULL, 1, 1, func_degree},
+    {"sparse", NULL, 3, 5, func_sparse},
+    {"speye", NULL, 1, 1, func_speye},
+    {"nnz", NULL, 1, 1, func_nnz},
+    {"cg", NULL, 2, 4, func_cg},
+    {"bicgstab", NULL, 2, 4, func_bicgstab},
+    {"matrix", NULL, 2, 2, func_matrix},
+    {"eye", NULL, 1, 1, func_eye},
+    {"transpose", NULL, 1, 1, func_transpose},
+    {"full", NULL, 1, 1, func_full},
+    {"eig", NULL, 1, 1, func_eig},
+    {"eigvals", NULL, 1, 1, func_eigvals},
+    {"svd", NULL, 1, 1, func_svd},
+    {"cond", NULL, 1, 1, func_cond},
+    {"mpow", NULL, 2, 2, func_mpow},
+    {"expm", NULL, 1, 1, func_expm},
+    {"sqrtm", NULL, 1, 1, func_sqrtm},
+    {"logm", NULL, 1, 1, func_logm},
+    {"lstsq", NULL, 2, 2, func_lstsq},
+    {"polyfit", NULL, 3, 3, func_polyfit},
+    {"linfit", NULL, 2, 2, func_linfit},
+    {"groupby", NULL, 3, 3, func_groupby},
+    {"hist", NULL, 2, 2, func_hist},
+    {"sort", NULL, 1, 1, func_sort},
+    {"argsort", NULL, 1, 1, func_argsort},
+    {"unique", NULL, 1, 1, func_unique},
+    {"rank", NULL, 1, 1, func_rank},
+    {"cumsum", NULL, 1, 1, func_cumsum},
+    {"cumprod", NULL, 1, 1, func_cumprod},
+    {"diff", NULL, 1, 1, func_diff},
+    {"movmean", NULL, 2, 2, func_movmean},
+    {"movstd", NULL, 2, 2, func_movstd},
+    {"movmin", NULL, 2, 2, func_movmin},
+    {"movmax", NULL, 2, 2, func_movmax},
+    {"", NULL, 0, 0}  // Sentinel
+};
+
+// Initialize calculator with default variables and constants
+void init_calculator(Calculator *calc) {
+    calc->variables = NULL;
+    calc->var_count = 0;
+    calc->var_capacity = 0;
+    calc->var_table = NULL;
+    calc->var_table_size = 0;
+    calc->reactive = 0;
+    calc->visit_epoch = 0;
+    calc->functions = NULL;
+    calc->function_count = 0;
+    calc->function_capacity = 0;
+    memset(&calc->cache, 0, sizeof(ExprCache));
+    calc->cache.byte_limit = EXPR_CACHE_BYTES;
+    memset(&calc->memo, 0, sizeof(MemoCache));
+    pthread_mutex_init(&calc->memo.big_lock, NULL);
+    calc->history_index = 0;
+    calc->history_count = 0;
+    calc->angle_mode = 0; // Default to radians
+    calc->precision = 10; // Default precision
+    calc->exact_integers = 0;
+    calc->fft_plans = NULL;
+    pthread_mutex_init(&calc->plan_lock, NULL);
+    calc->pool = NULL;
+    calc->profile = NULL;
+    calc->output = NULL;
+    calc->error_line = 0;
+    calc->unit_count = 0;
+    calc->unit_epoch = 0;
+    calc->result_unit = 0;
+    calc->rng_state = ((unsigned long long)time(NULL) << 20) ^ (unsigned long long)(size_t)calc ^ 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < HISTORY_SIZE; i++) {
+        calc->history[i].expression = NULL;
+        calc->history[i].result = value_real(0);
+    }
+    
+    // Add constants. Programs never load them (the compiler inlines them),
+    // so their units are not counted in unit_count.
+    for (const NamedConstant *constant = constant_table; constant->name != NULL; constant++) {
+        Value value = strcmp(constant->name, "i") == 0 ? value_complex(0, 1) : value_real(constant->value);
+        if (set_variable_value(calc, constant->name, value, 1)) {
+            find_variable(calc, constant->name)->unit = constant->unit;
+        }
+    }
+}
+
+// Release variables, history values and cached FFT plans
+// Free variables, user functions and history
+void free_session(Calculator *calc) {
+    // Formulas first: dropping one edits the dependents of its inputs
+    for (int i = 0; i < calc->var_count; i++) {
+        drop_definition(calc, i);
+    }
+    for (int i = 0; i < calc->var_count; i++) {
+        free(calc->variables[i].dependents);
+        value_release(&calc->variables[i].value);
+    }
+    free(calc->variables);
+    free(calc->var_table);
+    calc->variables = NULL;
+    calc->var_table = NULL;
+    calc->var_count = calc->var_capacity = calc->var_table_size = 0;
+    calc->unit_count = 0;
+    for (int i = 0; i < HISTORY_SIZE; i++) {
+        free(calc->history[i].expression);
+        calc->history[i].expression = NULL;
+        value_release(&calc->history[i].result);
+    }
+    calc->history_index = calc->history_count = 0;
+    for (int i = 0; i < calc->function_count; i++) {
+        program_free(calc->functions[i].body);
+        free(calc->functions[i].source);
+    }
+    free(calc->functions);
+    calc->functions = NULL;
+    calc->function_count = calc->function_capacity = 0;
+}
+
+void free_calculator(Calculator *calc) {
+    free_session(calc);
+    cache_clear(&calc->cache);
+    free(calc->memo.entries);
+    calc->memo.entries = NULL;
+    for (int i = 0; calc->memo.big != NULL && i < MEMO_BIG_ENTRIES; i++) {
+        value_release(&calc->memo.big[i].result);
+    }
+    free(calc->memo.big);
+    calc->memo.big = NULL;
+    pthread_mutex_destroy(&calc->memo.big_lock);
+    fft_free_plans(calc);
+    pthread_mutex_destroy(&calc->plan_lock);
+    calculator_pool_release(calc->pool);
+    calc->pool = NULL;
+}
+
+// FNV-1a hash of a name or expression key
+unsigned hash_name(const char *name) {
+    unsigned h = 2166136261u;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+// 64-bit FNV-1a hash of a block of bytes, such as a script's text
+uint64_t hash_bytes(const char *data, size_t size) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Find a variable by name
+Variable* find_variable(Calculator *calc, const char *name) {
+    if (calc->var_table_size == 0) return NULL;
+    unsigned mask = calc->var_table_size - 1;
+    for (unsigned slot = hash_name(name) & mask; calc->var_table[slot] >= 0; slot = (slot + 1) & mask) {
+        Variable *var = &calc->variables[calc->var_table[slot]];
+        if (strcmp(var->name, name) == 0) {
+            return var;
+        }
+    }
+    return NULL;
+}
+
+// Rebuild the name index at twice the variable capacity
+int rebuild_variable_table(Calculator *calc, int size) {
+    int *table = malloc(size * sizeof(int));
+    if (table == NULL) return 0;
+    for (int i = 0; i < size; i++) table[i] = -1;
+    for (int i = 0; i < calc->var_count; i++) {
+        unsigned slot = hash_name(calc->variables[i].name) & (size - 1);
+        while (table[slot] >= 0) slot = (slot + 1) & (size - 1);
+        table[slot] = i;
+    }
+    free(calc->var_table);
+    calc->var_table = table;
+    calc->var_table_size = size;
+    return 1;
+}
+
+// Add or update a variable
+int set_variable(Calculator *calc, const char *name, double value, int constant) {
+    return set_variable_value(calc, name, value_real(value), constant);
+}
+
+// Give an existing variable a new value (takes a new reference). Its
+// formula, if any, is dropped and its dependents are marked dirty.
+int assign_variable(Calculator *calc, int index, Value value) {
+    Variable *var = &calc->variables[index];
+    if (var->constant) {
+        return 0; // Cannot modify constant
+    }
+    drop_definition(calc, index);
+    value_release(&var->value);
+    var->value = value_retain(value);
+    var->dirty = 0;
+    mark_dependents_dirty(calc, index);
+    return 1;
+}
+
+// Record the unit of a variable's new value. Cached programs were compiled
+// for the old unit, so a change advances unit_epoch.
+void set_variable_unit(Calculator *calc, int index, Unit unit) {
+    Variable *var = &calc->variables[index];
+    if (var->unit == unit) return;
+    calc->unit_count += (unit != 0) - (var->unit != 0);
+    var->unit = unit;
+    calc->unit_epoch++;
+}
+
+// Add or update a variable holding any value type (takes a new reference)
+int set_variable_value(Calculator *calc, const char *name, Value value, int constant) {
+    Variable *var = find_variable(calc, name);
+    
+    if (var != NULL) {
+        return assign_variable(calc, (int)(var - calc->variables), value);
+    }
+    
+    if (calc->var_count == calc->var_capacity) {
+        int capacity = calc->var_capacity ? calc->var_capacity * 2 : VAR_INITIAL_CAPACITY;
+        Variable *grown = realloc(calc->variables, capacity * sizeof(Variable));
+        if (grown == NULL) return 0;
+        calc->variables = grown;
+        calc->var_capacity = capacity;
+    }
+    if (calc->var_table_size < 2 * (calc->var_count + 1) &&
+        !rebuild_variable_table(calc, 2 * calc->var_capacity)) {
+        return 0;
+    }
+    
+    var = &calc->variables[calc->var_count];
+    memset(var, 0, sizeof(Variable));
+    strncpy(var->name, name, 31);
+    var->name[31] = '\0';
+    var->value = value_retain(value);
+    var->constant = constant;
+    
+    unsigned mask = calc->var_table_size - 1;
+    unsigned slot = hash_name(var->name) & mask;
+    while (calc->var_table[slot] >= 0) slot = (slot + 1) & mask;
+    calc->var_table[slot] = calc->var_count++;
+    return 1;
+}
+
+// Next traversal stamp; stamps are reset if the counter wraps
+unsigned next_visit(Calculator *calc) {
+    if (++calc->visit_epoch == 0) {
+        for (int i = 0; i < calc->var_count; i++) calc->variables[i].visit = 0;
+        calc->visit_epoch = 1;
+    }
+    return calc->visit_epoch;
+}
+
+// Remove the edges from a variable's inputs in the dependency graph
+void detach_depends(Calculator *calc, int index) {
+    Variable *var = &calc->variables[index];
+    for (int i = 0; i < var->depend_count; i++) {
+        Variable *dep = &calc->variables[var->depends[i]];
+        for (int j = 0; j < dep->dependent_count; j++) {
+            if (dep->dependents[j] == index) {
+                dep->dependents[j] = dep->dependents[--dep->dependent_count];
+                break;
+            }
+        }
+    }
+    free(var->depends);
+    var->depends = NULL;
+    var->depend_count = 0;
+}
+
+// Remove a variable's formula and its edges in the dependency graph
+void drop_definition(Calculator *calc, int index) {
+    Variable *var = &calc->variables[index];
+    if (var->definition == NULL) return;
+    
+    detach_depends(calc, index);
+    program_free(var->definition);
+    free(var->formula);
+    var->definition = NULL;
+    var->formula = NULL;
+    var->dirty = 0;
+}
+
+// Mark every transitive dependent of a variable dirty. A dirty variable's
+// dependents are already dirty, so the walk stops there.
+void mark_dependents_dirty(Calculator *calc, int index) {
+    if (calc->variables[index].dependent_count == 0) return;
+    
+    int *stack = malloc(calc->var_count * sizeof(int));
+    if (stack == NULL) return;
+    int top = 0;
+    stack[top++] = index;
+    while (top > 0) {
+        Variable *var = &calc->variables[stack[--top]];
+        for (int i = 0; i < var->dependent_count; i++) {
+            Variable *dependent = &calc->variables[var->dependents[i]];
+            if (!dependent->dirty) {
+                dependent->dirty = 1;
+                stack[top++] = var->dependents[i];
+            }
+        }
+    }
+    free(stack);
+}
+
+// Recompute a dirty variable: collect its dirty inputs in post-order
+// (a topological order of the affected slice) and evaluate each once
+int refresh_variable(Calculator *calc, int index, CalcError *error) {
+    if (!calc->variables[index].dirty) return 1;
+    
+    int *stack = malloc(calc->var_count * sizeof(int));
+    int *child = malloc(calc->var_count * sizeof(int));
+    int *order = malloc(calc->var_count * sizeof(int));
+    if (stack == NULL || child == NULL || order == NULL) {
+        free(stack);
+        free(child);
+        free(order);
+        *error = CALC_ERROR_MEMORY;
+        return 0;
+    }
+    
+    unsigned stamp = next_visit(calc);
+    int top = 0, count = 0;
+    stack[top] = index;
+    child[top++] = 0;
+    calc->variables[index].visit = stamp;
+    while (top > 0) {
+        Variable *var = &calc->variables[stack[top - 1]];
+        if (child[top - 1] < var->depend_count) {
+            int dep = var->depends[child[top - 1]++];
+            if (calc->variables[dep].dirty && calc->variables[dep].visit != stamp) {
+                calc->variables[dep].visit = stamp;
+                stack[top] = dep;
+                child[top++] = 0;
+            }
+        } else {
+            order[count++] = stack[--top];
+        }
+    }
+    
+    for (int i = 0; i < count && *error == CALC_OK; i++) {
+        Variable *var = &calc->variables[order[i]];
+        Value value = program_run(calc, var->definition, NULL, error);
+        if (*error == CALC_OK) {
+            value_release(&var->value);
+            var->value = value;
+            var->dirty = 0;
+        }
+    }
+    
+    free(stack);
+    free(child);
+    free(order);
+    return *error == CALC_OK;
+}
+
+// Indices of the distinct variables a formula loads, itself or in the
+// bodies of the user functions it calls, directly or not; NULL on error.
+// Each variable is recorded the first time the traversal stamps it.
+int* collect_depends(Calculator *calc, const Program *definition, int *depend_count, CalcError *error) {
+    int *depends = malloc((calc->var_count + 1) * sizeof(int));
+    const Program **pending = malloc((calc->function_count + 1) * sizeof(Program*));
+    char *reached = calloc(calc->function_count + 1, 1);
+    if (depends == NULL || pending == NULL || reached == NULL) {
+        free(depends);
+        free(pending);
+        free(reached);
+        *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    *depend_count = 0;
+    unsigned stamp = next_visit(calc);
+    int top = 0;
+    pending[top++] = definition;
+    while (top > 0 && *error == CALC_OK) {
+        const Program *prog = pending[--top];
+        for (int pc = 0; pc < prog->code_count; pc++) {
+            const Instruction *ins = &prog->code[pc];
+            if (ins->op == OP_UCALL && !reached[ins->c]) {
+                reached[ins->c] = 1;
+                pending[top++] = calc->functions[ins->c].body;
+            }
+            if (ins->op != OP_LOAD) continue;
+            Variable *dep = find_variable(calc, prog->symbols[ins->a]);
+            if (dep == NULL) {
+                *error = CALC_ERROR_UNKNOWN_VARIABLE;
+                break;
+            }
+            if (dep->visit != stamp) {
+                dep->visit = stamp;
+                depends[(*depend_count)++] = (int)(dep - calc->variables);
+            }
+        }
+    }
+    free(pending);
+    free(reached);
+    if (*error != CALC_OK) {
+        free(depends);
+        return NULL;
+    }
+    return depends;
+}
+
+// Would reading these inputs make the variable depend on itself? True,
+// with CALC_ERROR_CYCLE, if an input is the variable or one of its
+// transitive dependents.
+int forms_cycle(Calculator *calc, int index, const int *depends, int depend_count, CalcError *error) {
+    unsigned stamp = next_visit(calc);
+    int *stack = malloc(calc->var_count * sizeof(int));
+    int top = 0;
+    if (stack == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return 1;
+    }
+    stack[top++] = index;
+    calc->variables[index].visit = stamp;
+    while (top > 0) {
+        Variable *var = &calc->variables[stack[--top]];
+        for (int i = 0; i < var->dependent_count; i++) {
+            Variable *dependent = &calc->variables[var->dependents[i]];
+            if (dependent->visit != stamp) {
+                dependent->visit = stamp;
+                stack[top++] = var->dependents[i];
+            }
+        }
+    }
+    free(stack);
+    for (int i = 0; i < depend_count; i++) {
+        if (calc->variables[depends[i]].visit == stamp) {
+            *error = CALC_ERROR_CYCLE;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Add the edges from a variable's inputs (takes ownership of the depends
+// array)
+int attach_depends(Calculator *calc, int index, int *depends, int depend_count, CalcError *error) {
+    for (int i = 0; i < depend_count; i++) {
+        Variable *dep = &calc->variables[depends[i]];
+        if (dep->dependent_count == dep->dependent_capacity) {
+            int capacity = dep->dependent_capacity ? dep->dependent_capacity * 2 : 4;
+            int *grown = realloc(dep->dependents, capacity * sizeof(int));
+            if (grown == NULL) {
+                // Keep the edges added so far consistent with depends
+                depend_count = i;
+                *error = CALC_ERROR_MEMORY;
+                break;
+            }
+            dep->dependents = grown;
+            dep->dependent_capacity = capacity;
+        }
+        dep->dependents[dep->dependent_count++] = index;
+    }
+    
+    Variable *var = &calc->variables[index];
+    var->depends = depends;
+    var->depend_count = depend_count;
+    return *error == CALC_OK;
+}
+
+// Give a variable its formula and add the edges from its inputs (takes
+// ownership of the program and the depends array)
+int attach_definition(Calculator *calc, int index, Program *definition, const char *formula, int *depends, int depend_count, CalcError *error) {
+    Variable *var = &calc->variables[index];
+    var->definition = definition;
+    var->formula = strdup(formula);
+    return attach_depends(calc, index, depends, depend_count, error);
+}
+
+// A user function the variable's formula calls changed: replace its edges
+// with the variables the formula reads now. A formula that now reads an
+// undefined variable keeps its edges and fails when it is recomputed.
+int redepend_variable(Calculator *calc, int index, CalcError *error) {
+    CalcError collect = CALC_OK;
+    int depend_count = 0;
+    int *depends = collect_depends(calc, calc->variables[index].definition, &depend_count, &collect);
+    if (depends == NULL) {
+        if (collect == CALC_ERROR_MEMORY) *error = collect;
+        return collect != CALC_ERROR_MEMORY;
+    }
+    if (forms_cycle(calc, index, depends, depend_count, error)) {
+        free(depends);
+        return 0;
+    }
+    detach_depends(calc, index);
+    return attach_depends(calc, index, depends, depend_count, error);
+}
+
+// Define a variable by a formula (takes ownership of the program). The
+// formula's variable loads become edges of the dependency graph; a
+// definition that would close a cycle is rejected.
+int define_variable(Calculator *calc, const char *name, Program *definition, const char *formula, CalcError *error) {
+    int depend_count = 0;
+    int *depends = collect_depends(calc, definition, &depend_count, error);
+    if (depends == NULL) {
+        program_free(definition);
+        return 0;
+    }
+    
+    // Formulas reading the variable were compiled for its current unit
+    Variable *target = find_variable(calc, name);
+    if (target != NULL && target->dependent_count > 0 && target->unit != definition->unit) {
+        free(depends);
+        program_free(definition);
+        *error = CALC_ERROR_UNITS;
+        return 0;
+    }
+    
+    // Reject the formula if it reads the variable through a function or
+    // any input already depends on it. Replacing the old formula only
+    // removes edges into the variable, so the check can run before
+    // anything is modified.
+    if (target != NULL && forms_cycle(calc, (int)(target - calc->variables), depends, depend_count, error)) {
+        free(depends);
+        program_free(definition);
+        return 0;
+    }
+    
+    Value value = program_run(calc, definition, NULL, error);
+    if (*error != CALC_OK || !set_variable_value(calc, name, value, 0)) {
+        if (*error == CALC_OK) *error = CALC_ERROR_MEMORY;
+        value_release(&value);
+        free(depends);
+        program_free(definition);
+        return 0;
+    }
+    value_release(&value);
+    int index = (int)(find_variable(calc, name) - calc->variables);
+    set_variable_unit(calc, index, definition->unit);
+    return attach_definition(calc, index, definition, formula, depends, depend_count, error);
+}
+
+// Add entry to history
+void add_history(Calculator *calc, const char *expr, Value result, Unit unit) {
+    free(calc->history[calc->history_index].expression);
+    calc->history[calc->history_index].expression = strdup(expr);
+    value_release(&calc->history[calc->history_index].result);
+    calc->history[calc->history_index].result = value_retain(result);
+    calc->history[calc->history_index].unit = unit;
+    
+    calc->history_index = (calc->history_index + 1) % HISTORY_SIZE;
+    if (calc->history_count < HISTORY_SIZE) {
+        calc->history_count++;
+    }
+}
+
+// Error message text
+const char* error_message(CalcError error) {
+    switch (error) {
+        case CALC_ERROR_SYNTAX:
+            return "Error: Syntax error in expression";
+        case CALC_ERROR_DIV_ZERO:
+            return "Error: Division by zero";
+        case CALC_ERROR_UNDEFINED:
+            return "Error: Undefined result (e.g., sqrt of negative number)";
+        case CALC_ERROR_OVERFLOW:
+            return "Error: Numerical overflow";
+        case CALC_ERROR_MEMORY:
+            return "Error: Memory allocation failed";
+        case CALC_ERROR_UNKNOWN_FUNCTION:
+            return "Error: Unknown function";
+        case CALC_ERROR_UNKNOWN_VARIABLE:
+            return "Error: Unknown variable";
+        case CALC_ERROR_ARG_COUNT:
+            return "Error: Incorrect number of arguments for function";
+        case CALC_ERROR_ARG_RANGE:
+            return "Error: Argument out of valid range";
+        case CALC_ERROR_MATRIX_DIM:
+            return "Error: Matrix dimension mismatch";
+        case CALC_ERROR_COMPLEX_OP:
+            return "Error: Complex number operation not supported";
+        case CALC_ERROR_TYPE:
+            return "Error: Operation not supported for this value type";
+        case CALC_ERROR_CYCLE:
+            return "Error: Circular definition";
+        case CALC_ERROR_IO:
+            return "Error: Cannot read or write file";
+        case CALC_ERROR_FORMAT:
+            return "Error: Not a session file from this version";
+        case CALC_ERROR_CONVERGENCE:
+            return "Error: Iteration did not converge";
+        case CALC_ERROR_DATA:
+            return "Error: Malformed data file";
+        case CALC_ERROR_UNITS:
+            return "Error: Incompatible units";
+        default:
+            return "Error: Unknown error";
+    }
+}
+
+// Built-in constants, which the compiler inlines; the physical constants
+// carry their units. i is the complex unit (value 0 here).
+const NamedConstant constant_table[] = {
+    {"pi", PI, 0},
+    {"e", E, 0},
+    {"phi", PHI, 0},
+    {"gamma", GAMMA, 0},
+    {"c", LIGHT_SPEED, UNIT(1, 0, -1, 0, 0, 0, 0)},
+    {"G", GRAVITATIONAL_CONSTANT, UNIT(3, -1, -2, 0, 0, 0, 0)},
+    {"h", PLANCK_CONSTANT, UNIT(2, 1, -1, 0, 0, 0, 0)},
+    {"q", ELECTRON_CHARGE, UNIT(0, 0, 1, 1, 0, 0, 0)},
+    {"Na", AVOGADRO, UNIT(0, 0, 0, 0, 0, -1, 0)},
+    {"k", BOLTZMANN, UNIT(2, 1, -2, 0, -1, 0, 0)},
+    {"inf", INFINITY, 0},
+    {"i", 0, 0},
+    {NULL, 0, 0}
+};
+
+const NamedConstant* find_constant(const char *name) {
+    for (const NamedConstant *constant = constant_table; constant->name != NULL; constant++) {
+        if (strcmp(name, constant->name) == 0) return constant;
+    }
+    return NULL;
+}
+
+// Check if a string is a known constant
+int is_constant(const char *name) {
+    return find_constant(name) != NULL;
+}
+
+// Get value of a constant
+double get_constant_value(const char *name) {
+    const NamedConstant *constant = find_constant(name);
+    return constant != NULL ? constant->value : 0.0;
+}
+
+// Find function definition by name
+FunctionDef* find_function(const char *name) {
+    for (int i = 0; function_table[i].name[0] != '\0'; i++) {
+        if (strcmp(function_table[i].name, name) == 0) {
+            return &function_table[i];
+        }
+    }
+    return NULL;
+}
+
+// Calculate factorial
+// n! for n < FACTORIAL_TABLE_SIZE and Pascal's triangle for
+// n < BINOMIAL_TABLE_SIZE, built once on first use
+double factorial_table[FACTORIAL_TABLE_SIZE];
+unsigned long long binomial_table[BINOMIAL_TABLE_SIZE][BINOMIAL_TABLE_SIZE];
+pthread_once_t factorial_once = PTHREAD_ONCE_INIT;
+
+void build_factorial_table(void) {
+    factorial_table[0] = 1;
+    for (int i = 1; i < FACTORIAL_TABLE_SIZE; i++) {
+        factorial_table[i] = factorial_table[i - 1] * i;
+    }
+    for (int n = 0; n < BINOMIAL_TABLE_SIZE; n++) {
+        binomial_table[n][0] = binomial_table[n][n] = 1;
+        for (int k = 1; k < n; k++) {
+            binomial_table[n][k] = binomial_table[n - 1][k - 1] + binomial_table[n - 1][k];
+        }
+    }
+}
+
+double factorial(double n) {
+    if (n < 0 || n != floor(n)) {
+        return NAN;
+    }
+    if (n >= FACTORIAL_TABLE_SIZE) {
+        return INFINITY;
+    }
+    pthread_once(&factorial_once, build_factorial_table);
+    return factorial_table[(int)n];
+}
+
+// log(n!) via the log-gamma function (lgamma_r leaves signgam alone)
+double log_factorial(double n) {
+    int sign;
+    return lgamma_r(n + 1, &sign);
+}
+
+// Calculate GCD of two integers
+long long gcd(long long a, long long b) {
+    a = llabs(a);
+    b = llabs(b);
+    
+    while (b != 0) {
+        long long temp = b;
+        b = a % b;
+        a = temp;
+    }
+    return a;
+}
+
+// Calculate LCM of two integers, or -1 if it does not fit
+long long lcm(long long a, long long b) {
+    if (a == 0 || b == 0) return 0;
+    long long m;
+    if (__builtin_mul_overflow(a / gcd(a, b), b, &m) || m == LLONG_MIN) return -1;
+    return llabs(m);
+}
+
+// Matrix determinant
+double matrix_det(Matrix a) {
+    if (a.rows != a.cols) return NAN;
+    
+    if (a.rows == 1) return a.data[0][0];
+    if (a.rows == 2) return a.data[0][0] * a.data[1][1] - a.data[0][1] * a.data[1][0];
+    
+    double det = 0;
+    for (int col = 0; col < a.cols; col++) {
+        Matrix submatrix;
+        submatrix.rows = a.rows - 1;
+        submatrix.cols = a.cols - 1;
+        
+        for (int i = 1; i < a.rows; i++) {
+            int subcol = 0;
+            for (int j = 0; j < a.cols; j++) {
+                if (j == col) continue;
+                submatrix.data[i-1][subcol++] = a.data[i][j];
+            }
+        }
+        
+        double sign = (col % 2 == 0) ? 1 : -1;
+        det += sign * a.data[0][col] * matrix_det(submatrix);
+    }
+    
+    return det;
+}
+
+// Matrix trace
+double matrix_trace(Matrix a) {
+    if (a.rows != a.cols) return NAN;
+    
+    double trace = 0;
+    for (int i = 0; i < a.rows; i++) {
+        trace += a.data[i][i];
+    }
+    return trace;
+}
+
+// Mathematical function implementations
+double func_sin(double args[], int count) {
+    return sin(args[0]);
+}
+
+double func_cos(double args[], int count) {
+    return cos(args[0]);
+}
+
+double func_tan(double args[], int count) {
+    return tan(args[0]);
+}
+
+double func_asin(double args[], int count) {
+    if (args[0] < -1 || args[0] > 1) return NAN;
+    return asin(args[0]);
+}
+
+double func_acos(double args[], int count) {
+    if (args[0] < -1 || args[0] > 1) return NAN;
+    return acos(args[0]);
+}
+
+double func_atan(double args[], int count) {
+    return atan(args[0]);
+}
+
+double func_atan2(double args[], int count) {
+    return atan2(args[0], args[1]);
+}
+
+double func_sinh(double args[], int count) {
+    return sinh(args[0]);
+}
+
+double func_cosh(double args[], int count) {
+    return cosh(args[0]);
+}
+
+double func_tanh(double args[], int count) {
+    return tanh(args[0]);
+}
+
+double func_asinh(double args[], int count) {
+    return asinh(args[0]);
+}
+
+double func_acosh(double args[], int count) {
+    if (args[0] < 1) return NAN;
+    return acosh(args[0]);
+}
+
+double func_atanh(double args[], int count) {
+    if (args[0] <= -1 || args[0] >= 1) return NAN;
+    return atanh(args[0]);
+}
+
+double func_log(double args[], int count) {
+    if (args[0] <= 0) return NAN;
+    return log(args[0]);
+}
+
+double func_log10(double args[], int count) {
+    if (args[0] <= 0) return NAN;
+    return log10(args[0]);
+}
+
+double func_log2(double args[], int count) {
+    if (args[0] <= 0) return NAN;
+    return log2(args[0]);
+}
+
+double func_exp(double args[], int count) {
+    return exp(args[0]);
+}
+
+double func_sqrt(double args[], int count) {
+    if (args[0] < 0) return NAN;
+    return sqrt(args[0]);
+}
+
+double func_cbrt(double args[], int count) {
+    return cbrt(args[0]);
+}
+
+double func_pow(double args[], int count) {
+    return pow(args[0], args[1]);
+}
+
+double func_abs(double args[], int count) {
+    return fabs(args[0]);
+}
+
+double func_floor(double args[], int count) {
+    return floor(args[0]);
+}
+
+double func_ceil(double args[], int count) {
+    return ceil(args[0]);
+}
+
+double func_round(double args[], int count) {
+    return round(args[0]);
+}
+
+double func_min(double args[], int count) {
+    double min_val = args[0];
+    for (int i = 1; i < count; i++) {
+        if (args[i] < min_val) min_val = args[i];
+    }
+    return min_val;
+}
+
+double func_max(double args[], int count) {
+    double max_val = args[0];
+    for (int i = 1; i < count; i++) {
+        if (args[i] > max_val) max_val = args[i];
+    }
+    return max_val;
+}
+
+double func_sum(double args[], int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += args[i];
+    }
+    return sum;
+}
+
+double func_mean(double args[], int count) {
+    if (count == 0) return 0;
+    return func_sum(args, count) / count;
+}
+
+double func_median(double args[], int count) {
+    if (count == 0) return 0;
+    if (!sort_doubles(args, count)) return NAN;
+    
+    if (count % 2 == 1) {
+        return args[count / 2];
+    } else {
+        return (args[count / 2 - 1] + args[count / 2]) / 2;
+    }
+}
+
+double func_factorial(double args[], int count) {
+    return factorial(args[0]);
+}
+
+// gcd and lcm of doubles, which must be integers below 2^63 in magnitude
+// (integer values take the exact func_igcd and func_ilcm)
+double func_gcd(double args[], int count) {
+    long long result = 0;
+    for (int i = 0; i < count; i++) {
+        if (args[i] != floor(args[i]) || fabs(args[i]) >= 0x1p63) return NAN;
+        result = gcd(result, (long long)args[i]);
+    }
+    return (double)result;
+}
+
+double func_lcm(double args[], int count) {
+    long long result = 1;
+    for (int i = 0; i < count; i++) {
+        if (args[i] != floor(args[i]) || fabs(args[i]) >= 0x1p63) return NAN;
+        result = lcm(result, (long long)args[i]);
+        if (result < 0) return INFINITY;
+    }
+    return (double)result;
+}
+
+double func_deg2rad(double args[], int count) {
+    return args[0] * PI / 180.0;
+}
+
+double func_rad2deg(double args[], int count) {
+    return args[0] * 180.0 / PI;
+}
+
+// perm and comb are exact while the result fits in a double's 53-bit
+// mantissa, which takes at most about 53 steps. Beyond that they come from
+// the factorial table for n < FACTORIAL_TABLE_SIZE, then from a product in
+// doubles when few factors remain, and otherwise from log-gamma. comb for
+// n < BINOMIAL_TABLE_SIZE is a table lookup.
+#define EXACT_INTEGER_LIMIT (1ULL << 53)
+#define PRODUCT_STEP_LIMIT 64
+
+double func_perm(double args[], int count) {
+    long long n = (long long)args[0];
+    long long k = (long long)args[1];
+    
+    if (n < 0 || k < 0 || k > n) return NAN;
+    
+    unsigned long long result = 1, next;
+    long long i = 0;
+    for (; i < k; i++) {
+        if (__builtin_mul_overflow(result, (unsigned long long)(n - i), &next) || next > EXACT_INTEGER_LIMIT) break;
+        result = next;
+    }
+    if (i == k) return (double)result;
+    if (n < FACTORIAL_TABLE_SIZE) return factorial(n) / factorial(n - k);
+    if (k - i > PRODUCT_STEP_LIMIT) return exp(log_factorial(n) - log_factorial(n - k));
+    
+    double product = (double)result;
+    for (; i < k && !isinf(product); i++) {
+        product *= n - i;
+    }
+    return product;
+}
+
+double func_comb(double args[], int count) {
+    long long n = (long long)args[0];
+    long long k = (long long)args[1];
+    
+    if (n < 0 || k < 0 || k > n) return NAN;
+    
+    if (n < BINOMIAL_TABLE_SIZE) {
+        pthread_once(&factorial_once, build_factorial_table);
+        return (double)binomial_table[n][k];
+    }
+    
+    // Use smaller of k and n-k
+    if (k > n - k) k = n - k;
+    
+    // result is C(n-k+i, i) after step i, so the division is exact
+    unsigned long long result = 1, next;
+    long long i = 1;
+    for (; i <= k; i++) {
+        if (__builtin_mul_overflow(result, (unsigned long long)(n - k + i), &next) || next / i > EXACT_INTEGER_LIMIT) break;
+        result = next / i;
+    }
+    if (i > k) return (double)result;
+    if (n < FACTORIAL_TABLE_SIZE) return factorial(n) / (factorial(k) * factorial(n - k));
+    if (k - i >= PRODUCT_STEP_LIMIT) return exp(log_factorial(n) - log_factorial(k) - log_factorial(n - k));
+    
+    double product = (double)result;
+    for (; i <= k && !isinf(product); i++) {
+        product = product * (n - k + i) / i;
+    }
+    return product;
+}
+
+double func_lgamma(double args[], int count) {
+    int sign;
+    return lgamma_r(args[0], &sign);
+}
+
+// Uniform double in [0, 1) from the calculator's xorshift64* generator
+double calculator_random(Calculator *calc) {
+    unsigned long long x = calc->rng_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    calc->rng_state = x;
+    return ((x * 0x2545F4914F6CDD1DULL) >> 11) * 0x1.0p-53;
+}
+
+// rand(), rand(max), rand(min, max); each calculator has its own generator
+Value func_rand(Calculator *calc, Value args[], int count, CalcError *error) {
+    for (int i = 0; i < count; i++) {
+        if (args[i].type != CALC_REAL) {
+            *error = CALC_ERROR_TYPE;
+            return value_real(0);
+        }
+    }
+    double r = calculator_random(calc);
+    if (count == 0) {
+        return value_real(r);
+    } else if (count == 1) {
+        return value_real(r * args[0].real);
+    } else {
+        return value_real(args[0].real + r * (args[1].real - args[0].real));
+    }
+}
+
+double func_det(double args[], int count) {
+    // For simplicity, assume a 2x2 matrix with 4 elements
+    if (count != 4) return NAN;
+    
+    Matrix m;
+    m.rows = 2;
+    m.cols = 2;
+    m.data[0][0] = args[0];
+    m.data[0][1] = args[1];
+    m.data[1][0] = args[2];
+    m.data[1][1] = args[3];
+    
+    return matrix_det(m);
+}
+
+double func_trace(double args[], int count) {
+    // For simplicity, assume a 2x2 matrix with 4 elements
+    if (count != 4) return NAN;
+    
+    Matrix m;
+    m.rows = 2;
+    m.cols = 2;
+    m.data[0][0] = args[0];
+    m.data[0][1] = args[1];
+    m.data[1][0] = args[2];
+    m.data[1][1] = args[3];
+    
+    return matrix_trace(m);
+}
+
+// Complex number operations
+ComplexNumber complex_add(ComplexNumber a, ComplexNumber b) {
+    ComplexNumber r = {a.real + b.real, a.imag + b.imag};
+    return r;
+}
+
+ComplexNumber complex_sub(ComplexNumber a, ComplexNumber b) {
+    ComplexNumber r = {a.real - b.real, a.imag - b.imag};
+    return r;
+}
+
+ComplexNumber complex_mul(ComplexNumber a, ComplexNumber b) {
+    ComplexNumber r = {a.real * b.real - a.imag * b.imag,
+                       a.real * b.imag + a.imag * b.real};
+    return r;
+}
+
+ComplexNumber complex_div(ComplexNumber a, ComplexNumber b) {
+    // Smith's algorithm avoids overflow in the denominator
+    ComplexNumber r;
+    if (fabs(b.real) >= fabs(b.imag)) {
+        double ratio = b.imag / b.real;
+        double denom = b.real + b.imag * ratio;
+        r.real = (a.real + a.imag * ratio) / denom;
+        r.imag = (a.imag - a.real * ratio) / denom;
+    } else {
+        double ratio = b.real / b.imag;
+        double denom = b.real * ratio + b.imag;
+        r.real = (a.real * ratio + a.imag) / denom;
+        r.imag = (a.imag * ratio - a.real) / denom;
+    }
+    return r;
+}
+
+double complex_abs(ComplexNumber a) {
+    return hypot(a.real, a.imag);
+}
+
+ComplexNumber complex_exp(ComplexNumber a) {
+    double scale = exp(a.real);
+    ComplexNumber r = {scale * cos(a.imag), scale * sin(a.imag)};
+    return r;
+}
+
+ComplexNumber complex_log(ComplexNumber a) {
+    ComplexNumber r = {log(complex_abs(a)), atan2(a.imag, a.real)};
+    return r;
+}
+
+ComplexNumber complex_pow(ComplexNumber a, ComplexNumber b) {
+    if (a.real == 0 && a.imag == 0) {
+        ComplexNumber zero = {0, 0};
+        ComplexNumber one = {1, 0};
+        return (b.real == 0 && b.imag == 0) ? one : zero;
+    }
+    return complex_exp(complex_mul(b, complex_log(a)));
+}
+
+ComplexNumber complex_sqrt(ComplexNumber a) {
+    // Principal root, computed without cancellation
+    ComplexNumber r;
+    if (a.real == 0 && a.imag == 0) {
+        r.real = 0;
+        r.imag = a.imag;
+        return r;
+    }
+    double t = sqrt((fabs(a.real) + complex_abs(a)) / 2);
+    if (a.real >= 0) {
+        r.real = t;
+        r.imag = a.imag / (2 * t);
+    } else {
+        r.real = fabs(a.imag) / (2 * t);
+        r.imag = copysign(t, a.imag);
+    }
+    return r;
+}
+
+ComplexNumber complex_sin(ComplexNumber a) {
+    ComplexNumber r = {sin(a.real) * cosh(a.imag), cos(a.real) * sinh(a.imag)};
+    return r;
+}
+
+ComplexNumber complex_cos(ComplexNumber a) {
+    ComplexNumber r = {cos(a.real) * cosh(a.imag), -sin(a.real) * sinh(a.imag)};
+    return r;
+}
+
+ComplexNumber complex_tan(ComplexNumber a) {
+    return complex_div(complex_sin(a), complex_cos(a));
+}
+
+// Allocate a vector; arrays are 64-byte aligned for vectorized loops
+Vector* vector_new(size_t length, int complex) {
+    Vector *v = malloc(sizeof(Vector));
+    if (v == NULL) return NULL;
+    
+    size_t bytes = (length * sizeof(double) + 63) & ~(size_t)63;
+    if (bytes == 0) bytes = 64;
+    
+    v->refcount = 1;
+    v->length = length;
+    v->re = aligned_alloc(64, bytes);
+    v->im = complex ? aligned_alloc(64, bytes) : NULL;
+    if (v->re == NULL || (complex && v->im == NULL)) {
+        free(v->re);
+        free(v->im);
+        free(v);
+        return NULL;
+    }
+    return v;
+}
+
+// Drop a reference to a vector, freeing it with the last one
+void vector_release(Vector *v) {
+    if (v == NULL) return;
+    if (__atomic_sub_fetch(&v->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(v->re);
+        free(v->im);
+        free(v);
+    }
+}
+
+Value value_real(double x) {
+    Value v;
+    v.type = CALC_REAL;
+    v.real = x;
+    return v;
+}
+
+Value value_complex(double re, double im) {
+    Value v;
+    v.type = CALC_COMPLEX;
+    v.complex_num.real = re;
+    v.complex_num.imag = im;
+    return v;
+}
+
+Value value_integer(long long x) {
+    Value v;
+    v.type = CALC_INTEGER;
+    v.integer = x;
+    return v;
+}
+
+// Wrap a vector in a value (the value takes over the reference)
+Value value_vector(Vector *vec) {
+    Value v;
+    v.type = CALC_VECTOR;
+    v.vector = vec;
+    return v;
+}
+
+// Wrap polynomial coefficients (highest power first, no leading zeros)
+// in a value, which takes over the reference
+Value value_poly(Vector *coeffs) {
+    Value v;
+    v.type = CALC_POLY;
+    v.vector = coeffs;
+    return v;
+}
+
+Value value_retain(Value v) {
+    if (v.type == CALC_VECTOR || v.type == CALC_POLY) {
+        __atomic_add_fetch(&v.vector->refcount, 1, __ATOMIC_RELAXED);
+    } else if (v.type == CALC_SPARSE) {
+        __atomic_add_fetch(&v.sparse->refcount, 1, __ATOMIC_RELAXED);
+    } else if (v.type == CALC_MATRIX) {
+        __atomic_add_fetch(&v.matrix->refcount, 1, __ATOMIC_RELAXED);
+    } else if (v.type == CALC_BIGINT) {
+        __atomic_add_fetch(&v.bigint->refcount, 1, __ATOMIC_RELAXED);
+    }
+    return v;
+}
+
+void value_release(Value *v) {
+    if (v->type == CALC_VECTOR || v->type == CALC_POLY) {
+        vector_release(v->vector);
+    } else if (v->type == CALC_SPARSE) {
+        sparse_release(v->sparse);
+    } else if (v->type == CALC_MATRIX) {
+        dense_release(v->matrix);
+    } else if (v->type == CALC_BIGINT) {
+        bigint_release(v->bigint);
+    }
+    *v = value_real(0);
+}
+
+// Print a complex number as a+bi; a part that is roundoff relative to the
+// other at the display precision is dropped
+void fprint_complex(FILE *out, Calculator *calc, double re, double im) {
+    double noise = pow(10, -calc->precision);
+    if (fabs(im) < fabs(re) * noise) im = 0;
+    if (fabs(re) < fabs(im) * noise) re = 0;
+    
+    if (im == 0 || isnan(im)) {
+        fprintf(out, "%.*g", calc->precision, re);
+    } else if (re == 0) {
+        fprintf(out, "%.*gi", calc->precision, im);
+    } else {
+        fprintf(out, "%.*g%c%.*gi", calc->precision, re, signbit(im) ? '-' : '+',
+                calc->precision, fabs(im));
+    }
+}
+
+// Print a polynomial as 2x^3 - x + 0.5 with complex coefficients in
+// parentheses; long polynomials are elided in the middle
+void fprint_poly(FILE *out, Calculator *calc, const Vector *p) {
+    size_t degree = p->length - 1;
+    int first = 1;
+    for (size_t j = 0; j <= degree; j++) {
+        if (p->length > 16 && j == 8) {
+            fprintf(out, " + ...");
+            j = p->length - 4;
+        }
+        double re = p->re[j], im = p->im ? p->im[j] : 0;
+        if (re == 0 && im == 0 && degree > 0) continue;
+        size_t power = degree - j;
+        if (im != 0) {
+            fprintf(out, first ? "(" : " + (");
+            fprint_complex(out, calc, re, im);
+            fprintf(out, ")");
+        } else {
+            if (signbit(re)) fprintf(out, first ? "-" : " - ");
+            else if (!first) fprintf(out, " + ");
+            if (fabs(re) != 1 || power == 0) fprintf(out, "%.*g", calc->precision, fabs(re));
+        }
+        if (power >= 2) fprintf(out, "x^%zu", power);
+        else if (power == 1) fprintf(out, "x");
+        first = 0;
+    }
+    if (p->length > 16) {
+        fprintf(out, " (degree %zu)", degree);
+    }
+}
+
+// Print a value; long vectors are elided in the middle
+void fprint_value(FILE *out, Calculator *calc, Value v) {
+    if (v.type == CALC_REAL) {
+        fprintf(out, "%.*g", calc->precision, v.real);
+    } else if (v.type == CALC_COMPLEX) {
+        fprint_complex(out, calc, v.complex_num.real, v.complex_num.imag);
+    } else if (v.type == CALC_VECTOR) {
+        Vector *vec = v.vector;
+        fprintf(out, "[");
+        for (size_t i = 0; i < vec->length; i++) {
+            if (vec->length > 16 && i == 8) {
+                fprintf(out, ", ...");
+                i = vec->length - 4;
+            }
+            if (i > 0) fprintf(out, ", ");
+            fprint_complex(out, calc, vec->re[i], vec->im ? vec->im[i] : 0);
+        }
+        fprintf(out, "]");
+        if (vec->length > 16) {
+            fprintf(out, " (%zu elements)", vec->length);
+        }
+    } else if (v.type == CALC_POLY) {
+        fprint_poly(out, calc, v.vector);
+    } else if (v.type == CALC_SPARSE) {
+        fprintf(out, "sparse(%zux%zu, %zu nonzeros)", v.sparse->rows, v.sparse->cols,
+                v.sparse->row_start[v.sparse->rows]);
+    } else if (v.type == CALC_MATRIX) {
+        fprint_matrix(out, calc, v.matrix);
+    } else if (v.type == CALC_INTEGER) {
+        fprintf(out, "%lld", v.integer);
+    } else if (v.type == CALC_BIGINT) {
+        char *digits = integer_format(v);
+        if (digits != NULL) {
+            fputs(digits, out);
+        } else {
+            fprintf(out, "%.*g", calc->precision, value_to_double(v));
+        }
+        free(digits);
+    }
+}
+
+// Convert a scalar or vector argument into a (possibly new) vector
+Vector* value_to_vector(Value v, CalcError *error) {
+    if (v.type == CALC_VECTOR) {
+        __atomic_add_fetch(&v.vector->refcount, 1, __ATOMIC_RELAXED);
+        return v.vector;
+    }
+    if (v.type != CALC_REAL && v.type != CALC_COMPLEX) {
+        *error = CALC_ERROR_TYPE;
+        return NULL;
+    }
+    Vector *vec = vector_new(1, v.type == CALC_COMPLEX);
+    if (vec == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    if (v.type == CALC_COMPLEX) {
+        vec->re[0] = v.complex_num.real;
+        vec->im[0] = v.complex_num.imag;
+    } else {
+        vec->re[0] = v.real;
+    }
+    return vec;
+}
+
+// Read an optional transform length argument
+int get_length_arg(Value args[], int count, int index, size_t *length, CalcError *error) {
+    if (count <= index) return 1;
+    if (args[index].type != CALC_REAL || args[index].real < 1 ||
+        args[index].real != floor(args[index].real) || args[index].real > 1e12) {
+        *error = CALC_ERROR_ARG_RANGE;
+        return 0;
+    }
+    *length = (size_t)args[index].real;
+    return 1;
+}
+
+// Element-wise kernels over split real/imaginary arrays. Operands are
+// processed in blocks so that broadcast scalars expand into small
+// cache-resident buffers and every kernel sees plain unit-stride arrays.
+#define KERNEL_BLOCK 512
+
+typedef double v4df __attribute__((vector_size(32)));
+typedef double v4df_unaligned __attribute__((vector_size(32), aligned(8), may_alias));
+#define V4_LOAD(p) (*(const v4df_unaligned *)(p))
+#define V4_STORE(p, v) (*(v4df_unaligned *)(p) = (v))
+
+// out = a op b for real arrays
+void kernel_real_binary(char op, size_t n, const double *a, const double *b, double *out) {
+    size_t k = 0;
+    switch (op) {
+        case '+':
+            for (; k + 4 <= n; k += 4) V4_STORE(out + k, V4_LOAD(a + k) + V4_LOAD(b + k));
+            for (; k < n; k++) out[k] = a[k] + b[k];
+            break;
+        case '-':
+            for (; k + 4 <= n; k += 4) V4_STORE(out + k, V4_LOAD(a + k) - V4_LOAD(b + k));
+            for (; k < n; k++) out[k] = a[k] - b[k];
+            break;
+        case '*':
+            for (; k + 4 <= n; k += 4) V4_STORE(out + k, V4_LOAD(a + k) * V4_LOAD(b + k));
+            for (; k < n; k++) out[k] = a[k] * b[k];
+            break;
+        case '/':
+            for (; k + 4 <= n; k += 4) V4_STORE(out + k, V4_LOAD(a + k) / V4_LOAD(b + k));
+            for (; k < n; k++) out[k] = a[k] / b[k];
+            break;
+        case '%':
+            for (; k < n; k++) out[k] = fmod(a[k], b[k]);
+            break;
+        case '^':
+            batch_pow(n, a, b, out);
+            break;
+    }
+}
+
+// out = a op b for complex arrays
+void kernel_complex_binary(char op, size_t n, const double *ar, const double *ai,
+                           const double *br, const double *bi, double *outr, double *outi) {
+    size_t k = 0;
+    switch (op) {
+        case '+':
+            for (; k + 4 <= n; k += 4) {
+                V4_STORE(outr + k, V4_LOAD(ar + k) + V4_LOAD(br + k));
+                V4_STORE(outi + k, V4_LOAD(ai + k) + V4_LOAD(bi + k));
+            }
+            for (; k < n; k++) {
+                outr[k] = ar[k] + br[k];
+                outi[k] = ai[k] + bi[k];
+            }
+            break;
+        case '-':
+            for (; k + 4 <= n; k += 4) {
+                V4_STORE(outr + k, V4_LOAD(ar + k) - V4_LOAD(br + k));
+                V4_STORE(outi + k, V4_LOAD(ai + k) - V4_LOAD(bi + k));
+            }
+            for (; k < n; k++) {
+                outr[k] = ar[k] - br[k];
+                outi[k] = ai[k] - bi[k];
+            }
+            break;
+        case '*':
+            for (; k + 4 <= n; k += 4) {
+                v4df xr = V4_LOAD(ar + k), xi = V4_LOAD(ai + k);
+                v4df yr = V4_LOAD(br + k), yi = V4_LOAD(bi + k);
+                V4_STORE(outr + k, xr * yr - xi * yi);
+                V4_STORE(outi + k, xr * yi + xi * yr);
+            }
+            for (; k < n; k++) {
+                double r = ar[k] * br[k] - ai[k] * bi[k];
+                outi[k] = ar[k] * bi[k] + ai[k] * br[k];
+                outr[k] = r;
+            }
+            break;
+        case '/':
+            for (; k + 4 <= n; k += 4) {
+                v4df xr = V4_LOAD(ar + k), xi = V4_LOAD(ai + k);
+                v4df yr = V4_LOAD(br + k), yi = V4_LOAD(bi + k);
+                v4df inv = 1.0 / (yr * yr + yi * yi);
+                V4_STORE(outr + k, (xr * yr + xi * yi) * inv);
+                V4_STORE(outi + k, (xi * yr - xr * yi) * inv);
+            }
+            for (; k < n; k++) {
+                ComplexNumber x = {ar[k], ai[k]}, y = {br[k], bi[k]};
+                ComplexNumber r = complex_div(x, y);
+                outr[k] = r.real;
+                outi[k] = r.imag;
+            }
+            break;
+        case '^':
+            for (; k < n; k++) {
+                ComplexNumber x = {ar[k], ai[k]}, y = {br[k], bi[k]};
+                ComplexNumber r = complex_pow(x, y);
+                outr[k] = r.real;
+                outi[k] = r.imag;
+            }
+            break;
+    }
+}
+
+// out = z^e for an integer exponent by repeated squaring (im may be NULL)
+void kernel_integer_power(size_t n, const double *zr, const double *zi, long e,
+                          double *outr, double *outi) {
+    double br[KERNEL_BLOCK], bi[KERNEL_BLOCK];
+    unsigned long bits = e < 0 ? -(unsigned long)e : (unsigned long)e;
+    
+    for (size_t base = 0; base < n; base += KERNEL_BLOCK) {
+        size_t len = n - base < KERNEL_BLOCK ? n - base : KERNEL_BLOCK;
+        double *rr = outr + base, *ri = outi ? outi + base : NULL;
+        memcpy(br, zr + base, len * sizeof(double));
+        if (zi) memcpy(bi, zi + base, len * sizeof(double));
+        for (size_t k = 0; k < len; k++) {
+            rr[k] = 1;
+            if (ri) ri[k] = 0;
+        }
+        
+        for (unsigned long rest = bits; rest != 0; rest >>= 1) {
+            if (rest & 1) {
+                if (zi) kernel_complex_binary('*', len, rr, ri, br, bi, rr, ri);
+                else kernel_real_binary('*', len, rr, br, rr);
+            }
+            if (rest > 1) {
+                if (zi) kernel_complex_binary('*', len, br, bi, br, bi, br, bi);
+                else kernel_real_binary('*', len, br, br, br);
+            }
+        }
+        
+        if (e < 0) {
+            for (size_t k = 0; k < len; k++) {
+                br[k] = 1;
+                bi[k] = 0;
+            }
+            if (zi) kernel_complex_binary('/', len, br, bi, rr, ri, rr, ri);
+            else kernel_real_binary('/', len, br, rr, rr);
+        }
+    }
+}
+
+// Batch math kernels: vectorized sin, cos, tan, atan, tanh, exp, log,
+// log2, log10, pow and sqrt over arrays. Each kernel works on eight
+// doubles at a time with GCC vector extensions; on x86-64 Linux every
+// batch_* loop is compiled for SSE2, AVX2+FMA and AVX-512 and the best
+// version for the running CPU is chosen when the library is loaded.
+// Results follow the scalar func_* conventions (log of a value <= 0 is
+// nan). Lanes outside a kernel's reduced range (trig arguments from 2^19
+// up, non-positive or non-finite pow operands) fall back to libm.
+// Maximum error measured against long double references, in ulps:
+//   sin, cos, atan, exp, log, log2, log10  below 1
+//   tanh, pow                              below 1.5
+//   tan                                    below 2.5
+//   sqrt                                   0.5 (correctly rounded)
+// Cloned functions are static (see the declarations at the top), since
+// their dispatchers would be exported otherwise.
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__) && !defined(__clang__)
+#define BATCH_CLONES static __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "default")))
+#else
+#define BATCH_CLONES static
+#endif
+// The v8df helpers take vectors by pointer since GCC notes an ABI change
+// for every 64-byte vector parameter; the -Wpsabi warnings about returning
+// them are reported at the end of the file, hence no matching pop.
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+typedef double v8df __attribute__((vector_size(64)));
+typedef long long v8di __attribute__((vector_size(64)));
+typedef unsigned long long v8du __attribute__((vector_size(64)));
+typedef double v8df_unaligned __attribute__((vector_size(64), aligned(8), may_alias));
+#define V8_LOAD(p) (*(const v8df_unaligned *)(p))
+#define V8_STORE(p, v) (*(v8df_unaligned *)(p) = (v))
+#define V8_SPLAT(x) ((v8df){0} + (x))
+#define V8_SELECT(mask, a, b) ((v8df)(((v8di)(mask) & (v8di)(a)) | (~(v8di)(mask) & (v8di)(b))))
+#define V8_ABS(x) ((v8df)((v8du)(x) & ~SIGN_BIT))
+// -1 in the lanes where a < b, for non-negative a and b (nan above inf),
+// else 0. Masks are computed from the bit patterns because GCC types a
+// vector comparison for the target the function is parsed for, so every
+// target_clones version would split it into scalar compares.
+#define V8_BELOW(a, b) (((v8di)(a) - (v8di)(b)) >> 63)
+// Integer-valued lanes (|k| < 2^51) as doubles
+#define V8_FROM_INT(k) ((v8df)((k) + ROUND_SHIFT_BITS) - ROUND_SHIFT)
+// High half of x: the low 27 mantissa bits cleared, so products of two
+// high halves are exact and x - high is exact
+#define V8_HIGH(x) ((v8df)((v8du)(x) & ~((1ULL << 27) - 1)))
+
+#define SIGN_BIT 0x8000000000000000ULL
+#define ROUND_SHIFT 0x1.8p52            // x + ROUND_SHIFT - ROUND_SHIFT rounds x to an integer
+#define ROUND_SHIFT_BITS 0x4338000000000000LL
+#define LN2_HI 6.93147180369123816490e-01   // 32 bits, so k * LN2_HI is exact
+#define LN2_LO 1.90821492927058770002e-10
+
+// The block k..k+7 of p to load, or for a last partial block its lanes
+// copied to buf with the rest set to 1. The vectors themselves are never
+// copied through memory, which costs store-forwarding stalls.
+ALWAYS_INLINE const double *v8_block_in(const double *p, size_t k, size_t n, double *buf) {
+    if (k + 8 <= n) return p + k;
+    for (size_t j = 0; j < 8; j++) buf[j] = k + j < n ? p[k + j] : 1.0;
+    return buf;
+}
+
+// Where to store the block k..k+7 of p: p itself, or buf for a last
+// partial block, which v8_block_done then copies to p
+ALWAYS_INLINE double *v8_block_out(double *p, size_t k, size_t n, double *buf) {
+    return k + 8 <= n ? p + k : buf;
+}
+
+ALWAYS_INLINE void v8_block_done(double *p, size_t k, size_t n, const double *buf) {
+    if (k + 8 > n) memcpy(p + k, buf, (n - k) * sizeof(double));
+}
+
+ALWAYS_INLINE int v8_any(const v8di *mask) {
+    long long any = 0;
+    for (int j = 0; j < 8; j++) any |= (*mask)[j];
+    return any != 0;
+}
+
+// s + err = a + b exactly
+ALWAYS_INLINE v8df v8_two_sum(const v8df *a, const v8df *b, v8df *err) {
+    v8df s = *a + *b;
+    v8df bb = s - *a;
+    *err = (*a - (s - bb)) + (*b - bb);
+    return s;
+}
+
+// exp(x + xlo) for |xlo| far below 1: x = n*ln2 + r with |r| <= ln2/2,
+// a degree-13 Taylor polynomial for exp(r), and 2^n applied in two steps
+// so that subnormal results round once. |x| is clamped to 746, beyond
+// which the result is 0 or inf either way.
+ALWAYS_INLINE v8df v8_exp(const v8df *arg, const v8df *xlo) {
+    v8df ax = V8_ABS(*arg);
+    v8di clamp = ~V8_BELOW(ax, V8_SPLAT(746.0)) & ~V8_BELOW(V8_SPLAT(INFINITY), ax);
+    v8df x = V8_SELECT(clamp, (v8df)(((v8du)*arg & SIGN_BIT) | (v8du)V8_SPLAT(746.0)), *arg);
+    v8df t = x * 1.44269504088896338700 + ROUND_SHIFT;
+    v8df n = t - ROUND_SHIFT;
+    v8df r = (x - n * LN2_HI) - n * LN2_LO + *xlo;
+    v8df p = V8_SPLAT(1.0 / 6227020800.0);
+    p = 1.0 / 479001600.0 + r * p;
+    p = 1.0 / 39916800.0 + r * p;
+    p = 1.0 / 3628800.0 + r * p;
+    p = 1.0 / 362880.0 + r * p;
+    p = 1.0 / 40320.0 + r * p;
+    p = 1.0 / 5040.0 + r * p;
+    p = 1.0 / 720.0 + r * p;
+    p = 1.0 / 120.0 + r * p;
+    p = 1.0 / 24.0 + r * p;
+    p = 1.0 / 6.0 + r * p;
+    p = 0.5 + r * p;
+    p = 1.0 + (r + r * r * p);
+    v8di e = (v8di)t - ROUND_SHIFT_BITS;
+    v8di e1 = e >> 1, e2 = e - e1;
+    return p * (v8df)((e1 + 1023) << 52) * (v8df)((e2 + 1023) << 52);
+}
+
+// log(x) = k*ln2 + f - hfsq + tail with 1 + f in [sqrt(2)/2, sqrt(2)),
+// hfsq = f^2/2 and tail = s*(hfsq + R(s^2)), s = f/(2 + f) (fdlibm)
+ALWAYS_INLINE v8df v8_log_parts(const v8df *arg, v8df *dk, v8df *f, v8df *hfsq) {
+    v8di subnormal = V8_BELOW(V8_ABS(*arg), V8_SPLAT(0x1p-1022));
+    v8df x = V8_SELECT(subnormal, *arg * 0x1p54, *arg);
+    v8di ix = (v8di)x + ((0x3ff00000LL - 0x3fe6a09eLL) << 32);
+    *dk = V8_FROM_INT((ix >> 52) - 1023 + (subnormal & -54));
+    ix = (ix & 0x000fffffffffffffLL) + (0x3fe6a09eLL << 32);
+    *f = (v8df)ix - 1.0;
+    *hfsq = 0.5 * *f * *f;
+    v8df s = *f / (2.0 + *f);
+    v8df z = s * s;
+    v8df w = z * z;
+    v8df t1 = w * (3.999999999940941908e-01 + w * (2.222219843214978396e-01 + w * 1.531383769920937332e-01));
+    v8df t2 = z * (6.666666666666735130e-01 + w * (2.857142874366239149e-01 +
+                   w * (1.818357216161805012e-01 + w * 1.479819860511658591e-01)));
+    return s * (*hfsq + (t2 + t1));
+}
+
+// Results of the log family outside (0, inf): nan for x <= 0 and nan,
+// inf for inf
+ALWAYS_INLINE v8df v8_log_special(const v8df *x, const v8df *v) {
+    v8df ax = V8_ABS(*x);
+    v8df r = V8_SELECT(V8_BELOW(ax, V8_SPLAT(INFINITY)), *v, *x);
+    v8di nonpositive = ((v8di)*x >> 63) | ~V8_BELOW(V8_SPLAT(0.0), ax);
+    return V8_SELECT(nonpositive, V8_SPLAT(NAN), r);
+}
+
+ALWAYS_INLINE v8df v8_log(const v8df *x) {
+    v8df dk, f, hfsq;
+    v8df tail = v8_log_parts(x, &dk, &f, &hfsq);
+    v8df v = tail + dk * LN2_LO - hfsq + f + dk * LN2_HI;
+    return v8_log_special(x, &v);
+}
+
+// log2 and log10 scale f - hfsq split into a 21-bit head and a tail, so
+// the multiplication by 1/ln(2) or 1/ln(10) adds no rounding error
+ALWAYS_INLINE v8df v8_log2(const v8df *x) {
+    v8df dk, f, hfsq;
+    v8df tail = v8_log_parts(x, &dk, &f, &hfsq);
+    v8df hi = (v8df)((v8du)(f - hfsq) & 0xffffffff00000000ULL);
+    v8df lo = f - hi - hfsq + tail;
+    v8df val_hi = hi * 1.44269504072144627571e+00;
+    v8df val_lo = (lo + hi) * 1.67517131648865118353e-10 + lo * 1.44269504072144627571e+00;
+    v8df w = dk + val_hi;
+    val_lo += (dk - w) + val_hi;
+    v8df v = val_lo + w;
+    return v8_log_special(x, &v);
+}
+
+ALWAYS_INLINE v8df v8_log10(const v8df *x) {
+    v8df dk, f, hfsq;
+    v8df tail = v8_log_parts(x, &dk, &f, &hfsq);
+    v8df hi = (v8df)((v8du)(f - hfsq) & 0xffffffff00000000ULL);
+    v8df lo = f - hi - hfsq + tail;
+    v8df val_hi = hi * 4.34294481878168880939e-01;
+    v8df y = dk * 3.01029995663611771306e-01;
+    v8df val_lo = dk * 3.69423907715893078616e-13 + (lo + hi) * 2.50829467116452752298e-11 +
+                  lo * 4.34294481878168880939e-01;
+    v8df w = y + val_hi;
+    val_lo += (y - w) + val_hi;
+    v8df v = val_lo + w;
+    return v8_log_special(x, &v);
+}
+
+// x = q*pi/2 + r + tail with |r| <= pi/4. pi/2 is split into four parts
+// of which the first three have 33 bits, so for |x| < 2^19 every product
+// and the first difference are exact and the second is kept exactly as
+// a sum. Lanes from 2^19 up, or where r is so small that the rounding of
+// the last parts matters, are flagged in *fallback.
+ALWAYS_INLINE v8df v8_rem_pio2(const v8df *arg, v8df *tail, v8di *q, v8di *fallback) {
+    v8df x = *arg;
+    v8df t = x * 6.36619772367581382433e-01 + ROUND_SHIFT;
+    v8df fn = t - ROUND_SHIFT;
+    *q = (v8di)t - ROUND_SHIFT_BITS;
+    v8df a = x - fn * 1.57079632673412561417e+00;
+    v8df w = -(fn * 6.07710050630396597660e-11);
+    v8df err;
+    v8df r = v8_two_sum(&a, &w, &err);
+    err = err - fn * 2.02226624871116645580e-21 - fn * 8.47842766036889956997e-32;
+    v8df y = r + err;
+    *tail = err - (y - r);
+    v8di q_nonzero = (*q | -*q) >> 63;
+    *fallback = ~V8_BELOW(V8_ABS(x), V8_SPLAT(0x1p19)) | (V8_BELOW(V8_ABS(y), V8_SPLAT(0x1p-40)) & q_nonzero);
+    return y;
+}
+
+// sin and cos of x + y on [-pi/4, pi/4], y a tail far below ulp(x)
+// (fdlibm __kernel_sin and __kernel_cos)
+ALWAYS_INLINE v8df v8_sin_poly(const v8df *arg, const v8df *y) {
+    v8df x = *arg;
+    v8df z = x * x;
+    v8df v = z * x;
+    v8df r = 8.33333333332248946124e-03 + z * (-1.98412698298579493134e-04 + z * (2.75573137070700676789e-06 +
+             z * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10)));
+    return x - ((z * (0.5 * *y - v * r) - *y) - v * -1.66666666666666324348e-01);
+}
+
+ALWAYS_INLINE v8df v8_cos_poly(const v8df *arg, const v8df *y) {
+    v8df x = *arg;
+    v8df z = x * x;
+    v8df w = z * z;
+    v8df r = z * (4.16666666666666019037e-02 + z * (-1.38888888888741095749e-03 + z * 2.48015872894767294178e-05)) +
+             w * w * (-2.75573143513906633035e-07 + z * (2.08757232129817482790e-09 + z * -1.13596475577881948265e-11));
+    v8df hz = 0.5 * z;
+    w = 1.0 - hz;
+    return w + (((1.0 - w) - hz) + (z * r - x * *y));
+}
+
+// Recompute with libm the elements k..k+7 (below n) flagged in mask
+void batch_libm_lanes(const v8di *mask, size_t k, size_t n, const double *x, double *out, double (*fn)(double)) {
+    for (int j = 0; j < 8 && k + j < n; j++) {
+        if ((*mask)[j]) out[k + j] = fn(x[k + j]);
+    }
+}
+
+void batch_libm_pow_lanes(const v8di *mask, size_t k, size_t n, const double *x, const double *y, double *out) {
+    for (int j = 0; j < 8 && k + j < n; j++) {
+        if ((*mask)[j]) out[k + j] = pow(x[k + j], y[k + j]);
+    }
+}
+
+// which: 0 = sin, 1 = cos, 2 = tan. Lanes that need libm are flagged in
+// *fallback.
+ALWAYS_INLINE v8df v8_trig(const v8df *x, int which, v8di *fallback) {
+    v8di q;
+    v8df tail;
+    v8df r = v8_rem_pio2(x, &tail, &q, fallback);
+    v8df s = v8_sin_poly(&r, &tail), c = v8_cos_poly(&r, &tail);
+    v8di odd = -(q & 1);
+    if (which == 0) {
+        return (v8df)((v8du)V8_SELECT(odd, c, s) ^ ((v8du)(q & 2) << 62));
+    } else if (which == 1) {
+        return (v8df)((v8du)V8_SELECT(odd, s, c) ^ ((v8du)((q + 1) & 2) << 62));
+    }
+    v8df v = V8_SELECT(odd, c, s) / V8_SELECT(odd, s, c);
+    return (v8df)((v8du)v ^ ((v8du)odd & SIGN_BIT));
+}
+
+// atan after fdlibm: |x| is mapped into [-7/16, 7/16] relative to one of
+// atan(0.5), atan(1), atan(1.5) or pi/2, chosen per lane
+ALWAYS_INLINE v8df v8_atan(const v8df *arg) {
+    v8df x = *arg;
+    v8du sign = (v8du)x & SIGN_BIT;
+    v8df ax = V8_ABS(x);
+    v8df num = ax, den = V8_SPLAT(1.0), hi = V8_SPLAT(0.0), lo = V8_SPLAT(0.0);
+    v8di m = ~V8_BELOW(ax, V8_SPLAT(0.4375));
+    num = V8_SELECT(m, 2.0 * ax - 1.0, num);
+    den = V8_SELECT(m, 2.0 + ax, den);
+    hi = V8_SELECT(m, V8_SPLAT(4.63647609000806093515e-01), hi);
+    lo = V8_SELECT(m, V8_SPLAT(2.26987774529616870924e-17), lo);
+    m = ~V8_BELOW(ax, V8_SPLAT(0.6875));
+    num = V8_SELECT(m, ax - 1.0, num);
+    den = V8_SELECT(m, ax + 1.0, den);
+    hi = V8_SELECT(m, V8_SPLAT(7.85398163397448278999e-01), hi);
+    lo = V8_SELECT(m, V8_SPLAT(3.06161699786838301793e-17), lo);
+    m = ~V8_BELOW(ax, V8_SPLAT(1.1875));
+    num = V8_SELECT(m, ax - 1.5, num);
+    den = V8_SELECT(m, 1.0 + 1.5 * ax, den);
+    hi = V8_SELECT(m, V8_SPLAT(9.82793723247329054082e-01), hi);
+    lo = V8_SELECT(m, V8_SPLAT(1.39033110312309984516e-17), lo);
+    m = ~V8_BELOW(ax, V8_SPLAT(2.4375));
+    num = V8_SELECT(m, V8_SPLAT(-1.0), num);
+    den = V8_SELECT(m, ax, den);
+    hi = V8_SELECT(m, V8_SPLAT(1.57079632679489655800e+00), hi);
+    lo = V8_SELECT(m, V8_SPLAT(6.12323399573676603587e-17), lo);
+    v8df t = num / den;
+    v8df z = t * t;
+    v8df w = z * z;
+    v8df s1 = z * (3.33333333333329318027e-01 + w * (1.42857142725034663711e-01 + w * (9.09088713343650656196e-02 +
+              w * (6.66107313738753120669e-02 + w * (4.97687799461593236017e-02 + w * 1.62858201153657823623e-02)))));
+    v8df s2 = w * (-1.99999999998764832476e-01 + w * (-1.11111104054623557880e-01 + w * (-7.69187620504482999495e-02 +
+              w * (-5.83357013379057348645e-02 + w * -3.65315727442169155270e-02))));
+    v8df v = hi - ((t * (s1 + s2) - lo) - t);
+    return (v8df)((v8du)v ^ sign);
+}
+
+// tanh from its Taylor series (to x^37) for |x| < 0.55, else
+// 1 - 2/(exp(2|x|) + 1)
+ALWAYS_INLINE v8df v8_tanh(const v8df *arg) {
+    v8df x = *arg;
+    v8du sign = (v8du)x & SIGN_BIT;
+    v8df ax = V8_ABS(x);
+    v8df z = ax * ax;
+    v8df p = V8_SPLAT(7.0546369464009681e-08);
+    p = -1.7406618963571648e-07 + z * p;
+    p = 4.2949110782738057e-07 + z * p;
+    p = -1.0597268320104654e-06 + z * p;
+    p = 2.6147711512907546e-06 + z * p;
+    p = -6.4516892156554306e-06 + z * p;
+    p = 1.5918905069328964e-05 + z * p;
+    p = -3.9278323883316833e-05 + z * p;
+    p = 9.6915379569294509e-05 + z * p;
+    p = -0.00023912911424355248 + z * p;
+    p = 0.00059002744094558595 + z * p;
+    p = -0.0014558343870513183 + z * p;
+    p = 0.0035921280365724811 + z * p;
+    p = -0.0088632355299021973 + z * p;
+    p = 0.021869488536155203 + z * p;
+    p = -0.053968253968253971 + z * p;
+    p = 0.13333333333333333 + z * p;
+    p = -0.33333333333333331 + z * p;
+    v8df small = ax + ax * (z * p);
+    v8df y = 2.0 * ax, zero = V8_SPLAT(0.0);
+    v8df large = 1.0 - 2.0 / (v8_exp(&y, &zero) + 1.0);
+    v8df v = V8_SELECT(V8_BELOW(ax, V8_SPLAT(0.55)), small, large);
+    return (v8df)((v8du)v ^ sign);
+}
+
+// Table for pow's logarithm: [OFF, 2*OFF) in bits is cut into 128
+// intervals with centers c, 1/c rounded to 26 bits (so z/c - 1 is exact
+// as two products) and log(c) to about 64 bits as head + tail. The
+// interval holding 1 uses c = 1.
+#define POW_LOG_OFF 0x3fe6955500000000ULL
+#define POW_LOG_BITS 7
+
+typedef struct {
+    double invc;
+    double logc_hi;
+    double logc_lo;
+} PowLogEntry;
+
+PowLogEntry pow_log_table[1 << POW_LOG_BITS];
+pthread_once_t pow_log_once = PTHREAD_ONCE_INIT;
+
+void build_pow_log_table(void) {
+    for (int i = 0; i < 1 << POW_LOG_BITS; i++) {
+        uint64_t a_bits = POW_LOG_OFF + ((uint64_t)i << (52 - POW_LOG_BITS));
+        uint64_t b_bits = a_bits + (1ULL << (52 - POW_LOG_BITS));
+        double a, b;
+        memcpy(&a, &a_bits, sizeof(double));
+        memcpy(&b, &b_bits, sizeof(double));
+        double invc = 1.0;
+        if (a > 1.0 || b <= 1.0) {
+            invc = 2.0 / (a + b);
+            uint64_t bits;
+            memcpy(&bits, &invc, sizeof(double));
+            bits = (bits + (1ULL << 26)) & ~((1ULL << 27) - 1);
+            memcpy(&invc, &bits, sizeof(double));
+        }
+        long double logc = -logl((long double)invc);
+        pow_log_table[i].invc = invc;
+        pow_log_table[i].logc_hi = (double)logc;
+        pow_log_table[i].logc_lo = (double)(logc - (long double)pow_log_table[i].logc_hi);
+    }
+}
+
+// pow(x, y) = exp(y*log(x)) with log(x) carried as head + tail to about
+// 2^-62 relative, enough that y*log(x) keeps its precision up to the
+// overflow threshold. Lanes with x <= 0, subnormal or non-finite x, or
+// non-finite y are flagged in *special for libm.
+ALWAYS_INLINE v8df v8_pow(const v8df *x, const v8df *y, v8di *special) {
+    v8df ax = V8_ABS(*x), inf = V8_SPLAT(INFINITY);
+    *special = ((v8di)*x >> 63) | V8_BELOW(ax, V8_SPLAT(0x1p-1022)) | ~V8_BELOW(ax, inf) |
+               ~V8_BELOW(V8_ABS(*y), inf);
+    v8du ix = (v8du)V8_SELECT(*special, V8_SPLAT(1.0), *x);
+    v8du tmp = ix - POW_LOG_OFF;
+    v8du idx = (tmp >> (52 - POW_LOG_BITS)) & ((1 << POW_LOG_BITS) - 1);
+    v8df dk = V8_FROM_INT((v8di)tmp >> 52);
+    v8df z = (v8df)(ix - (tmp & (0xfffULL << 52)));
+    v8df invc, logc_hi, logc_lo;
+    for (int j = 0; j < 8; j++) {
+        const PowLogEntry *entry = &pow_log_table[idx[j]];
+        invc[j] = entry->invc;
+        logc_hi[j] = entry->logc_hi;
+        logc_lo[j] = entry->logc_lo;
+    }
+    
+    // r = z/c - 1 = rhi + rlo exactly
+    v8df zh = V8_HIGH(z);
+    v8df rhi = zh * invc - 1.0;
+    v8df rlo = (z - zh) * invc;
+    v8df r = rhi + rlo;
+    v8df rh = V8_HIGH(rhi);
+    v8df rl = (rhi - rh) + rlo;
+    
+    // log(x) = k*ln2 + log(c) + r - r^2/2 + r^3*P(r); the exact terms are
+    // summed in double-double
+    v8df e1, e2, e3, e4;
+    v8df k_ln2 = dk * LN2_HI, half_rh2 = -0.5 * rh * rh;
+    v8df hi = v8_two_sum(&k_ln2, &logc_hi, &e1);
+    hi = v8_two_sum(&hi, &rhi, &e2);
+    hi = v8_two_sum(&hi, &rlo, &e3);
+    hi = v8_two_sum(&hi, &half_rh2, &e4);
+    v8df p = V8_SPLAT(-1.0 / 10);
+    p = 1.0 / 9 + r * p;
+    p = -1.0 / 8 + r * p;
+    p = 1.0 / 7 + r * p;
+    p = -1.0 / 6 + r * p;
+    p = 1.0 / 5 + r * p;
+    p = -1.0 / 4 + r * p;
+    p = 1.0 / 3 + r * p;
+    v8df lo = e1 + e2 + e3 + e4 + dk * LN2_LO + logc_lo - (rh * rl + 0.5 * rl * rl) + r * r * r * p;
+    hi = v8_two_sum(&hi, &lo, &lo);
+    
+    // y*log(x) = ehi + elo, the product error from Dekker's splitting
+    v8df yh = V8_HIGH(*y), yl = *y - yh, hh = V8_HIGH(hi), hl = hi - hh;
+    v8df ehi = *y * hi;
+    v8df elo = ((yh * hh - ehi) + yh * hl + yl * hh) + yl * hl + *y * lo;
+    elo = V8_SELECT(V8_BELOW(V8_ABS(ehi), V8_SPLAT(1000.0)), elo, V8_SPLAT(0.0));
+    return v8_exp(&ehi, &elo);
+}
+
+BATCH_CLONES
+void batch_sin(size_t n, const double *x, const double *y, double *out) {
+    for (size_t k = 0; k < n; k += 8) {
+        v8di fallback;
+        double in[8], res[8];
+        v8df v = V8_LOAD(v8_block_in(x, k, n, in));
+        v = v8_trig(&v, 0, &fallback);
+        V8_STORE(v8_block_out(out, k, n, res), v);
+        v8_block_done(out, k, n, res);
+        if (v8_any(&fallback)) batch_libm_lanes(&fallback, k, n, x, out, sin);
+    }
+}
+
+BATCH_CLONES
+void batch_cos(size_t n, const double *x, const double *y, double *out) {
+    for (size_t k = 0; k < n; k += 8) {
+        v8di fallback;
+        double in[8], res[8];
+        v8df v = V8_LOAD(v8_block_in(x, k, n, in));
+        v = v8_trig(&v, 1, &fallback);
+        V8_STORE(v8_block_out(out, k, n, res), v);
+        v8_block_done(out, k, n, res);
+        if (v8_any(&fallback)) batch_libm_lanes(&fallback, k, n, x, out, cos);
+    }
+}
+
+BATCH_CLONES
+void batch_tan(size_t n, const double *x, const double *y, double *out) {
+    for (size_t k = 0; k < n; k += 8) {
+        v8di fallback;
+        double in[8], res[8];
+        v8df v = V8_LOAD(v8_block_in(x, k, n, in));
+        v = v8_trig(&v, 2, &fallback);
+        V8_STORE(v8_block_out(out, k, n, res), v);
+        v8_block_done(out, k, n, res);
+        if (v8_any(&fallback)) batch_libm_lanes(&fallback, k, n, x, out, tan);
+    }
+}
+
+BATCH_CLONES
+void batch_atan(size_t n, const double *x, const double *y, double *out) {
+    for (size_t k = 0; k < n; k += 8) {
+        double in[8], res[8];
+        v8df v = V8_LOAD(v8_block_in(x, k, n, in));
+        v = v8_atan(&v);
+        V8_STORE(v8_block_out(out, k, n, res), v);
+        v8_block_done(out, k, n, res);
+    }
+}
+
+BATCH_CLONES
+void batch_tanh(size_t n, const double *x, const double *y, double *out) {
+    for (size_t k = 0; k < n; k += 8) {
+        double in[8], res[8];
+        v8df v = V8_LOAD(v8_block_in(x, k, n, in));
+        v = v8_tanh(&v);
+        V8_STORE(v8_block_out(out, k, n, res), v);
+        v8_block_done(out, k, n, res);
+    }
+}
+
+BATCH_CLONES
+void batch_exp(size_t n, const double *x, const double *y, double *out) {
+    v8df zero = V8_SPLAT(0.0);
+    for (size_t k = 0; k < n; k += 8) {
+        double in[8], res[8];
+        v8df v = V8_LOAD(v8_block_in(x, k, n, in));
+        v = v8_exp(&v, &zero);
+        V8_STORE(v8_block_out(out, k, n, res), v);
+        v8_block_done(out, k, n, res);
+    }
+}
+
+BATCH_CLONES
+void batch_log(size_t n, const double *x, const double *y, double *out) {
+    for (size_t k = 0; k < n; k += 8) {
+        double in[8], res[8];
+        v8df v = V8_LOAD(v8_block_in(x, k, n, in));
+        v = v8_log(&v);
+        V8_STORE(v8_block_out(out, k, n, res), v);
+        v8_block_done(out, k, n, res);
+    }
+}
+
+BATCH_CLONES
+void batch_log2(size_t n, const double *x, const double *y, double *out) {
+    for (size_t k = 0; k < n; k += 8) {
+        double in[8], res[8];
+        v8df v = V8_LOAD(v8_block_in(x, k, n, in));
+        v = v8_log2(&v);
+        V8_STORE(v8_block_out(out, k, n, res), v);
+        v8_block_done(out, k, n, res);
+    }
+}
+
+BATCH_CLONES
+void batch_log10(size_t n, const double *x, const double *y, double *out) {
+    for (size_t k = 0; k < n; k += 8) {
+        double in[8], res[8];
+        v8df v = V8_LOAD(v8_block_in(x, k, n, in));
+        v = v8_log10(&v);
+        V8_STORE(v8_block_out(out, k, n, res), v);
+        v8_block_done(out, k, n, res);
+    }
+}
+
+// pow(x[k], y[k])
+BATCH_CLONES
+void batch_pow(size_t n, const double *x, const double *y, double *out) {
+    pthread_once(&pow_log_once, build_pow_log_table);
+    for (size_t k = 0; k < n; k += 8) {
+        v8di special;
+        double in_x[8], in_y[8], res[8];
+        v8df a = V8_LOAD(v8_block_in(x, k, n, in_x)), b = V8_LOAD(v8_block_in(y, k, n, in_y));
+        v8df v = v8_pow(&a, &b, &special);
+        V8_STORE(v8_block_out(out, k, n, res), v);
+        v8_block_done(out, k, n, res);
+        if (v8_any(&special)) batch_libm_pow_lanes(&special, k, n, x, y, out);
+    }
+}
+
+// Negative x gives nan, as in func_sqrt
+BATCH_CLONES
+void batch_sqrt(size_t n, const double *x, const double *y, double *out) {
+    for (size_t k = 0; k < n; k++) out[k] = x[k] >= 0 ? __builtin_sqrt(x[k]) : NAN;
+}
+
+// Polynomial evaluation carries its sums from one coefficient to the
+// next, and GCC keeps loop-carried v8df values in memory on targets
+// without 512-bit registers, so this kernel uses four-wide vectors
+// (native on AVX2, a register pair on SSE2) and reads coefficients that
+// were broadcast beforehand instead of splatting scalars in the loop.
+typedef double v4df __attribute__((vector_size(32)));
+typedef double v4df_unaligned __attribute__((vector_size(32), aligned(8), may_alias));
+#define V4_LOAD(p) (*(const v4df_unaligned *)(p))
+#define V4_STORE(p, v) (*(v4df_unaligned *)(p) = (v))
+
+// Sixteen points by second-order Horner: the even and odd powers are two
+// chains in x^2, combined as even + x*odd, so with four vectors of points
+// there are eight independent multiply-add chains. The chains start from
+// coefficients rather than zeros so that infinite x gives inf, as with
+// plain Horner. count must be at least 2.
+ALWAYS_INLINE void v4_polyval16(const double *c4, size_t count, const double *x, double *out) {
+    v4df x0 = V4_LOAD(x), x1 = V4_LOAD(x + 4), x2 = V4_LOAD(x + 8), x3 = V4_LOAD(x + 12);
+    v4df y0 = x0 * x0, y1 = x1 * x1, y2 = x2 * x2, y3 = x3 * x3;
+    size_t j = count % 2;
+    v4df a = V4_LOAD(c4 + 4 * j), b = V4_LOAD(c4 + 4 * j + 4);
+    v4df odd0 = a, odd1 = a, odd2 = a, odd3 = a;
+    v4df even0 = b, even1 = b, even2 = b, even3 = b;
+    if (j) {
+        v4df lead = V4_LOAD(c4);
+        even0 = lead * y0 + b;
+        even1 = lead * y1 + b;
+        even2 = lead * y2 + b;
+        even3 = lead * y3 + b;
+    }
+    for (j += 2; j < count; j += 2) {
+        a = V4_LOAD(c4 + 4 * j);
+        b = V4_LOAD(c4 + 4 * j + 4);
+        odd0 = odd0 * y0 + a;
+        odd1 = odd1 * y1 + a;
+        odd2 = odd2 * y2 + a;
+        odd3 = odd3 * y3 + a;
+        even0 = even0 * y0 + b;
+        even1 = even1 * y1 + b;
+        even2 = even2 * y2 + b;
+        even3 = even3 * y3 + b;
+    }
+    V4_STORE(out, even0 + x0 * odd0);
+    V4_STORE(out + 4, even1 + x1 * odd1);
+    V4_STORE(out + 8, even2 + x2 * odd2);
+    V4_STORE(out + 12, even3 + x3 * odd3);
+}
+
+// The polynomial with count coefficients, highest power first, at
+// x[0..n-1]; c4 holds every coefficient four times over
+BATCH_CLONES
+void batch_polyval(const double *c4, size_t count, size_t n, const double *x, double *out) {
+    if (count == 1) {
+        for (size_t k = 0; k < n; k++) out[k] = c4[0];
+        return;
+    }
+    size_t k = 0;
+    for (; k + 16 <= n; k += 16) {
+        v4_polyval16(c4, count, x + k, out + k);
+    }
+    if (k < n) {
+        double in[16] = {0}, res[16];
+        memcpy(in, x + k, (n - k) * sizeof(double));
+        v4_polyval16(c4, count, in, res);
+        memcpy(out + k, res, (n - k) * sizeof(double));
+    }
+}
+
+// Index of the first inf or nan in v, or n if every value is finite
+size_t batch_first_nonfinite(const double *v, size_t n) {
+    size_t k = 0;
+    for (; k + 8 <= n; k += 8) {
+        v8di bad = ~V8_BELOW(V8_ABS(V8_LOAD(v + k)), V8_SPLAT(INFINITY));
+        if (v8_any(&bad)) break;
+    }
+    while (k < n && isfinite(v[k])) k++;
+    return k;
+}
+
+// exp over split complex arrays: exp of the real parts, then sin and cos
+// of the imaginary parts a block at a time
+void kernel_complex_exp(size_t n, const double *zr, const double *zi, double *outr, double *outi) {
+    double c[KERNEL_BLOCK];
+    batch_exp(n, zr, NULL, outr);
+    for (size_t base = 0; base < n; base += KERNEL_BLOCK) {
+        size_t len = n - base < KERNEL_BLOCK ? n - base : KERNEL_BLOCK;
+        batch_sin(len, zi + base, NULL, outi + base);
+        batch_cos(len, zi + base, NULL, c);
+        for (size_t k = 0; k < len; k++) {
+            outi[base + k] *= outr[base + k];
+            outr[base + k] *= c[k];
+        }
+    }
+}
+
+int value_is_complex(Value v) {
+    return v.type == CALC_COMPLEX || (v.type == CALC_VECTOR && v.vector->im != NULL);
+}
+
+// Is v a real or integer scalar holding a small integer?
+int value_small_integer(Value v, long *out) {
+    if (v.type == CALC_INTEGER && v.integer >= -1024 && v.integer <= 1024) {
+        *out = (long)v.integer;
+        return 1;
+    }
+    if (v.type != CALC_REAL || v.real != floor(v.real) || fabs(v.real) > 1024) {
+        return 0;
+    }
+    *out = (long)v.real;
+    return 1;
+}
+
+// Point re/im at one block of an operand. Vectors are offset in place;
+// scalars use buffers already filled with the broadcast value.
+void operand_block(Value v, size_t base, const double *scalar_re, const double *scalar_im,
+                   const double *zeros, const double **re, const double **im) {
+    if (v.type == CALC_VECTOR) {
+        *re = v.vector->re + base;
+        *im = v.vector->im ? v.vector->im + base : zeros;
+    } else {
+        *re = scalar_re;
+        *im = scalar_im;
+    }
+}
+
+// Element-wise binary operation where at least one operand is a vector
+Value vector_binary(char op, Value a, Value b, CalcError *error) {
+    if (a.type != CALC_VECTOR && a.type != CALC_REAL && a.type != CALC_COMPLEX) {
+        *error = CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    if (b.type != CALC_VECTOR && b.type != CALC_REAL && b.type != CALC_COMPLEX) {
+        *error = CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    
+    size_t n = a.type == CALC_VECTOR ? a.vector->length : b.vector->length;
+    if (a.type == CALC_VECTOR && b.type == CALC_VECTOR && b.vector->length != n) {
+        *error = CALC_ERROR_MATRIX_DIM;
+        return value_real(0);
+    }
+    
+    int complex = value_is_complex(a) || value_is_complex(b);
+    if (complex && op == '%') {
+        *error = CALC_ERROR_COMPLEX_OP;
+        return value_real(0);
+    }
+    
+    Vector *out = vector_new(n, complex);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    
+    long e;
+    if (op == '^' && a.type == CALC_VECTOR && value_small_integer(b, &e)) {
+        kernel_integer_power(n, a.vector->re, a.vector->im, e, out->re, out->im);
+        return value_vector(out);
+    }
+    
+    static const double zeros[KERNEL_BLOCK];
+    double sa_re[KERNEL_BLOCK], sa_im[KERNEL_BLOCK], sb_re[KERNEL_BLOCK], sb_im[KERNEL_BLOCK];
+    Value scalars[2] = {a, b};
+    double *fill_re[2] = {sa_re, sb_re}, *fill_im[2] = {sa_im, sb_im};
+    for (int s = 0; s < 2; s++) {
+        if (scalars[s].type == CALC_VECTOR) continue;
+        double re = scalars[s].type == CALC_COMPLEX ? scalars[s].complex_num.real : scalars[s].real;
+        double im = scalars[s].type == CALC_COMPLEX ? scalars[s].complex_num.imag : 0;
+        for (int k = 0; k < KERNEL_BLOCK; k++) {
+            fill_re[s][k] = re;
+            fill_im[s][k] = im;
+        }
+    }
+    
+    for (size_t base = 0; base < n; base += KERNEL_BLOCK) {
+        size_t len = n - base < KERNEL_BLOCK ? n - base : KERNEL_BLOCK;
+        const double *ar, *ai, *br, *bi;
+        operand_block(a, base, sa_re, sa_im, zeros, &ar, &ai);
+        operand_block(b, base, sb_re, sb_im, zeros, &br, &bi);
+        if (complex) {
+            kernel_complex_binary(op, len, ar, ai, br, bi, out->re + base, out->im + base);
+        } else {
+            kernel_real_binary(op, len, ar, br, out->re + base);
+        }
+    }
+    return value_vector(out);
+}
+
+// Complex z^e for an integer exponent (exact for small powers like z^2)
+ComplexNumber complex_integer_power(ComplexNumber z, long e) {
+    ComplexNumber result = {1, 0};
+    unsigned long bits = e < 0 ? -(unsigned long)e : (unsigned long)e;
+    for (; bits != 0; bits >>= 1) {
+        if (bits & 1) result = complex_mul(result, z);
+        z = complex_mul(z, z);
+    }
+    if (e < 0) {
+        ComplexNumber one = {1, 0};
+        result = complex_div(one, result);
+    }
+    return result;
+}
+
+// Apply a complex function element-wise or to a scalar
+Value apply_complex_function(Calculator *calc, FunctionDef *func_def, Value arg, CalcError *error) {
+    int degrees = calc->angle_mode == 1 &&
+        (func_def->cfunc == complex_sin || func_def->cfunc == complex_cos || func_def->cfunc == complex_tan);
+    double scale = degrees ? PI / 180.0 : 1.0;
+    
+    if (arg.type != CALC_VECTOR) {
+        ComplexNumber z = {arg.complex_num.real * scale, arg.complex_num.imag * scale};
+        ComplexNumber r = func_def->cfunc(z);
+        if (isnan(r.real) || isnan(r.imag)) {
+            *error = CALC_ERROR_UNDEFINED;
+        }
+        return value_complex(r.real, r.imag);
+    }
+    
+    Vector *in = arg.vector;
+    Vector *out = vector_new(in->length, 1);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    if (func_def->cfunc == complex_exp) {
+        kernel_complex_exp(in->length, in->re, in->im, out->re, out->im);
+        return value_vector(out);
+    }
+    for (size_t k = 0; k < in->length; k++) {
+        ComplexNumber z = {in->re[k] * scale, in->im[k] * scale};
+        ComplexNumber r = func_def->cfunc(z);
+        out->re[k] = r.real;
+        out->im[k] = r.imag;
+    }
+    return value_vector(out);
+}
+
+// sum and mean of arguments that include complex scalars or vectors:
+// the real and imaginary parts are added separately
+Value complex_reduce(Value args[], int arg_count, int mean, CalcError *error) {
+    double re = 0, im = 0;
+    size_t total = 0;
+    for (int i = 0; i < arg_count; i++) {
+        if (args[i].type == CALC_VECTOR) {
+            const Vector *v = args[i].vector;
+            for (size_t k = 0; k < v->length; k++) {
+                re += v->re[k];
+                if (v->im != NULL) im += v->im[k];
+            }
+            total += v->length;
+        } else if (args[i].type == CALC_COMPLEX) {
+            re += args[i].complex_num.real;
+            im += args[i].complex_num.imag;
+            total++;
+        } else if (args[i].type == CALC_REAL) {
+            re += args[i].real;
+            total++;
+        } else {
+            *error = CALC_ERROR_TYPE;
+            return value_real(0);
+        }
+    }
+    
+    if (mean && total > 0) {
+        re /= (double)total;
+        im /= (double)total;
+    }
+    if (isnan(re) || isnan(im)) {
+        *error = CALC_ERROR_UNDEFINED;
+    } else if (isinf(re) || isinf(im)) {
+        *error = CALC_ERROR_OVERFLOW;
+    }
+    return value_complex(re, im);
+}
+
+// Shared body of real/imag/conj/arg/abs: part 0 = real, 1 = imag,
+// 2 = conj, 3 = arg, 4 = abs
+Value complex_part(Value arg, int part, CalcError *error) {
+    if (arg.type == CALC_REAL || arg.type == CALC_COMPLEX) {
+        double re = arg.type == CALC_COMPLEX ? arg.complex_num.real : arg.real;
+        double im = arg.type == CALC_COMPLEX ? arg.complex_num.imag : 0;
+        switch (part) {
+            case 0: return value_real(re);
+            case 1: return value_real(im);
+            case 2: return arg.type == CALC_COMPLEX ? value_complex(re, -im) : value_real(re);
+            case 3: return value_real(atan2(im, re));
+            default: return value_real(hypot(re, im));
+        }
+    }
+    if (arg.type != CALC_VECTOR) {
+        *error = CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    
+    Vector *in = arg.vector;
+    Vector *out = vector_new(in->length, part == 2 && in->im != NULL);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    for (size_t k = 0; k < in->length; k++) {
+        double re = in->re[k], im = in->im ? in->im[k] : 0;
+        switch (part) {
+            case 0: out->re[k] = re; break;
+            case 1: out->re[k] = im; break;
+            case 2:
+                out->re[k] = re;
+                if (out->im) out->im[k] = -im;
+                break;
+            case 3: out->re[k] = atan2(im, re); break;
+            default: out->re[k] = hypot(re, im); break;
+        }
+    }
+    return value_vector(out);
+}
+
+Value func_real(Calculator *calc, Value args[], int count, CalcError *error) {
+    return complex_part(args[0], 0, error);
+}
+
+Value func_imag(Calculator *calc, Value args[], int count, CalcError *error) {
+    return complex_part(args[0], 1, error);
+}
+
+Value func_conj(Calculator *calc, Value args[], int count, CalcError *error) {
+    return complex_part(args[0], 2, error);
+}
+
+Value func_arg(Calculator *calc, Value args[], int count, CalcError *error) {
+    return complex_part(args[0], 3, error);
+}
+
+Value func_vabs(Calculator *calc, Value args[], int count, CalcError *error) {
+    return complex_part(args[0], 4, error);
+}
+
+Value func_vpow(Calculator *calc, Value args[], int count, CalcError *error) {
+    return value_binary(calc, '^', args[0], args[1], error);
+}
+
+// Smallest length >= n whose only prime factors are 2, 3 and 5
+size_t fft_next_size(size_t n) {
+    if (n <= 1) return 1;
+    size_t best = 1;
+    while (best < n) best *= 2;
+    for (size_t p5 = 1; p5 < best; p5 *= 5) {
+        for (size_t p35 = p5; p35 < best; p35 *= 3) {
+            size_t m = p35;
+            while (m < n) m *= 2;
+            if (m < best) best = m;
+        }
+    }
+    return best;
+}
+
+// Radix-p Stockham stage: reads x with stride s, writes y in sorted order.
+// Length of the sub-transform is p*m; twiddles w^(j*k) are stored as
+// tw[j*(p-1) + k-1].
+void fft_stage(int p, size_t m, size_t s,
+               const double *xr, const double *xi, double *yr, double *yi,
+               const double *twr, const double *twi) {
+    const double s3 = 0.86602540378443864676;   // sin(pi/3)
+    const double c51 = 0.30901699437494742410;  // cos(2pi/5)
+    const double c52 = -0.80901699437494742410; // cos(4pi/5)
+    const double s51 = 0.95105651629515357212;  // sin(2pi/5)
+    const double s52 = 0.58778525229247312917;  // sin(4pi/5)
+    
+    for (size_t j = 0; j < m; j++) {
+        const double *wr = twr + j * (p - 1);
+        const double *wi = twi + j * (p - 1);
+        const double *x0r = xr + s * j, *x0i = xi + s * j;
+        double *y0r = yr + s * p * j, *y0i = yi + s * p * j;
+        size_t ms = m * s;
+        
+        if (p == 2) {
+            double w1r = wr[0], w1i = wi[0];
+            for (size_t q = 0; q < s; q++) {
+                double ar = x0r[q], ai = x0i[q];
+                double br = x0r[q + ms], bi = x0i[q + ms];
+                double dr = ar - br, di = ai - bi;
+                y0r[q] = ar + br;
+                y0i[q] = ai + bi;
+                y0r[q + s] = dr * w1r - di * w1i;
+                y0i[q + s] = dr * w1i + di * w1r;
+            }
+        } else if (p == 4) {
+            double w1r = wr[0], w1i = wi[0], w2r = wr[1], w2i = wi[1];
+            double w3r = wr[2], w3i = wi[2];
+            for (size_t q = 0; q < s; q++) {
+                double a0r = x0r[q], a0i = x0i[q];
+                double a1r = x0r[q + ms], a1i = x0i[q + ms];
+                double a2r = x0r[q + 2 * ms], a2i = x0i[q + 2 * ms];
+                double a3r = x0r[q + 3 * ms], a3i = x0i[q + 3 * ms];
+                double t0r = a0r + a2r, t0i = a0i + a2i;
+                double t1r = a0r - a2r, t1i = a0i - a2i;
+                double t2r = a1r + a3r, t2i = a1i + a3i;
+                double t3r = a1i - a3i, t3i = a3r - a1r;  // -i * (a1 - a3)
+                double b1r = t1r + t3r, b1i = t1i + t3i;
+                double b2r = t0r - t2r, b2i = t0i - t2i;
+                double b3r = t1r - t3r, b3i = t1i - t3i;
+                y0r[q] = t0r + t2r;
+                y0i[q] = t0i + t2i;
+                y0r[q + s] = b1r * w1r - b1i * w1i;
+                y0i[q + s] = b1r * w1i + b1i * w1r;
+                y0r[q + 2 * s] = b2r * w2r - b2i * w2i;
+                y0i[q + 2 * s] = b2r * w2i + b2i * w2r;
+                y0r[q + 3 * s] = b3r * w3r - b3i * w3i;
+                y0i[q + 3 * s] = b3r * w3i + b3i * w3r;
+            }
+        } else if (p == 3) {
+            double w1r = wr[0], w1i = wi[0], w2r = wr[1], w2i = wi[1];
+            for (size_t q = 0; q < s; q++) {
+                double a0r = x0r[q], a0i = x0i[q];
+                double a1r = x0r[q + ms], a1i = x0i[q + ms];
+                double a2r = x0r[q + 2 * ms], a2i = x0i[q + 2 * ms];
+                double tr = a1r + a2r, ti = a1i + a2i;
+                double mr = a0r - 0.5 * tr, mi = a0i - 0.5 * ti;
+                double dr = s3 * (a1i - a2i), di = -s3 * (a1r - a2r); // -i*s3*(a1-a2)
+                double b1r = mr + dr, b1i = mi + di;
+                double b2r = mr - dr, b2i = mi - di;
+                y0r[q] = a0r + tr;
+                y0i[q] = a0i + ti;
+                y0r[q + s] = b1r * w1r - b1i * w1i;
+                y0i[q + s] = b1r * w1i + b1i * w1r;
+                y0r[q + 2 * s] = b2r * w2r - b2i * w2i;
+                y0i[q + 2 * s] = b2r * w2i + b2i * w2r;
+            }
+        } else {
+            for (size_t q = 0; q < s; q++) {
+                double a0r = x0r[q], a0i = x0i[q];
+                double a1r = x0r[q + ms], a1i = x0i[q + ms];
+                double a2r = x0r[q + 2 * ms], a2i = x0i[q + 2 * ms];
+                double a3r = x0r[q + 3 * ms], a3i = x0i[q + 3 * ms];
+                double a4r = x0r[q + 4 * ms], a4i = x0i[q + 4 * ms];
+                double t1r = a1r + a4r, t1i = a1i + a4i;
+                double t2r = a2r + a3r, t2i = a2i + a3i;
+                double t3r = a1r - a4r, t3i = a1i - a4i;
+                double t4r = a2r - a3r, t4i = a2i - a3i;
+                double c1r = a0r + c51 * t1r + c52 * t2r, c1i = a0i + c51 * t1i + c52 * t2i;
+                double c2r = a0r + c52 * t1r + c51 * t2r, c2i = a0i + c52 * t1i + c51 * t2i;
+                double d1r = s51 * t3r + s52 * t4r, d1i = s51 * t3i + s52 * t4i;
+                double d2r = s52 * t3r - s51 * t4r, d2i = s52 * t3i - s51 * t4i;
+                // y1 = c1 - i*d1, y4 = c1 + i*d1, y2 = c2 - i*d2, y3 = c2 + i*d2
+                double b[4][2] = {{c1r + d1i, c1i - d1r}, {c2r + d2i, c2i - d2r},
+                                  {c2r - d2i, c2i + d2r}, {c1r - d1i, c1i + d1r}};
+                y0r[q] = a0r + t1r + t2r;
+                y0i[q] = a0i + t1i + t2i;
+                for (int k = 1; k < 5; k++) {
+                    y0r[q + k * s] = b[k-1][0] * wr[k-1] - b[k-1][1] * wi[k-1];
+                    y0i[q + k * s] = b[k-1][0] * wi[k-1] + b[k-1][1] * wr[k-1];
+                }
+            }
+        }
+    }
+}
+
+// Build a plan for a 2/3/5-smooth length
+FFTPlan* fft_plan_mixed(size_t n) {
+    FFTPlan *plan = calloc(1, sizeof(FFTPlan));
+    if (plan == NULL) return NULL;
+    plan->n = n;
+    
+    // Radix-4 first: fewest passes over memory
+    size_t rest = n;
+    static const int radices[] = {4, 2, 3, 5};
+    for (int r = 0; r < 4; r++) {
+        while (rest % radices[r] == 0) {
+            plan->radix[plan->stage_count++] = radices[r];
+            rest /= radices[r];
+        }
+    }
+    
+    size_t total = 0, len = n;
+    for (int st = 0; st < plan->stage_count; st++) {
+        plan->twiddle_offset[st] = total;
+        total += len / plan->radix[st] * (plan->radix[st] - 1);
+        len /= plan->radix[st];
+    }
+    plan->twiddle_re = malloc((total + 1) * sizeof(double));
+    plan->twiddle_im = malloc((total + 1) * sizeof(double));
+    if (plan->twiddle_re == NULL || plan->twiddle_im == NULL) {
+        free(plan->twiddle_re);
+        free(plan->twiddle_im);
+        free(plan);
+        return NULL;
+    }
+    
+    len = n;
+    for (int st = 0; st < plan->stage_count; st++) {
+        int p = plan->radix[st];
+        size_t m = len / p;
+        double *wr = plan->twiddle_re + plan->twiddle_offset[st];
+        double *wi = plan->twiddle_im + plan->twiddle_offset[st];
+        for (size_t j = 0; j < m; j++) {
+            for (int k = 1; k < p; k++) {
+                double angle = -2 * PI * (double)((j * k) % len) / (double)len;
+                wr[j * (p - 1) + k - 1] = cos(angle);
+                wi[j * (p - 1) + k - 1] = sin(angle);
+            }
+        }
+        len = m;
+    }
+    return plan;
+}
+
+// Build a Bluestein plan: the DFT becomes a convolution with a chirp
+FFTPlan* fft_plan_bluestein(Calculator *calc, size_t n, CalcError *error) {
+    FFTPlan *plan = calloc(1, sizeof(FFTPlan));
+    if (plan == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    plan->n = n;
+    plan->bluestein = 1;
+    plan->conv_length = fft_next_size(2 * n - 1);
+    plan->conv_plan = fft_find_plan(calc, plan->conv_length, error);
+    if (plan->conv_plan != NULL) plan->conv_plan->users++;
+    
+    size_t m = plan->conv_length;
+    plan->chirp_re = malloc(n * sizeof(double));
+    plan->chirp_im = malloc(n * sizeof(double));
+    plan->kernel_re = calloc(m, sizeof(double));
+    plan->kernel_im = calloc(m, sizeof(double));
+    if (plan->conv_plan == NULL || plan->chirp_re == NULL || plan->chirp_im == NULL ||
+        plan->kernel_re == NULL || plan->kernel_im == NULL) {
+        fft_free_plan(plan);
+        if (*error == CALC_OK) *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    
+    // w_k = exp(-i*pi*k^2/n), with k^2 reduced mod 2n to keep the angle exact
+    for (size_t k = 0; k < n; k++) {
+        unsigned long long k2 = ((unsigned long long)k * k) % (2ULL * n);
+        double angle = -PI * (double)k2 / (double)n;
+        plan->chirp_re[k] = cos(angle);
+        plan->chirp_im[k] = sin(angle);
+    }
+    
+    // Kernel b_k = conj(w_k), wrapped symmetrically, kept in frequency domain
+    for (size_t k = 0; k < n; k++) {
+        plan->kernel_re[k] = plan->chirp_re[k];
+        plan->kernel_im[k] = -plan->chirp_im[k];
+        if (k > 0) {
+            plan->kernel_re[m - k] = plan->chirp_re[k];
+            plan->kernel_im[m - k] = -plan->chirp_im[k];
+        }
+    }
+    if (!fft_execute(plan->conv_plan, plan->kernel_re, plan->kernel_im)) {
+        fft_free_plan(plan);
+        *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    return plan;
+}
+
+// Find or build the plan for length n and hold it until fft_release_plan,
+// so it stays valid after the lock is dropped
+FFTPlan* fft_get_plan(Calculator *calc, size_t n, CalcError *error) {
+    pthread_mutex_lock(&calc->plan_lock);
+    FFTPlan *plan = fft_find_plan(calc, n, error);
+    if (plan != NULL) plan->users++;
+    fft_trim_plans(calc);
+    pthread_mutex_unlock(&calc->plan_lock);
+    return plan;
+}
+
+void fft_release_plan(Calculator *calc, FFTPlan *plan) {
+    if (plan == NULL) return;
+    pthread_mutex_lock(&calc->plan_lock);
+    plan->users--;
+    fft_trim_plans(calc);
+    pthread_mutex_unlock(&calc->plan_lock);
+}
+
+// Find or build the plan for length n and move it to the front of the
+// cache. Called with plan_lock held.
+FFTPlan* fft_find_plan(Calculator *calc, size_t n, CalcError *error) {
+    for (FFTPlan **link = &calc->fft_plans; *link != NULL; link = &(*link)->next) {
+        FFTPlan *plan = *link;
+        if (plan->n != n) continue;
+        *link = plan->next;
+        plan->next = calc->fft_plans;
+        calc->fft_plans = plan;
+        return plan;
+    }
+    
+    size_t rest = n;
+    while (rest % 2 == 0) rest /= 2;
+    while (rest % 3 == 0) rest /= 3;
+    while (rest % 5 == 0) rest /= 5;
+    
+    FFTPlan *plan;
+    if (rest == 1) {
+        plan = fft_plan_mixed(n);
+        if (plan == NULL) *error = CALC_ERROR_MEMORY;
+    } else {
+        plan = fft_plan_bluestein(calc, n, error);
+    }
+    if (plan == NULL) return NULL;
+    
+    plan->next = calc->fft_plans;
+    calc->fft_plans = plan;
+    return plan;
+}
+
+// Free the plans past the first FFT_PLAN_LIMIT that nobody holds. Freeing
+// a Bluestein plan lets go of its conv_plan, which a later pass may free.
+// Called with plan_lock held.
+void fft_trim_plans(Calculator *calc) {
+    int kept = 0;
+    for (FFTPlan **link = &calc->fft_plans; *link != NULL; ) {
+        FFTPlan *plan = *link;
+        if (++kept <= FFT_PLAN_LIMIT || plan->users > 0) {
+            link = &plan->next;
+            continue;
+        }
+        *link = plan->next;
+        if (plan->conv_plan != NULL) plan->conv_plan->users--;
+        fft_free_plan(plan);
+    }
+}
+
+void fft_free_plan(FFTPlan *plan) {
+    free(plan->twiddle_re);
+    free(plan->twiddle_im);
+    free(plan->real_re);
+    free(plan->real_im);
+    free(plan->chirp_re);
+    free(plan->chirp_im);
+    free(plan->kernel_re);
+    free(plan->kernel_im);
+    free(plan->scratch_re);
+    free(plan->scratch_im);
+    free(plan);
+}
+
+void fft_free_plans(Calculator *calc) {
+    FFTPlan *plan = calc->fft_plans;
+    while (plan != NULL) {
+        FFTPlan *next = plan->next;
+        fft_free_plan(plan);
+        plan = next;
+    }
+    calc->fft_plans = NULL;
+}
+
+// Work buffers of length for one transform with the plan: its own unless
+// another thread is using them, then fresh ones. 0 if out of memory.
+int fft_scratch(FFTPlan *plan, size_t length, double **re, double **im) {
+    if (!__atomic_exchange_n(&plan->scratch_busy, 1, __ATOMIC_ACQUIRE)) {
+        if (plan->scratch_re == NULL) plan->scratch_re = malloc(length * sizeof(double));
+        if (plan->scratch_im == NULL) plan->scratch_im = malloc(length * sizeof(double));
+        *re = plan->scratch_re;
+        *im = plan->scratch_im;
+    } else {
+        *re = malloc(length * sizeof(double));
+        *im = malloc(length * sizeof(double));
+    }
+    if (*re != NULL && *im != NULL) return 1;
+    fft_scratch_done(plan, *re, *im);
+    return 0;
+}
+
+void fft_scratch_done(FFTPlan *plan, double *re, double *im) {
+    if (re == plan->scratch_re || im == plan->scratch_im) {
+        __atomic_store_n(&plan->scratch_busy, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    free(re);
+    free(im);
+}
+
+// In-place forward DFT of the split-complex array (re, im).
+// The unscaled inverse is fft_execute(plan, im, re). 0 if the work
+// buffers could not be allocated, leaving the data unchanged.
+int fft_execute(FFTPlan *plan, double *re, double *im) {
+    size_t n = plan->n;
+    if (n <= 1) return 1;
+    
+    if (plan->bluestein) {
+        size_t m = plan->conv_length;
+        double *ar, *ai;
+        if (!fft_scratch(plan, m, &ar, &ai)) return 0;
+        memset(ar + n, 0, (m - n) * sizeof(double));
+        memset(ai + n, 0, (m - n) * sizeof(double));
+        for (size_t k = 0; k < n; k++) {
+            ar[k] = re[k] * plan->chirp_re[k] - im[k] * plan->chirp_im[k];
+            ai[k] = re[k] * plan->chirp_im[k] + im[k] * plan->chirp_re[k];
+        }
+        if (!fft_execute(plan->conv_plan, ar, ai)) {
+            fft_scratch_done(plan, ar, ai);
+            return 0;
+        }
+        for (size_t k = 0; k < m; k++) {
+            double xr = ar[k] * plan->kernel_re[k] - ai[k] * plan->kernel_im[k];
+            double xi = ar[k] * plan->kernel_im[k] + ai[k] * plan->kernel_re[k];
+            ar[k] = xr;
+            ai[k] = xi;
+        }
+        if (!fft_execute(plan->conv_plan, ai, ar)) {
+            fft_scratch_done(plan, ar, ai);
+            return 0;
+        }
+        double scale = 1.0 / (double)m;
+        for (size_t k = 0; k < n; k++) {
+            double xr = ar[k] * scale, xi = ai[k] * scale;
+            re[k] = xr * plan->chirp_re[k] - xi * plan->chirp_im[k];
+            im[k] = xr * plan->chirp_im[k] + xi * plan->chirp_re[k];
+        }
+        fft_scratch_done(plan, ar, ai);
+        return 1;
+    }
+    
+    double *wr, *wi;
+    if (!fft_scratch(plan, n, &wr, &wi)) return 0;
+    
+    // Ping-pong between the data and work buffers, ending in the data
+    double *xr = re, *xi = im, *yr = wr, *yi = wi;
+    if (plan->stage_count % 2 == 1) {
+        memcpy(wr, re, n * sizeof(double));
+        memcpy(wi, im, n * sizeof(double));
+        xr = wr; xi = wi; yr = re; yi = im;
+    }
+    
+    size_t s = 1, len = n;
+    for (int st = 0; st < plan->stage_count; st++) {
+        int p = plan->radix[st];
+        size_t m = len / p;
+        fft_stage(p, m, s, xr, xi, yr, yi,
+                  plan->twiddle_re + plan->twiddle_offset[st],
+                  plan->twiddle_im + plan->twiddle_offset[st]);
+        double *tr = xr, *ti = xi;
+        xr = yr; xi = yi; yr = tr; yi = ti;
+        s *= p;
+        len = m;
+    }
+    
+    fft_scratch_done(plan, wr, wi);
+    return 1;
+}
+
+// Copy a vector into a new complex vector of the given length (zero-padded
+// or truncated)
+Vector* vector_resize_complex(Vector *src, size_t length) {
+    Vector *dst = vector_new(length, 1);
+    if (dst == NULL) return NULL;
+    size_t n = src->length < length ? src->length : length;
+    memcpy(dst->re, src->re, n * sizeof(double));
+    if (src->im) {
+        memcpy(dst->im, src->im, n * sizeof(double));
+    } else {
+        memset(dst->im, 0, n * sizeof(double));
+    }
+    memset(dst->re + n, 0, (length - n) * sizeof(double));
+    memset(dst->im + n, 0, (length - n) * sizeof(double));
+    return dst;
+}
+
+// Shared body of fft/ifft
+Value fft_transform(Calculator *calc, Value args[], int count, int inverse, CalcError *error) {
+    Vector *src = value_to_vector(args[0], error);
+    if (src == NULL) return value_real(0);
+    
+    size_t n = src->length;
+    if (!get_length_arg(args, count, 1, &n, error)) {
+        vector_release(src);
+        return value_real(0);
+    }
+    
+    Vector *out = vector_resize_complex(src, n);
+    vector_release(src);
+    if (out != NULL && n == 0) return value_vector(out);
+    FFTPlan *plan = out ? fft_get_plan(calc, n, error) : NULL;
+    if (plan == NULL) {
+        vector_release(out);
+        if (*error == CALC_OK) *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    
+    int ok = inverse ? fft_execute(plan, out->im, out->re) : fft_execute(plan, out->re, out->im);
+    fft_release_plan(calc, plan);
+    if (!ok) {
+        vector_release(out);
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    if (inverse) {
+        double scale = 1.0 / (double)n;
+        for (size_t k = 0; k < n; k++) {
+            out->re[k] *= scale;
+            out->im[k] *= scale;
+        }
+    }
+    return value_vector(out);
+}
+
+Value func_fft(Calculator *calc, Value args[], int count, CalcError *error) {
+    return fft_transform(calc, args, count, 0, error);
+}
+
+Value func_ifft(Calculator *calc, Value args[], int count, CalcError *error) {
+    return fft_transform(calc, args, count, 1, error);
+}
+
+// Real-input FFT returning bins 0..n/2. Even lengths pack pairs of samples
+// into one complex transform of half the length.
+Value func_rfft(Calculator *calc, Value args[], int count, CalcError *error) {
+    Vector *src = value_to_vector(args[0], error);
+    if (src == NULL) return value_real(0);
+    if (src->im != NULL) {
+        vector_release(src);
+        *error = CALC_ERROR_COMPLEX_OP;
+        return value_real(0);
+    }
+    
+    size_t n = src->length;
+    if (!get_length_arg(args, count, 1, &n, error)) {
+        vector_release(src);
+        return value_real(0);
+    }
+    
+    if (n % 2 == 1 || n < 4) {
+        Value full = fft_transform(calc, args, count, 0, error);
+        vector_release(src);
+        if (*error != CALC_OK) return full;
+        if (n > 0) full.vector->length = n / 2 + 1;
+        return full;
+    }
+    
+    size_t h = n / 2;
+    FFTPlan *plan = fft_get_plan(calc, h, error);
+    Vector *z = plan ? vector_new(h, 1) : NULL;
+    Vector *out = z ? vector_new(h + 1, 1) : NULL;
+    if (plan != NULL) {
+        pthread_mutex_lock(&calc->plan_lock);
+        if (plan->real_re == NULL) {
+            double *wr = malloc((h + 1) * sizeof(double));
+            double *wi = malloc((h + 1) * sizeof(double));
+            if (wr != NULL && wi != NULL) {
+                for (size_t k = 0; k <= h; k++) {
+                    wr[k] = cos(-PI * (double)k / (double)h);
+                    wi[k] = sin(-PI * (double)k / (double)h);
+                }
+                plan->real_im = wi;
+                plan->real_re = wr;
+            } else {
+                free(wr);
+                free(wi);
+            }
+        }
+        pthread_mutex_unlock(&calc->plan_lock);
+    }
+    if (out == NULL || plan->real_re == NULL) {
+        vector_release(src);
+        vector_release(z);
+        vector_release(out);
+        fft_release_plan(calc, plan);
+        if (*error == CALC_OK) *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    
+    for (size_t j = 0; j < h; j++) {
+        size_t i0 = 2 * j, i1 = 2 * j + 1;
+        z->re[j] = i0 < src->length ? src->re[i0] : 0;
+        z->im[j] = i1 < src->length ? src->re[i1] : 0;
+    }
+    vector_release(src);
+    if (!fft_execute(plan, z->re, z->im)) {
+        vector_release(z);
+        vector_release(out);
+        fft_release_plan(calc, plan);
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    
+    // X_k = E_k + w^k O_k with E = (Z_k + conj Z_{h-k})/2, O = (Z_k - conj Z_{h-k})/2i
+    for (size_t k = 0; k <= h; k++) {
+        size_t a = k % h, b = (h - k) % h;
+        double zr = z->re[a], zi = z->im[a];
+        double cr = z->re[b], ci = -z->im[b];
+        double er = 0.5 * (zr + cr), ei = 0.5 * (zi + ci);
+        double or_ = 0.5 * (zi - ci), oi = -0.5 * (zr - cr);
+        double wr = plan->real_re[k], wi = plan->real_im[k];
+        out->re[k] = er + or_ * wr - oi * wi;
+        out->im[k] = ei + or_ * wi + oi * wr;
+    }
+    vector_release(z);
+    fft_release_plan(calc, plan);
+    return value_vector(out);
+}
+
+// Linear convolution; long inputs go through zero-padded FFTs. Empty
+// inputs give an empty result
+Vector* convolve(Calculator *calc, Vector *a, Vector *b, CalcError *error) {
+    size_t n = a->length > 0 && b->length > 0 ? a->length + b->length - 1 : 0;
+    int complex = a->im != NULL || b->im != NULL;
+    Vector *out = vector_new(n, complex);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    
+    size_t shorter = a->length < b->length ? a->length : b->length;
+    if (shorter <= 32) {
+        memset(out->re, 0, n * sizeof(double));
+        if (complex) memset(out->im, 0, n * sizeof(double));
+        for (size_t i = 0; i < a->length; i++) {
+            double ar = a->re[i], ai = a->im ? a->im[i] : 0;
+            for (size_t j = 0; j < b->length; j++) {
+                double br = b->re[j], bi = b->im ? b->im[j] : 0;
+                out->re[i + j] += ar * br - ai * bi;
+                if (complex) out->im[i + j] += ar * bi + ai * br;
+            }
+        }
+        return out;
+    }
+    
+    size_t m = fft_next_size(n);
+    FFTPlan *plan = fft_get_plan(calc, m, error);
+    Vector *fa = plan ? vector_resize_complex(a, m) : NULL;
+    Vector *fb = fa ? vector_resize_complex(b, m) : NULL;
+    int ok = fb != NULL && fft_execute(plan, fa->re, fa->im) && fft_execute(plan, fb->re, fb->im);
+    for (size_t k = 0; ok && k < m; k++) {
+        double xr = fa->re[k] * fb->re[k] - fa->im[k] * fb->im[k];
+        double xi = fa->re[k] * fb->im[k] + fa->im[k] * fb->re[k];
+        fa->re[k] = xr;
+        fa->im[k] = xi;
+    }
+    ok = ok && fft_execute(plan, fa->im, fa->re);
+    fft_release_plan(calc, plan);
+    if (!ok) {
+        vector_release(fa);
+        vector_release(fb);
+        vector_release(out);
+        if (*error == CALC_OK) *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    
+    double scale = 1.0 / (double)m;
+    for (size_t k = 0; k < n; k++) {
+        out->re[k] = fa->re[k] * scale;
+        if (complex) out->im[k] = fa->im[k] * scale;
+    }
+    vector_release(fa);
+    vector_release(fb);
+    return out;
+}
+
+Value func_conv(Calculator *calc, Value args[], int count, CalcError *error) {
+    Vector *a = value_to_vector(args[0], error);
+    Vector *b = a ? value_to_vector(args[1], error) : NULL;
+    Vector *out = b ? convolve(calc, a, b, error) : NULL;
+    vector_release(a);
+    vector_release(b);
+    return out ? value_vector(out) : value_real(0);
+}
+
+// Cross-correlation r[k] = sum_j a[j+k] * conj(b[j]) for lags
+// k = -(len(b)-1) .. len(a)-1, returned in that order
+Value func_xcorr(Calculator *calc, Value args[], int count, CalcError *error) {
+    Vector *a = value_to_vector(args[0], error);
+    Vector *b = a ? value_to_vector(args[1], error) : NULL;
+    Vector *rev = b ? vector_new(b->length, b->im != NULL) : NULL;
+    if (rev == NULL) {
+        vector_release(a);
+        vector_release(b);
+        if (*error == CALC_OK) *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    
+    size_t nb = b->length;
+    for (size_t j = 0; j < nb; j++) {
+        rev->re[j] = b->re[nb - 1 - j];
+        if (rev->im) rev->im[j] = -b->im[nb - 1 - j];
+    }
+    Vector *out = convolve(calc, a, rev, error);
+    vector_release(a);
+    vector_release(b);
+    vector_release(rev);
+    return out ? value_vector(out) : value_real(0);
+}
+
+// Polynomials. Coefficients are kept highest power first in a Vector that
+// is complex only if some coefficient is; the leading coefficient is
+// nonzero except in the zero polynomial, which is [0].
+#define POLY_EVAL_CHUNK 16384
+#define POLY_ROOT_ITERATIONS 500
+#define POLY_EPSILON 0x1p-52
+#define POLY_GCD_TOLERANCE 1e-10
+
+// Drop leading zero coefficients and an all-zero imaginary part. Takes
+// over p and returns it or a trimmed copy.
+Vector* poly_trim(Vector *p, CalcError *error) {
+    size_t lead = 0;
+    while (lead + 1 < p->length && p->re[lead] == 0 && (p->im == NULL || p->im[lead] == 0)) {
+        lead++;
+    }
+    int complex = 0;
+    for (size_t k = lead; p->im != NULL && k < p->length && !complex; k++) {
+        complex = p->im[k] != 0;
+    }
+    if (p->length > 0 && lead == 0 && complex == (p->im != NULL)) return p;
+    
+    size_t n = p->length > 0 ? p->length - lead : 1;
+    Vector *out = vector_new(n, complex);
+    if (out == NULL) {
+        vector_release(p);
+        *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    if (p->length == 0) {
+        out->re[0] = 0;
+    } else {
+        memcpy(out->re, p->re + lead, n * sizeof(double));
+        if (complex) memcpy(out->im, p->im + lead, n * sizeof(double));
+    }
+    vector_release(p);
+    return out;
+}
+
+// Coefficients of a polynomial, vector or scalar argument (a new reference)
+Vector* poly_coeffs(Value v, CalcError *error) {
+    if (v.type == CALC_POLY) {
+        __atomic_add_fetch(&v.vector->refcount, 1, __ATOMIC_RELAXED);
+        return v.vector;
+    }
+    Vector *p = value_to_vector(v, error);
+    return p ? poly_trim(p, error) : NULL;
+}
+
+int poly_is_zero(const Vector *p) {
+    return p->length == 1 && p->re[0] == 0 && (p->im == NULL || p->im[0] == 0);
+}
+
+// a + sign*b
+Vector* poly_add(const Vector *a, const Vector *b, double sign, CalcError *error) {
+    size_t n = a->length > b->length ? a->length : b->length;
+    int complex = a->im != NULL || b->im != NULL;
+    Vector *out = vector_new(n, complex);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    
+    size_t da = n - a->length, db = n - b->length;
+    for (size_t k = 0; k < n; k++) {
+        double re = 0, im = 0;
+        if (k >= da) {
+            re = a->re[k - da];
+            if (a->im) im = a->im[k - da];
+        }
+        if (k >= db) {
+            re += sign * b->re[k - db];
+            if (b->im) im += sign * b->im[k - db];
+        }
+        out->re[k] = re;
+        if (complex) out->im[k] = im;
+    }
+    return poly_trim(out, error);
+}
+
+// p times the complex scalar sr + si*i
+Vector* poly_scale(const Vector *p, double sr, double si, CalcError *error) {
+    int complex = p->im != NULL || si != 0;
+    Vector *out = vector_new(p->length, complex);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    for (size_t k = 0; k < p->length; k++) {
+        double re = p->re[k], im = p->im ? p->im[k] : 0;
+        out->re[k] = re * sr - im * si;
+        if (complex) out->im[k] = re * si + im * sr;
+    }
+    return poly_trim(out, error);
+}
+
+// Long division a = q*b + r with deg r < deg b; b must not be zero
+int poly_divide(const Vector *a, const Vector *b, Vector **quotient, Vector **remainder, CalcError *error) {
+    size_t na = a->length, nb = b->length;
+    size_t nq = na >= nb ? na - nb + 1 : 1;
+    int complex = a->im != NULL || b->im != NULL;
+    Vector *q = vector_new(nq, complex);
+    Vector *r = q ? vector_new(na, complex) : NULL;
+    if (r == NULL) {
+        vector_release(q);
+        *error = CALC_ERROR_MEMORY;
+        return 0;
+    }
+    
+    memcpy(r->re, a->re, na * sizeof(double));
+    if (complex && a->im) memcpy(r->im, a->im, na * sizeof(double));
+    else if (complex) memset(r->im, 0, na * sizeof(double));
+    q->re[0] = 0;
+    if (complex) q->im[0] = 0;
+    
+    ComplexNumber lead = {b->re[0], b->im ? b->im[0] : 0};
+    for (size_t i = 0; na >= nb && i < nq; i++) {
+        ComplexNumber t = {r->re[i], complex ? r->im[i] : 0};
+        if (lead.imag == 0) {
+            t.real /= lead.real;
+            t.imag /= lead.real;
+        } else {
+            t = complex_div(t, lead);
+        }
+        q->re[i] = t.real;
+        r->re[i] = 0;
+        if (complex) {
+            q->im[i] = t.imag;
+            r->im[i] = 0;
+        }
+        for (size_t j = 1; j < nb; j++) {
+            double br = b->re[j], bi = b->im ? b->im[j] : 0;
+            r->re[i + j] -= t.real * br - t.imag * bi;
+            if (complex) r->im[i + j] -= t.real * bi + t.imag * br;
+        }
+    }
+    *quotient = poly_trim(q, error);
+    *remainder = poly_trim(r, error);
+    if (*quotient == NULL || *remainder == NULL) {
+        vector_release(*quotient);
+        vector_release(*remainder);
+        return 0;
+    }
+    return 1;
+}
+
+// p^e by repeated squaring; products go through convolve (FFT for long
+// factors)
+Vector* poly_power(Calculator *calc, Vector *p, long e, CalcError *error) {
+    Vector *result = vector_new(1, 0);
+    if (result == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    result->re[0] = 1;
+    __atomic_add_fetch(&p->refcount, 1, __ATOMIC_RELAXED);
+    Vector *base = p;
+    for (; e > 0 && result != NULL; e >>= 1) {
+        if (e & 1) {
+            Vector *next = convolve(calc, result, base, error);
+            vector_release(result);
+            result = next ? poly_trim(next, error) : NULL;
+        }
+        if (e > 1 && result != NULL) {
+            Vector *next = convolve(calc, base, base, error);
+            vector_release(base);
+            base = next ? poly_trim(next, error) : NULL;
+            if (base == NULL) {
+                vector_release(result);
+                return NULL;
+            }
+        }
+    }
+    vector_release(base);
+    return result;
+}
+
+// Arithmetic where at least one operand is a polynomial: + - * with
+// polynomials and scalars, / and % as quotient and remainder of long
+// division, and ^ to a non-negative integer power
+Value poly_binary(Calculator *calc, char op, Value a, Value b, CalcError *error) {
+    if (a.type == CALC_VECTOR || b.type == CALC_VECTOR) {
+        *error = CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    
+    long e;
+    if (op == '^') {
+        if (a.type != CALC_POLY || b.type != CALC_REAL) {
+            *error = CALC_ERROR_TYPE;
+            return value_real(0);
+        }
+        if (!value_small_integer(b, &e) || e < 0) {
+            *error = CALC_ERROR_ARG_RANGE;
+            return value_real(0);
+        }
+        Vector *out = poly_power(calc, a.vector, e, error);
+        return out ? value_poly(out) : value_real(0);
+    }
+    
+    Vector *pa = poly_coeffs(a, error);
+    Vector *pb = pa ? poly_coeffs(b, error) : NULL;
+    Vector *out = NULL, *quotient, *remainder;
+    if (pb == NULL) {
+        vector_release(pa);
+        return value_real(0);
+    }
+    switch (op) {
+        case '+': out = poly_add(pa, pb, 1, error); break;
+        case '-': out = poly_add(pa, pb, -1, error); break;
+        case '*':
+            out = convolve(calc, pa, pb, error);
+            if (out != NULL) out = poly_trim(out, error);
+            break;
+        case '/':
+        case '%':
+            if (poly_is_zero(pb)) {
+                *error = CALC_ERROR_DIV_ZERO;
+            } else if (poly_divide(pa, pb, &quotient, &remainder, error)) {
+                out = op == '/' ? quotient : remainder;
+                vector_release(op == '/' ? remainder : quotient);
+            }
+            break;
+        default:
+            *error = CALC_ERROR_SYNTAX;
+    }
+    vector_release(pa);
+    vector_release(pb);
+    return out ? value_poly(out) : value_real(0);
+}
+
+// One chunk of points for the thread pool
+typedef struct {
+    const double *c4;
+    size_t count;
+    const double *x;
+    double *out;
+    size_t n;
+} PolyEvalJob;
+
+void poly_eval_task(void *arg, size_t index, int worker) {
+    PolyEvalJob *job = arg;
+    size_t start = index * POLY_EVAL_CHUNK;
+    size_t len = job->n - start < POLY_EVAL_CHUNK ? job->n - start : POLY_EVAL_CHUNK;
+    batch_polyval(job->c4, job->count, len, job->x + start, job->out + start);
+}
+
+// Real coefficients at real points; large jobs are split across the
+// calculator's thread pool
+int poly_eval_real(Calculator *calc, const double *c, size_t count, const double *x, double *out, size_t n) {
+    double *c4 = malloc(count * 4 * sizeof(double));
+    if (c4 == NULL) return 0;
+    for (size_t j = 0; j < count; j++) {
+        c4[4 * j] = c4[4 * j + 1] = c4[4 * j + 2] = c4[4 * j + 3] = c[j];
+    }
+    PolyEvalJob job = {c4, count, x, out, n};
+    size_t chunks = (n + POLY_EVAL_CHUNK - 1) / POLY_EVAL_CHUNK;
+    if (chunks > 1 && n * count >= (1 << 22)) {
+        threadpool_run(calculator_pool(calc), poly_eval_task, &job, chunks);
+    } else {
+        batch_polyval(c4, count, n, x, out);
+    }
+    free(c4);
+    return 1;
+}
+
+// Horner's rule at one complex point
+ComplexNumber poly_eval_complex(const Vector *p, ComplexNumber z) {
+    ComplexNumber v = {0, 0};
+    for (size_t k = 0; k < p->length; k++) {
+        double re = v.real * z.real - v.imag * z.imag + p->re[k];
+        double im = v.real * z.imag + v.imag * z.real + (p->im ? p->im[k] : 0);
+        v.real = re;
+        v.imag = im;
+    }
+    return v;
+}
+
+// p(x) for a scalar, each element of a vector, or the composition p(x(t))
+// of two polynomials
+Value poly_evaluate(Calculator *calc, const Vector *p, Value x, CalcError *error) {
+    if (x.type == CALC_POLY) {
+        Value result = value_real(0);
+        for (size_t k = 0; k < p->length && *error == CALC_OK; k++) {
+            Value product = value_binary(calc, '*', result, x, error);
+            value_release(&result);
+            Value c = p->im ? value_complex(p->re[k], p->im[k]) : value_real(p->re[k]);
+            result = value_binary(calc, '+', product, c, error);
+            value_release(&product);
+        }
+        return result;
+    }
+    
+    if (x.type == CALC_REAL || x.type == CALC_COMPLEX) {
+        ComplexNumber z = {x.type == CALC_COMPLEX ? x.complex_num.real : x.real,
+                           x.type == CALC_COMPLEX ? x.complex_num.imag : 0};
+        ComplexNumber v = poly_eval_complex(p, z);
+        if (isnan(v.real) || isnan(v.imag)) {
+            *error = CALC_ERROR_UNDEFINED;
+        } else if ((isinf(v.real) || isinf(v.imag)) && isfinite(z.real) && isfinite(z.imag)) {
+            *error = CALC_ERROR_OVERFLOW;
+        }
+        if (x.type == CALC_REAL && p->im == NULL) return value_real(v.real);
+        return value_complex(v.real, v.imag);
+    }
+    
+    if (x.type != CALC_VECTOR) {
+        *error = CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    Vector *in = x.vector;
+    Vector *out = vector_new(in->length, in->im != NULL || p->im != NULL);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    if (in->im == NULL) {
+        if (!poly_eval_real(calc, p->re, p->length, in->re, out->re, in->length) ||
+            (p->im && !poly_eval_real(calc, p->im, p->length, in->re, out->im, in->length))) {
+            vector_release(out);
+            *error = CALC_ERROR_MEMORY;
+            return value_real(0);
+        }
+    } else {
+        for (size_t k = 0; k < in->length; k++) {
+            ComplexNumber z = {in->re[k], in->im[k]};
+            ComplexNumber v = poly_eval_complex(p, z);
+            out->re[k] = v.real;
+            out->im[k] = v.imag;
+        }
+    }
+    return value_vector(out);
+}
+
+// poly(v) or poly(c0, c1, ...): coefficients highest power first
+Value func_poly(Calculator *calc, Value args[], int count, CalcError *error) {
+    Value coeffs = count == 1 ? value_retain(args[0]) : make_vector(args, count, error);
+    Vector *p = *error == CALC_OK ? poly_coeffs(coeffs, error) : NULL;
+    value_release(&coeffs);
+    return p ? value_poly(p) : value_real(0);
+}
+
+Value func_polyval(Calculator *calc, Value args[], int count, CalcError *error) {
+    Vector *p = poly_coeffs(args[0], error);
+    if (p == NULL) return value_real(0);
+    Value result = poly_evaluate(calc, p, args[1], error);
+    vector_release(p);
+    return result;
+}
+
+Value func_coeffs(Calculator *calc, Value args[], int count, CalcError *error) {
+    Vector *p = poly_coeffs(args[0], error);
+    return p ? value_vector(p) : value_real(0);
+}
+
+// The zero polynomial has degree 0
+Value func_degree(Calculator *calc, Value args[], int count, CalcError *error) {
+    Vector *p = poly_coeffs(args[0], error);
+    if (p == NULL) return value_real(0);
+    double degree = (double)(p->length - 1);
+    vector_release(p);
+    return value_real(degree);
+}
+
+Value func_polyder(Calculator *calc, Value args[], int count, CalcError *error) {
+    Vector *p = poly_coeffs(args[0], error);
+    if (p == NULL) return value_real(0);
+    size_t n = p->length > 1 ? p->length - 1 : 1;
+    Vector *out = vector_new(n, p->im != NULL);
+    if (out == NULL) {
+        vector_release(p);
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    for (size_t k = 0; k < n; k++) {
+        double power = (double)(p->length - 1 - k);
+        out->re[k] = p->length > 1 ? p->re[k] * power : 0;
+        if (out->im) out->im[k] = p->length > 1 ? p->im[k] * power : 0;
+    }
+    vector_release(p);
+    out = poly_trim(out, error);
+    return out ? value_poly(out) : value_real(0);
+}
+
+// Largest coefficient magnitude
+double poly_norm(const Vector *p) {
+    double norm = 0;
+    for (size_t k = 0; k < p->length; k++) {
+        double m = hypot(p->re[k], p->im ? p->im[k] : 0);
+        if (m > norm) norm = m;
+    }
+    return norm;
+}
+
+// Greatest common divisor by Euclid's algorithm, made monic. Remainder
+// coefficients below POLY_GCD_TOLERANCE times the larger of the two
+// current operands count as zero, so inexact common roots still cancel.
+Value func_polygcd(Calculator *calc, Value args[], int count, CalcError *error) {
+    Vector *a = poly_coeffs(args[0], error);
+    Vector *b = a ? poly_coeffs(args[1], error) : NULL;
+    if (b == NULL) {
+        vector_release(a);
+        return value_real(0);
+    }
+    
+    while (!poly_is_zero(b)) {
+        double na = poly_norm(a), nb = poly_norm(b);
+        double tolerance = POLY_GCD_TOLERANCE * (na > nb ? na : nb);
+        Vector *quotient, *remainder;
+        if (!poly_divide(a, b, &quotient, &remainder, error)) break;
+        vector_release(quotient);
+        vector_release(a);
+        a = b;
+    
+        // The remainder is a new vector owned here, so it is chopped in place
+        for (size_t k = 0; k < remainder->length; k++) {
+            if (hypot(remainder->re[k], remainder->im ? remainder->im[k] : 0) <= tolerance) {
+                remainder->re[k] = 0;
+                if (remainder->im) remainder->im[k] = 0;
+            }
+        }
+        b = poly_trim(remainder, error);
+        if (b == NULL) break;
+    }
+    vector_release(b);
+    if (*error != CALC_OK) {
+        vector_release(a);
+        return value_real(0);
+    }
+    
+    Vector *out = a;
+    if (!poly_is_zero(a)) {
+        ComplexNumber one = {1, 0}, lead = {a->re[0], a->im ? a->im[0] : 0};
+        ComplexNumber inverse = complex_div(one, lead);
+        out = poly_scale(a, inverse.real, inverse.imag, error);
+        vector_release(a);
+    }
+    return out ? value_poly(out) : value_real(0);
+}
+
+// Order roots by real part, then imaginary part
+int compare_roots(const void *a, const void *b) {
+    const ComplexNumber *x = a, *y = b;
+    if (x->real != y->real) return x->real < y->real ? -1 : 1;
+    return (x->imag > y->imag) - (x->imag < y->imag);
+}
+
+// Newton correction p/p' of the monic polynomial a (degree m) at z, or
+// 0 once |p(z)| is at the rounding level of its evaluation. Points
+// outside the unit circle use the reversed polynomial in y = 1/z, with
+// p'/p = y*(m - y*q'(y)/q(y)), so Horner's rule never overflows there.
+ComplexNumber aberth_newton(const ComplexNumber *a, size_t m, ComplexNumber z) {
+    ComplexNumber zero = {0, 0}, one = {1, 0};
+    int reversed = complex_abs(z) > 1;
+    ComplexNumber y = reversed ? complex_div(one, z) : z;
+    double ay = complex_abs(y);
+    ComplexNumber v = reversed ? a[m] : a[0], dv = zero;
+    double bound = complex_abs(v);
+    for (size_t k = 1; k <= m; k++) {
+        dv = complex_add(complex_mul(dv, y), v);
+        v = complex_add(complex_mul(v, y), a[reversed ? m - k : k]);
+        bound = bound * ay + complex_abs(a[reversed ? m - k : k]);
+    }
+    if (complex_abs(v) <= 4 * m * POLY_EPSILON * bound) return zero;
+    
+    ComplexNumber g = complex_div(dv, v);
+    if (reversed) {
+        ComplexNumber mm = {(double)m, 0};
+        g = complex_mul(y, complex_sub(mm, complex_mul(y, g)));
+    }
+    return complex_div(one, g);
+}
+
+// All complex roots, with multiplicity, sorted by real then imaginary
+// part; a real vector if every root is real. Uses the Aberth-Ehrlich
+// iteration: each estimate moves by w = N/(1 - N*S), N the Newton
+// correction and S the sum of 1/(z_i - z_j) over the other estimates,
+// updated in place. Zero roots are split off first.
+Value func_roots(Calculator *calc, Value args[], int count, CalcError *error) {
+    Vector *p = poly_coeffs(args[0], error);
+    if (p == NULL) return value_real(0);
+    if (poly_is_zero(p)) {
+        vector_release(p);
+        *error = CALC_ERROR_UNDEFINED;
+        return value_real(0);
+    }
+    
+    size_t n = p->length - 1, zeros = 0;
+    while (zeros < n && p->re[n - zeros] == 0 && (p->im == NULL || p->im[n - zeros] == 0)) zeros++;
+    size_t m = n - zeros;
+    ComplexNumber *a = malloc((m + 1) * sizeof(ComplexNumber));
+    ComplexNumber *z = malloc((n + 1) * sizeof(ComplexNumber));
+    char *done = calloc(m + 1, 1);
+    if (a == NULL || z == NULL || done == NULL) {
+        free(a);
+        free(z);
+        free(done);
+        vector_release(p);
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    
+    ComplexNumber lead = {p->re[0], p->im ? p->im[0] : 0};
+    for (size_t k = 0; k <= m; k++) {
+        ComplexNumber c = {p->re[k], p->im ? p->im[k] : 0};
+        a[k] = complex_div(c, lead);
+    }
+    
+    // Start on a circle whose radius is the geometric mean of the roots'
+    // magnitudes, off the real axis so real polynomials break symmetry
+    double radius = m > 0 ? pow(complex_abs(a[m]), 1.0 / (double)m) : 0;
+    for (size_t i = 0; i < m; i++) {
+        double angle = 2 * PI * (double)i / (double)m + 0.25;
+        z[i].real = radius * cos(angle);
+        z[i].imag = radius * sin(angle);
+    }
+    
+    size_t remaining = m;
+    for (int iteration = 0; iteration < POLY_ROOT_ITERATIONS && remaining > 0; iteration++) {
+        for (size_t i = 0; i < m; i++) {
+            if (done[i]) continue;
+            ComplexNumber newton = aberth_newton(a, m, z[i]);
+            if (newton.real == 0 && newton.imag == 0) {
+                done[i] = 1;
+                remaining--;
+                continue;
+            }
+            ComplexNumber sum = {0, 0}, one = {1, 0};
+            for (size_t j = 0; j < m; j++) {
+                double dr = z[i].real - z[j].real, di = z[i].imag - z[j].imag;
+                if (j == i) continue;
+                double scale = 1 / (dr * dr + di * di);
+                sum.real += dr * scale;
+                sum.imag -= di * scale;
+            }
+            ComplexNumber w = complex_div(newton, complex_sub(one, complex_mul(newton, sum)));
+            if (!isfinite(w.real) || !isfinite(w.imag)) continue;
+            z[i] = complex_sub(z[i], w);
+            if (complex_abs(w) <= 4 * POLY_EPSILON * complex_abs(z[i])) {
+                done[i] = 1;
+                remaining--;
+            }
+        }
+    }
+    for (size_t i = m; i < n; i++) {
+        z[i].real = z[i].imag = 0;
+    }
+    
+    // Parts that are rounding noise, such as the imaginary parts of a real
+    // polynomial's real roots
+    int complex = 0;
+    for (size_t i = 0; i < n; i++) {
+        double noise = 1e-14 * complex_abs(z[i]);
+        if (fabs(z[i].real) <= noise) z[i].real = 0;
+        if (p->im == NULL && fabs(z[i].imag) <= noise) z[i].imag = 0;
+        if (z[i].imag != 0) complex = 1;
+    }
+    qsort(z, n, sizeof(ComplexNumber), compare_roots);
+    
+    Vector *out = vector_new(n, complex);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            out->re[i] = z[i].real;
+            if (complex) out->im[i] = z[i].imag;
+        }
+    }
+    free(a);
+    free(z);
+    free(done);
+    vector_release(p);
+    return out ? value_vector(out) : value_real(0);
+}
+
+// Sparse matrices. Products with a vector are split into blocks of rows
+// holding about SPARSE_TASK_NNZ entries each for the thread pool; the
+// blocks depend only on the matrix, so results do not depend on the
+// number of threads.
+#define SPARSE_TASK_NNZ 65536
+#define SPARSE_TOLERANCE 1e-10
+#define SPARSE_ITERATIONS 10000
+
+SparseMatrix* sparse_new(size_t rows, size_t cols, size_t nnz) {
+    SparseMatrix *m = malloc(sizeof(SparseMatrix));
+    if (m == NULL) return NULL;
+    
+    m->refcount = 1;
+    m->rows = rows;
+    m->cols = cols;
+    m->tasks = 0;
+    m->task_start = NULL;
+    m->row_start = calloc(rows + 1, sizeof(size_t));
+    m->col = malloc((nnz > 0 ? nnz : 1) * sizeof(int));
+    m->values = malloc((nnz > 0 ? nnz : 1) * sizeof(double));
+    if (m->row_start == NULL || m->col == NULL || m->values == NULL) {
+        free(m->row_start);
+        free(m->col);
+        free(m->values);
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+// Drop a reference to a sparse matrix, freeing it with the last one
+void sparse_release(SparseMatrix *m) {
+    if (m == NULL) return;
+    if (__atomic_sub_fetch(&m->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(m->row_start);
+        free(m->col);
+        free(m->values);
+        free(m->task_start);
+        free(m);
+    }
+}
+
+// Wrap a sparse matrix in a value (the value takes over the reference)
+Value value_sparse(SparseMatrix *m) {
+    Value v;
+    v.type = CALC_SPARSE;
+    v.sparse = m;
+    return v;
+}
+
+// Split the rows into blocks of roughly equal work (entries plus one per
+// row) once row_start is final. Takes over m; returns NULL if out of
+// memory.
+SparseMatrix* sparse_partition(SparseMatrix *m, CalcError *error) {
+    size_t total = m->row_start[m->rows] + m->rows;
+    size_t tasks = total / SPARSE_TASK_NNZ + 1;
+    if (tasks > m->rows) tasks = m->rows > 0 ? m->rows : 1;
+    
+    m->task_start = malloc((tasks + 1) * sizeof(size_t));
+    if (m->task_start == NULL) {
+        sparse_release(m);
+        *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    m->tasks = tasks;
+    m->task_start[0] = 0;
+    m->task_start[tasks] = m->rows;
+    size_t lo = 0;
+    for (size_t t = 1; t < tasks; t++) {
+        // First row whose work so far reaches t/tasks of the total
+        size_t target = total / tasks * t, hi = m->rows;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (m->row_start[mid] + mid < target) lo = mid + 1;
+            else hi = mid;
+        }
+        m->task_start[t] = lo;
+    }
+    return m;
+}
+
+// Sort one row's entries by column (Shell sort on the parallel arrays;
+// rows read from files are usually sorted already)
+void sparse_sort_row(int *col, double *values, size_t n) {
+    for (size_t gap = n / 2; gap > 0; gap = gap == 2 ? 1 : gap * 5 / 11) {
+        for (size_t i = gap; i < n; i++) {
+            int c = col[i];
+            double v = values[i];
+            size_t j = i;
+            for (; j >= gap && col[j - gap] > c; j -= gap) {
+                col[j] = col[j - gap];
+                values[j] = values[j - gap];
+            }
+            col[j] = c;
+            values[j] = v;
+        }
+    }
+}
+
+// Build a matrix from 0-based (row, col, value) triplets in any order.
+// Repeated positions are summed and entries that end up zero dropped.
+SparseMatrix* sparse_from_triplets(size_t rows, size_t cols, size_t count, const int *row, const int *col, const double *values, CalcError *error) {
+    for (size_t k = 0; k < count; k++) {
+        if (row[k] < 0 || (size_t)row[k] >= rows || col[k] < 0 || (size_t)col[k] >= cols) {
+            *error = CALC_ERROR_ARG_RANGE;
+            return NULL;
+        }
+    }
+    SparseMatrix *m = sparse_new(rows, cols, count);
+    if (m == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    
+    // Counting sort into rows, then by column within each row
+    size_t *next = m->row_start + 1;
+    for (size_t k = 0; k < count; k++) next[row[k]]++;
+    for (size_t r = 1; r < rows; r++) next[r] += next[r - 1];
+    for (size_t r = rows; r > 0; r--) next[r - 1] = r > 1 ? next[r - 2] : 0;
+    for (size_t k = 0; k < count; k++) {
+        size_t slot = next[row[k]]++;
+        m->col[slot] = col[k];
+        m->values[slot] = values[k];
+    }
+    
+    size_t out = 0, start = 0;
+    for (size_t r = 0; r < rows; r++) {
+        size_t end = m->row_start[r + 1];
+        sparse_sort_row(m->col + start, m->values + start, end - start);
+        for (size_t k = start; k < end; ) {
+            int c = m->col[k];
+            double sum = 0;
+            for (; k < end && m->col[k] == c; k++) sum += m->values[k];
+            if (sum != 0) {
+                m->col[out] = c;
+                m->values[out++] = sum;
+            }
+        }
+        start = end;
+        m->row_start[r + 1] = out;
+    }
+    return sparse_partition(m, error);
+}
+
+// Triplets collected while reading a file (0-based)
+typedef struct {
+    size_t count;
+    size_t capacity;
+    int *row;
+    int *col;
+    double *values;
+} TripletList;
+
+int triplet_push(TripletList *list, size_t row, size_t col, double value) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+        int *r = realloc(list->row, capacity * sizeof(int));
+        if (r != NULL) list->row = r;
+        int *c = realloc(list->col, capacity * sizeof(int));
+        if (c != NULL) list->col = c;
+        double *v = realloc(list->values, capacity * sizeof(double));
+        if (v != NULL) list->values = v;
+        if (r == NULL || c == NULL || v == NULL) return 0;
+        list->capacity = capacity;
+    }
+    list->row[list->count] = (int)row;
+    list->col[list->count] = (int)col;
+    list->values[list->count++] = value;
+    return 1;
+}
+
+const char* skip_blanks(const char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+    return p;
+}
+
+// Parse a non-negative decimal integer no larger than INT_MAX; returns the
+// position after it, or NULL if there is none
+const char* parse_index(const char *p, size_t *out) {
+    p = skip_blanks(p);
+    if (*p < '0' || *p > '9') return NULL;
+    size_t n = 0;
+    for (; *p >= '0' && *p <= '9'; p++) {
+        n = n * 10 + (size_t)(*p - '0');
+        if (n > INT_MAX) return NULL;
+    }
+    *out = n;
+    return p;
+}
+
+const char* parse_number(const char *p, double *out) {
+    char *end;
+    *out = strtod(p, &end);
+    return end == p ? NULL : end;
+}
+
+// Move past the end of the current line, which must hold nothing more
+const char* end_of_line(const char *p) {
+    p = skip_blanks(p);
+    if (*p == '\n') return p + 1;
+    return *p == '\0' ? p : NULL;
+}
+
+// Skip empty lines and lines starting with one of the comment characters
+const char* skip_comments(const char *p, const char *comment) {
+    for (;;) {
+        const char *q = skip_blanks(p);
+        if (*q == '\n') {
+            p = q + 1;
+        } else if (*q != '\0' && strchr(comment, *q)) {
+            const char *eol = strchr(q, '\n');
+            p = eol ? eol + 1 : q + strlen(q);
+        } else {
+            return q;
+        }
+    }
+}
+
+// Does the header word at p (case-insensitive) match word? Advances p.
+int header_word(const char **p, const char *word) {
+    const char *q = skip_blanks(*p);
+    size_t n = strlen(word);
+    for (size_t k = 0; k < n; k++) {
+        if (tolower((unsigned char)q[k]) != word[k]) return 0;
+    }
+    if (q[n] != ' ' && q[n] != '\t' && q[n] != '\r' && q[n] != '\n') return 0;
+    *p = q + n;
+    return 1;
+}
+
+// Entries of a Matrix Market file after the banner
+int read_matrix_market(const char *p, TripletList *list, size_t *rows, size_t *cols, CalcError *error) {
+    int coordinate, pattern = 0, symmetric = 0, skew = 0;
+    if (!header_word(&p, "matrix")) return 0;
+    if (header_word(&p, "coordinate")) coordinate = 1;
+    else if (header_word(&p, "array")) coordinate = 0;
+    else return 0;
+    if (header_word(&p, "pattern")) pattern = 1;
+    else if (!header_word(&p, "real") && !header_word(&p, "integer")) return 0;
+    if (pattern && !coordinate) return 0;
+    if (header_word(&p, "symmetric")) symmetric = 1;
+    else if (header_word(&p, "skew-symmetric")) symmetric = skew = 1;
+    else if (!header_word(&p, "general")) return 0;
+    if ((p = end_of_line(p)) == NULL) return 0;
+    
+    size_t entries;
+    p = skip_comments(p, "%");
+    if ((p = parse_index(p, rows)) == NULL || (p = parse_index(p, cols)) == NULL) return 0;
+    if (coordinate) {
+        if ((p = parse_index(p, &entries)) == NULL) return 0;
+    } else {
+        entries = symmetric ? *rows * (*rows + 1) / 2 - (skew ? *rows : 0) : *rows * *cols;
+    }
+    if ((p = end_of_line(p)) == NULL) return 0;
+    if (symmetric && *rows != *cols) return 0;
+    
+    size_t i = 0, j = 0;
+    for (size_t k = 0; k < entries; k++) {
+        double value = 1;
+        p = skip_comments(p, "%");
+        if (coordinate) {
+            if ((p = parse_index(p, &i)) == NULL || (p = parse_index(p, &j)) == NULL) return 0;
+            if (i < 1 || i > *rows || j < 1 || j > *cols) return 0;
+            i--;
+            j--;
+        } else if (k > 0 && ++i == *rows) {
+            // Column-major, only the lower triangle when symmetric
+            j++;
+            i = symmetric ? j + skew : 0;
+        } else if (k == 0) {
+            i = skew;
+        }
+        if (!pattern && (p = parse_number(p, &value)) == NULL) return 0;
+        if ((p = end_of_line(p)) == NULL) return 0;
+        if (symmetric && (j > i || (skew && i == j))) return 0;
+    
+        if (value == 0) continue;
+        if (!triplet_push(list, i, j, value) ||
+            (symmetric && i != j && !triplet_push(list, j, i, skew ? -value : value))) {
+            *error = CALC_ERROR_MEMORY;
+            return 0;
+        }
+    }
+    return *skip_comments(p, "%") == '\0';
+}
+
+// 1-based "row col value" lines; the size is given by the largest indices
+int read_triplets(const char *p, TripletList *list, size_t *rows, size_t *cols, CalcError *error) {
+    *rows = *cols = 0;
+    while (*(p = skip_comments(p, "%#")) != '\0') {
+        size_t i, j;
+        double value;
+        if ((p = parse_index(p, &i)) == NULL || (p = parse_index(p, &j)) == NULL ||
+            (p = parse_number(p, &value)) == NULL || (p = end_of_line(p)) == NULL) {
+            return 0;
+        }
+        if (i < 1 || j < 1) return 0;
+        if (i > *rows) *rows = i;
+        if (j > *cols) *cols = j;
+        if (!triplet_push(list, i - 1, j - 1, value)) {
+            *error = CALC_ERROR_MEMORY;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Read a Matrix Market file (real, integer or pattern; general, symmetric
+// or skew-symmetric; coordinate or array) or a plain triplet file
+SparseMatrix* sparse_load(const char *path, CalcError *error) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        *error = CALC_ERROR_IO;
+        return NULL;
+    }
+    char *text = NULL;
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+        text = malloc((size_t)size + 1);
+    }
+    if (text == NULL || fread(text, 1, (size_t)size, file) != (size_t)size) {
+        *error = text == NULL && size >= 0 ? CALC_ERROR_MEMORY : CALC_ERROR_IO;
+        free(text);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    text[size] = '\0';
+    
+    TripletList list = {0, 0, NULL, NULL, NULL};
+    size_t rows, cols;
+    int ok;
+    if (strncmp(text, "%%MatrixMarket", 14) == 0) {
+        ok = read_matrix_market(text + 14, &list, &rows, &cols, error);
+    } else {
+        ok = read_triplets(text, &list, &rows, &cols, error);
+    }
+    free(text);
+    
+    SparseMatrix *m = NULL;
+    if (ok) {
+        m = sparse_from_triplets(rows, cols, list.count, list.row, list.col, list.values, error);
+    } else if (*error == CALC_OK) {
+        *error = CALC_ERROR_DATA;
+    }
+    free(list.row);
+    free(list.col);
+    free(list.values);
+    return m;
+}
+
+double dot_product(const double *x, const double *y, size_t n) {
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) sum += x[i] * y[i];
+    return sum;
+}
+
+// One block of rows of y = A x, with the partial dot product u . y
+typedef struct {
+    const SparseMatrix *a;
+    const double *x;
+    double *y;
+    const double *u;
+    double *dots;
+} SparseJob;
+
+void sparse_task(void *arg, size_t index, int worker) {
+    SparseJob *job = arg;
+    const SparseMatrix *a = job->a;
+    const size_t *row_start = a->row_start;
+    const int *col = a->col;
+    const double *values = a->values, *x = job->x, *u = job->u;
+    double *y = job->y, dot = 0;
+    size_t start = a->task_start[index], end = a->task_start[index + 1];
+    for (size_t r = start; r < end; r++) {
+        double sum = 0;
+        for (size_t k = row_start[r]; k < row_start[r + 1]; k++) {
+            sum += values[k] * x[col[k]];
+        }
+        y[r] = sum;
+    }
+    if (u != NULL) dot = dot_product(u + start, y + start, end - start);
+    job->dots[index] = dot;
+}
+
+// y = A x on the calculator's thread pool. Returns u . y when u is given
+// (summed over the blocks in order, so the result is reproducible).
+double sparse_multiply(Calculator *calc, const SparseMatrix *a, const double *x, double *y, const double *u) {
+    double local, *dots = a->tasks > 1 ? malloc(a->tasks * sizeof(double)) : &local;
+    SparseJob job = {a, x, y, u, dots};
+    if (dots == NULL) {
+        // Out of memory for the partial sums: run as one block
+        SparseMatrix whole = *a;
+        size_t bounds[2] = {0, a->rows};
+        whole.tasks = 1;
+        whole.task_start = bounds;
+        job.a = &whole;
+        job.dots = &local;
+        sparse_task(&job, 0, 0);
+        return local;
+    }
+    if (a->tasks > 1) {
+        threadpool_run(calculator_pool(calc), sparse_task, &job, a->tasks);
+    } else {
+        sparse_task(&job, 0, 0);
+    }
+    double dot = 0;
+    for (size_t t = 0; t < a->tasks; t++) dot += dots[t];
+    if (dots != &local) free(dots);
+    return dot;
+}
+
+// Inverse of the diagonal for Jacobi preconditioning; zero diagonal
+// entries are treated as 1
+double* sparse_jacobi(const SparseMatrix *a) {
+    double *inverse = malloc((a->rows > 0 ? a->rows : 1) * sizeof(double));
+    if (inverse == NULL) return NULL;
+    for (size_t r = 0; r < a->rows; r++) {
+        size_t lo = a->row_start[r], hi = a->row_start[r + 1];
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if ((size_t)a->col[mid] < r) lo = mid + 1;
+            else hi = mid;
+        }
+        int found = lo < a->row_start[r + 1] && (size_t)a->col[lo] == r;
+        inverse[r] = found ? 1 / a->values[lo] : 1;
+    }
+    return inverse;
+}
+
+// Negate, scale or add sparse matrices, or multiply one by a real vector
+Value sparse_binary(Calculator *calc, char op, Value a, Value b, CalcError *error) {
+    if (op == '*' && a.type == CALC_SPARSE && b.type == CALC_VECTOR) {
+        SparseMatrix *m = a.sparse;
+        if (b.vector->im != NULL) {
+            *error = CALC_ERROR_COMPLEX_OP;
+            return value_real(0);
+        }
+        if (b.vector->length != m->cols) {
+            *error = CALC_ERROR_MATRIX_DIM;
+            return value_real(0);
+        }
+        Vector *y = vector_new(m->rows, 0);
+        if (y == NULL) {
+            *error = CALC_ERROR_MEMORY;
+            return value_real(0);
+        }
+        sparse_multiply(calc, m, b.vector->re, y->re, NULL);
+        return value_vector(y);
+    }
+    
+    // Scaling: A * s, s * A, A / s and 0 - A (negation)
+    double scale = 0;
+    SparseMatrix *m = NULL;
+    if (op == '*' && a.type == CALC_SPARSE && b.type == CALC_REAL) {
+        m = a.sparse;
+        scale = b.real;
+    } else if (op == '*' && a.type == CALC_REAL && b.type == CALC_SPARSE) {
+        m = b.sparse;
+        scale = a.real;
+    } else if (op == '/' && a.type == CALC_SPARSE && b.type == CALC_REAL) {
+        if (b.real == 0) {
+            *error = CALC_ERROR_DIV_ZERO;
+            return value_real(0);
+        }
+        m = a.sparse;
+        scale = 1 / b.real;
+    } else if (op == '-' && a.type == CALC_REAL && a.real == 0 && b.type == CALC_SPARSE) {
+        m = b.sparse;
+        scale = -1;
+    }
+    if (m != NULL) {
+        SparseMatrix *out = sparse_new(m->rows, m->cols, m->row_start[m->rows]);
+        if (out == NULL) {
+            *error = CALC_ERROR_MEMORY;
+            return value_real(0);
+        }
+        size_t n = 0;
+        for (size_t r = 0; r < m->rows; r++) {
+            for (size_t k = m->row_start[r]; k < m->row_start[r + 1]; k++) {
+                double v = m->values[k] * scale;
+                if (v != 0) {
+                    out->col[n] = m->col[k];
+                    out->values[n++] = v;
+                }
+            }
+            out->row_start[r + 1] = n;
+        }
+        out = sparse_partition(out, error);
+        return out ? value_sparse(out) : value_real(0);
+    }
+    
+    if ((op != '+' && op != '-') || a.type != CALC_SPARSE || b.type != CALC_SPARSE) {
+        *error = CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    SparseMatrix *x = a.sparse, *y = b.sparse;
+    if (x->rows != y->rows || x->cols != y->cols) {
+        *error = CALC_ERROR_MATRIX_DIM;
+        return value_real(0);
+    }
+    SparseMatrix *out = sparse_new(x->rows, x->cols, x->row_start[x->rows] + y->row_start[y->rows]);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    double sign = op == '+' ? 1 : -1;
+    size_t n = 0;
+    for (size_t r = 0; r < x->rows; r++) {
+        // Merge the two sorted rows, dropping cancelled entries
+        size_t i = x->row_start[r], j = y->row_start[r];
+        while (i < x->row_start[r + 1] || j < y->row_start[r + 1]) {
+            int ci = i < x->row_start[r + 1] ? x->col[i] : INT_MAX;
+            int cj = j < y->row_start[r + 1] ? y->col[j] : INT_MAX;
+            int c = ci < cj ? ci : cj;
+            double v = 0;
+            if (ci == c) v += x->values[i++];
+            if (cj == c) v += sign * y->values[j++];
+            if (v != 0) {
+                out->col[n] = c;
+                out->values[n++] = v;
+            }
+        }
+        out->row_start[r + 1] = n;
+    }
+    out = sparse_partition(out, error);
+    return out ? value_sparse(out) : value_real(0);
+}
+
+// Read a real vector of 1-based indices no larger than INT_MAX
+Vector* index_vector(Value v, CalcError *error) {
+    Vector *vec = value_to_vector(v, error);
+    if (vec == NULL) return NULL;
+    for (size_t k = 0; k < vec->length && *error == CALC_OK; k++) {
+        double x = vec->re[k];
+        if (vec->im != NULL && vec->im[k] != 0) *error = CALC_ERROR_COMPLEX_OP;
+        else if (x < 1 || x > INT_MAX || x != floor(x)) *error = CALC_ERROR_ARG_RANGE;
+    }
+    if (*error != CALC_OK) {
+        vector_release(vec);
+        return NULL;
+    }
+    return vec;
+}
+
+// Triplets from index and value vectors (a length-1 vector repeats) and
+// the optional size arguments m, n
+SparseMatrix* sparse_from_vectors(const Vector *i, const Vector *j, const Vector *v, Value args[], int count, CalcError *error) {
+    size_t n = i->length > j->length ? i->length : j->length;
+    if (v->length > n) n = v->length;
+    if (v->im != NULL) {
+        *error = CALC_ERROR_COMPLEX_OP;
+        return NULL;
+    }
+    if ((i->length != n && i->length != 1) || (j->length != n && j->length != 1) ||
+        (v->length != n && v->length != 1)) {
+        *error = CALC_ERROR_MATRIX_DIM;
+        return NULL;
+    }
+    for (int k = 3; k < count; k++) {
+        if (args[k].type != CALC_REAL || args[k].real < 0 || args[k].real > INT_MAX ||
+            args[k].real != floor(args[k].real)) {
+            *error = CALC_ERROR_ARG_RANGE;
+            return NULL;
+        }
+    }
+    
+    int *row = malloc((n > 0 ? n : 1) * sizeof(int));
+    int *col = malloc((n > 0 ? n : 1) * sizeof(int));
+    double *values = malloc((n > 0 ? n : 1) * sizeof(double));
+    SparseMatrix *m = NULL;
+    if (row == NULL || col == NULL || values == NULL) {
+        *error = CALC_ERROR_MEMORY;
+    } else {
+        size_t rows = 0, cols = 0;
+        for (size_t k = 0; k < n; k++) {
+            row[k] = (int)i->re[i->length == 1 ? 0 : k] - 1;
+            col[k] = (int)j->re[j->length == 1 ? 0 : k] - 1;
+            values[k] = v->re[v->length == 1 ? 0 : k];
+            if ((size_t)row[k] >= rows) rows = (size_t)row[k] + 1;
+            if ((size_t)col[k] >= cols) cols = (size_t)col[k] + 1;
+        }
+        if (count == 5) {
+            rows = (size_t)args[3].real;
+            cols = (size_t)args[4].real;
+        }
+        m = sparse_from_triplets(rows, cols, n, row, col, values, error);
+    }
+    free(row);
+    free(col);
+    free(values);
+    return m;
+}
+
+// sparse(i, j, v [, m, n]): entries v at 1-based rows i and columns j,
+// summing repeats. Any of i, j and v may be a single number; the size
+// defaults to the largest indices.
+Value func_sparse(Calculator *calc, Value args[], int count, CalcError *error) {
+    if (count != 3 && count != 5) {
+        *error = CALC_ERROR_ARG_COUNT;
+        return value_real(0);
+    }
+    Vector *i = index_vector(args[0], error);
+    Vector *j = i ? index_vector(args[1], error) : NULL;
+    Vector *v = j ? value_to_vector(args[2], error) : NULL;
+    SparseMatrix *m = v ? sparse_from_vectors(i, j, v, args, count, error) : NULL;
+    vector_release(i);
+    vector_release(j);
+    vector_release(v);
+    return m ? value_sparse(m) : value_real(0);
+}
+
+// speye(n): the n x n identity
+Value func_speye(Calculator *calc, Value args[], int count, CalcError *error) {
+    if (args[0].type != CALC_REAL || args[0].real < 0 || args[0].real > INT_MAX ||
+        args[0].real != floor(args[0].real)) {
+        *error = args[0].type == CALC_REAL ? CALC_ERROR_ARG_RANGE : CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    size_t n = (size_t)args[0].real;
+    SparseMatrix *m = sparse_new(n, n, n);
+    if (m == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    for (size_t k = 0; k < n; k++) {
+        m->row_start[k + 1] = k + 1;
+        m->col[k] = (int)k;
+        m->values[k] = 1;
+    }
+    m = sparse_partition(m, error);
+    return m ? value_sparse(m) : value_real(0);
+}
+
+// nnz(A): stored entries of a sparse matrix, or nonzero elements of a
+// vector or number
+Value func_nnz(Calculator *calc, Value args[], int count, CalcError *error) {
+    if (args[0].type == CALC_SPARSE) {
+        return value_real((double)args[0].sparse->row_start[args[0].sparse->rows]);
+    }
+    Vector *v = value_to_vector(args[0], error);
+    if (v == NULL) return value_real(0);
+    size_t n = 0;
+    for (size_t k = 0; k < v->length; k++) {
+        n += v->re[k] != 0 || (v->im != NULL && v->im[k] != 0);
+    }
+    vector_release(v);
+    return value_real((double)n);
+}
+
+// Preconditioned conjugate gradients from x = 0; work holds 4n doubles.
+// Returns 0 if |b - A x| did not drop to limit.
+int cg_solve(Calculator *calc, const SparseMatrix *a, const double *b, double *x, const double *inverse, double *work, double limit, size_t iterations) {
+    size_t n = a->rows;
+    double *r = work, *z = work + n, *p = work + 2 * n, *q = work + 3 * n;
+    memcpy(r, b, n * sizeof(double));
+    for (size_t k = 0; k < n; k++) p[k] = z[k] = inverse[k] * r[k];
+    double rz = dot_product(r, z, n);
+    if (limit == 0) return 1;
+    
+    for (size_t iteration = 0; iteration < iterations; iteration++) {
+        double pq = sparse_multiply(calc, a, p, q, p);
+        if (!(pq > 0) || !isfinite(pq)) return 0;  // A is not positive definite
+        double alpha = rz / pq, rr = 0;
+        for (size_t k = 0; k < n; k++) {
+            x[k] += alpha * p[k];
+            r[k] -= alpha * q[k];
+            rr += r[k] * r[k];
+        }
+        if (sqrt(rr) <= limit) return 1;
+        
+        double rz_next = 0;
+        for (size_t k = 0; k < n; k++) {
+            z[k] = inverse[k] * r[k];
+            rz_next += r[k] * z[k];
+        }
+        double beta = rz_next / rz;
+        for (size_t k = 0; k < n; k++) p[k] = z[k] + beta * p[k];
+        rz = rz_next;
+    }
+    return 0;
+}
+
+// BiCGSTAB with right preconditioning from x = 0; work holds 7n doubles.
+// Returns 0 on breakdown or if |b - A x| did not drop to limit.
+int bicgstab_solve(Calculator *calc, const SparseMatrix *a, const double *b, double *x, const double *inverse, double *work, double limit, size_t iterations) {
+    size_t n = a->rows;
+    double *r = work, *r0 = work + n, *p = work + 2 * n, *v = work + 3 * n;
+    double *s = work + 4 * n, *t = work + 5 * n, *y = work + 6 * n;
+    memcpy(r, b, n * sizeof(double));
+    memcpy(r0, b, n * sizeof(double));
+    memset(p, 0, n * sizeof(double));
+    memset(v, 0, n * sizeof(double));
+    double rho = 1, alpha = 1, omega = 1;
+    if (limit == 0) return 1;
+    
+    for (size_t iteration = 0; iteration < iterations; iteration++) {
+        double rho_next = dot_product(r0, r, n);
+        if (rho_next == 0 || !isfinite(rho_next)) return 0;
+        double beta = rho_next / rho * (alpha / omega);
+        for (size_t k = 0; k < n; k++) {
+            p[k] = r[k] + beta * (p[k] - omega * v[k]);
+            y[k] = inverse[k] * p[k];
+        }
+        double r0v = sparse_multiply(calc, a, y, v, r0);
+        if (r0v == 0 || !isfinite(r0v)) return 0;
+        alpha = rho_next / r0v;
+        double ss = 0;
+        for (size_t k = 0; k < n; k++) {
+            x[k] += alpha * y[k];
+            s[k] = r[k] - alpha * v[k];
+            ss += s[k] * s[k];
+        }
+        if (sqrt(ss) <= limit) return 1;
+        
+        for (size_t k = 0; k < n; k++) y[k] = inverse[k] * s[k];
+        double st = sparse_multiply(calc, a, y, t, s);
+        double tt = dot_product(t, t, n);
+        if (tt == 0 || !isfinite(tt)) return 0;
+        omega = st / tt;
+        double rr = 0;
+        for (size_t k = 0; k < n; k++) {
+            x[k] += omega * y[k];
+            r[k] = s[k] - omega * t[k];
+            rr += r[k] * r[k];
+        }
+        if (sqrt(rr) <= limit) return 1;
+        if (omega == 0) return 0;
+        rho = rho_next;
+    }
+    return 0;
+}
+
+// Solve A x = b for the arguments (A, b [, tol [, maxit]]), stopping when
+// |b - A x| <= tol |b| (default 1e-10, at most 10000 iterations). solve
+// needs work_vectors scratch vectors of length n.
+Value sparse_solve(Calculator *calc, Value args[], int count, SparseSolver solve, size_t work_vectors, CalcError *error) {
+    double tolerance = SPARSE_TOLERANCE;
+    size_t iterations = SPARSE_ITERATIONS;
+    if (args[0].type != CALC_SPARSE) {
+        *error = CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    if (count > 2) {
+        if (args[2].type != CALC_REAL || !(args[2].real > 0 && args[2].real < 1)) {
+            *error = CALC_ERROR_ARG_RANGE;
+            return value_real(0);
+        }
+        tolerance = args[2].real;
+    }
+    if (count > 3) {
+        if (args[3].type != CALC_REAL || args[3].real < 1 || args[3].real > 1e12 ||
+            args[3].real != floor(args[3].real)) {
+            *error = CALC_ERROR_ARG_RANGE;
+            return value_real(0);
+        }
+        iterations = (size_t)args[3].real;
+    }
+    const SparseMatrix *a = args[0].sparse;
+    Vector *b = value_to_vector(args[1], error);
+    if (b == NULL) return value_real(0);
+    if (b->im != NULL || a->rows != a->cols || b->length != a->rows) {
+        *error = b->im != NULL ? CALC_ERROR_COMPLEX_OP : CALC_ERROR_MATRIX_DIM;
+        vector_release(b);
+        return value_real(0);
+    }
+    
+    size_t n = a->rows;
+    Vector *x = vector_new(n, 0);
+    double *work = malloc((work_vectors * n + 1) * sizeof(double));
+    double *inverse = sparse_jacobi(a);
+    if (x == NULL || work == NULL || inverse == NULL) {
+        *error = CALC_ERROR_MEMORY;
+    } else {
+        memset(x->re, 0, n * sizeof(double));
+        double limit = tolerance * sqrt(dot_product(b->re, b->re, n));
+        if (!solve(calc, a, b->re, x->re, inverse, work, limit, iterations)) {
+            *error = CALC_ERROR_CONVERGENCE;
+        }
+    }
+    vector_release(b);
+    free(work);
+    free(inverse);
+    if (*error != CALC_OK) {
+        vector_release(x);
+        return value_real(0);
+    }
+    return value_vector(x);
+}
+
+// cg(A, b [, tol [, maxit]]): conjugate gradients with Jacobi
+// preconditioning, for symmetric positive definite A
+Value func_cg(Calculator *calc, Value args[], int count, CalcError *error) {
+    return sparse_solve(calc, args, count, cg_solve, 4, error);
+}
+
+// bicgstab(A, b [, tol [, maxit]]): BiCGSTAB with Jacobi preconditioning,
+// for general square A
+Value func_bicgstab(Calculator *calc, Value args[], int count, CalcError *error) {
+    return sparse_solve(calc, args, count, bicgstab_solve, 7, error);
+}
+
+// Dense matrices, stored row-major in one 64-byte aligned block. Products
+// run on 4x8 tiles of the result held in registers, over blocks of the
+// inner dimension that stay in L1, with row blocks spread over the thread
+// pool. The eigenvalue and singular value solvers keep every inner loop
+// on contiguous rows and transform blocks of vectors together.
+#define MATRIX_EPSILON 0x1p-52
+#define MATRIX_EPSILON_SQRT 0x1p-26
+#define MATRIX_BLOCK_K 256
+#define MATRIX_TASK_ROWS 64
+#define EIGEN_BLOCK 32
+#define QL_BATCH 16384
+#define EIGEN_ITERATIONS 60
+#define SVD_SWEEPS 60
+#define SVD_BLOCK 32
+#define SQRTM_ITERATIONS 50
+#define LOGM_THETA 0.25
+#define LOGM_ROOTS 64
+
+DenseMatrix* dense_new(size_t rows, size_t cols) {
+    if (cols > 0 && rows > SIZE_MAX / 8 / cols) return NULL;
+    DenseMatrix *m = malloc(sizeof(DenseMatrix));
+    if (m == NULL) return NULL;
+    
+    size_t bytes = (rows * cols * sizeof(double) + 63) & ~(size_t)63;
+    m->refcount = 1;
+    m->rows = rows;
+    m->cols = cols;
+    m->data = aligned_alloc(64, bytes > 0 ? bytes : 64);
+    if (m->data == NULL) {
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+// Drop a reference to a dense matrix, freeing it with the last one
+void dense_release(DenseMatrix *m) {
+    if (m == NULL) return;
+    if (__atomic_sub_fetch(&m->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(m->data);
+        free(m);
+    }
+}
+
+// Wrap a dense matrix in a value (the value takes over the reference)
+Value value_matrix(DenseMatrix *m) {
+    Value v;
+    v.type = CALC_MATRIX;
+    v.matrix = m;
+    return v;
+}
+
+// [[a, b], [c, d]]: rows given as real vectors of equal length
+Value make_matrix(Value rows[], int count, CalcError *error) {
+    size_t cols = rows[0].vector->length;
+    for (int i = 0; i < count; i++) {
+        if (rows[i].type != CALC_VECTOR) {
+            *error = CALC_ERROR_TYPE;
+            return value_real(0);
+        }
+        if (rows[i].vector->im != NULL) {
+            *error = CALC_ERROR_COMPLEX_OP;
+            return value_real(0);
+        }
+        if (rows[i].vector->length != cols) {
+            *error = CALC_ERROR_MATRIX_DIM;
+            return value_real(0);
+        }
+    }
+    DenseMatrix *m = dense_new(count, cols);
+    if (m == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    for (int i = 0; i < count; i++) {
+        memcpy(m->data + i * cols, rows[i].vector->re, cols * sizeof(double));
+    }
+    return value_matrix(m);
+}
+
+// Print a matrix as [[1, 2], [3, 4]]; large matrices are elided in the
+// middle of each row and of the column
+void fprint_matrix(FILE *out, Calculator *calc, const DenseMatrix *m) {
+    fprintf(out, "[");
+    for (size_t i = 0; i < m->rows; i++) {
+        if (m->rows > 16 && i == 8) {
+            fprintf(out, ", ...");
+            i = m->rows - 4;
+        }
+        fprintf(out, i > 0 ? ", [" : "[");
+        for (size_t j = 0; j < m->cols; j++) {
+            if (m->cols > 16 && j == 8) {
+                fprintf(out, ", ...");
+                j = m->cols - 4;
+            }
+            if (j > 0) fprintf(out, ", ");
+            fprintf(out, "%.*g", calc->precision, m->data[i * m->cols + j]);
+        }
+        fprintf(out, "]");
+    }
+    fprintf(out, "]");
+    if (m->rows > 16 || m->cols > 16) {
+        fprintf(out, " (%zux%zu)", m->rows, m->cols);
+    }
+}
+
+// c += a b for a rows x inner block of A and the inner x cols matrix B
+// (row-major, with row strides inner and cols)
+BATCH_CLONES void matrix_multiply_rows(const double *a, const double *b, double *c, size_t rows, size_t inner, size_t cols) {
+    for (size_t k0 = 0; k0 < inner; k0 += MATRIX_BLOCK_K) {
+        size_t k1 = inner - k0 > MATRIX_BLOCK_K ? k0 + MATRIX_BLOCK_K : inner;
+        size_t i = 0;
+        for (; i + 4 <= rows; i += 4) {
+            const double *a0 = a + i * inner, *a1 = a0 + inner, *a2 = a1 + inner, *a3 = a2 + inner;
+            double *c0 = c + i * cols, *c1 = c0 + cols, *c2 = c1 + cols, *c3 = c2 + cols;
+            size_t j = 0;
+            for (; j + 8 <= cols; j += 8) {
+                v4df s00 = V4_LOAD(c0 + j), s01 = V4_LOAD(c0 + j + 4);
+                v4df s10 = V4_LOAD(c1 + j), s11 = V4_LOAD(c1 + j + 4);
+                v4df s20 = V4_LOAD(c2 + j), s21 = V4_LOAD(c2 + j + 4);
+                v4df s30 = V4_LOAD(c3 + j), s31 = V4_LOAD(c3 + j + 4);
+                for (size_t k = k0; k < k1; k++) {
+                    v4df x = V4_LOAD(b + k * cols + j), y = V4_LOAD(b + k * cols + j + 4);
+                    v4df w0 = {a0[k], a0[k], a0[k], a0[k]}, w1 = {a1[k], a1[k], a1[k], a1[k]};
+                    v4df w2 = {a2[k], a2[k], a2[k], a2[k]}, w3 = {a3[k], a3[k], a3[k], a3[k]};
+                    s00 += w0 * x;
+                    s01 += w0 * y;
+                    s10 += w1 * x;
+                    s11 += w1 * y;
+                    s20 += w2 * x;
+                    s21 += w2 * y;
+                    s30 += w3 * x;
+                    s31 += w3 * y;
+                }
+                V4_STORE(c0 + j, s00);
+                V4_STORE(c0 + j + 4, s01);
+                V4_STORE(c1 + j, s10);
+                V4_STORE(c1 + j + 4, s11);
+                V4_STORE(c2 + j, s20);
+                V4_STORE(c2 + j + 4, s21);
+                V4_STORE(c3 + j, s30);
+                V4_STORE(c3 + j + 4, s31);
+            }
+            for (; j < cols; j++) {
+                double s0 = c0[j], s1 = c1[j], s2 = c2[j], s3 = c3[j];
+                for (size_t k = k0; k < k1; k++) {
+                    double x = b[k * cols + j];
+                    s0 += a0[k] * x;
+                    s1 += a1[k] * x;
+                    s2 += a2[k] * x;
+                    s3 += a3[k] * x;
+                }
+                c0[j] = s0;
+                c1[j] = s1;
+                c2[j] = s2;
+                c3[j] = s3;
+            }
+        }
+        for (; i < rows; i++) {
+            for (size_t k = k0; k < k1; k++) {
+                double x = a[i * inner + k];
+                for (size_t j = 0; j < cols; j++) c[i * cols + j] += x * b[k * cols + j];
+            }
+        }
+    }
+}
+
+// One block of MATRIX_TASK_ROWS rows of a product for the thread pool
+typedef struct {
+    const double *a;
+    const double *b;
+    double *c;
+    size_t rows;
+    size_t inner;
+    size_t cols;
+} MatrixJob;
+
+void matrix_multiply_task(void *arg, size_t index, int worker) {
+    MatrixJob *job = arg;
+    size_t start = index * MATRIX_TASK_ROWS;
+    size_t rows = job->rows - start < MATRIX_TASK_ROWS ? job->rows - start : MATRIX_TASK_ROWS;
+    matrix_multiply_rows(job->a + start * job->inner, job->b, job->c + start * job->cols,
+                         rows, job->inner, job->cols);
+}
+
+// c += a b for row-major a (rows x inner) and b (inner x cols); c must
+// not overlap the operands
+void matrix_multiply_add(Calculator *calc, const double *a, const double *b, double *c, size_t rows, size_t inner, size_t cols) {
+    MatrixJob job = {a, b, c, rows, inner, cols};
+    size_t tasks = (rows + MATRIX_TASK_ROWS - 1) / MATRIX_TASK_ROWS;
+    if (tasks > 1 && (double)rows * inner * cols >= 1 << 21) {
+        threadpool_run(calculator_pool(calc), matrix_multiply_task, &job, tasks);
+    } else {
+        matrix_multiply_rows(a, b, c, rows, inner, cols);
+    }
+}
+
+// c = a b, as matrix_multiply_add
+void matrix_multiply(Calculator *calc, const double *a, const double *b, double *c, size_t rows, size_t inner, size_t cols) {
+    memset(c, 0, rows * cols * sizeof(double));
+    matrix_multiply_add(calc, a, b, c, rows, inner, cols);
+}
+
+// Sums, differences and products of matrices, products with a vector
+// (taken as a column), whole powers and element-wise arithmetic with a
+// number
+Value matrix_binary(Calculator *calc, char op, Value a, Value b, CalcError *error) {
+    if (a.type == CALC_MATRIX && b.type == CALC_REAL && op == '^') {
+        return matrix_pow(calc, a, b.real, error);
+    }
+    if (a.type == CALC_MATRIX && (b.type == CALC_MATRIX || b.type == CALC_VECTOR) && op == '*') {
+        const DenseMatrix *x = a.matrix;
+        size_t cols = b.type == CALC_MATRIX ? b.matrix->cols : 1;
+        size_t inner = b.type == CALC_MATRIX ? b.matrix->rows : b.vector->length;
+        if (b.type == CALC_VECTOR && b.vector->im != NULL) {
+            *error = CALC_ERROR_COMPLEX_OP;
+            return value_real(0);
+        }
+        if (inner != x->cols) {
+            *error = CALC_ERROR_MATRIX_DIM;
+            return value_real(0);
+        }
+        if (b.type == CALC_VECTOR) {
+            Vector *y = vector_new(x->rows, 0);
+            if (y == NULL) {
+                *error = CALC_ERROR_MEMORY;
+                return value_real(0);
+            }
+            matrix_multiply(calc, x->data, b.vector->re, y->re, x->rows, inner, 1);
+            return value_vector(y);
+        }
+        DenseMatrix *out = dense_new(x->rows, cols);
+        if (out == NULL) {
+            *error = CALC_ERROR_MEMORY;
+            return value_real(0);
+        }
+        matrix_multiply(calc, x->data, b.matrix->data, out->data, x->rows, inner, cols);
+        return value_matrix(out);
+    }
+    
+    // Element-wise: matrix with matrix (+ and -) or with a real number
+    int scalar_a = a.type == CALC_REAL, scalar_b = b.type == CALC_REAL;
+    if ((a.type != CALC_MATRIX && !scalar_a) || (b.type != CALC_MATRIX && !scalar_b) ||
+        (!scalar_a && !scalar_b && op != '+' && op != '-') ||
+        (op != '+' && op != '-' && op != '*' && op != '/') || (op == '/' && scalar_b == 0)) {
+        *error = CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    const DenseMatrix *shape = scalar_a ? b.matrix : a.matrix;
+    if (!scalar_a && !scalar_b && (a.matrix->rows != b.matrix->rows || a.matrix->cols != b.matrix->cols)) {
+        *error = CALC_ERROR_MATRIX_DIM;
+        return value_real(0);
+    }
+    DenseMatrix *out = dense_new(shape->rows, shape->cols);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    size_t n = shape->rows * shape->cols;
+    for (size_t k = 0; k < n; k++) {
+        double x = scalar_a ? a.real : a.matrix->data[k];
+        double y = scalar_b ? b.real : b.matrix->data[k];
+        switch (op) {
+            case '+': out->data[k] = x + y; break;
+            case '-': out->data[k] = x - y; break;
+            case '*': out->data[k] = x * y; break;
+            default: out->data[k] = x / y; break;
+        }
+    }
+    return value_matrix(out);
+}
+
+// A matrix argument, or a number taken as a 1x1 matrix (a new reference)
+DenseMatrix* matrix_arg(Value v, CalcError *error) {
+    if (v.type == CALC_MATRIX) {
+        __atomic_add_fetch(&v.matrix->refcount, 1, __ATOMIC_RELAXED);
+        return v.matrix;
+    }
+    if (v.type != CALC_REAL) {
+        *error = v.type == CALC_COMPLEX ? CALC_ERROR_COMPLEX_OP : CALC_ERROR_TYPE;
+        return NULL;
+    }
+    DenseMatrix *m = dense_new(1, 1);
+    if (m == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    m->data[0] = v.real;
+    return m;
+}
+
+// A square matrix argument, copied so it can be overwritten
+double* square_matrix_copy(Value v, size_t *n, CalcError *error) {
+    DenseMatrix *m = matrix_arg(v, error);
+    if (m == NULL) return NULL;
+    double *copy = NULL;
+    if (m->rows != m->cols) {
+        *error = CALC_ERROR_MATRIX_DIM;
+    } else if ((copy = malloc((m->rows * m->cols > 0 ? m->rows * m->cols : 1) * sizeof(double))) == NULL) {
+        *error = CALC_ERROR_MEMORY;
+    } else {
+        memcpy(copy, m->data, m->rows * m->cols * sizeof(double));
+        *n = m->rows;
+    }
+    dense_release(m);
+    return copy;
+}
+
+// LU factorization with partial pivoting of a (n x n, overwritten by the
+// unit lower factor below the diagonal and the upper factor), recording
+// in pivots (if given) the row swapped with each row k. Returns the sign
+// of the permutation, or 0 for a singular matrix.
+int lu_factor(double *a, size_t n, size_t *pivots) {
+    int sign = 1;
+    for (size_t k = 0; k < n; k++) {
+        size_t pivot = k;
+        for (size_t i = k + 1; i < n; i++) {
+            if (fabs(a[i * n + k]) > fabs(a[pivot * n + k])) pivot = i;
+        }
+        if (a[pivot * n + k] == 0) return 0;
+        if (pivots != NULL) pivots[k] = pivot;
+        if (pivot != k) {
+            for (size_t j = 0; j < n; j++) {
+                double t = a[k * n + j];
+                a[k * n + j] = a[pivot * n + j];
+                a[pivot * n + j] = t;
+            }
+            sign = -sign;
+        }
+        double *row = a + k * n;
+        for (size_t i = k + 1; i < n; i++) {
+            double *target = a + i * n, f = target[k] / row[k];
+            target[k] = f;
+            for (size_t j = k + 1; j < n; j++) target[j] -= f * row[j];
+        }
+    }
+    return sign;
+}
+
+// Solve A X = B in place for the n x cols matrix b, given the factors of
+// A from lu_factor. Columns are taken MATRIX_BLOCK_K at a time so the
+// rows being combined stay in cache.
+void lu_solve(const double *lu, const size_t *pivots, size_t n, double *b, size_t cols) {
+    for (size_t k = 0; k < n; k++) {
+        if (pivots[k] == k) continue;
+        double *x = b + k * cols, *y = b + pivots[k] * cols;
+        for (size_t j = 0; j < cols; j++) {
+            double t = x[j];
+            x[j] = y[j];
+            y[j] = t;
+        }
+    }
+    for (size_t c0 = 0; c0 < cols; c0 += MATRIX_BLOCK_K) {
+        size_t width = cols - c0 < MATRIX_BLOCK_K ? cols - c0 : MATRIX_BLOCK_K;
+        for (size_t i = 1; i < n; i++) {
+            double *x = b + i * cols + c0;
+            for (size_t k = 0; k < i; k++) {
+                const double *y = b + k * cols + c0;
+                double f = lu[i * n + k];
+                if (f == 0) continue;
+                for (size_t j = 0; j < width; j++) x[j] -= f * y[j];
+            }
+        }
+        for (size_t i = n; i-- > 0;) {
+            double *x = b + i * cols + c0;
+            for (size_t k = i + 1; k < n; k++) {
+                const double *y = b + k * cols + c0;
+                double f = lu[i * n + k];
+                for (size_t j = 0; j < width; j++) x[j] -= f * y[j];
+            }
+            double d = lu[i * n + i];
+            for (size_t j = 0; j < width; j++) x[j] /= d;
+        }
+    }
+}
+
+// Determinant by LU decomposition with partial pivoting (a is overwritten)
+double lu_determinant(double *a, size_t n) {
+    double det = lu_factor(a, n, NULL);
+    for (size_t k = 0; det != 0 && k < n; k++) det *= a[k * n + k];
+    return det;
+}
+
+// det(A), or det(a, b, c, d) for the 2x2 matrix [[a, b], [c, d]]
+Value func_matrix_det(Calculator *calc, Value args[], int count, CalcError *error) {
+    if (count == 4) {
+        double m[4];
+        for (int i = 0; i < 4; i++) {
+            if (args[i].type != CALC_REAL) {
+                *error = CALC_ERROR_TYPE;
+                return value_real(0);
+            }
+            m[i] = args[i].real;
+        }
+        return value_real(func_det(m, 4));
+    }
+    if (count != 1) {
+        *error = CALC_ERROR_ARG_COUNT;
+        return value_real(0);
+    }
+    size_t n;
+    double *a = square_matrix_copy(args[0], &n, error);
+    if (a == NULL) return value_real(0);
+    double det = lu_determinant(a, n);
+    free(a);
+    return value_real(det);
+}
+
+// trace(A), or trace(a, b, c, d) for the 2x2 matrix [[a, b], [c, d]]
+Value func_matrix_trace(Calculator *calc, Value args[], int count, CalcError *error) {
+    if (count == 4) {
+        double m[4];
+        for (int i = 0; i < 4; i++) {
+            if (args[i].type != CALC_REAL) {
+                *error = CALC_ERROR_TYPE;
+                return value_real(0);
+            }
+            m[i] = args[i].real;
+        }
+        return value_real(func_trace(m, 4));
+    }
+    if (count != 1) {
+        *error = CALC_ERROR_ARG_COUNT;
+        return value_real(0);
+    }
+    DenseMatrix *m = matrix_arg(args[0], error);
+    if (m == NULL) return value_real(0);
+    double trace = 0;
+    if (m->rows != m->cols) {
+        *error = CALC_ERROR_MATRIX_DIM;
+    } else {
+        for (size_t i = 0; i < m->rows; i++) trace += m->data[i * m->cols + i];
+    }
+    dense_release(m);
+    return value_real(trace);
+}
+
+// matrix(v, m): the elements of v, row by row, as a matrix with m rows
+Value func_matrix(Calculator *calc, Value args[], int count, CalcError *error) {
+    Vector *v = value_to_vector(args[0], error);
+    if (v == NULL) return value_real(0);
+    DenseMatrix *m = NULL;
+    if (v->im != NULL) {
+        *error = CALC_ERROR_COMPLEX_OP;
+    } else if (args[1].type != CALC_REAL || args[1].real < 1 || args[1].real != floor(args[1].real) ||
+               args[1].real > v->length || v->length % (size_t)args[1].real != 0) {
+        *error = CALC_ERROR_ARG_RANGE;
+    } else if ((m = dense_new((size_t)args[1].real, v->length / (size_t)args[1].real)) == NULL) {
+        *error = CALC_ERROR_MEMORY;
+    } else {
+        memcpy(m->data, v->re, v->length * sizeof(double));
+    }
+    vector_release(v);
+    return m ? value_matrix(m) : value_real(0);
+}
+
+// eye(n): the n x n identity
+Value func_eye(Calculator *calc, Value args[], int count, CalcError *error) {
+    if (args[0].type != CALC_REAL || args[0].real < 1 || args[0].real > 1e5 ||
+        args[0].real != floor(args[0].real)) {
+        *error = args[0].type == CALC_REAL ? CALC_ERROR_ARG_RANGE : CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    size_t n = (size_t)args[0].real;
+    DenseMatrix *m = dense_new(n, n);
+    if (m == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    memset(m->data, 0, n * n * sizeof(double));
+    for (size_t i = 0; i < n; i++) m->data[i * n + i] = 1;
+    return value_matrix(m);
+}
+
+// Row-major transpose of a rows x cols block, by 32x32 tiles
+void transpose_into(const double *a, double *t, size_t rows, size_t cols) {
+    for (size_t i0 = 0; i0 < rows; i0 += 32) {
+        for (size_t j0 = 0; j0 < cols; j0 += 32) {
+            size_t i1 = rows - i0 > 32 ? i0 + 32 : rows, j1 = cols - j0 > 32 ? j0 + 32 : cols;
+            for (size_t i = i0; i < i1; i++) {
+                for (size_t j = j0; j < j1; j++) t[j * rows + i] = a[i * cols + j];
+            }
+        }
+    }
+}
+
+Value func_transpose(Calculator *calc, Value args[], int count, CalcError *error) {
+    DenseMatrix *m = matrix_arg(args[0], error);
+    if (m == NULL) return value_real(0);
+    DenseMatrix *t = dense_new(m->cols, m->rows);
+    if (t == NULL) {
+        *error = CALC_ERROR_MEMORY;
+    } else {
+        transpose_into(m->data, t->data, m->rows, m->cols);
+    }
+    dense_release(m);
+    return t ? value_matrix(t) : value_real(0);
+}
+
+// full(S): a sparse matrix as a dense one
+Value func_full(Calculator *calc, Value args[], int count, CalcError *error) {
+    if (args[0].type == CALC_MATRIX) return value_retain(args[0]);
+    if (args[0].type != CALC_SPARSE) {
+        *error = CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    const SparseMatrix *s = args[0].sparse;
+    DenseMatrix *m = dense_new(s->rows, s->cols);
+    if (m == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    memset(m->data, 0, s->rows * s->cols * sizeof(double));
+    for (size_t r = 0; r < s->rows; r++) {
+        for (size_t k = s->row_start[r]; k < s->row_start[r + 1]; k++) {
+            m->data[r * s->cols + s->col[k]] = s->values[k];
+        }
+    }
+    return value_matrix(m);
+}
+
+// Householder reflector H = I - tau v v^T with v[0] = 1 mapping x
+// (length n >= 1) to beta e1. v[1..] is written over x[1..]; returns tau.
+double householder(double *x, size_t n, double *beta) {
+    double scale = 0, sum = 0;
+    for (size_t i = 1; i < n; i++) scale = fmax(scale, fabs(x[i]));
+    if (scale == 0) {
+        *beta = x[0];
+        return 0;
+    }
+    for (size_t i = 1; i < n; i++) sum += (x[i] / scale) * (x[i] / scale);
+    double norm = scale * sqrt(sum);
+    *beta = -copysign(hypot(x[0], norm), x[0]);
+    double tau = (*beta - x[0]) / *beta, f = 1 / (x[0] - *beta);
+    for (size_t i = 1; i < n; i++) x[i] *= f;
+    return tau;
+}
+
+// Dot product with vector accumulators (a plain loop is kept in order as
+// one scalar sum)
+ALWAYS_INLINE double dense_dot(const double *x, const double *y, size_t n) {
+    v4df s0 = {0, 0, 0, 0}, s1 = s0;
+    size_t k = 0;
+    for (; k + 8 <= n; k += 8) {
+        s0 += V4_LOAD(x + k) * V4_LOAD(y + k);
+        s1 += V4_LOAD(x + k + 4) * V4_LOAD(y + k + 4);
+    }
+    for (; k + 4 <= n; k += 4) s0 += V4_LOAD(x + k) * V4_LOAD(y + k);
+    s0 += s1;
+    double sum = (s0[0] + s0[1]) + (s0[2] + s0[3]);
+    for (; k < n; k++) sum += x[k] * y[k];
+    return sum;
+}
+
+// Reduce the symmetric matrix held in the upper triangle of a (n x n,
+// row-major) to tridiagonal form Q^T A Q by Householder reflections. Each
+// step makes one pass over the trailing rows: their rank-2 update is
+// fused with the product A v that the next reflector needs. On return d
+// and e hold the diagonal and superdiagonal; row k holds reflector k in
+// columns k+2.. (with an implicit 1 at k+1) and tau[k] its factor. work
+// has room for 4n doubles.
+BATCH_CLONES void tridiagonalize(double *a, size_t n, double *d, double *e, double *tau, double *work) {
+    double *v = work, *p = work + n, *vn = work + 2 * n, *pn = work + 3 * n;
+    for (size_t k = 0; k + 2 < n; k++) tau[k] = 0;
+    if (n <= 2) {
+        for (size_t k = 0; k < n; k++) d[k] = a[k * n + k];
+        if (n == 2) e[0] = a[1];
+        return;
+    }
+    
+    // First reflector and its product, from the original matrix
+    double beta, t = householder(a + 1, n - 1, &beta);
+    v[1] = 1;
+    memcpy(v + 2, a + 2, (n - 2) * sizeof(double));
+    memset(p, 0, n * sizeof(double));
+    for (size_t i = 1; i < n; i++) {
+        const double *row = a + i * n;
+        double vi = v[i];
+        for (size_t j = i + 1; j < n; j++) p[j] += vi * row[j];
+        p[i] += row[i] * vi + dense_dot(row + i + 1, v + i + 1, n - i - 1);
+    }
+    
+    for (size_t k = 0; k + 2 < n; k++) {
+        d[k] = a[k * n + k];
+        e[k] = beta;
+        tau[k] = t;
+    
+        // w = tau p - (tau^2 / 2)(p . v) v; A22 -= v w^T + w v^T
+        double pv = dense_dot(p + k + 1, v + k + 1, n - k - 1);
+        double *w = p, half = t * t * pv / 2;
+        for (size_t j = k + 1; j < n; j++) w[j] = t * p[j] - half * v[j];
+    
+        double *row = a + (k + 1) * n;
+        for (size_t j = k + 1; j < n; j++) row[j] -= v[k + 1] * w[j] + w[k + 1] * v[j];
+        int next = k + 3 < n;
+        double next_beta = 0, next_tau = 0;
+        if (next) {
+            next_tau = householder(row + k + 2, n - k - 2, &next_beta);
+            vn[k + 2] = 1;
+            memcpy(vn + k + 3, row + k + 3, (n - k - 3) * sizeof(double));
+            memset(pn + k + 2, 0, (n - k - 2) * sizeof(double));
+        }
+        for (size_t i = k + 2; i < n; i++) {
+            row = a + i * n;
+            double vi = v[i], wi = w[i];
+            row[i] -= 2 * vi * wi;
+            size_t j = i + 1;
+            if (!next) {
+                for (; j < n; j++) row[j] -= vi * w[j] + wi * v[j];
+                continue;
+            }
+            double vni = vn[i];
+            v4df sum = {0, 0, 0, 0};
+            for (; j + 4 <= n; j += 4) {
+                v4df x = V4_LOAD(row + j) - vi * V4_LOAD(w + j) - wi * V4_LOAD(v + j);
+                V4_STORE(row + j, x);
+                sum += x * V4_LOAD(vn + j);
+                V4_STORE(pn + j, V4_LOAD(pn + j) + vni * x);
+            }
+            double s = row[i] * vni + (sum[0] + sum[1]) + (sum[2] + sum[3]);
+            for (; j < n; j++) {
+                double x = row[j] - vi * w[j] - wi * v[j];
+                row[j] = x;
+                s += x * vn[j];
+                pn[j] += vni * x;
+            }
+            pn[i] += s;
+        }
+    
+        double *swap = v;
+        v = vn;
+        vn = swap;
+        swap = p;
+        p = pn;
+        pn = swap;
+        beta = next_beta;
+        t = next_tau;
+    }
+    d[n - 2] = a[(n - 2) * n + n - 2];
+    e[n - 2] = a[(n - 2) * n + n - 1];
+    d[n - 1] = a[(n - 1) * n + n - 1];
+}
+
+// Multiply z (n x n, row-major) on the left by Q = H_0 H_1 ... H_{n-3},
+// where H_k = I - tau[k] v v^T and v is zero above row k+1, 1 at k+1 and
+// v[k n + k+2 ..] below. EIGEN_BLOCK reflectors at a time are applied
+// as I - V T V^T (the compact WY form), so the work is done by matrix
+// products. work has room for (4n + EIGEN_BLOCK) EIGEN_BLOCK doubles.
+void reflector_product(Calculator *calc, const double *v, const double *tau, size_t n, double *z, double *work) {
+    double *t = work, *vt = t + EIGEN_BLOCK * EIGEN_BLOCK;
+    double *vb = vt + EIGEN_BLOCK * n, *y = vb + EIGEN_BLOCK * n, *u = y + EIGEN_BLOCK * n;
+    for (size_t k1 = n >= 2 ? n - 2 : 0; k1 > 0; ) {
+        size_t k0 = k1 > EIGEN_BLOCK ? k1 - EIGEN_BLOCK : 0, b = k1 - k0, m = n - k0 - 1;
+    
+        // The block's vectors over rows k0+1.., as the rows of vt
+        for (size_t c = 0; c < b; c++) {
+            double *row = vt + c * m;
+            const double *src = v + (k0 + c) * n + k0 + 1;
+            for (size_t r = 0; r < m; r++) row[r] = r < c ? 0 : r == c ? 1 : src[r];
+        }
+        transpose_into(vt, vb, b, m);
+    
+        // Upper triangular T with H_k0 ... H_k1-1 = I - V T V^T
+        double g[EIGEN_BLOCK];
+        for (size_t i = 0; i < b; i++) {
+            const double *vi = vt + i * m + i;
+            for (size_t l = 0; l < i; l++) g[l] = dense_dot(vt + l * m + i, vi, m - i);
+            for (size_t j = 0; j < b; j++) {
+                double s = 0;
+                for (size_t l = j; l < i; l++) s += t[j * b + l] * g[l];
+                t[j * b + i] = j < i ? -tau[k0 + i] * s : j == i ? tau[k0 + i] : 0;
+            }
+        }
+    
+        // Rows k0+1.. of z -= V T (V^T z)
+        double *rows = z + (k0 + 1) * n;
+        matrix_multiply(calc, vt, rows, y, b, m, n);
+        matrix_multiply(calc, t, y, u, b, b, n);
+        for (size_t k = 0; k < b * n; k++) u[k] = -u[k];
+        matrix_multiply_add(calc, vb, u, rows, m, b, n);
+        k1 = k0;
+    }
+}
+
+// sqrt(x^2 + y^2), falling back to hypot (several times slower) only when
+// the squares overflow or underflow
+ALWAYS_INLINE double rotation_norm(double x, double y) {
+    double r = sqrt(x * x + y * y);
+    return r < 0x1p500 && r > 0x1p-500 ? r : hypot(x, y);
+}
+
+// A plane rotation of columns i and i+1 recorded by tridiagonal_ql
+typedef struct {
+    double c;
+    double s;
+    size_t i;
+} PlaneRotation;
+
+// Apply count recorded rotations to the rows of z (n x n). Eight rows at
+// a time are held transposed in buf (n x 8 doubles), so a run of
+// rotations on neighbouring columns passes its shared column along in
+// registers and each row is loaded once per batch rather than once per
+// QL step.
+BATCH_CLONES void apply_rotations(double *z, size_t n, const PlaneRotation *rotations, size_t count, double *buf) {
+    for (size_t r0 = 0; r0 < n; r0 += 8) {
+        size_t rows = n - r0 < 8 ? n - r0 : 8;
+        for (size_t i = 0; i < n; i++) {
+            for (size_t r = 0; r < 8; r++) buf[i * 8 + r] = r < rows ? z[(r0 + r) * n + i] : 0;
+        }
+        size_t k = 0;
+        while (k < count) {
+            size_t i = rotations[k].i;
+            v4df lo = V4_LOAD(buf + (i + 1) * 8), hi = V4_LOAD(buf + (i + 1) * 8 + 4);
+            for (;;) {
+                double c = rotations[k].c, s = rotations[k].s;
+                v4df xl = V4_LOAD(buf + i * 8), xh = V4_LOAD(buf + i * 8 + 4);
+                V4_STORE(buf + (i + 1) * 8, s * xl + c * lo);
+                V4_STORE(buf + (i + 1) * 8 + 4, s * xh + c * hi);
+                lo = c * xl - s * lo;
+                hi = c * xh - s * hi;
+                if (++k == count || rotations[k].i + 1 != i) break;
+                i--;
+            }
+            V4_STORE(buf + i * 8, lo);
+            V4_STORE(buf + i * 8 + 4, hi);
+        }
+        for (size_t r = 0; r < rows; r++) {
+            for (size_t i = 0; i < n; i++) z[(r0 + r) * n + i] = buf[i * 8 + r];
+        }
+    }
+}
+
+// Eigenvalues of the symmetric tridiagonal matrix (d, e) by the implicit
+// QL method with Wilkinson shifts. An off-diagonal entry is dropped once
+// it is negligible next to the norm of the matrix, as in EISPACK tql2 (a
+// test against its neighbours alone can stall on clusters of tiny
+// eigenvalues). If z (n x n) is given, its columns are
+// rotated along, so that starting from the identity they end as the
+// eigenvectors; the rotations are logged in batches of QL_BATCH and
+// applied by apply_rotations with buf (8n doubles). Returns 0 if an
+// eigenvalue does not converge.
+int tridiagonal_ql(double *d, double *e, size_t n, double *z, PlaneRotation *log, double *buf) {
+    if (n == 0) return 1;
+    size_t logged = 0;
+    double norm = 0;
+    e[n - 1] = 0;
+    for (size_t i = 0; i < n; i++) norm = fmax(norm, fabs(d[i]) + fabs(e[i]));
+    for (size_t l = 0; l < n; l++) {
+        int iterations = 0;
+        for (;;) {
+            size_t m = l;
+            for (; m + 1 < n; m++) {
+                if (fabs(e[m]) <= MATRIX_EPSILON * norm) break;
+            }
+            if (m == l) break;
+            if (++iterations > EIGEN_ITERATIONS) return 0;
+            if (z != NULL && logged + m - l > QL_BATCH) {
+                apply_rotations(z, n, log, logged, buf);
+                logged = 0;
+            }
+    
+            double g = (d[l + 1] - d[l]) / (2 * e[l]);
+            double r = rotation_norm(g, 1);
+            g = d[m] - d[l] + e[l] / (g + copysign(r, g));
+            double s = 1, c = 1, p = 0;
+            size_t i = m;
+            int underflow = 0;
+            while (i-- > l) {
+                double f = s * e[i], b = c * e[i];
+                r = rotation_norm(f, g);
+                e[i + 1] = r;
+                if (r == 0) {
+                    d[i + 1] -= p;
+                    e[m] = 0;
+                    underflow = 1;
+                    break;
+                }
+                s = f / r;
+                c = g / r;
+                g = d[i + 1] - p;
+                r = (d[i] - g) * s + 2 * c * b;
+                p = s * r;
+                d[i + 1] = g + p;
+                g = c * r - b;
+                if (z != NULL) log[logged++] = (PlaneRotation){c, s, i};
+            }
+            if (underflow) continue;
+            d[l] -= p;
+            e[l] = g;
+            e[m] = 0;
+        }
+    }
+    if (z != NULL && logged > 0) apply_rotations(z, n, log, logged, buf);
+    return 1;
+}
+
+// Eigenvalues sorted with the index of their vector
+typedef struct {
+    double re;
+    double im;
+    size_t index;
+} EigenPair;
+
+int compare_eigen(const void *a, const void *b) {
+    const EigenPair *x = a, *y = b;
+    if (x->re != y->re) return x->re < y->re ? -1 : 1;
+    return (x->im > y->im) - (x->im < y->im);
+}
+
+// Is a (n x n) symmetric up to rounding? Nearly equal pairs are averaged.
+int symmetrize(double *a, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = i + 1; j < n; j++) {
+            double x = a[i * n + j], y = a[j * n + i];
+            if (fabs(x - y) > 64 * MATRIX_EPSILON * (fabs(x) + fabs(y))) return 0;
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = i + 1; j < n; j++) {
+            a[i * n + j] = a[j * n + i] = (a[i * n + j] + a[j * n + i]) / 2;
+        }
+    }
+    return 1;
+}
+
+// Eigenvalues of the symmetric matrix a (overwritten) into pairs, and, if
+// vectors is given, the eigenvectors as its rows
+int symmetric_eigen(Calculator *calc, double *a, size_t n, EigenPair *pairs, double *vectors, CalcError *error) {
+    double *d = malloc((3 * n + 1) * sizeof(double)), *e = d + n, *tau = e + n;
+    double *work = malloc(((4 * n + EIGEN_BLOCK) * EIGEN_BLOCK) * sizeof(double));
+    double *z = NULL;
+    PlaneRotation *log = NULL;
+    if (vectors != NULL) {
+        z = malloc((n * n > 0 ? n * n : 1) * sizeof(double));
+        log = malloc(QL_BATCH * sizeof(PlaneRotation));
+    }
+    int ok = d != NULL && work != NULL && (vectors == NULL || (z != NULL && log != NULL));
+    if (!ok) {
+        *error = CALC_ERROR_MEMORY;
+    } else {
+        tridiagonalize(a, n, d, e, tau, work);
+        if (z != NULL) {
+            memset(z, 0, n * n * sizeof(double));
+            for (size_t i = 0; i < n; i++) z[i * n + i] = 1;
+        }
+        ok = tridiagonal_ql(d, e, n, z, log, work);
+        if (!ok) {
+            *error = CALC_ERROR_CONVERGENCE;
+        } else {
+            // Columns of z are eigenvectors of the tridiagonal matrix
+            if (z != NULL) {
+                reflector_product(calc, a, tau, n, z, work);
+                transpose_into(z, vectors, n, n);
+            }
+            for (size_t i = 0; i < n; i++) {
+                pairs[i].re = d[i];
+                pairs[i].im = 0;
+                pairs[i].index = i;
+            }
+        }
+    }
+    free(d);
+    free(work);
+    free(z);
+    free(log);
+    return ok;
+}
+
+// Reduce a (n x n, row-major) to upper Hessenberg form Q^T A Q by
+// Householder reflections, clearing the rest of a. If reflectors is
+// given, it receives reflector k in row k, columns k+2.. (with an
+// implicit 1 at k+1), with its factor in tau[k]. work has room for 2n
+// doubles.
+BATCH_CLONES void hessenberg(double *a, size_t n, double *tau, double *reflectors, double *work) {
+    for (size_t k = 0; k + 2 < n; k++) {
+        size_t m = n - k - 1;
+        double *v = work, beta;
+        for (size_t i = 0; i < m; i++) v[i] = a[(k + 1 + i) * n + k];
+        double t = householder(v, m, &beta);
+        tau[k] = t;
+        v[0] = 1;
+        a[(k + 1) * n + k] = beta;
+        for (size_t i = 1; i < m; i++) a[(k + 1 + i) * n + k] = 0;
+        if (reflectors != NULL) memcpy(reflectors + k * n + k + 2, v + 1, (m - 1) * sizeof(double));
+        if (t == 0) continue;
+    
+        // Left: rows k+1.. of columns k+1.. -= tau v (v^T A). Right:
+        // columns k+1.. of every row -= tau (A v) v^T, in the same pass
+        // over the rows below k
+        double *u = work + n;
+        memset(u + k + 1, 0, m * sizeof(double));
+        for (size_t i = 0; i < m; i++) {
+            const double *row = a + (k + 1 + i) * n;
+            for (size_t j = k + 1; j < n; j++) u[j] += v[i] * row[j];
+        }
+        for (size_t i = 0; i < n; i++) {
+            double *row = a + i * n + k + 1;
+            if (i > k) {
+                double f = t * v[i - k - 1];
+                for (size_t j = 0; j < m; j++) row[j] -= f * u[k + 1 + j];
+            }
+            double s = t * dense_dot(row, v, m);
+            for (size_t j = 0; j < m; j++) row[j] -= s * v[j];
+        }
+    }
+}
+
+// Eigenvalues of the upper Hessenberg matrix h by the Francis double-shift
+// QR iteration (after EISPACK hqr2). With z, the Schur vectors are
+// accumulated into z and h is left triangular over all columns; as only
+// real eigenvectors are wanted then, it stops at the first complex pair
+// and returns -1. Returns 0 if an eigenvalue does not converge.
+int hessenberg_qr(double *h, size_t size, double *wr, double *wi, double *z) {
+    long nn = (long)size, n = nn - 1;
+    double exshift = 0, norm = 0, p = 0, q = 0, r = 0, s = 0, w, x, y, t;
+#define H(i, j) h[(size_t)(i) * size + (size_t)(j)]
+#define Z(i, j) z[(size_t)(i) * size + (size_t)(j)]
+    for (long i = 0; i < nn; i++) {
+        for (long j = i > 0 ? i - 1 : 0; j < nn; j++) norm += fabs(H(i, j));
+    }
+    
+    int iterations = 0;
+    while (n >= 0) {
+        // Look for a single small subdiagonal element
+        long l = n;
+        while (l > 0) {
+            s = fabs(H(l - 1, l - 1)) + fabs(H(l, l));
+            if (s == 0) s = norm;
+            if (fabs(H(l, l - 1)) < MATRIX_EPSILON * s) break;
+            l--;
+        }
+    
+        if (l == n) {
+            // One root
+            H(n, n) += exshift;
+            wr[n] = H(n, n);
+            wi[n] = 0;
+            n--;
+            iterations = 0;
+        } else if (l == n - 1) {
+            // Two roots
+            w = H(n, n - 1) * H(n - 1, n);
+            p = (H(n - 1, n - 1) - H(n, n)) / 2;
+            q = p * p + w;
+            double zz = sqrt(fabs(q));
+            H(n, n) += exshift;
+            H(n - 1, n - 1) += exshift;
+            x = H(n, n);
+            if (q >= 0) {
+                zz = p >= 0 ? p + zz : p - zz;
+                wr[n - 1] = wr[n] = x + zz;
+                if (zz != 0) wr[n] = x - w / zz;
+                wi[n - 1] = wi[n] = 0;
+                if (z != NULL) {
+                    // Rotate the real pair into triangular form
+                    x = H(n, n - 1);
+                    s = fabs(x) + fabs(zz);
+                    p = x / s;
+                    q = zz / s;
+                    r = sqrt(p * p + q * q);
+                    p /= r;
+                    q /= r;
+                    for (long j = n - 1; j < nn; j++) {
+                        zz = H(n - 1, j);
+                        H(n - 1, j) = q * zz + p * H(n, j);
+                        H(n, j) = q * H(n, j) - p * zz;
+                    }
+                    for (long i = 0; i <= n; i++) {
+                        zz = H(i, n - 1);
+                        H(i, n - 1) = q * zz + p * H(i, n);
+                        H(i, n) = q * H(i, n) - p * zz;
+                    }
+                    for (long i = 0; i < nn; i++) {
+                        zz = Z(i, n - 1);
+                        Z(i, n - 1) = q * zz + p * Z(i, n);
+                        Z(i, n) = q * Z(i, n) - p * zz;
+                    }
+                }
+            } else {
+                if (z != NULL) return -1;
+                wr[n - 1] = wr[n] = x + p;
+                wi[n - 1] = zz;
+                wi[n] = -zz;
+            }
+            n -= 2;
+            iterations = 0;
+        } else {
+            // Form the shift, with exceptional shifts after 10 and 30
+            // iterations
+            x = H(n, n);
+            y = H(n - 1, n - 1);
+            w = H(n, n - 1) * H(n - 1, n);
+            if (iterations == 10) {
+                exshift += x;
+                for (long i = 0; i <= n; i++) H(i, i) -= x;
+                s = fabs(H(n, n - 1)) + fabs(H(n - 1, n - 2));
+                x = y = 0.75 * s;
+                w = -0.4375 * s * s;
+            }
+            if (iterations == 30) {
+                s = (y - x) / 2;
+                s = s * s + w;
+                if (s > 0) {
+                    s = sqrt(s);
+                    if (y < x) s = -s;
+                    s = x - w / ((y - x) / 2 + s);
+                    for (long i = 0; i <= n; i++) H(i, i) -= s;
+                    exshift += s;
+                    x = y = w = 0.964;
+                }
+            }
+            if (++iterations > EIGEN_ITERATIONS) return 0;
+    
+            // Look for two consecutive small subdiagonal elements
+            long m = n - 2;
+            while (m >= l) {
+                double hm = H(m, m);
+                r = x - hm;
+                s = y - hm;
+                p = (r * s - w) / H(m + 1, m) + H(m, m + 1);
+                q = H(m + 1, m + 1) - hm - r - s;
+                r = H(m + 2, m + 1);
+                s = fabs(p) + fabs(q) + fabs(r);
+                p /= s;
+                q /= s;
+                r /= s;
+                if (m == l) break;
+                if (fabs(H(m, m - 1)) * (fabs(q) + fabs(r)) <
+                    MATRIX_EPSILON * (fabs(p) * (fabs(H(m - 1, m - 1)) + fabs(hm) + fabs(H(m + 1, m + 1))))) {
+                    break;
+                }
+                m--;
+            }
+            for (long i = m + 2; i <= n; i++) {
+                H(i, i - 2) = 0;
+                if (i > m + 2) H(i, i - 3) = 0;
+            }
+    
+            // Double QR step on rows l..n and columns m..n; without
+            // vectors only the active block is updated
+            long first = z != NULL ? 0 : l, last = z != NULL ? nn - 1 : n;
+            for (long k = m; k <= n - 1; k++) {
+                int notlast = k != n - 1;
+                if (k != m) {
+                    p = H(k, k - 1);
+                    q = H(k + 1, k - 1);
+                    r = notlast ? H(k + 2, k - 1) : 0;
+                    x = fabs(p) + fabs(q) + fabs(r);
+                    if (x == 0) continue;
+                    p /= x;
+                    q /= x;
+                    r /= x;
+                }
+                s = sqrt(p * p + q * q + r * r);
+                if (p < 0) s = -s;
+                if (s == 0) continue;
+                if (k != m) {
+                    H(k, k - 1) = -s * x;
+                } else if (l != m) {
+                    H(k, k - 1) = -H(k, k - 1);
+                }
+                p += s;
+                x = p / s;
+                y = q / s;
+                double zz = r / s;
+                q /= p;
+                r /= p;
+    
+                double *h0 = &H(k, 0), *h1 = &H(k + 1, 0), *h2 = notlast ? &H(k + 2, 0) : NULL;
+                for (long j = k; j <= last; j++) {
+                    t = h0[j] + q * h1[j];
+                    if (notlast) {
+                        t += r * h2[j];
+                        h2[j] -= t * zz;
+                    }
+                    h0[j] -= t * x;
+                    h1[j] -= t * y;
+                }
+                long bottom = n < k + 3 ? n : k + 3;
+                for (long i = first; i <= bottom; i++) {
+                    t = x * H(i, k) + y * H(i, k + 1);
+                    if (notlast) {
+                        t += zz * H(i, k + 2);
+                        H(i, k + 2) -= t * r;
+                    }
+                    H(i, k) -= t;
+                    H(i, k + 1) -= t * q;
+                }
+                for (long i = 0; z != NULL && i < nn; i++) {
+                    t = x * Z(i, k) + y * Z(i, k + 1);
+                    if (notlast) {
+                        t += zz * Z(i, k + 2);
+                        Z(i, k + 2) -= t * r;
+                    }
+                    Z(i, k) -= t;
+                    Z(i, k + 1) -= t * q;
+                }
+            }
+        }
+    }
+#undef H
+#undef Z
+    return 1;
+}
+
+// Eigenvectors of the quasi-triangular Schur form h for real eigenvalues
+// wr, by back-substitution into the upper triangle of h (columns become
+// the vectors of the triangular matrix)
+void schur_vectors(double *h, size_t n, const double *wr) {
+    double norm = 0;
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = i; j < n; j++) norm += fabs(h[i * n + j]);
+    }
+    if (norm == 0) return;
+    for (size_t c = n; c-- > 0; ) {
+        double lambda = wr[c];
+        h[c * n + c] = 1;
+        for (size_t i = c; i-- > 0; ) {
+            double w = h[i * n + i] - lambda, r = 0;
+            for (size_t j = i + 1; j <= c; j++) r += h[i * n + j] * h[j * n + c];
+            h[i * n + c] = -r / (w != 0 ? w : MATRIX_EPSILON * norm);
+    
+            // Rescale to keep later products from overflowing
+            double t = fabs(h[i * n + c]);
+            if (MATRIX_EPSILON * t * t > 1) {
+                for (size_t j = i; j <= c; j++) h[j * n + c] /= t;
+            }
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < i; j++) h[i * n + j] = 0;
+    }
+}
+
+// Eigenvalues of the general matrix a (overwritten) into pairs and, if
+// vectors is given, the eigenvectors as its rows (real eigenvalues only)
+int general_eigen(Calculator *calc, double *a, size_t n, EigenPair *pairs, double *vectors, CalcError *error) {
+    size_t size = n * n > 0 ? n * n : 1;
+    double *tau = malloc((5 * n + 1) * sizeof(double)), *wr = tau + n, *wi = wr + n, *work = wi + n;
+    double *z = NULL, *reflectors = NULL, *wy = NULL;
+    if (vectors != NULL) {
+        z = malloc(size * sizeof(double));
+        reflectors = malloc(size * sizeof(double));
+        wy = malloc(((4 * n + EIGEN_BLOCK) * EIGEN_BLOCK) * sizeof(double));
+    }
+    int ok = tau != NULL && (vectors == NULL || (z != NULL && reflectors != NULL && wy != NULL));
+    if (!ok) {
+        *error = CALC_ERROR_MEMORY;
+    } else {
+        hessenberg(a, n, tau, reflectors, work);
+        if (z != NULL) {
+            memset(z, 0, n * n * sizeof(double));
+            for (size_t i = 0; i < n; i++) z[i * n + i] = 1;
+            reflector_product(calc, reflectors, tau, n, z, wy);
+        }
+        int found = hessenberg_qr(a, n, wr, wi, z);
+        ok = found > 0;
+        for (size_t i = 0; ok && i < n; i++) {
+            pairs[i].re = wr[i];
+            pairs[i].im = wi[i];
+            pairs[i].index = i;
+        }
+        if (!ok) {
+            *error = found < 0 ? CALC_ERROR_COMPLEX_OP : CALC_ERROR_CONVERGENCE;
+        } else if (vectors != NULL) {
+            // Vectors of A are Z times those of the triangular form
+            schur_vectors(a, n, wr);
+            matrix_multiply(calc, z, a, reflectors, n, n, n);
+            transpose_into(reflectors, vectors, n, n);
+        }
+    }
+    free(tau);
+    free(z);
+    free(reflectors);
+    free(wy);
+    return ok;
+}
+
+// Eigen-decomposition of the square matrix argument: pairs sorted
+// ascending (by real part, then imaginary), and optionally the matching
+// eigenvectors as unit-length rows of vectors with the largest component
+// positive
+EigenPair* eigen_decompose(Calculator *calc, Value arg, size_t *n, double **vectors, CalcError *error) {
+    double *a = square_matrix_copy(arg, n, error);
+    if (a == NULL) return NULL;
+    size_t size = *n;
+    EigenPair *pairs = malloc((size > 0 ? size : 1) * sizeof(EigenPair));
+    double *v = vectors != NULL ? malloc((size * size > 0 ? size * size : 1) * sizeof(double)) : NULL;
+    int ok = pairs != NULL && (vectors == NULL || v != NULL);
+    if (!ok) {
+        *error = CALC_ERROR_MEMORY;
+    } else if (symmetrize(a, size)) {
+        ok = symmetric_eigen(calc, a, size, pairs, v, error);
+    } else {
+        ok = general_eigen(calc, a, size, pairs, v, error);
+    }
+    free(a);
+    if (!ok) {
+        free(pairs);
+        free(v);
+        return NULL;
+    }
+    qsort(pairs, size, sizeof(EigenPair), compare_eigen);
+    for (size_t r = 0; v != NULL && r < size; r++) {
+        double *row = v + r * size, norm = 0, largest = 0;
+        for (size_t j = 0; j < size; j++) {
+            norm = hypot(norm, row[j]);
+            if (fabs(row[j]) > fabs(largest)) largest = row[j];
+        }
+        double f = norm > 0 ? copysign(1 / norm, largest) : 1;
+        for (size_t j = 0; j < size; j++) row[j] *= f;
+    }
+    if (vectors != NULL) *vectors = v;
+    return pairs;
+}
+
+// eigvals(A): eigenvalues in ascending order (of real part), complex if
+// any is
+Value func_eigvals(Calculator *calc, Value args[], int count, CalcError *error) {
+    size_t n;
+    EigenPair *pairs = eigen_decompose(calc, args[0], &n, NULL, error);
+    if (pairs == NULL) return value_real(0);
+    int complex = 0;
+    for (size_t i = 0; i < n; i++) complex |= pairs[i].im != 0;
+    Vector *out = vector_new(n, complex);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            out->re[i] = pairs[i].re;
+            if (complex) out->im[i] = pairs[i].im;
+        }
+    }
+    free(pairs);
+    return out ? value_vector(out) : value_real(0);
+}
+
+// eig(A): the eigenvectors as the columns of a matrix, in the order of
+// eigvals(A)
+Value func_eig(Calculator *calc, Value args[], int count, CalcError *error) {
+    size_t n;
+    double *vectors = NULL;
+    EigenPair *pairs = eigen_decompose(calc, args[0], &n, &vectors, error);
+    if (pairs == NULL) return value_real(0);
+    DenseMatrix *out = dense_new(n, n);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+    } else {
+        for (size_t c = 0; c < n; c++) {
+            const double *row = vectors + pairs[c].index * n;
+            for (size_t i = 0; i < n; i++) out->data[i * n + c] = row[i];
+        }
+    }
+    free(pairs);
+    free(vectors);
+    return out ? value_matrix(out) : value_real(0);
+}
+
+// One sweep of one-sided Jacobi over the rows w[0..n-1] (each of length
+// m, squared norms in norms) in blocks of SVD_BLOCK rows, so that both
+// blocks of a pair stay in cache. Returns the number of rotations.
+BATCH_CLONES size_t svd_sweep(double **w, double *norms, size_t n, size_t m, double tolerance) {
+    size_t rotations = 0;
+    for (size_t b0 = 0; b0 < n; b0 += SVD_BLOCK) {
+        for (size_t c0 = b0; c0 < n; c0 += SVD_BLOCK) {
+            size_t b1 = n - b0 > SVD_BLOCK ? b0 + SVD_BLOCK : n;
+            size_t c1 = n - c0 > SVD_BLOCK ? c0 + SVD_BLOCK : n;
+            for (size_t p = b0; p < b1; p++) {
+                for (size_t q = c0 > p ? c0 : p + 1; q < c1; q++) {
+                    double *x = w[p], *y = w[q], alpha = norms[p], beta = norms[q];
+                    double gamma = dense_dot(x, y, m);
+                    if (!(fabs(gamma) > tolerance * sqrt(alpha * beta))) continue;
+    
+                    // Rutishauser's rotation making x and y orthogonal
+                    double zeta = (beta - alpha) / (2 * gamma);
+                    double t = copysign(1, zeta) / (fabs(zeta) + sqrt(1 + zeta * zeta));
+                    double c = 1 / sqrt(1 + t * t), s = c * t;
+                    for (size_t k = 0; k < m; k++) {
+                        double u = x[k], v = y[k];
+                        x[k] = c * u - s * v;
+                        y[k] = s * u + c * v;
+                    }
+                    norms[p] = alpha - t * gamma;
+                    norms[q] = beta + t * gamma;
+                    // Recompute a norm that lost most of its digits
+                    if (norms[p] < alpha / 8) norms[p] = dense_dot(x, x, m);
+                    rotations++;
+                }
+            }
+        }
+    }
+    return rotations;
+}
+
+int compare_descending(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x < y) - (x > y);
+}
+
+// Householder LQ factorization with row pivoting of the rows w[0..n-1]
+// (each of length m >= n): the rows are reordered by pointer and their
+// first n entries left holding the lower triangular factor L. The
+// largest remaining row goes first, tracked by downdating the norms in
+// scratch (2n doubles) and recomputing one once it has lost half its
+// digits.
+BATCH_CLONES void pivoted_lq(double **w, size_t n, size_t m, double *scratch) {
+    double *norms = scratch, *exact = scratch + n;
+    for (size_t i = 0; i < n; i++) norms[i] = exact[i] = dense_dot(w[i], w[i], m);
+    for (size_t k = 0; k < n; k++) {
+        size_t best = k;
+        for (size_t i = k + 1; i < n; i++) {
+            if (norms[i] > norms[best]) best = i;
+        }
+        double *row = w[k], t = norms[k], u = exact[k];
+        w[k] = w[best];
+        w[best] = row;
+        norms[k] = norms[best];
+        norms[best] = t;
+        exact[k] = exact[best];
+        exact[best] = u;
+    
+        double *x = w[k] + k, beta, tau = householder(x, m - k, &beta);
+        for (size_t i = k + 1; i < n; i++) {
+            double *y = w[i] + k;
+            if (tau != 0) {
+                double s = tau * (y[0] + dense_dot(x + 1, y + 1, m - k - 1));
+                y[0] -= s;
+                for (size_t j = 1; j < m - k; j++) y[j] -= s * x[j];
+            }
+            norms[i] -= y[0] * y[0];
+            if (norms[i] <= exact[i] * MATRIX_EPSILON_SQRT) {
+                norms[i] = exact[i] = dense_dot(y + 1, y + 1, m - k - 1);
+            }
+        }
+        x[0] = beta;
+    }
+}
+
+// Singular values of a matrix argument in descending order (count is
+// min(rows, cols)), by one-sided Jacobi. The matrix, scaled so squared
+// norms cannot overflow, is first reduced to a triangular L by pivoted
+// LQ; Jacobi on the columns of L then needs far fewer sweeps than on the
+// matrix itself (the preconditioning of Drmac and Veselic).
+double* singular_values(Value arg, size_t *count, CalcError *error) {
+    DenseMatrix *a = matrix_arg(arg, error);
+    if (a == NULL) return NULL;
+    size_t n = a->rows < a->cols ? a->rows : a->cols, m = a->rows < a->cols ? a->cols : a->rows;
+    double *data = malloc((n * m > 0 ? n * m : 1) * sizeof(double));
+    double *l = malloc((n * n > 0 ? n * n : 1) * sizeof(double));
+    double **w = malloc((n > 0 ? n : 1) * sizeof(double *));
+    double *norms = malloc((2 * n + 1) * sizeof(double));
+    int ok = data != NULL && l != NULL && w != NULL && norms != NULL;
+    double scale = 0;
+    if (!ok) {
+        *error = CALC_ERROR_MEMORY;
+    } else {
+        // Rows of data are the columns of A (or its rows if A is wide)
+        if (a->rows >= a->cols) {
+            transpose_into(a->data, data, a->rows, a->cols);
+        } else {
+            memcpy(data, a->data, n * m * sizeof(double));
+        }
+        for (size_t k = 0; k < n * m; k++) scale = fmax(scale, fabs(data[k]));
+        if (!isfinite(scale)) {
+            *error = CALC_ERROR_UNDEFINED;
+            ok = 0;
+        }
+    }
+    dense_release(a);
+    
+    if (ok) {
+        for (size_t k = 0; scale > 0 && k < n * m; k++) data[k] /= scale;
+        for (size_t i = 0; i < n; i++) w[i] = data + i * m;
+        pivoted_lq(w, n, m, norms);
+        for (size_t j = 0; j < n; j++) {
+            for (size_t i = 0; i < n; i++) l[j * n + i] = i >= j ? w[i][j] : 0;
+            w[j] = l + j * n;
+            norms[j] = dense_dot(w[j], w[j], n);
+        }
+    
+        double tolerance = sqrt((double)n) * MATRIX_EPSILON;
+        int converged = 0;
+        for (int sweep = 0; sweep < SVD_SWEEPS && !converged; sweep++) {
+            converged = svd_sweep(w, norms, n, n, tolerance) == 0;
+            for (size_t i = 0; i < n; i++) norms[i] = dense_dot(w[i], w[i], n);
+        }
+        if (!converged) {
+            *error = CALC_ERROR_CONVERGENCE;
+            ok = 0;
+        }
+    }
+    free(data);
+    free(l);
+    free(w);
+    if (!ok) {
+        free(norms);
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) norms[i] = sqrt(norms[i]) * scale;
+    qsort(norms, n, sizeof(double), compare_descending);
+    *count = n;
+    return norms;
+}
+
+// svd(A): the singular values of A in descending order
+Value func_svd(Calculator *calc, Value args[], int count, CalcError *error) {
+    size_t n;
+    double *sigma = singular_values(args[0], &n, error);
+    if (sigma == NULL) return value_real(0);
+    Vector *out = vector_new(n, 0);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+    } else {
+        memcpy(out->re, sigma, n * sizeof(double));
+    }
+    free(sigma);
+    return out ? value_vector(out) : value_real(0);
+}
+
+// cond(A): the 2-norm condition number, largest over smallest singular
+// value (inf for a singular matrix)
+Value func_cond(Calculator *calc, Value args[], int count, CalcError *error) {
+    size_t n;
+    double *sigma = singular_values(args[0], &n, error);
+    if (sigma == NULL) return value_real(0);
+    double cond = n == 0 ? 0 : sigma[n - 1] > 0 ? sigma[0] / sigma[n - 1] : INFINITY;
+    free(sigma);
+    return value_real(cond);
+}
+
+// Matrix functions. Powers square and multiply through three n x n
+// buffers whose pointers are swapped after each product, so a step never
+// allocates; expm, sqrtm and logm likewise preallocate their work space
+// and then run on matrix_multiply and lu_solve.
+
+void dense_identity(double *a, size_t n) {
+    memset(a, 0, n * n * sizeof(double));
+    for (size_t i = 0; i < n; i++) a[i * n + i] = 1;
+}
+
+// The 1-norm (largest column sum) of a - shift I
+double matrix_norm1(const double *a, size_t n, double shift) {
+    double norm = 0;
+    for (size_t j = 0; j < n; j++) {
+        double sum = 0;
+        for (size_t i = 0; i < n; i++) sum += fabs(a[i * n + j] - (i == j ? shift : 0));
+        norm = fmax(norm, sum);
+    }
+    return norm;
+}
+
+// A^p by binary powering, with A in base on entry. Returns whichever of
+// base, result and temp holds the power.
+double* matrix_power(Calculator *calc, size_t n, unsigned long long p, double *base, double *result, double *temp) {
+    int started = 0;
+    while (p > 0) {
+        if (p & 1) {
+            if (started) {
+                matrix_multiply(calc, result, base, temp, n, n, n);
+                double *t = result;
+                result = temp;
+                temp = t;
+            } else {
+                memcpy(result, base, n * n * sizeof(double));
+                started = 1;
+            }
+        }
+        p >>= 1;
+        if (p > 0) {
+            matrix_multiply(calc, base, base, temp, n, n, n);
+            double *t = base;
+            base = temp;
+            temp = t;
+        }
+    }
+    if (!started) dense_identity(result, n);
+    return result;
+}
+
+// A^p for a square matrix A and a whole number p (through the inverse
+// for negative p)
+Value matrix_pow(Calculator *calc, Value a, double p, CalcError *error) {
+    if (p != floor(p) || fabs(p) >= 0x1p63) {
+        *error = CALC_ERROR_ARG_RANGE;
+        return value_real(0);
+    }
+    size_t n;
+    double *base = square_matrix_copy(a, &n, error);
+    if (base == NULL) return value_real(0);
+    size_t size = n * n > 0 ? n * n : 1;
+    DenseMatrix *out = dense_new(n, n);
+    double *temp = malloc(size * sizeof(double));
+    double *lu = p < 0 ? malloc(size * sizeof(double)) : NULL;
+    size_t *pivots = p < 0 ? malloc((n > 0 ? n : 1) * sizeof(size_t)) : NULL;
+    int ok = out != NULL && temp != NULL && (p >= 0 || (lu != NULL && pivots != NULL));
+    if (!ok) {
+        *error = CALC_ERROR_MEMORY;
+    } else if (p < 0) {
+        memcpy(lu, base, n * n * sizeof(double));
+        if (lu_factor(lu, n, pivots) == 0) {
+            *error = CALC_ERROR_DIV_ZERO;
+            ok = 0;
+        } else {
+            dense_identity(base, n);
+            lu_solve(lu, pivots, n, base, n);
+        }
+    }
+    if (ok) {
+        double *power = matrix_power(calc, n, (unsigned long long)fabs(p), base, out->data, temp);
+        if (power != out->data) memcpy(out->data, power, n * n * sizeof(double));
+    }
+    free(base);
+    free(temp);
+    free(lu);
+    free(pivots);
+    if (!ok) {
+        dense_release(out);
+        return value_real(0);
+    }
+    return value_matrix(out);
+}
+
+// mpow(A, n): A to the whole power n
+Value func_mpow(Calculator *calc, Value args[], int count, CalcError *error) {
+    if (args[1].type != CALC_REAL) {
+        *error = CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    return matrix_pow(calc, args[0], args[1].real, error);
+}
+
+// exp(a) (n x n, overwritten) by Higham's scaling and squaring with a
+// Padé approximant of degree 3, 5, 7, 9 or 13 picked by the 1-norm. work
+// has room for 6 n^2 doubles. Returns whichever of a and work holds the
+// result, or NULL (error set).
+double* matrix_exp(Calculator *calc, double *a, size_t n, double *work, size_t *pivots, CalcError *error) {
+    static const double theta[] = {1.495585217958292e-2, 2.539398330063230e-1, 9.504178996162932e-1,
+                                   2.097847961257068, 5.371920351148152};
+    static const int degrees[] = {3, 5, 7, 9, 13};
+    static const double pade[][14] = {
+        {120, 60, 12, 1},
+        {30240, 15120, 3360, 420, 30, 1},
+        {17297280, 8648640, 1995840, 277200, 25200, 1512, 56, 1},
+        {17643225600.0, 8821612800.0, 2075673600, 302702400, 30270240, 2162160, 110880, 3960, 90, 1},
+        {64764752532480000.0, 32382376266240000.0, 7771770303897600.0, 1187353796428800.0,
+         129060195264000.0, 10559470521600.0, 670442572800.0, 33522128640.0, 1323241920,
+         40840800, 960960, 16380, 182, 1}};
+    size_t nn = n * n;
+    double *a2 = work, *a4 = a2 + nn, *a6 = a4 + nn, *u = a6 + nn, *v = u + nn, *t = v + nn;
+    double norm = matrix_norm1(a, n, 0);
+    if (!isfinite(norm)) {
+        *error = CALC_ERROR_UNDEFINED;
+        return NULL;
+    }
+    int d = 0, squarings = 0;
+    while (d < 4 && norm > theta[d]) d++;
+    if (norm > theta[4]) {
+        squarings = (int)ceil(log2(norm / theta[4]));
+        for (size_t k = 0; k < nn; k++) a[k] = ldexp(a[k], -squarings);
+    }
+    const double *b = pade[d];
+    int m = degrees[d];
+    
+    // U = A (odd terms) and V = even terms, from A^2, A^4 and A^6 only
+    matrix_multiply(calc, a, a, a2, n, n, n);
+    if (m >= 5) matrix_multiply(calc, a2, a2, a4, n, n, n);
+    if (m >= 7) matrix_multiply(calc, a2, a4, a6, n, n, n);
+    if (m <= 9) {
+        if (m == 9) matrix_multiply(calc, a4, a4, u, n, n, n);
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = 0; j < n; j++) {
+                size_t k = i * n + j;
+                double odd = b[3] * a2[k] + (i == j ? b[1] : 0);
+                double even = b[2] * a2[k] + (i == j ? b[0] : 0);
+                if (m >= 5) {
+                    odd += b[5] * a4[k];
+                    even += b[4] * a4[k];
+                }
+                if (m >= 7) {
+                    odd += b[7] * a6[k];
+                    even += b[6] * a6[k];
+                }
+                if (m == 9) {
+                    odd += b[9] * u[k];
+                    even += b[8] * u[k];
+                }
+                t[k] = odd;
+                v[k] = even;
+            }
+        }
+        matrix_multiply(calc, a, t, u, n, n, n);
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = 0; j < n; j++) {
+                size_t k = i * n + j;
+                u[k] = b[13] * a6[k] + b[11] * a4[k] + b[9] * a2[k];
+                t[k] = b[7] * a6[k] + b[5] * a4[k] + b[3] * a2[k] + (i == j ? b[1] : 0);
+            }
+        }
+        matrix_multiply_add(calc, a6, u, t, n, n, n);
+        matrix_multiply(calc, a, t, u, n, n, n);
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = 0; j < n; j++) {
+                size_t k = i * n + j;
+                t[k] = b[12] * a6[k] + b[10] * a4[k] + b[8] * a2[k];
+                v[k] = b[6] * a6[k] + b[4] * a4[k] + b[2] * a2[k] + (i == j ? b[0] : 0);
+            }
+        }
+        matrix_multiply_add(calc, a6, t, v, n, n, n);
+    }
+    
+    // Solve (V - U) X = V + U, then square X back up
+    for (size_t k = 0; k < nn; k++) {
+        double x = v[k], y = u[k];
+        v[k] = x - y;
+        u[k] = x + y;
+    }
+    if (lu_factor(v, n, pivots) == 0) {
+        *error = CALC_ERROR_OVERFLOW;
+        return NULL;
+    }
+    lu_solve(v, pivots, n, u, n);
+    double *x = u, *y = a;
+    for (int s = 0; s < squarings; s++) {
+        matrix_multiply(calc, x, x, y, n, n, n);
+        double *swap = x;
+        x = y;
+        y = swap;
+    }
+    for (size_t k = 0; k < nn; k++) {
+        if (!isfinite(x[k])) {
+            *error = CALC_ERROR_OVERFLOW;
+            return NULL;
+        }
+    }
+    return x;
+}
+
+// f(A) = V f(L) V^T for the symmetric a (n x n, overwritten) from its
+// eigen-decomposition, into out. Eigenvalues within rounding of zero are
+// taken as zero; f must be real at every eigenvalue.
+int symmetric_function(Calculator *calc, double *a, size_t n, double (*f)(double), double *out, CalcError *error) {
+    size_t size = n * n > 0 ? n * n : 1;
+    EigenPair *pairs = malloc((n > 0 ? n : 1) * sizeof(EigenPair));
+    double *vectors = malloc(size * sizeof(double)), *scaled = malloc(size * sizeof(double));
+    int ok = pairs != NULL && vectors != NULL && scaled != NULL;
+    if (!ok) {
+        *error = CALC_ERROR_MEMORY;
+    } else {
+        ok = symmetric_eigen(calc, a, n, pairs, vectors, error);
+    }
+    if (ok) {
+        double largest = 0;
+        for (size_t i = 0; i < n; i++) largest = fmax(largest, fabs(pairs[i].re));
+        for (size_t i = 0; i < n && ok; i++) {
+            double lambda = pairs[i].re;
+            if (fabs(lambda) <= n * MATRIX_EPSILON * largest) lambda = 0;
+            double y = f(lambda);
+            if (!isfinite(y)) {
+                *error = lambda < 0 ? CALC_ERROR_COMPLEX_OP : CALC_ERROR_UNDEFINED;
+                ok = 0;
+            }
+            // Row i of vectors is the eigenvector of pairs[i]
+            for (size_t j = 0; j < n; j++) scaled[i * n + j] = y * vectors[i * n + j];
+        }
+    }
+    if (ok) {
+        transpose_into(vectors, a, n, n);
+        matrix_multiply(calc, a, scaled, out, n, n, n);
+    }
+    free(pairs);
+    free(vectors);
+    free(scaled);
+    return ok;
+}
+
+// Square root of a (n x n) into y by the scaled product form of the
+// Denman-Beavers iteration, in which Y tends to A^(1/2) as M tends to I.
+// work has room for 4 n^2 doubles. Fails to converge when A has
+// eigenvalues on the negative real axis.
+int matrix_sqrt(Calculator *calc, const double *a, size_t n, double *y, double *work, size_t *pivots, CalcError *error) {
+    size_t nn = n * n;
+    double *m = work, *inv = m + nn, *lu = inv + nn, *t = lu + nn;
+    memcpy(m, a, nn * sizeof(double));
+    memcpy(y, a, nn * sizeof(double));
+    double previous = INFINITY, tolerance = (n + 1) * MATRIX_EPSILON;
+    int scaling = 1;
+    for (int iteration = 0; iteration < SQRTM_ITERATIONS; iteration++) {
+        memcpy(lu, m, nn * sizeof(double));
+        if (lu_factor(lu, n, pivots) == 0) {
+            *error = CALC_ERROR_UNDEFINED;
+            return 0;
+        }
+        dense_identity(inv, n);
+        lu_solve(lu, pivots, n, inv, n);
+        
+        // Determinant scaling speeds up the early steps
+        double mu = 1;
+        if (scaling) {
+            double log_det = 0;
+            for (size_t i = 0; i < n; i++) log_det += log(fabs(lu[i * n + i]));
+            mu = exp(-log_det / (2.0 * n));
+        }
+        double mu2 = mu * mu, residual = 0;
+        for (size_t i = 0; i < n; i++) {
+            double row = 0;
+            for (size_t j = 0; j < n; j++) {
+                size_t k = i * n + j;
+                double delta = i == j ? 1 : 0;
+                m[k] = (delta + (mu2 * m[k] + inv[k] / mu2) / 2) / 2;
+                inv[k] = delta + inv[k] / mu2;
+                row += fabs(m[k] - delta);
+            }
+            residual = fmax(residual, row);
+        }
+        matrix_multiply(calc, y, inv, t, n, n, n);
+        for (size_t k = 0; k < nn; k++) y[k] = t[k] * mu / 2;
+        if (!isfinite(residual)) break;
+        
+        // Done at the rounding level, or once M stops improving there
+        if (residual <= tolerance) return 1;
+        if (residual < MATRIX_EPSILON_SQRT && residual > previous / 2) return 1;
+        if (residual < 0.01) scaling = 0;
+        previous = residual;
+    }
+    *error = CALC_ERROR_CONVERGENCE;
+    return 0;
+}
+
+// log(a) (n x n, overwritten) into out by inverse scaling and squaring:
+// square roots until A^(1/2^k) is near I, then log(I + X) from the
+// 8-point Gauss-Legendre rule for the integral of X (I + t X)^-1 over
+// [0, 1], scaled by 2^k. work has room for 5 n^2 doubles.
+int matrix_log(Calculator *calc, double *a, size_t n, double *out, double *work, size_t *pivots, CalcError *error) {
+    static const double nodes[] = {0.9602898564975363, 0.7966664774136267, 0.5255324099163290, 0.1834346424956498};
+    static const double weights[] = {0.1012285362903763, 0.2223810344533745, 0.3137066458778873, 0.3626837833783620};
+    size_t nn = n * n;
+    double *x = a, *root = work, *lu = work + nn;
+    int roots = 0;
+    while (matrix_norm1(x, n, 1) > LOGM_THETA) {
+        if (roots == LOGM_ROOTS) {
+            *error = CALC_ERROR_CONVERGENCE;
+            return 0;
+        }
+        if (!matrix_sqrt(calc, x, n, root, work + nn, pivots, error)) return 0;
+        double *swap = x;
+        x = root;
+        root = swap;
+        roots++;
+    }
+    for (size_t i = 0; i < n; i++) x[i * n + i] -= 1;
+    memset(out, 0, nn * sizeof(double));
+    for (int q = 0; q < 8; q++) {
+        double node = (1 + (q < 4 ? -nodes[q] : nodes[7 - q])) / 2, weight = weights[q < 4 ? q : 7 - q] / 2;
+        for (size_t k = 0; k < nn; k++) lu[k] = node * x[k];
+        for (size_t i = 0; i < n; i++) lu[i * n + i] += 1;
+        if (lu_factor(lu, n, pivots) == 0) {
+            *error = CALC_ERROR_UNDEFINED;
+            return 0;
+        }
+        memcpy(root, x, nn * sizeof(double));
+        lu_solve(lu, pivots, n, root, n);
+        for (size_t k = 0; k < nn; k++) out[k] += weight * root[k];
+    }
+    for (size_t k = 0; k < nn; k++) out[k] = ldexp(out[k], roots);
+    return 1;
+}
+
+// The shared driver of expm, sqrtm and logm: a copy of the square
+// argument, work space and the result matrix
+Value matrix_function(Calculator *calc, Value arg, char kind, CalcError *error) {
+    size_t n;
+    double *a = square_matrix_copy(arg, &n, error);
+    if (a == NULL) return value_real(0);
+    size_t size = n * n > 0 ? n * n : 1;
+    DenseMatrix *out = dense_new(n, n);
+    double *work = malloc(6 * size * sizeof(double));
+    size_t *pivots = malloc((n > 0 ? n : 1) * sizeof(size_t));
+    int ok = out != NULL && work != NULL && pivots != NULL;
+    if (!ok) {
+        *error = CALC_ERROR_MEMORY;
+    } else if (kind == 'e') {
+        double *x = matrix_exp(calc, a, n, work, pivots, error);
+        if (x != NULL) memcpy(out->data, x, n * n * sizeof(double));
+        ok = x != NULL;
+    } else if (symmetrize(a, n)) {
+        ok = symmetric_function(calc, a, n, kind == 's' ? sqrt : log, out->data, error);
+    } else if (kind == 's') {
+        ok = matrix_sqrt(calc, a, n, out->data, work, pivots, error);
+    } else {
+        ok = matrix_log(calc, a, n, out->data, work, pivots, error);
+    }
+    free(a);
+    free(work);
+    free(pivots);
+    if (!ok) {
+        dense_release(out);
+        return value_real(0);
+    }
+    return value_matrix(out);
+}
+
+// expm(A): the matrix exponential
+Value func_expm(Calculator *calc, Value args[], int count, CalcError *error) {
+    return matrix_function(calc, args[0], 'e', error);
+}
+
+// sqrtm(A): the principal square root
+Value func_sqrtm(Calculator *calc, Value args[], int count, CalcError *error) {
+    return matrix_function(calc, args[0], 's', error);
+}
+
+// logm(A): the principal logarithm
+Value func_logm(Calculator *calc, Value args[], int count, CalcError *error) {
+    return matrix_function(calc, args[0], 'l', error);
+}
+
+// Least squares. A LeastSquares accumulates the triangular factor R of
+// [A b] by Householder QR, one batch of rows at a time: each batch is
+// stacked under R and reduced back to triangular form, so memory stays
+// at one batch and R however many rows stream through. Batches are sized
+// to stay in cache. The last column of R holds Q^T b, with the residual
+// norm in its corner. Long fits are split into chunks of LSQ_CHUNK rows
+// that run on the thread pool, LSQ_WAVE at a time, and merge in order, so
+// results do not depend on the number of threads.
+#define LSQ_BATCH_BYTES (1 << 16)
+#define LSQ_CHUNK 65536
+#define LSQ_WAVE 16
+#define LSQ_MAX_DEGREE 1000
+
+LeastSquares* lsq_new(size_t p) {
+    LeastSquares *ls = malloc(sizeof(LeastSquares));
+    if (ls == NULL) return NULL;
+    size_t cols = p + 1;
+    ls->cols = cols;
+    ls->batch_rows = LSQ_BATCH_BYTES / sizeof(double) / cols;
+    if (ls->batch_rows < cols) ls->batch_rows = cols;
+    ls->rows = 0;
+    ls->r = calloc(cols * cols, sizeof(double));
+    ls->batch = malloc((ls->batch_rows * cols + cols) * sizeof(double));
+    if (ls->r == NULL || ls->batch == NULL) {
+        lsq_free(ls);
+        return NULL;
+    }
+    return ls;
+}
+
+void lsq_free(LeastSquares *ls) {
+    if (ls == NULL) return;
+    free(ls->r);
+    free(ls->batch);
+    free(ls);
+}
+
+// Reduce [r; rows] (rows is count x cols, overwritten) to upper
+// triangular form in r. Each reflector acts on one row of r and one
+// column of rows, and is applied to the rest row by row. w has room for
+// cols doubles.
+BATCH_CLONES void lsq_absorb(double *r, double *rows, size_t count, size_t cols, double *w) {
+    for (size_t k = 0; k < cols; k++) {
+        double alpha = r[k * cols + k], sum = 0, scale = 1;
+        for (size_t i = 0; i < count; i++) sum += rows[i * cols + k] * rows[i * cols + k];
+        if (sum == 0) continue;
+        if (!isfinite(sum) || sum < 0x1p-900) {
+            // Rescale a column whose squares overflow or underflow
+            scale = 0;
+            for (size_t i = 0; i < count; i++) scale = fmax(scale, fabs(rows[i * cols + k]));
+            sum = 0;
+            for (size_t i = 0; i < count; i++) {
+                double t = rows[i * cols + k] / scale;
+                sum += t * t;
+            }
+        }
+        double beta = -copysign(hypot(alpha, scale * sqrt(sum)), alpha);
+        double tau = (beta - alpha) / beta, f = 1 / (alpha - beta);
+        
+        // v = [1; rows(:, k) / (alpha - beta)], w = [r(k, :); rows]^T v
+        for (size_t j = k + 1; j < cols; j++) w[j] = r[k * cols + j];
+        for (size_t i = 0; i < count; i++) {
+            double *row = rows + i * cols, v = row[k] * f;
+            row[k] = v;
+            for (size_t j = k + 1; j < cols; j++) w[j] += v * row[j];
+        }
+        r[k * cols + k] = beta;
+        for (size_t j = k + 1; j < cols; j++) {
+            w[j] *= tau;
+            r[k * cols + j] -= w[j];
+        }
+        for (size_t i = 0; i < count; i++) {
+            double *row = rows + i * cols, v = row[k];
+            for (size_t j = k + 1; j < cols; j++) row[j] -= v * w[j];
+        }
+    }
+}
+
+// Stream rows start.. start + count - 1 of [A b] from fill through ls
+void lsq_add(LeastSquares *ls, LsqFill fill, const void *source, size_t start, size_t count) {
+    double *w = ls->batch + ls->batch_rows * ls->cols;
+    for (size_t done = 0; done < count;) {
+        size_t n = count - done < ls->batch_rows ? count - done : ls->batch_rows;
+        fill(source, start + done, n, ls->batch);
+        lsq_absorb(ls->r, ls->batch, n, ls->cols, w);
+        done += n;
+    }
+    ls->rows += count;
+}
+
+// Fold the rows seen by other into ls (other's factor is overwritten)
+void lsq_merge(LeastSquares *ls, LeastSquares *other) {
+    lsq_absorb(ls->r, other->r, ls->cols, ls->cols, ls->batch + ls->batch_rows * ls->cols);
+    ls->rows += other->rows;
+}
+
+// The coefficients x minimizing |A x - b| by back substitution, and the
+// residual norm. A rank-deficient A (a diagonal of R within rounding of
+// zero) is an error.
+int lsq_solve(const LeastSquares *ls, double *x, double *residual, CalcError *error) {
+    size_t p = ls->cols - 1, cols = ls->cols;
+    double largest = 0;
+    for (size_t k = 0; k < p; k++) largest = fmax(largest, fabs(ls->r[k * cols + k]));
+    for (size_t k = 0; k < p; k++) {
+        if (!(fabs(ls->r[k * cols + k]) > (p + 1) * MATRIX_EPSILON * largest)) {
+            *error = ls->rows < p ? CALC_ERROR_MATRIX_DIM : CALC_ERROR_UNDEFINED;
+            return 0;
+        }
+    }
+    for (size_t i = p; i-- > 0;) {
+        const double *row = ls->r + i * cols;
+        double sum = row[p];
+        for (size_t j = i + 1; j < p; j++) sum -= row[j] * x[j];
+        x[i] = sum / row[i];
+    }
+    if (residual != NULL) *residual = fabs(ls->r[p * cols + p]);
+    return 1;
+}
+
+// Chunks of a long fit for the thread pool
+typedef struct {
+    LsqFill fill;
+    const void *source;
+    size_t rows;
+    size_t first;
+    LeastSquares **parts;
+} LsqJob;
+
+void lsq_task(void *arg, size_t index, int worker) {
+    LsqJob *job = arg;
+    size_t start = (job->first + index) * LSQ_CHUNK;
+    size_t count = job->rows - start < LSQ_CHUNK ? job->rows - start : LSQ_CHUNK;
+    LeastSquares *part = job->parts[index];
+    memset(part->r, 0, part->cols * part->cols * sizeof(double));
+    part->rows = 0;
+    lsq_add(part, job->fill, job->source, start, count);
+}
+
+// Fit the p coefficients x for rows rows of [A b] produced by fill
+int lsq_fit(Calculator *calc, LsqFill fill, const void *source, size_t rows, size_t p, double *x, double *residual, CalcError *error) {
+    LeastSquares *ls = lsq_new(p);
+    if (ls == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return 0;
+    }
+    size_t chunks = (rows + LSQ_CHUNK - 1) / LSQ_CHUNK;
+    if (chunks <= 1) {
+        lsq_add(ls, fill, source, 0, rows);
+    } else {
+        LeastSquares *parts[LSQ_WAVE];
+        size_t made = 0;
+        while (made < LSQ_WAVE && made < chunks && (parts[made] = lsq_new(p)) != NULL) made++;
+        if (made < LSQ_WAVE && made < chunks) {
+            for (size_t i = 0; i < made; i++) lsq_free(parts[i]);
+            lsq_free(ls);
+            *error = CALC_ERROR_MEMORY;
+            return 0;
+        }
+        LsqJob job = {fill, source, rows, 0, parts};
+        for (; job.first < chunks; job.first += made) {
+            size_t wave = chunks - job.first < made ? chunks - job.first : made;
+            threadpool_run(calculator_pool(calc), lsq_task, &job, wave);
+            for (size_t i = 0; i < wave; i++) lsq_merge(ls, parts[i]);
+        }
+        for (size_t i = 0; i < made; i++) lsq_free(parts[i]);
+    }
+    int ok = lsq_solve(ls, x, residual, error);
+    lsq_free(ls);
+    return ok;
+}
+
+// Rows of [A b] for a dense or single-column A
+typedef struct {
+    const double *a;
+    const double *b;
+    size_t p;
+} LsqMatrixSource;
+
+void lsq_fill_matrix(const void *source, size_t start, size_t count, double *rows) {
+    const LsqMatrixSource *s = source;
+    size_t p = s->p;
+    for (size_t i = 0; i < count; i++) {
+        memcpy(rows + i * (p + 1), s->a + (start + i) * p, p * sizeof(double));
+        rows[i * (p + 1) + p] = s->b[start + i];
+    }
+}
+
+// Rows [t^d, ..., t, 1, y] of a polynomial fit in t = x * scale
+typedef struct {
+    const double *x;
+    const double *y;
+    size_t degree;
+    double scale;
+} LsqPolySource;
+
+void lsq_fill_poly(const void *source, size_t start, size_t count, double *rows) {
+    const LsqPolySource *s = source;
+    size_t d = s->degree;
+    for (size_t i = 0; i < count; i++) {
+        double *row = rows + i * (d + 2), t = s->x[start + i] * s->scale, power = 1;
+        for (size_t j = d + 1; j-- > 0;) {
+            row[j] = power;
+            power *= t;
+        }
+        row[d + 1] = s->y[start + i];
+    }
+}
+
+// A real vector argument (borrowed)
+const Vector* lsq_vector(Value v, CalcError *error) {
+    if (v.type != CALC_VECTOR) {
+        *error = v.type == CALC_COMPLEX ? CALC_ERROR_COMPLEX_OP : CALC_ERROR_TYPE;
+        return NULL;
+    }
+    if (v.vector->im != NULL) {
+        *error = CALC_ERROR_COMPLEX_OP;
+        return NULL;
+    }
+    return v.vector;
+}
+
+// lstsq(A, b): x minimizing |A x - b| for a matrix (or a vector taken as
+// one column) A with at least as many rows as columns
+Value func_lstsq(Calculator *calc, Value args[], int count, CalcError *error) {
+    const Vector *b = lsq_vector(args[1], error);
+    if (b == NULL) return value_real(0);
+    LsqMatrixSource source = {NULL, b->re, 1};
+    if (args[0].type == CALC_MATRIX) {
+        source.a = args[0].matrix->data;
+        source.p = args[0].matrix->cols;
+        if (args[0].matrix->rows != b->length) *error = CALC_ERROR_MATRIX_DIM;
+    } else if (args[0].type == CALC_VECTOR && args[0].vector->im == NULL) {
+        source.a = args[0].vector->re;
+        if (args[0].vector->length != b->length) *error = CALC_ERROR_MATRIX_DIM;
+    } else {
+        *error = args[0].type == CALC_VECTOR || args[0].type == CALC_COMPLEX ? CALC_ERROR_COMPLEX_OP : CALC_ERROR_TYPE;
+    }
+    if (*error == CALC_OK && b->length < source.p) *error = CALC_ERROR_MATRIX_DIM;
+    Vector *x = *error == CALC_OK ? vector_new(source.p, 0) : NULL;
+    if (x == NULL && *error == CALC_OK) *error = CALC_ERROR_MEMORY;
+    if (x != NULL && !lsq_fit(calc, lsq_fill_matrix, &source, b->length, source.p, x->re, NULL, error)) {
+        vector_release(x);
+        x = NULL;
+    }
+    return x ? value_vector(x) : value_real(0);
+}
+
+// Least-squares polynomial of degree d through the points (x, y): the
+// coefficients (highest power first) into c, and the residual norm. x is
+// scaled by a power of two to about [-1, 1] while fitting, which leaves
+// the digits of the Vandermonde columns alone.
+int poly_fit(Calculator *calc, Value xs, Value ys, size_t d, double *c, double *residual, CalcError *error) {
+    const Vector *x = lsq_vector(xs, error);
+    const Vector *y = x ? lsq_vector(ys, error) : NULL;
+    int ok = y != NULL;
+    if (ok && x->length != y->length) {
+        *error = CALC_ERROR_MATRIX_DIM;
+        ok = 0;
+    }
+    if (ok) {
+        double largest = 0;
+        for (size_t i = 0; i < x->length; i++) largest = fmax(largest, fabs(x->re[i]));
+        int exponent = 0;
+        if (largest > 0 && isfinite(largest)) frexp(largest, &exponent);
+        LsqPolySource source = {x->re, y->re, d, ldexp(1, -exponent)};
+        ok = lsq_fit(calc, lsq_fill_poly, &source, x->length, d + 1, c, residual, error);
+        for (size_t j = 0; ok && j <= d; j++) c[j] = ldexp(c[j], -exponent * (int)(d - j));
+    }
+    return ok;
+}
+
+// polyfit(x, y, d): the least-squares polynomial of degree d
+Value func_polyfit(Calculator *calc, Value args[], int count, CalcError *error) {
+    if (args[2].type != CALC_REAL || args[2].real < 0 || args[2].real > LSQ_MAX_DEGREE ||
+        args[2].real != floor(args[2].real)) {
+        *error = args[2].type == CALC_REAL ? CALC_ERROR_ARG_RANGE : CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    size_t d = (size_t)args[2].real;
+    Vector *c = vector_new(d + 1, 0);
+    if (c == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    if (!poly_fit(calc, args[0], args[1], d, c->re, NULL, error)) {
+        vector_release(c);
+        return value_real(0);
+    }
+    c = poly_trim(c, error);
+    return c ? value_poly(c) : value_real(0);
+}
+
+// linfit(x, y): [slope, intercept, r^2] of the least-squares line
+Value func_linfit(Calculator *calc, Value args[], int count, CalcError *error) {
+    double c[2], residual;
+    if (!poly_fit(calc, args[0], args[1], 1, c, &residual, error)) return value_real(0);
+    const Vector *y = args[1].vector;
+    double mean = 0, total = 0;
+    for (size_t i = 0; i < y->length; i++) mean += y->re[i];
+    mean /= y->length;
+    for (size_t i = 0; i < y->length; i++) total += (y->re[i] - mean) * (y->re[i] - mean);
+    Vector *out = vector_new(3, 0);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    out->re[0] = c[0];
+    out->re[1] = c[1];
+    out->re[2] = total > 0 ? 1 - residual * residual / total : 1;
+    return value_vector(out);
+}
+
+// Grouping. groupby aggregates values by key in open-addressing hash
+// tables keyed by the bits of the key (-0 is 0 and every NaN is one key),
+// probed linearly from a multiplicative hash. Long inputs are split into
+// chunks of GROUP_CHUNK rows that run on the thread pool, GROUP_WAVE at a
+// time, each into a table of its own sized from an estimate of the number
+// of distinct keys; the chunk tables merge in order, so results do not
+// depend on the number of threads. hist counts into one array of bins
+// per thread, added up at the end.
+#define GROUP_CHUNK 65536
+#define GROUP_WAVE 16
+#define GROUP_SAMPLE 4096
+#define HIST_MAX_BINS (1 << 24)
+
+// Aggregates, in the order of their codes, and what GroupEntry.a and b hold
+const char *const group_aggregates[] = {
+    "count",    // Nothing
+    "sum",      // Sum and its compensation (Neumaier)
+    "mean",     // The same
+    "min",      // Smallest value (NaN ignored)
+    "max",      // Largest value (NaN ignored)
+    "std",      // Running mean and sum of squared deviations (Welford)
+    NULL
+};
+
+enum {GROUP_COUNT, GROUP_SUM, GROUP_MEAN, GROUP_MIN, GROUP_MAX, GROUP_STD};
+
+int group_aggregate(const char *name) {
+    for (int i = 0; group_aggregates[i] != NULL; i++) {
+        if (strcmp(name, group_aggregates[i]) == 0) return i;
+    }
+    return -1;
+}
+
+int group_table_init(GroupTable *table, size_t expected) {
+    size_t capacity = 16;
+    while (capacity < 2 * expected) capacity *= 2;
+    table->slots = calloc(capacity, sizeof(GroupEntry));
+    table->mask = capacity - 1;
+    table->shift = 64;
+    for (size_t c = capacity; c > 1; c /= 2) table->shift--;
+    table->size = 0;
+    table->failed = table->slots == NULL;
+    return !table->failed;
+}
+
+// Bits of a key as the tables hold it
+ALWAYS_INLINE uint64_t group_key_bits(double key) {
+    uint64_t bits;
+    if (key == 0) key = 0;
+    if (isnan(key)) key = NAN;
+    memcpy(&bits, &key, sizeof(bits));
+    return bits;
+}
+
+ALWAYS_INLINE double group_key(const GroupEntry *entry) {
+    double key;
+    memcpy(&key, &entry->bits, sizeof(key));
+    return key;
+}
+
+ALWAYS_INLINE GroupEntry* group_probe(GroupEntry *slots, size_t mask, int shift, uint64_t bits) {
+    size_t slot = (size_t)((bits * 0x9E3779B97F4A7C15ULL) >> shift);
+    for (;; slot = (slot + 1) & mask) {
+        GroupEntry *entry = &slots[slot];
+        if (entry->count == 0 || entry->bits == bits) return entry;
+    }
+}
+
+// Double the table once it is half full
+int group_table_grow(GroupTable *table) {
+    size_t capacity = (table->mask + 1) * 2;
+    GroupEntry *slots = calloc(capacity, sizeof(GroupEntry));
+    if (slots == NULL) {
+        table->failed = 1;
+        return 0;
+    }
+    for (size_t i = 0; i <= table->mask; i++) {
+        if (table->slots[i].count != 0) {
+            *group_probe(slots, capacity - 1, table->shift - 1, table->slots[i].bits) = table->slots[i];
+        }
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->mask = capacity - 1;
+    table->shift--;
+    return 1;
+}
+
+// The entry for a key, added empty (count 0) if new; NULL without memory
+ALWAYS_INLINE GroupEntry* group_entry(GroupTable *table, double key) {
+    uint64_t bits = group_key_bits(key);
+    GroupEntry *entry = group_probe(table->slots, table->mask, table->shift, bits);
+    if (entry->count != 0) return entry;
+    if (2 * (table->size + 1) > table->mask + 1) {
+        if (!group_table_grow(table)) return NULL;
+        entry = group_probe(table->slots, table->mask, table->shift, bits);
+    }
+    entry->bits = bits;
+    table->size++;
+    return entry;
+}
+
+// Add rows start .. start+count-1 to a table
+void group_add(GroupTable *table, int aggregate, const double *key, const double *value, size_t start, size_t count) {
+    for (size_t i = start; i < start + count; i++) {
+        GroupEntry *entry = group_entry(table, key[i]);
+        if (entry == NULL) return;
+        double x = value[i];
+        uint64_t n = ++entry->count;
+        switch (aggregate) {
+            case GROUP_SUM: case GROUP_MEAN: {
+                double t = entry->a + x;
+                entry->b += fabs(entry->a) >= fabs(x) ? (entry->a - t) + x : (x - t) + entry->a;
+                entry->a = t;
+                break;
+            }
+            case GROUP_MIN: entry->a = n == 1 ? x : fmin(entry->a, x); break;
+            case GROUP_MAX: entry->a = n == 1 ? x : fmax(entry->a, x); break;
+            case GROUP_STD: {
+                double d = x - entry->a;
+                entry->a += d / n;
+                entry->b += d * (x - entry->a);
+                break;
+            }
+        }
+    }
+}
+
+// Fold the groups of part into table
+void group_merge(GroupTable *table, const GroupTable *part, int aggregate) {
+    for (size_t i = 0; i <= part->mask && !table->failed; i++) {
+        const GroupEntry *from = &part->slots[i];
+        if (from->count == 0) continue;
+        GroupEntry *entry = group_entry(table, group_key(from));
+        if (entry == NULL) return;
+        uint64_t n = entry->count;
+        entry->count += from->count;
+        if (n == 0) {
+            entry->a = from->a;
+            entry->b = from->b;
+            continue;
+        }
+        switch (aggregate) {
+            case GROUP_SUM: case GROUP_MEAN: {
+                double t = entry->a + from->a;
+                entry->b += from->b + (fabs(entry->a) >= fabs(from->a) ? (entry->a - t) + from->a
+                                                                        : (from->a - t) + entry->a);
+                entry->a = t;
+                break;
+            }
+            case GROUP_MIN: entry->a = fmin(entry->a, from->a); break;
+            case GROUP_MAX: entry->a = fmax(entry->a, from->a); break;
+            case GROUP_STD: {
+                double d = from->a - entry->a;
+                entry->a += d * from->count / entry->count;
+                entry->b += from->b + d * d * ((double)n * from->count / entry->count);
+                break;
+            }
+        }
+    }
+}
+
+// Distinct keys to expect in n rows, judged by GROUP_SAMPLE evenly spaced
+// ones with the bias-corrected Chao1 estimator: the keys seen, plus
+// f1 (f1 - 1) / (2 (f2 + 1)) for the f1 seen once and f2 seen twice
+size_t group_estimate(const double *key, size_t n) {
+    if (n <= GROUP_SAMPLE) return n;
+    GroupTable sample;
+    if (!group_table_init(&sample, GROUP_SAMPLE)) return GROUP_SAMPLE;
+    for (size_t i = 0; i < GROUP_SAMPLE; i++) {
+        GroupEntry *entry = group_entry(&sample, key[i * (n / GROUP_SAMPLE)]);
+        if (entry != NULL) entry->count++;
+    }
+    double once = 0, twice = 0;
+    for (size_t i = 0; i <= sample.mask; i++) {
+        once += sample.slots[i].count == 1;
+        twice += sample.slots[i].count == 2;
+    }
+    double estimate = sample.size + once * (once - 1) / (2 * (twice + 1));
+    free(sample.slots);
+    return estimate < n ? (size_t)estimate : n;
+}
+
+// Chunks of a long groupby for the thread pool
+typedef struct {
+    const double *key;
+    const double *value;
+    size_t rows;
+    size_t first;
+    int aggregate;
+    GroupTable *parts;
+} GroupJob;
+
+void group_task(void *arg, size_t index, int worker) {
+    GroupJob *job = arg;
+    size_t start = (job->first + index) * GROUP_CHUNK;
+    size_t count = job->rows - start < GROUP_CHUNK ? job->rows - start : GROUP_CHUNK;
+    group_add(&job->parts[index], job->aggregate, job->key, job->value, start, count);
+}
+
+// Groups sorted by key, NaN last
+int compare_groups(const void *a, const void *b) {
+    double x = group_key(a), y = group_key(b);
+    if (isnan(x) || isnan(y)) return isnan(x) - isnan(y);
+    return (x > y) - (x < y);
+}
+
+// groupby(key, value, agg): one row [key, aggregate] per distinct key, in
+// ascending order of key. agg is count, sum, mean, min, max or std
+// (sample standard deviation), written as a name; the compiler turns it
+// into the aggregate's code.
+Value func_groupby(Calculator *calc, Value args[], int count, CalcError *error) {
+    const Vector *key = lsq_vector(args[0], error);
+    const Vector *value = key ? lsq_vector(args[1], error) : NULL;
+    if (value == NULL) return value_real(0);
+    double code = args[2].type == CALC_INTEGER ? (double)args[2].integer : args[2].real;
+    if ((args[2].type != CALC_INTEGER && args[2].type != CALC_REAL) || !(code >= 0 && code < GROUP_STD + 1) ||
+        code != floor(code)) {
+        *error = args[2].type == CALC_INTEGER || args[2].type == CALC_REAL ? CALC_ERROR_ARG_RANGE : CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    if (key->length != value->length) {
+        *error = CALC_ERROR_MATRIX_DIM;
+        return value_real(0);
+    }
+    int aggregate = (int)code;
+    size_t rows = key->length;
+    size_t expected = group_estimate(key->re, rows);
+    
+    GroupTable table, parts[GROUP_WAVE];
+    size_t chunks = (rows + GROUP_CHUNK - 1) / GROUP_CHUNK, made = 0;
+    int ok = group_table_init(&table, expected);
+    if (ok && chunks <= 1) {
+        group_add(&table, aggregate, key->re, value->re, 0, rows);
+    } else if (ok) {
+        size_t per_chunk = expected < GROUP_CHUNK ? expected : GROUP_CHUNK;
+        while (made < GROUP_WAVE && made < chunks && group_table_init(&parts[made], per_chunk)) made++;
+        ok = made == GROUP_WAVE || made == chunks;
+        GroupJob job = {key->re, value->re, rows, 0, aggregate, parts};
+        for (; ok && job.first < chunks; job.first += made) {
+            size_t wave = chunks - job.first < made ? chunks - job.first : made;
+            threadpool_run(calculator_pool(calc), group_task, &job, wave);
+            for (size_t i = 0; i < wave; i++) {
+                ok = ok && !parts[i].failed;
+                if (ok) group_merge(&table, &parts[i], aggregate);
+                memset(parts[i].slots, 0, (parts[i].mask + 1) * sizeof(GroupEntry));
+                parts[i].size = 0;
+            }
+        }
+        for (size_t i = 0; i < made; i++) free(parts[i].slots);
+    }
+    
+    // Compact the groups to the front of the table and sort them
+    GroupEntry *groups = table.slots;
+    size_t group_count = 0;
+    ok = ok && !table.failed;
+    for (size_t i = 0; ok && i <= table.mask; i++) {
+        if (groups[i].count != 0) groups[group_count++] = groups[i];
+    }
+    DenseMatrix *out = ok ? dense_new(group_count, 2) : NULL;
+    if (out == NULL) {
+        free(table.slots);
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    qsort(groups, group_count, sizeof(GroupEntry), compare_groups);
+    for (size_t i = 0; i < group_count; i++) {
+        const GroupEntry *g = &groups[i];
+        double result = 0;
+        switch (aggregate) {
+            case GROUP_COUNT: result = (double)g->count; break;
+            case GROUP_SUM: result = g->a + g->b; break;
+            case GROUP_MEAN: result = (g->a + g->b) / g->count; break;
+            case GROUP_MIN: case GROUP_MAX: result = g->a; break;
+            case GROUP_STD: result = g->count > 1 ? sqrt(g->b / (g->count - 1)) : 0; break;
+        }
+        out->data[2 * i] = group_key(g);
+        out->data[2 * i + 1] = result;
+    }
+    free(table.slots);
+    return value_matrix(out);
+}
+
+// Chunks of a histogram for the thread pool; each worker counts into its
+// own row of counts. edges is NULL for equal-width bins from lo, scale
+// bins per unit.
+typedef struct {
+    const double *x;
+    size_t length;
+    size_t bins;
+    const double *edges;
+    double lo;
+    double hi;
+    double scale;
+    uint64_t *counts;
+    double *range;      // Smallest and largest finite value of each chunk
+} HistJob;
+
+void hist_range_task(void *arg, size_t index, int worker) {
+    HistJob *job = arg;
+    size_t start = index * GROUP_CHUNK;
+    size_t end = job->length - start < GROUP_CHUNK ? job->length : start + GROUP_CHUNK;
+    double lo = INFINITY, hi = -INFINITY;
+    for (size_t i = start; i < end; i++) {
+        double x = job->x[i];
+        if (isfinite(x)) {
+            lo = x < lo ? x : lo;
+            hi = x > hi ? x : hi;
+        }
+    }
+    job->range[2 * index] = lo;
+    job->range[2 * index + 1] = hi;
+}
+
+void hist_task(void *arg, size_t index, int worker) {
+    HistJob *job = arg;
+    size_t start = index * GROUP_CHUNK;
+    size_t end = job->length - start < GROUP_CHUNK ? job->length : start + GROUP_CHUNK;
+    uint64_t *counts = job->counts + (size_t)worker * job->bins;
+    const double *edges = job->edges;
+    size_t last = job->bins - 1;
+    if (edges == NULL) {
+        for (size_t i = start; i < end; i++) {
+            double x = job->x[i];
+            if (!isfinite(x)) continue;
+            size_t bin = (size_t)((x - job->lo) * job->scale);
+            counts[bin < last ? bin : last]++;
+        }
+        return;
+    }
+    for (size_t i = start; i < end; i++) {
+        double x = job->x[i];
+        if (!(x >= edges[0] && x <= edges[last + 1])) continue;
+        
+        // The first edge above x
+        size_t low = 1, high = last + 1;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (edges[mid] > x) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+        counts[low - 1 < last ? low - 1 : last]++;
+    }
+}
+
+// hist(x, bins): counts of x in bins equal-width bins spanning its finite
+// values, or between consecutive entries of an ascending vector of edges.
+// One row [lower edge, upper edge, count] per bin; bins include their
+// lower edge and the last one its upper edge too. NaN, infinities and
+// values outside the edges are not counted.
+Value func_hist(Calculator *calc, Value args[], int count, CalcError *error) {
+    const Vector *x = lsq_vector(args[0], error);
+    if (x == NULL) return value_real(0);
+    HistJob job = {x->re, x->length, 0, NULL, 0, 0, 0, NULL, NULL};
+    size_t chunks = (x->length + GROUP_CHUNK - 1) / GROUP_CHUNK;
+    ThreadPool *pool = chunks > 1 ? calculator_pool(calc) : NULL;
+    size_t workers = pool != NULL ? (size_t)pool->thread_count + 1 : 1;
+    
+    if (args[1].type == CALC_VECTOR) {
+        const Vector *edges = lsq_vector(args[1], error);
+        if (edges == NULL) return value_real(0);
+        int ascending = edges->length >= 2;
+        for (size_t i = 0; i < edges->length; i++) {
+            ascending = ascending && isfinite(edges->re[i]) && (i == 0 || edges->re[i] > edges->re[i - 1]);
+        }
+        if (!ascending) {
+            *error = CALC_ERROR_ARG_RANGE;
+            return value_real(0);
+        }
+        job.edges = edges->re;
+        job.bins = edges->length - 1;
+    } else {
+        double bins = args[1].type == CALC_INTEGER ? (double)args[1].integer : args[1].real;
+        if (args[1].type != CALC_INTEGER && args[1].type != CALC_REAL) {
+            *error = CALC_ERROR_TYPE;
+            return value_real(0);
+        }
+        if (!(bins >= 1 && bins <= HIST_MAX_BINS) || bins != floor(bins)) {
+            *error = CALC_ERROR_ARG_RANGE;
+            return value_real(0);
+        }
+        job.bins = (size_t)bins;
+        
+        // The range of the finite values, widened if they are all equal
+        job.range = malloc(2 * chunks * sizeof(double));
+        if (job.range == NULL) {
+            *error = CALC_ERROR_MEMORY;
+            return value_real(0);
+        }
+        threadpool_run(pool, hist_range_task, &job, chunks);
+        double lo = INFINITY, hi = -INFINITY;
+        for (size_t i = 0; i < chunks; i++) {
+            lo = fmin(lo, job.range[2 * i]);
+            hi = fmax(hi, job.range[2 * i + 1]);
+        }
+        free(job.range);
+        if (lo > hi) {
+            lo = 0;
+            hi = 1;
+        } else if (lo == hi) {
+            lo -= 0.5;
+            hi += 0.5;
+        }
+        job.lo = lo;
+        job.hi = hi;
+        job.scale = job.bins / (hi - lo);
+        if (!isfinite(job.scale)) {
+            *error = CALC_ERROR_OVERFLOW;
+            return value_real(0);
+        }
+    }
+    
+    job.counts = calloc(workers * job.bins, sizeof(uint64_t));
+    DenseMatrix *out = job.counts ? dense_new(job.bins, 3) : NULL;
+    if (out == NULL) {
+        free(job.counts);
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    threadpool_run(pool, hist_task, &job, chunks);
+    for (size_t b = 0; b < job.bins; b++) {
+        uint64_t total = 0;
+        for (size_t w = 0; w < workers; w++) total += job.counts[w * job.bins + b];
+        double width = (job.hi - job.lo) / job.bins;
+        out->data[3 * b] = job.edges ? job.edges[b] : job.lo + b * width;
+        out->data[3 * b + 1] = job.edges ? job.edges[b + 1] : b + 1 == job.bins ? job.hi : job.lo + (b + 1) * width;
+        out->data[3 * b + 2] = (double)total;
+    }
+    free(job.counts);
+    return value_matrix(out);
+}
+
+// Sorting. Doubles sort as 64-bit keys that order like the numbers: the
+// sign bit of a positive value is set and a negative one is complemented,
+// so -0 comes just before 0, and every NaN becomes the largest key, after
+// inf. Inputs of SORT_RADIX_MIN elements or more take an LSD radix sort
+// on SORT_BITS-bit digits of the keys, skipping digits every key shares.
+// Each pass counts digits per chunk of SORT_CHUNK keys on the thread
+// pool, then scatters the chunks in parallel to offsets taken in chunk
+// order, so the sort is stable and NaNs keep their order. Shorter inputs take pdqsort
+// on (key, index) pairs, which are distinct, so it is stable too.
+#define SORT_RADIX_MIN 8192
+#define SORT_CHUNK 262144
+#define SORT_BITS 11
+#define SORT_BUCKETS (1 << SORT_BITS)
+#define SORT_LINE 8
+#define PDQ_INSERTION 24
+#define PDQ_NINTHER 128
+#define PDQ_PARTIAL_LIMIT 8
+
+ALWAYS_INLINE uint64_t sort_key(double x) {
+    uint64_t bits;
+    if (isnan(x)) return UINT64_MAX;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits >> 63 ? ~bits : bits | 0x8000000000000000ULL;
+}
+
+ALWAYS_INLINE double sort_value(uint64_t key) {
+    uint64_t bits = key >> 63 ? key & 0x7FFFFFFFFFFFFFFFULL : ~key;
+    double x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+ALWAYS_INLINE int item_less(const SortItem *a, const SortItem *b) {
+    return a->key < b->key || (a->key == b->key && a->index < b->index);
+}
+
+ALWAYS_INLINE void item_swap(SortItem *a, SortItem *b) {
+    SortItem t = *a;
+    *a = *b;
+    *b = t;
+}
+
+ALWAYS_INLINE void sort3_items(SortItem *a, SortItem *b, SortItem *c) {
+    if (item_less(b, a)) item_swap(a, b);
+    if (item_less(c, b)) item_swap(b, c);
+    if (item_less(b, a)) item_swap(a, b);
+}
+
+void insertion_sort_items(SortItem *items, size_t n) {
+    for (size_t i = 1; i < n; i++) {
+        SortItem item = items[i];
+        size_t j = i;
+        for (; j > 0 && item_less(&item, &items[j - 1]); j--) items[j] = items[j - 1];
+        items[j] = item;
+    }
+}
+
+// Insertion sort that gives up once it has moved items more than
+// PDQ_PARTIAL_LIMIT places in all; returns whether it finished
+int partial_insertion_sort_items(SortItem *items, size_t n) {
+    size_t moved = 0;
+    for (size_t i = 1; i < n; i++) {
+        SortItem item = items[i];
+        size_t j = i;
+        for (; j > 0 && item_less(&item, &items[j - 1]); j--) items[j] = items[j - 1];
+        items[j] = item;
+        moved += i - j;
+        if (moved > PDQ_PARTIAL_LIMIT) return 0;
+    }
+    return 1;
+}
+
+ALWAYS_INLINE void sift_down_items(SortItem *items, size_t root, size_t n) {
+    for (;;) {
+        size_t child = 2 * root + 1;
+        if (child >= n) return;
+        if (child + 1 < n && item_less(&items[child], &items[child + 1])) child++;
+        if (!item_less(&items[root], &items[child])) return;
+        item_swap(&items[root], &items[child]);
+        root = child;
+    }
+}
+
+void heapsort_items(SortItem *items, size_t n) {
+    for (size_t i = n / 2; i-- > 0;) sift_down_items(items, i, n);
+    for (size_t end = n; end-- > 1;) {
+        item_swap(&items[0], &items[end]);
+        sift_down_items(items, 0, end);
+    }
+}
+
+// Partition around the pivot items[0], which the pivot selection left
+// no larger than items[n - 1]; returns the pivot's final position and
+// sets *already when nothing had to move
+size_t partition_items(SortItem *items, size_t n, int *already) {
+    SortItem pivot = items[0];
+    size_t first = 0, last = n;
+    while (item_less(&items[++first], &pivot)) {}
+    if (first == 1) {
+        while (first < last && !item_less(&items[--last], &pivot)) {}
+    } else {
+        while (!item_less(&items[--last], &pivot)) {}
+    }
+    *already = first >= last;
+    while (first < last) {
+        item_swap(&items[first], &items[last]);
+        while (item_less(&items[++first], &pivot)) {}
+        while (!item_less(&items[--last], &pivot)) {}
+    }
+    size_t position = first - 1;
+    items[0] = items[position];
+    items[position] = pivot;
+    return position;
+}
+
+// Pattern-defeating quicksort: quicksort on a median-of-three (or of
+// three medians) pivot that finishes already partitioned ranges with
+// insertion sort, swaps items around after a lopsided partition and
+// falls back to heapsort after bad_allowed of them
+void pdqsort_items(SortItem *items, size_t n, int bad_allowed) {
+    for (;;) {
+        if (n < PDQ_INSERTION) {
+            insertion_sort_items(items, n);
+            return;
+        }
+        size_t half = n / 2;
+        if (n > PDQ_NINTHER) {
+            sort3_items(&items[0], &items[half], &items[n - 1]);
+            sort3_items(&items[1], &items[half - 1], &items[n - 2]);
+            sort3_items(&items[2], &items[half + 1], &items[n - 3]);
+            sort3_items(&items[half - 1], &items[half], &items[half + 1]);
+            item_swap(&items[0], &items[half]);
+        } else {
+            sort3_items(&items[half], &items[0], &items[n - 1]);
+        }
+    
+        int already;
+        size_t pivot = partition_items(items, n, &already);
+        size_t left = pivot, right = n - pivot - 1;
+        SortItem *high = items + pivot + 1;
+        if (left < n / 8 || right < n / 8) {
+            if (--bad_allowed == 0) {
+                heapsort_items(items, n);
+                return;
+            }
+            if (left >= PDQ_INSERTION) {
+                item_swap(&items[0], &items[left / 4]);
+                item_swap(&items[left - 1], &items[left - left / 4]);
+                if (left > PDQ_NINTHER) {
+                    item_swap(&items[1], &items[left / 4 + 1]);
+                    item_swap(&items[2], &items[left / 4 + 2]);
+                    item_swap(&items[left - 2], &items[left - (left / 4 + 1)]);
+                    item_swap(&items[left - 3], &items[left - (left / 4 + 2)]);
+                }
+            }
+            if (right >= PDQ_INSERTION) {
+                item_swap(&high[0], &high[right / 4]);
+                item_swap(&high[right - 1], &high[right - right / 4]);
+                if (right > PDQ_NINTHER) {
+                    item_swap(&high[1], &high[right / 4 + 1]);
+                    item_swap(&high[2], &high[right / 4 + 2]);
+                    item_swap(&high[right - 2], &high[right - (right / 4 + 1)]);
+                    item_swap(&high[right - 3], &high[right - (right / 4 + 2)]);
+                }
+            }
+        } else if (already && partial_insertion_sort_items(items, left) &&
+                   partial_insertion_sort_items(high, right)) {
+            return;
+        }
+    
+        // Recurse into the shorter side and loop on the longer one
+        if (left < right) {
+            pdqsort_items(items, left, bad_allowed);
+            items = high;
+            n = right;
+        } else {
+            pdqsort_items(high, right, bad_allowed);
+            n = left;
+        }
+    }
+}
+
+void sort_items(SortItem *items, size_t n) {
+    int bad_allowed = 1;
+    for (size_t m = n; m > 1; m /= 2) bad_allowed++;
+    pdqsort_items(items, n, bad_allowed);
+}
+
+// A pass of the radix sort over a byte of the keys, for the thread pool
+// a chunk at a time
+typedef struct {
+    const double *x;
+    const uint64_t *keys;
+    const uint64_t *index;
+    uint64_t *keys_out;
+    uint64_t *index_out;
+    size_t n;
+    int shift;
+    size_t *counts;     // SORT_BUCKETS per chunk: digit counts, then offsets
+    uint64_t *bits;     // AND and OR of each chunk's keys
+    uint64_t *lines;    // Per worker, a line of keys and one of positions per digit
+} RadixJob;
+
+void radix_key_task(void *arg, size_t index, int worker) {
+    RadixJob *job = arg;
+    size_t start = index * SORT_CHUNK;
+    size_t end = job->n - start < SORT_CHUNK ? job->n : start + SORT_CHUNK;
+    uint64_t all = UINT64_MAX, any = 0;
+    for (size_t i = start; i < end; i++) {
+        uint64_t key = sort_key(job->x[i]);
+        job->keys_out[i] = key;
+        all &= key;
+        any |= key;
+    }
+    if (job->index_out != NULL) {
+        for (size_t i = start; i < end; i++) job->index_out[i] = i;
+    }
+    job->bits[2 * index] = all;
+    job->bits[2 * index + 1] = any;
+}
+
+void radix_count_task(void *arg, size_t index, int worker) {
+    RadixJob *job = arg;
+    size_t start = index * SORT_CHUNK;
+    size_t end = job->n - start < SORT_CHUNK ? job->n : start + SORT_CHUNK;
+    size_t *counts = job->counts + index * SORT_BUCKETS;
+    memset(counts, 0, SORT_BUCKETS * sizeof(size_t));
+    for (size_t i = start; i < end; i++) counts[(job->keys[i] >> job->shift) & (SORT_BUCKETS - 1)]++;
+}
+
+// Keys go out through a cache line per digit, written whole when full,
+// which keeps the SORT_BUCKETS output streams from thrashing the TLB
+void radix_scatter_task(void *arg, size_t index, int worker) {
+    RadixJob *job = arg;
+    size_t start = index * SORT_CHUNK;
+    size_t end = job->n - start < SORT_CHUNK ? job->n : start + SORT_CHUNK;
+    size_t offsets[SORT_BUCKETS];
+    unsigned char filled[SORT_BUCKETS] = {0};
+    uint64_t *keys = job->lines + (size_t)worker * 2 * SORT_BUCKETS * SORT_LINE;
+    uint64_t *positions = keys + SORT_BUCKETS * SORT_LINE;
+    memcpy(offsets, job->counts + index * SORT_BUCKETS, sizeof(offsets));
+    int shift = job->shift;
+    int with_index = job->index != NULL;
+    for (size_t i = start; i < end; i++) {
+        uint64_t key = job->keys[i];
+        size_t digit = (key >> shift) & (SORT_BUCKETS - 1);
+        size_t slot = digit * SORT_LINE + filled[digit]++;
+        keys[slot] = key;
+        if (with_index) positions[slot] = job->index[i];
+        if (filled[digit] == SORT_LINE) {
+            memcpy(job->keys_out + offsets[digit], keys + digit * SORT_LINE, SORT_LINE * sizeof(uint64_t));
+            if (with_index) {
+                memcpy(job->index_out + offsets[digit], positions + digit * SORT_LINE, SORT_LINE * sizeof(uint64_t));
+            }
+            offsets[digit] += SORT_LINE;
+            filled[digit] = 0;
+        }
+    }
+    for (size_t digit = 0; digit < SORT_BUCKETS; digit++) {
+        memcpy(job->keys_out + offsets[digit], keys + digit * SORT_LINE, filled[digit] * sizeof(uint64_t));
+        if (with_index) {
+            memcpy(job->index_out + offsets[digit], positions + digit * SORT_LINE, filled[digit] * sizeof(uint64_t));
+        }
+    }
+}
+
+// The sort keys of x in ascending order, and in *index, when index is not
+// NULL, the 0-based positions they came from; NULL without memory
+uint64_t* sort_reals(ThreadPool *pool, const double *x, size_t n, uint64_t **index) {
+    size_t size = (n > 0 ? n : 1) * sizeof(uint64_t);
+    uint64_t *keys = malloc(size), *order = index != NULL ? malloc(size) : NULL;
+    if (keys == NULL || (index != NULL && order == NULL)) {
+        free(keys);
+        free(order);
+        return NULL;
+    }
+    if (n < SORT_RADIX_MIN) {
+        SortItem *items = malloc((n > 0 ? n : 1) * sizeof(SortItem));
+        if (items == NULL) {
+            free(keys);
+            free(order);
+            return NULL;
+        }
+        for (size_t i = 0; i < n; i++) {
+            items[i].key = sort_key(x[i]);
+            items[i].index = i;
+        }
+        sort_items(items, n);
+        for (size_t i = 0; i < n; i++) keys[i] = items[i].key;
+        for (size_t i = 0; order != NULL && i < n; i++) order[i] = items[i].index;
+        free(items);
+        if (index != NULL) *index = order;
+        return keys;
+    }
+    
+    size_t chunks = (n + SORT_CHUNK - 1) / SORT_CHUNK;
+    if (chunks < 2) pool = NULL;
+    size_t workers = pool != NULL ? (size_t)pool->thread_count + 1 : 1;
+    uint64_t *spare_keys = malloc(size), *spare_order = index != NULL ? malloc(size) : NULL;
+    size_t *counts = malloc(chunks * SORT_BUCKETS * sizeof(size_t));
+    uint64_t *bits = malloc(2 * chunks * sizeof(uint64_t));
+    uint64_t *lines = aligned_alloc(64, workers * 2 * SORT_BUCKETS * SORT_LINE * sizeof(uint64_t));
+    if (spare_keys == NULL || (index != NULL && spare_order == NULL) || counts == NULL || bits == NULL ||
+        lines == NULL) {
+        free(keys);
+        free(order);
+        free(spare_keys);
+        free(spare_order);
+        free(counts);
+        free(bits);
+        free(lines);
+        return NULL;
+    }
+    RadixJob job = {x, NULL, NULL, keys, order, n, 0, counts, bits, lines};
+    threadpool_run(pool, radix_key_task, &job, chunks);
+    uint64_t all = UINT64_MAX, any = 0;
+    for (size_t c = 0; c < chunks; c++) {
+        all &= bits[2 * c];
+        any |= bits[2 * c + 1];
+    }
+    for (int shift = 0; shift < 64; shift += SORT_BITS) {
+        if ((((all ^ any) >> shift) & (SORT_BUCKETS - 1)) == 0) continue;
+        job.keys = keys;
+        job.index = order;
+        job.keys_out = spare_keys;
+        job.index_out = spare_order;
+        job.shift = shift;
+        threadpool_run(pool, radix_count_task, &job, chunks);
+        size_t total = 0;
+        for (size_t d = 0; d < SORT_BUCKETS; d++) {
+            for (size_t c = 0; c < chunks; c++) {
+                size_t count = counts[c * SORT_BUCKETS + d];
+                counts[c * SORT_BUCKETS + d] = total;
+                total += count;
+            }
+        }
+        threadpool_run(pool, radix_scatter_task, &job, chunks);
+    
+        uint64_t *swap = keys;
+        keys = spare_keys;
+        spare_keys = swap;
+        swap = order;
+        order = spare_order;
+        spare_order = swap;
+    }
+    free(spare_keys);
+    free(spare_order);
+    free(counts);
+    free(bits);
+    free(lines);
+    if (index != NULL) *index = order;
+    return keys;
+}
+
+// Sort n doubles in place, NaN last; 0 without memory. Short arrays are
+// insertion sorted where they are
+int sort_doubles(double *x, size_t n) {
+    if (n < PDQ_INSERTION) {
+        for (size_t i = 1; i < n; i++) {
+            double item = x[i];
+            uint64_t key = sort_key(item);
+            size_t j = i;
+            for (; j > 0 && key < sort_key(x[j - 1]); j--) x[j] = x[j - 1];
+            x[j] = item;
+        }
+        return 1;
+    }
+    uint64_t *keys = sort_reals(NULL, x, n, NULL);
+    if (keys == NULL) return 0;
+    for (size_t i = 0; i < n; i++) x[i] = sort_value(keys[i]);
+    free(keys);
+    return 1;
+}
+
+// sort(x): the elements of a real vector in ascending order
+Value func_sort(Calculator *calc, Value args[], int count, CalcError *error) {
+    const Vector *x = lsq_vector(args[0], error);
+    if (x == NULL) return value_real(0);
+    Vector *out = vector_new(x->length, 0);
+    uint64_t *keys = out != NULL ? sort_reals(calculator_pool(calc), x->re, x->length, NULL) : NULL;
+    if (keys == NULL) {
+        vector_release(out);
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    for (size_t i = 0; i < x->length; i++) out->re[i] = sort_value(keys[i]);
+    free(keys);
+    return value_vector(out);
+}
+
+// argsort(x): the 1-based positions of the elements of x in sorted order,
+// equal elements in the order they appear
+Value func_argsort(Calculator *calc, Value args[], int count, CalcError *error) {
+    const Vector *x = lsq_vector(args[0], error);
+    if (x == NULL) return value_real(0);
+    Vector *out = vector_new(x->length, 0);
+    uint64_t *order = NULL;
+    uint64_t *keys = out != NULL ? sort_reals(calculator_pool(calc), x->re, x->length, &order) : NULL;
+    if (keys == NULL) {
+        vector_release(out);
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    free(keys);
+    for (size_t i = 0; i < x->length; i++) out->re[i] = (double)(order[i] + 1);
+    free(order);
+    return value_vector(out);
+}
+
+// Whether two sorted keys hold equal numbers (-0 and 0, or two NaNs)
+ALWAYS_INLINE int sort_keys_equal(uint64_t a, uint64_t b) {
+    return a == b || sort_value(a) == sort_value(b);
+}
+
+// unique(x): the distinct elements of x in ascending order; -0 and 0 are
+// one element (0), and so are all NaNs
+Value func_unique(Calculator *calc, Value args[], int count, CalcError *error) {
+    const Vector *x = lsq_vector(args[0], error);
+    if (x == NULL) return value_real(0);
+    uint64_t *keys = sort_reals(calculator_pool(calc), x->re, x->length, NULL);
+    size_t distinct = 0;
+    for (size_t i = 0; keys != NULL && i < x->length; i++) {
+        if (i > 0 && sort_keys_equal(keys[i - 1], keys[i])) {
+            keys[distinct - 1] = keys[i];
+        } else {
+            keys[distinct++] = keys[i];
+        }
+    }
+    Vector *out = keys != NULL ? vector_new(distinct, 0) : NULL;
+    if (out == NULL) {
+        free(keys);
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    for (size_t i = 0; i < distinct; i++) out->re[i] = sort_value(keys[i]);
+    free(keys);
+    return value_vector(out);
+}
+
+// rank(x): the 1-based rank of each element of x in sorted order; tied
+// elements share the mean of their ranks, and NaNs rank last, tied
+Value func_rank(Calculator *calc, Value args[], int count, CalcError *error) {
+    const Vector *x = lsq_vector(args[0], error);
+    if (x == NULL) return value_real(0);
+    Vector *out = vector_new(x->length, 0);
+    uint64_t *order = NULL;
+    uint64_t *keys = out != NULL ? sort_reals(calculator_pool(calc), x->re, x->length, &order) : NULL;
+    if (keys == NULL) {
+        vector_release(out);
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    for (size_t first = 0, last; first < x->length; first = last) {
+        for (last = first + 1; last < x->length && sort_keys_equal(keys[first], keys[last]); last++) {}
+        double rank = (first + last + 1) / 2.0;
+        for (size_t i = first; i < last; i++) out->re[order[i]] = rank;
+    }
+    free(keys);
+    free(order);
+    return value_vector(out);
+}
+
+// Cumulative and moving-window kernels. Window i of movmean, movstd,
+// movmin and movmax holds the w elements centred on i (one more before it
+// than after for even w), cut short at the ends. Each output takes O(1)
+// steps whatever w is: the means and deviations slide compensated sums of
+// x - ref and (x - ref)^2, ref being the first element of the chunk's
+// first window, and movmin and movmax keep a monotonic deque of the
+// positions that can still be the window's extreme. Vectors longer than
+// MOVING_CHUNK split into chunks for the thread pool when w is at most
+// MOVING_CHUNK; each chunk sets up its first window afresh, so the work
+// stays O(n) and results do not depend on the number of threads.
+#define MOVING_CHUNK 65536
+
+enum { MOVING_MEAN, MOVING_STD, MOVING_MIN, MOVING_MAX };
+
+ALWAYS_INLINE void compensated_add(double *sum, double *compensation, double x) {
+    double t = *sum + x;
+    *compensation += fabs(*sum) >= fabs(x) ? (*sum - t) + x : (x - t) + *sum;
+    *sum = t;
+}
+
+// Check the input or output of a kernel for NaN and infinities, as
+// results of scalar functions are checked; 0 on error
+int kernel_finite(const double *x, size_t n, CalcError *error) {
+    size_t bad = batch_first_nonfinite(x, n);
+    if (bad < n) *error = isnan(x[bad]) ? CALC_ERROR_UNDEFINED : CALC_ERROR_OVERFLOW;
+    return bad == n;
+}
+
+// A real vector argument of a kernel, with finite elements
+const Vector* kernel_vector(Value v, CalcError *error) {
+    const Vector *x = lsq_vector(v, error);
+    return x != NULL && kernel_finite(x->re, x->length, error) ? x : NULL;
+}
+
+// cumsum(x): running sums of a real vector, compensated
+Value func_cumsum(Calculator *calc, Value args[], int count, CalcError *error) {
+    const Vector *x = kernel_vector(args[0], error);
+    if (x == NULL) return value_real(0);
+    Vector *out = vector_new(x->length, 0);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    double sum = 0, compensation = 0;
+    for (size_t i = 0; i < x->length; i++) {
+        compensated_add(&sum, &compensation, x->re[i]);
+        out->re[i] = sum + compensation;
+    }
+    if (!kernel_finite(out->re, out->length, error)) {
+        vector_release(out);
+        return value_real(0);
+    }
+    return value_vector(out);
+}
+
+// cumprod(x): running products of a real vector
+Value func_cumprod(Calculator *calc, Value args[], int count, CalcError *error) {
+    const Vector *x = kernel_vector(args[0], error);
+    if (x == NULL) return value_real(0);
+    Vector *out = vector_new(x->length, 0);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    double product = 1;
+    for (size_t i = 0; i < x->length; i++) {
+        product *= x->re[i];
+        out->re[i] = product;
+    }
+    if (!kernel_finite(out->re, out->length, error)) {
+        vector_release(out);
+        return value_real(0);
+    }
+    return value_vector(out);
+}
+
+// diff(x): differences of consecutive elements, one fewer than x has
+// (none for a single element, as numpy gives)
+Value func_diff(Calculator *calc, Value args[], int count, CalcError *error) {
+    const Vector *x = kernel_vector(args[0], error);
+    if (x == NULL) return value_real(0);
+    Vector *out = vector_new(x->length > 0 ? x->length - 1 : 0, 0);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    const double *in = x->re;
+    double *y = out->re;
+    for (size_t i = 0; i < out->length; i++) y[i] = in[i + 1] - in[i];
+    if (!kernel_finite(y, out->length, error)) {
+        vector_release(out);
+        return value_real(0);
+    }
+    return value_vector(out);
+}
+
+// Chunks of a moving kernel for the thread pool
+typedef struct {
+    const double *x;
+    double *out;
+    size_t n;
+    size_t before;      // Elements of a full window before its centre
+    size_t after;       // and after it
+    size_t chunk;       // Outputs per chunk
+    int kind;
+    size_t *deques;     // Per worker, room for the positions a chunk pushes
+    size_t deque_size;
+} MovingJob;
+
+void moving_sum_task(void *arg, size_t index, int worker) {
+    MovingJob *job = arg;
+    const double *x = job->x;
+    size_t start = index * job->chunk;
+    size_t end = job->n - start < job->chunk ? job->n : start + job->chunk;
+    size_t lo = start > job->before ? start - job->before : 0, hi = lo;
+    double ref = x[lo], sum = 0, sum_c = 0, squares = 0, squares_c = 0;
+    int std = job->kind == MOVING_STD;
+    for (size_t i = start; i < end; i++) {
+        size_t last = job->n - i > job->after ? i + job->after + 1 : job->n;
+        size_t first = i > job->before ? i - job->before : 0;
+        for (; hi < last; hi++) {
+            double d = x[hi] - ref;
+            compensated_add(&sum, &sum_c, d);
+            if (std) compensated_add(&squares, &squares_c, d * d);
+        }
+        for (; lo < first; lo++) {
+            double d = x[lo] - ref;
+            compensated_add(&sum, &sum_c, -d);
+            if (std) compensated_add(&squares, &squares_c, -d * d);
+        }
+        double count = (double)(hi - lo), mean = (sum + sum_c) / count;
+        if (!std) {
+            job->out[i] = ref + mean;
+            continue;
+        }
+        double variance = count > 1 ? ((squares + squares_c) - count * mean * mean) / (count - 1) : 0;
+        job->out[i] = sqrt(variance > 0 ? variance : 0);
+    }
+}
+
+// The deque holds positions in [lo, hi) whose values strictly increase
+// (movmin) or decrease (movmax) from head to tail; its head is the
+// window's extreme
+void moving_extreme_task(void *arg, size_t index, int worker) {
+    MovingJob *job = arg;
+    const double *x = job->x;
+    size_t start = index * job->chunk;
+    size_t end = job->n - start < job->chunk ? job->n : start + job->chunk;
+    size_t *deque = job->deques + (size_t)worker * job->deque_size;
+    size_t head = 0, tail = 0, hi = start > job->before ? start - job->before : 0;
+    int max = job->kind == MOVING_MAX;
+    for (size_t i = start; i < end; i++) {
+        size_t last = job->n - i > job->after ? i + job->after + 1 : job->n;
+        size_t first = i > job->before ? i - job->before : 0;
+        for (; hi < last; hi++) {
+            double v = x[hi];
+            while (tail > head && (max ? x[deque[tail - 1]] <= v : x[deque[tail - 1]] >= v)) tail--;
+            deque[tail++] = hi;
+        }
+        while (deque[head] < first) head++;
+        job->out[i] = x[deque[head]];
+    }
+}
+
+// movmean, movstd, movmin and movmax of x over windows of w elements
+Value moving_kernel(Calculator *calc, Value args[], int kind, CalcError *error) {
+    const Vector *x = kernel_vector(args[0], error);
+    if (x == NULL) return value_real(0);
+    double width = args[1].type == CALC_INTEGER ? (double)args[1].integer : args[1].real;
+    if (args[1].type != CALC_INTEGER && args[1].type != CALC_REAL) {
+        *error = CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    if (!(width >= 1) || width != floor(width)) {
+        *error = CALC_ERROR_ARG_RANGE;
+        return value_real(0);
+    }
+    
+    // Windows of 2n + 1 or more all cover the whole vector
+    size_t n = x->length;
+    size_t w = width < 2.0 * n + 1 ? (size_t)width : 2 * n + 1;
+    MovingJob job = {x->re, NULL, n, w / 2, (w - 1) / 2, w <= MOVING_CHUNK ? MOVING_CHUNK : n, kind, NULL, 0};
+    size_t chunks = (n + job.chunk - 1) / job.chunk;
+    ThreadPool *pool = chunks > 1 ? calculator_pool(calc) : NULL;
+    size_t workers = pool != NULL ? (size_t)pool->thread_count + 1 : 1;
+    int extreme = kind == MOVING_MIN || kind == MOVING_MAX;
+    Vector *out = vector_new(n, 0);
+    if (extreme && out != NULL) {
+        job.deque_size = n < job.chunk + w ? n : job.chunk + w;
+        job.deques = malloc(workers * job.deque_size * sizeof(size_t));
+    }
+    if (out == NULL || (extreme && job.deques == NULL)) {
+        vector_release(out);
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    job.out = out->re;
+    threadpool_run(pool, extreme ? moving_extreme_task : moving_sum_task, &job, chunks);
+    free(job.deques);
+    if (!kernel_finite(out->re, n, error)) {
+        vector_release(out);
+        return value_real(0);
+    }
+    return value_vector(out);
+}
+
+// movmean(x, w), movstd(x, w), movmin(x, w), movmax(x, w): the mean,
+// sample standard deviation (0 for one element), minimum and maximum of
+// each element's window
+Value func_movmean(Calculator *calc, Value args[], int count, CalcError *error) {
+    return moving_kernel(calc, args, MOVING_MEAN, error);
+}
+
+Value func_movstd(Calculator *calc, Value args[], int count, CalcError *error) {
+    return moving_kernel(calc, args, MOVING_STD, error);
+}
+
+Value func_movmin(Calculator *calc, Value args[], int count, CalcError *error) {
+    return moving_kernel(calc, args, MOVING_MIN, error);
+}
+
+Value func_movmax(Calculator *calc, Value args[], int count, CalcError *error) {
+    return moving_kernel(calc, args, MOVING_MAX, error);
+}
+
+// Calculate a scalar function with error checking
+double call_scalar_function(Calculator *calc, FunctionDef *func_def, double args[], int arg_count, CalcError *error) {
+    const char *func_name = func_def->name;
+    
+    // Handle angle conversion for trigonometric functions
+    if (calc->angle_mode == 1) { // Degrees mode
+        if (strcmp(func_name, "sin") == 0 || strcmp(func_name, "cos") == 0 || 
+            strcmp(func_name, "tan") == 0 || strcmp(func_name, "asin") == 0 ||
+            strcmp(func_name, "acos") == 0 || strcmp(func_name, "atan") == 0) {
+            if (strcmp(func_name, "sin") == 0 || strcmp(func_name, "cos") == 0 || 
+                strcmp(func_name, "tan") == 0) {
+                args[0] = args[0] * PI / 180.0;
+            } else {
+                double result = func_def->func(args, arg_count);
+                if (!isnan(result)) {
+                    result = result * 180.0 / PI;
+                }
+                return result;
+            }
+        }
+    }
+    
+    double result = func_def->func(args, arg_count);
+    if (isnan(result)) {
+        *error = CALC_ERROR_UNDEFINED;
+    } else if (isinf(result)) {
+        *error = CALC_ERROR_OVERFLOW;
+    }
+    
+    return result;
+}
+
+// Map a one-argument function over a real vector with its batch kernel,
+// a block at a time, with the angle conversion and errors of
+// call_scalar_function
+void batch_vector_function(Calculator *calc, FunctionDef *func_def, const Vector *in, Vector *out, CalcError *error) {
+    int degrees = calc->angle_mode == 1;
+    int scale_in = degrees && (func_def->func == func_sin || func_def->func == func_cos ||
+                               func_def->func == func_tan);
+    int scale_out = degrees && func_def->func == func_atan;
+    double block[KERNEL_BLOCK];
+    for (size_t base = 0; base < in->length; base += KERNEL_BLOCK) {
+        size_t len = in->length - base < KERNEL_BLOCK ? in->length - base : KERNEL_BLOCK;
+        const double *x = in->re + base;
+        double *y = out->re + base;
+        if (scale_in) {
+            for (size_t k = 0; k < len; k++) block[k] = x[k] * PI / 180.0;
+            x = block;
+        }
+        func_def->batch(len, x, NULL, y);
+        if (scale_out) {
+            for (size_t k = 0; k < len; k++) y[k] = y[k] * 180.0 / PI;
+            continue;
+        }
+        size_t bad = batch_first_nonfinite(y, len);
+        if (bad < len) {
+            *error = isnan(y[bad]) ? CALC_ERROR_UNDEFINED : CALC_ERROR_OVERFLOW;
+            return;
+        }
+    }
+}
+
+// Apply a scalar function to vector arguments: variadic functions (min, sum,
+// ...) see all elements, fixed-arity ones are mapped element-wise with
+// scalar arguments broadcast
+Value call_vector_function(Calculator *calc, FunctionDef *func_def, Value args[], int arg_count, CalcError *error) {
+    size_t length = 0;
+    for (int i = 0; i < arg_count; i++) {
+        if (args[i].type != CALC_VECTOR) continue;
+        if (args[i].vector->im != NULL) {
+            *error = CALC_ERROR_COMPLEX_OP;
+            return value_real(0);
+        }
+        if (func_def->max_args == 0) {
+            length += args[i].vector->length;
+        } else if (length != 0 && length != args[i].vector->length) {
+            *error = CALC_ERROR_MATRIX_DIM;
+            return value_real(0);
+        } else {
+            length = args[i].vector->length;
+        }
+    }
+    
+    if (func_def->max_args == 0) {
+        double *flat = malloc((length + arg_count) * sizeof(double));
+        if (flat == NULL) {
+            *error = CALC_ERROR_MEMORY;
+            return value_real(0);
+        }
+        int total = 0;
+        for (int i = 0; i < arg_count; i++) {
+            if (args[i].type == CALC_VECTOR) {
+                memcpy(flat + total, args[i].vector->re, args[i].vector->length * sizeof(double));
+                total += args[i].vector->length;
+            } else {
+                flat[total++] = args[i].real;
+            }
+        }
+        double result = total > 0 ? call_scalar_function(calc, func_def, flat, total, error) : 0;
+        free(flat);
+        return value_real(result);
+    }
+    
+    Vector *out = vector_new(length, 0);
+    if (out == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    if (func_def->batch != NULL && arg_count == 1) {
+        batch_vector_function(calc, func_def, args[0].vector, out, error);
+        if (*error != CALC_OK) {
+            vector_release(out);
+            return value_real(0);
+        }
+        return value_vector(out);
+    }
+    double scalar_args[MAX_FUNC_ARGS];
+    for (size_t k = 0; k < length && *error == CALC_OK; k++) {
+        for (int i = 0; i < arg_count; i++) {
+            scalar_args[i] = args[i].type == CALC_VECTOR ? args[i].vector->re[k] : args[i].real;
+        }
+        out->re[k] = call_scalar_function(calc, func_def, scalar_args, arg_count, error);
+    }
+    if (*error != CALC_OK) {
+        vector_release(out);
+        return value_real(0);
+    }
+    return value_vector(out);
+}
+
+// Calculate a function with error checking
+Value calculate_function(Calculator *calc, const char *func_name, Value args[], int arg_count, CalcError *error) {
+    FunctionDef *func_def = find_function(func_name);
+    if (func_def == NULL) {
+        *error = CALC_ERROR_UNKNOWN_FUNCTION;
+        return value_real(0);
+    }
+    return call_function(calc, func_def, args, arg_count, error);
+}
+
+// Call a resolved function, dispatching on the argument types
+Value call_function(Calculator *calc, FunctionDef *func_def, Value args[], int arg_count, CalcError *error) {
+    if (arg_count < func_def->min_args || (func_def->max_args > 0 && arg_count > func_def->max_args)) {
+        *error = CALC_ERROR_ARG_COUNT;
+        return value_real(0);
+    }
+    
+    // Integer arguments go to the exact version when all of them are
+    // integers and there is one; everything else sees them as doubles
+    int integers = 0;
+    for (int i = 0; i < arg_count; i++) {
+        integers += value_is_integer(args[i]);
+    }
+    if (integers > 0) {
+        if (integers == arg_count && func_def->ifunc != NULL) {
+            return call_integer_function(calc, func_def, args, arg_count, error);
+        }
+        if (arg_count > MAX_FUNC_ARGS) {
+            *error = CALC_ERROR_ARG_COUNT;
+            return value_real(0);
+        }
+        Value converted[MAX_FUNC_ARGS];
+        for (int i = 0; i < arg_count; i++) {
+            converted[i] = value_is_integer(args[i]) ? value_real(value_to_double(args[i])) : args[i];
+        }
+        return call_function(calc, func_def, converted, arg_count, error);
+    }
+    
+    if (func_def->vfunc != NULL) {
+        return func_def->vfunc(calc, args, arg_count, error);
+    }
+    
+    for (int i = 0; i < arg_count; i++) {
+        if (value_is_complex(args[i])) {
+            if (func_def->func == func_sum || func_def->func == func_mean) {
+                return complex_reduce(args, arg_count, func_def->func == func_mean, error);
+            }
+            if (func_def->cfunc == NULL) {
+                *error = CALC_ERROR_COMPLEX_OP;
+                return value_real(0);
+            }
+            return apply_complex_function(calc, func_def, args[0], error);
+        }
+    }
+    
+    double scalar_args[MAX_FUNC_ARGS];
+    for (int i = 0; i < arg_count; i++) {
+        if (args[i].type == CALC_VECTOR) {
+            return call_vector_function(calc, func_def, args, arg_count, error);
+        }
+        if (args[i].type != CALC_REAL) {
+            *error = args[i].type == CALC_COMPLEX ? CALC_ERROR_COMPLEX_OP : CALC_ERROR_TYPE;
+            return value_real(0);
+        }
+        scalar_args[i] = args[i].real;
+    }
+    if (func_def->memo_from > 0 && arg_count <= MEMO_MAX_ARGS && scalar_args[0] >= func_def->memo_from) {
+        // The tag is the table index; call_scalar_function may rewrite args
+        unsigned long long tag = (unsigned long long)(func_def - function_table + 1) << 8 | arg_count;
+        unsigned long long key[MEMO_MAX_ARGS];
+        Value result;
+        memcpy(key, scalar_args, arg_count * sizeof(double));
+        if (memo_lookup(calc, tag, key, arg_count, &result)) {
+            return result;
+        }
+        result = value_real(call_scalar_function(calc, func_def, scalar_args, arg_count, error));
+        if (*error == CALC_OK) memo_store(calc, tag, key, arg_count, result);
+        return result;
+    }
+    return value_real(call_scalar_function(calc, func_def, scalar_args, arg_count, error));
+}
+
+// Call the exact version of a function, through the memo cache when its
+// arguments are 64-bit integers and args[0] >= memo_from. Integer keys
+// have bit 7 of the tag set, so they never match the bits of doubles.
+Value call_integer_function(Calculator *calc, FunctionDef *func_def, Value args[], int arg_count, CalcError *error) {
+    int memoize = func_def->memo_from > 0 && arg_count <= MEMO_MAX_ARGS &&
+                  args[0].type == CALC_INTEGER && args[0].integer >= func_def->memo_from;
+    unsigned long long key[MEMO_MAX_ARGS];
+    for (int i = 0; memoize && i < arg_count; i++) {
+        memoize = args[i].type == CALC_INTEGER;
+        memcpy(&key[i], &args[i].integer, sizeof(key[i]));
+    }
+    if (!memoize) {
+        return func_def->ifunc(calc, args, arg_count, error);
+    }
+    
+    unsigned long long tag = (unsigned long long)(func_def - function_table + 1) << 8 | 1 << 7 | arg_count;
+    Value result;
+    if (memo_lookup(calc, tag, key, arg_count, &result)) {
+        return result;
+    }
+    result = func_def->ifunc(calc, args, arg_count, error);
+    if (*error == CALC_OK) memo_store(calc, tag, key, arg_count, result);
+    return result;
+}
+
+// Scan one token starting at p and return the position after it. At the
+// end of the input the token is TOK_EOF.
+const char* next_token(const char *p, Token *token, CalcError *error) {
+    while (isspace(*p)) p++;
+    token->start = p;
+    
+    if (*p == '\0') {
+        token->type = TOK_EOF;
+        return p;
+    }
+    
+    // Number (a leading '-' is parsed as unary minus)
+    if (isdigit(*p) || (*p == '.' && isdigit(*(p+1)))) {
+        char *end;
+        token->type = TOK_NUMBER;
+        token->value = strtod(p, &end);
+        if (end[-1] == '.' && end[0] == '.') end--; // 1..n is a range
+        token->digits = p;
+        token->digit_count = end - p;
+        for (const char *d = p; d < end; d++) {
+            if (!isdigit(*d)) token->digit_count = 0;
+        }
+        
+        // Imaginary literal such as 4i
+        if (*end == 'i' && !isalnum(*(end+1)) && *(end+1) != '_') {
+            token->type = TOK_IMAGINARY;
+            end++;
+        }
+        return end;
+    }
+    
+    // Identifier or function; names are limited to 31 characters
+    if (isalpha(*p) || *p == '_') {
+        int i = 0;
+        while (isalnum(*p) || *p == '_') {
+            if (i == 31) {
+                *error = CALC_ERROR_SYNTAX;
+                token->type = TOK_EOF;
+                return p;
+            }
+            token->name[i++] = *p++;
+        }
+        token->name[i] = '\0';
+        
+        // Check if it's followed by '(' - then it's a function
+        const char *next = p;
+        while (isspace(*next)) next++;
+        token->type = *next == '(' ? TOK_FUNCTION : TOK_IDENTIFIER;
+        return p;
+    }
+    
+    // Operators, two-character ones first (see Token for their codes)
+    static const struct { char text[3]; char code; } pairs[] = {
+        {"<=", 'l'}, {">=", 'g'}, {"==", 'e'}, {"!=", 'n'}, {"&&", '&'}, {"||", '|'}
+    };
+    for (size_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+        if (p[0] == pairs[i].text[0] && p[1] == pairs[i].text[1]) {
+            token->type = TOK_OPERATOR;
+            token->name[0] = pairs[i].code;
+            token->name[1] = '\0';
+            return p + 2;
+        }
+    }
+    if (strchr("+-*/^!%<>", *p) != NULL) {
+        token->type = TOK_OPERATOR;
+        token->name[0] = *p;
+        token->name[1] = '\0';
+        return p + 1;
+    }
+    
+    // Brackets, separators and equals
+    switch (*p) {
+        case '(': token->type = TOK_LPAREN; return p + 1;
+        case ')': token->type = TOK_RPAREN; return p + 1;
+        case '[': token->type = TOK_LBRACKET; return p + 1;
+        case ']': token->type = TOK_RBRACKET; return p + 1;
+        case '{': token->type = TOK_LBRACE; return p + 1;
+        case '}': token->type = TOK_RBRACE; return p + 1;
+        case ',': token->type = TOK_COMMA; return p + 1;
+        case ';': token->type = TOK_SEMICOLON; return p + 1;
+        case '=': token->type = TOK_EQUAL; return p + 1;
+    }
+    if (p[0] == '.' && p[1] == '.') {
+        token->type = TOK_RANGE;
+        return p + 2;
+    }
+    
+    // Unknown character
+    *error = CALC_ERROR_SYNTAX;
+    token->type = TOK_EOF;
+    return p;
+}
+
+// Tokenize a whole expression into a growable array ending with TOK_EOF
+Token* tokenize(const char *expr, int *token_count, CalcError *error) {
+    int capacity = 64;
+    Token *tokens = malloc(capacity * sizeof(Token));
+    if (tokens == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    
+    *token_count = 0;
+    const char *p = expr;
+    do {
+        if (*token_count == capacity) {
+            capacity *= 2;
+            Token *grown = realloc(tokens, capacity * sizeof(Token));
+            if (grown == NULL) {
+                free(tokens);
+                *error = CALC_ERROR_MEMORY;
+                return NULL;
+            }
+            tokens = grown;
+        }
+        p = next_token(p, &tokens[*token_count], error);
+    } while (*error == CALC_OK && tokens[(*token_count)++].type != TOK_EOF);
+    
+    if (*error != CALC_OK) {
+        free(tokens);
+        return NULL;
+    }
+    return tokens;
+}
+
+// Exact integers. Integer literals are CALC_INTEGER values, and +, -, *,
+// % and ^ with a non-negative exponent keep integer operands exact, as
+// does a division that leaves no remainder: 64-bit arithmetic checks for
+// overflow with the compiler builtins and continues in a BigInt, and
+// results that fit in 64 bits again become CALC_INTEGER. Operations with
+// a double operand, and divisions with a remainder, work in doubles.
+// Results are limited to BIGINT_MAX_LIMBS (about 39000 decimal digits);
+// larger ones are reported as overflow, as they would be for doubles.
+#define BIGINT_MAX_LIMBS 4096
+#define BIGINT_DECIMAL_BASE 1000000000u
+#define BIGINT_DECIMAL_DIGITS 9
+#define LOG2_E 1.44269504088896340736
+
+// Allocate a zeroed magnitude of length limbs
+BigInt* bigint_new(size_t length) {
+    BigInt *b = malloc(sizeof(BigInt) + (length > 0 ? length : 1) * sizeof(uint32_t));
+    if (b == NULL) return NULL;
+    b->refcount = 1;
+    b->sign = 1;
+    b->length = length;
+    memset(b->limbs, 0, length * sizeof(uint32_t));
+    return b;
+}
+
+void bigint_release(BigInt *b) {
+    if (b == NULL) return;
+    if (__atomic_sub_fetch(&b->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(b);
+    }
+}
+
+// Wrap a result in a value, which takes over the reference: leading zero
+// limbs are dropped and a result that fits in 64 bits becomes
+// CALC_INTEGER. NULL (allocation failed) and oversized results are errors.
+Value value_bigint(BigInt *b, CalcError *error) {
+    if (b == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    while (b->length > 0 && b->limbs[b->length - 1] == 0) b->length--;
+    if (b->length > BIGINT_MAX_LIMBS) {
+        bigint_release(b);
+        *error = CALC_ERROR_OVERFLOW;
+        return value_real(0);
+    }
+    if (b->length <= 2) {
+        unsigned long long m = b->length > 0 ? b->limbs[0] : 0;
+        if (b->length == 2) m |= (unsigned long long)b->limbs[1] << 32;
+        if (m <= LLONG_MAX || (b->sign < 0 && m == 1ULL << 63)) {
+            long long x = b->sign < 0 && m > 0 ? -(long long)(m - 1) - 1 : (long long)m;
+            bigint_release(b);
+            return value_integer(x);
+        }
+    }
+    Value v;
+    v.type = CALC_BIGINT;
+    v.bigint = b;
+    return v;
+}
+
+int value_is_integer(Value v) {
+    return v.type == CALC_INTEGER || v.type == CALC_BIGINT;
+}
+
+// A real or integer scalar as a double; bigints beyond the double range
+// become infinite
+double value_to_double(Value v) {
+    if (v.type == CALC_INTEGER) return (double)v.integer;
+    if (v.type == CALC_BIGINT) {
+        int exponent;
+        double mantissa = integer_frexp(v, &exponent);
+        return ldexp(mantissa, exponent);
+    }
+    return v.real;
+}
+
+void integer_view(Value v, IntegerView *view) {
+    if (v.type == CALC_BIGINT) {
+        view->sign = v.bigint->sign;
+        view->length = v.bigint->length;
+        view->limbs = v.bigint->limbs;
+        return;
+    }
+    unsigned long long m = v.integer < 0 ? 0 - (unsigned long long)v.integer : (unsigned long long)v.integer;
+    view->sign = v.integer < 0 ? -1 : 1;
+    view->small[0] = (uint32_t)m;
+    view->small[1] = (uint32_t)(m >> 32);
+    view->length = view->small[1] != 0 ? 2 : view->small[0] != 0;
+    view->limbs = view->small;
+}
+
+// An integer as mantissa * 2^exponent, the mantissa taken from the top
+// three limbs so that ratios of huge integers stay finite
+double integer_frexp(Value v, int *exponent) {
+    *exponent = 0;
+    if (v.type == CALC_INTEGER) return (double)v.integer;
+    const BigInt *b = v.bigint;
+    size_t low = b->length > 3 ? b->length - 3 : 0;
+    double mantissa = 0;
+    for (size_t i = b->length; i-- > low; ) {
+        mantissa = mantissa * 0x1p32 + b->limbs[i];
+    }
+    *exponent = (int)(low * 32);
+    return b->sign * mantissa;
+}
+
+int integer_sign(Value v) {
+    if (v.type == CALC_INTEGER) return (v.integer > 0) - (v.integer < 0);
+    return v.bigint->sign;
+}
+
+int integer_compare(Value a, Value b) {
+    if (a.type == CALC_INTEGER && b.type == CALC_INTEGER) {
+        return (a.integer > b.integer) - (a.integer < b.integer);
+    }
+    int sa = integer_sign(a), sb = integer_sign(b);
+    if (sa != sb) return sa < sb ? -1 : 1;
+    IntegerView x, y;
+    integer_view(a, &x);
+    integer_view(b, &y);
+    return sa * mag_compare(x.limbs, x.length, y.limbs, y.length);
+}
+
+// Compare an integer with a double exactly: -1, 0 or 1, or 2 if x is NaN.
+// A double of at least 2^63 in magnitude is an integer, whose limbs are
+// built from its 53-bit mantissa for comparison with a bigint.
+int integer_compare_real(Value a, double x) {
+    if (isnan(x)) return 2;
+    if (a.type == CALC_INTEGER) {
+        if (x >= 0x1p63) return -1;
+        if (x < -0x1p63) return 1;
+        long long t = (long long)x;
+        if (a.integer != t) return a.integer < t ? -1 : 1;
+        double fraction = x - (double)t;
+        return (fraction < 0) - (fraction > 0);
+    }
+    int sign = a.bigint->sign;
+    if (isinf(x) || fabs(x) < 0x1p63 || (x < 0) != (sign < 0)) {
+        return isinf(x) ? (x > 0 ? -1 : 1) : sign;
+    }
+    int exponent;
+    uint64_t mantissa = (uint64_t)ldexp(frexp(fabs(x), &exponent), 53);
+    int shift = exponent - 53;  // |x| = mantissa * 2^shift, shift > 0
+    uint32_t limbs[40] = {0};
+    size_t words = shift / 32;
+    int bits = shift % 32;
+    uint64_t low = mantissa & 0xFFFFFFFFu, high = mantissa >> 32;
+    limbs[words] = (uint32_t)(low << bits);
+    limbs[words + 1] = (uint32_t)((high << bits) | (bits ? low >> (32 - bits) : 0));
+    limbs[words + 2] = (uint32_t)(bits ? high >> (32 - bits) : 0);
+    size_t length = words + 3;
+    while (length > 0 && limbs[length - 1] == 0) length--;
+    return sign * mag_compare(a.bigint->limbs, a.bigint->length, limbs, length);
+}
+
+// Decimal digits of an integer (malloc'ed), peeled nine at a time by
+// division by 10^9
+char* integer_format(Value v) {
+    if (v.type == CALC_INTEGER) {
+        char *text = malloc(24);
+        if (text != NULL) snprintf(text, 24, "%lld", v.integer);
+        return text;
+    }
+    const BigInt *b = v.bigint;
+    size_t chunk_limit = b->length * 32 / 29 + 1;  // 10^9 > 2^29
+    uint32_t *work = malloc(b->length * sizeof(uint32_t));
+    uint32_t *chunks = malloc(chunk_limit * sizeof(uint32_t));
+    char *text = malloc(chunk_limit * BIGINT_DECIMAL_DIGITS + 2);
+    if (work == NULL || chunks == NULL || text == NULL) {
+        free(work);
+        free(chunks);
+        free(text);
+        return NULL;
+    }
+    
+    memcpy(work, b->limbs, b->length * sizeof(uint32_t));
+    size_t n = b->length, count = 0;
+    do {
+        chunks[count++] = mag_div_small(work, work, n, BIGINT_DECIMAL_BASE);
+        while (n > 0 && work[n - 1] == 0) n--;
+    } while (n > 0);
+    char *p = text;
+    if (b->sign < 0) *p++ = '-';
+    p += sprintf(p, "%u", chunks[count - 1]);
+    for (size_t i = count - 1; i-- > 0; ) {
+        p += sprintf(p, "%09u", chunks[i]);
+    }
+    free(work);
+    free(chunks);
+    return text;
+}
+
+// Value of a run of decimal digits, accumulated nine digits at a time
+Value integer_parse(const char *digits, size_t count, CalcError *error) {
+    while (count > 1 && *digits == '0') {
+        digits++;
+        count--;
+    }
+    if (count < 19) {
+        long long x = 0;
+        for (size_t i = 0; i < count; i++) x = x * 10 + (digits[i] - '0');
+        return value_integer(x);
+    }
+    if (count > BIGINT_MAX_LIMBS * BIGINT_DECIMAL_DIGITS) {
+        *error = CALC_ERROR_OVERFLOW;
+        return value_real(0);
+    }
+    
+    BigInt *b = bigint_new(count / BIGINT_DECIMAL_DIGITS + 2);
+    if (b == NULL) return value_bigint(NULL, error);
+    size_t n = 0;
+    for (size_t i = 0; i < count; ) {
+        size_t take = i == 0 && count % BIGINT_DECIMAL_DIGITS ? count % BIGINT_DECIMAL_DIGITS : BIGINT_DECIMAL_DIGITS;
+        uint64_t carry = 0;
+        for (size_t j = 0; j < take; j++) carry = carry * 10 + (digits[i + j] - '0');
+        i += take;
+        for (size_t k = 0; k < n; k++) {
+            carry += (uint64_t)b->limbs[k] * BIGINT_DECIMAL_BASE;
+            b->limbs[k] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        if (carry != 0) b->limbs[n++] = (uint32_t)carry;
+    }
+    b->length = n;
+    return value_bigint(b, error);
+}
+
+// Compare magnitudes without leading zero limbs
+int mag_compare(const uint32_t *a, size_t na, const uint32_t *b, size_t nb) {
+    if (na != nb) return na < nb ? -1 : 1;
+    for (size_t i = na; i-- > 0; ) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+// out = a + b for na >= nb; out has room for na + 1 limbs
+void mag_add(uint32_t *out, const uint32_t *a, size_t na, const uint32_t *b, size_t nb) {
+    uint64_t carry = 0;
+    for (size_t i = 0; i < na; i++) {
+        carry += (uint64_t)a[i] + (i < nb ? b[i] : 0);
+        out[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    out[na] = (uint32_t)carry;
+}
+
+// out = a - b for a >= b; out has room for na limbs
+void mag_sub(uint32_t *out, const uint32_t *a, size_t na, const uint32_t *b, size_t nb) {
+    uint64_t borrow = 0;
+    for (size_t i = 0; i < na; i++) {
+        uint64_t d = (uint64_t)a[i] - (i < nb ? b[i] : 0) - borrow;
+        out[i] = (uint32_t)d;
+        borrow = d >> 63;
+    }
+}
+
+// out = a * b by schoolbook multiplication; out has na + nb limbs and
+// overlaps neither operand
+void mag_mul(uint32_t *out, const uint32_t *a, size_t na, const uint32_t *b, size_t nb) {
+    memset(out, 0, (na + nb) * sizeof(uint32_t));
+    for (size_t i = 0; i < na; i++) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < nb; j++) {
+            carry += (uint64_t)a[i] * b[j] + out[i + j];
+            out[i + j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        out[i + nb] = (uint32_t)carry;
+    }
+}
+
+// q = a / d for a one-limb divisor, returning the remainder; q may be a
+uint32_t mag_div_small(uint32_t *q, const uint32_t *a, size_t n, uint32_t d) {
+    uint64_t rem = 0;
+    for (size_t i = n; i-- > 0; ) {
+        uint64_t cur = rem << 32 | a[i];
+        q[i] = (uint32_t)(cur / d);
+        rem = cur % d;
+    }
+    return (uint32_t)rem;
+}
+
+// Long division (Knuth's algorithm D) for na >= nb >= 2: q gets
+// na - nb + 1 limbs and r, unless NULL, nb limbs. work holds na + nb + 1
+// limbs for the operands shifted so the divisor's top bit is set.
+void mag_divmod(uint32_t *q, uint32_t *r, const uint32_t *a, size_t na, const uint32_t *b, size_t nb, uint32_t *work) {
+    int s = __builtin_clz(b[nb - 1]);
+    uint32_t *v = work, *u = work + nb;
+    for (size_t i = nb - 1; i > 0; i--) {
+        v[i] = b[i] << s | (s ? (uint32_t)((uint64_t)b[i - 1] >> (32 - s)) : 0);
+    }
+    v[0] = b[0] << s;
+    u[na] = s ? (uint32_t)((uint64_t)a[na - 1] >> (32 - s)) : 0;
+    for (size_t i = na - 1; i > 0; i--) {
+        u[i] = a[i] << s | (s ? (uint32_t)((uint64_t)a[i - 1] >> (32 - s)) : 0);
+    }
+    u[0] = a[0] << s;
+    
+    for (size_t j = na - nb + 1; j-- > 0; ) {
+        // Estimate the quotient digit from the top two limbs, then correct
+        // it with the next one; it is then at most one too large
+        uint64_t top = (uint64_t)u[j + nb] << 32 | u[j + nb - 1];
+        uint64_t qhat = top / v[nb - 1], rhat = top % v[nb - 1];
+        while (qhat >> 32 || qhat * v[nb - 2] > (rhat << 32 | u[j + nb - 2])) {
+            qhat--;
+            rhat += v[nb - 1];
+            if (rhat >> 32) break;
+        }
+    
+        // Subtract qhat * v from the current window
+        int64_t t;
+        uint64_t k = 0;
+        for (size_t i = 0; i < nb; i++) {
+            uint64_t p = qhat * v[i];
+            t = (int64_t)u[i + j] - (int64_t)k - (int64_t)(p & 0xFFFFFFFFu);
+            u[i + j] = (uint32_t)t;
+            k = (p >> 32) - (t >> 32);
+        }
+        t = (int64_t)u[j + nb] - (int64_t)k;
+        u[j + nb] = (uint32_t)t;
+        q[j] = (uint32_t)qhat;
+    
+        // Too large by one: add the divisor back
+        if (t < 0) {
+            q[j]--;
+            k = 0;
+            for (size_t i = 0; i < nb; i++) {
+                k += (uint64_t)u[i + j] + v[i];
+                u[i + j] = (uint32_t)k;
+                k >>= 32;
+            }
+            u[j + nb] += (uint32_t)k;
+        }
+    }
+    if (r != NULL) {
+        for (size_t i = 0; i < nb; i++) {
+            r[i] = u[i] >> s | (s ? (uint32_t)((uint64_t)u[i + 1] << (32 - s)) : 0);
+        }
+    }
+}
+
+// x + y, or x - y when negate is set
+Value integer_add(const IntegerView *x, const IntegerView *y, int negate, CalcError *error) {
+    const IntegerView *big = x, *small = y;
+    int big_sign = x->sign, small_sign = negate ? -y->sign : y->sign;
+    if (mag_compare(x->limbs, x->length, y->limbs, y->length) < 0) {
+        big = y;
+        small = x;
+        big_sign = small_sign;
+        small_sign = x->sign;
+    }
+    BigInt *out = bigint_new(big->length + 1);
+    if (out == NULL) return value_bigint(NULL, error);
+    if (big_sign == small_sign) {
+        mag_add(out->limbs, big->limbs, big->length, small->limbs, small->length);
+    } else {
+        mag_sub(out->limbs, big->limbs, big->length, small->limbs, small->length);
+    }
+    out->sign = big_sign;
+    return value_bigint(out, error);
+}
+
+Value integer_multiply(const IntegerView *x, const IntegerView *y, CalcError *error) {
+    if (x->length + y->length > BIGINT_MAX_LIMBS + 1) {
+        *error = CALC_ERROR_OVERFLOW;
+        return value_real(0);
+    }
+    BigInt *out = bigint_new(x->length + y->length);
+    if (out == NULL) return value_bigint(NULL, error);
+    mag_mul(out->limbs, x->limbs, x->length, y->limbs, y->length);
+    out->sign = x->sign * y->sign;
+    return value_bigint(out, error);
+}
+
+// Truncating division by a nonzero y: quotient and remainder (either may
+// be NULL), the remainder taking the sign of x
+int integer_divide(const IntegerView *x, const IntegerView *y, Value *quotient, Value *remainder, CalcError *error) {
+    size_t qn = x->length >= y->length ? x->length - y->length + 1 : 1;
+    BigInt *q = bigint_new(qn), *r = bigint_new(y->length);
+    uint32_t *work = NULL;
+    if (y->length >= 2 && x->length >= y->length) {
+        work = malloc((x->length + y->length + 1) * sizeof(uint32_t));
+    }
+    if (q == NULL || r == NULL || (work == NULL && y->length >= 2 && x->length >= y->length)) {
+        bigint_release(q);
+        bigint_release(r);
+        free(work);
+        *error = CALC_ERROR_MEMORY;
+        return 0;
+    }
+    
+    if (x->length < y->length) {
+        memcpy(r->limbs, x->limbs, x->length * sizeof(uint32_t));
+    } else if (y->length == 1) {
+        r->limbs[0] = mag_div_small(q->limbs, x->limbs, x->length, y->limbs[0]);
+    } else {
+        mag_divmod(q->limbs, r->limbs, x->limbs, x->length, y->limbs, y->length, work);
+    }
+    free(work);
+    q->sign = x->sign * y->sign;
+    r->sign = x->sign;
+    
+    Value qv = value_bigint(q, error), rv = value_bigint(r, error);
+    if (quotient != NULL) {
+        *quotient = qv;
+    } else {
+        value_release(&qv);
+    }
+    if (remainder != NULL) {
+        *remainder = rv;
+    } else {
+        value_release(&rv);
+    }
+    return 1;
+}
+
+// Integer power: exact by repeated squaring for a non-negative exponent
+// once the result is known to fit, a double for a negative one
+Value integer_power(Calculator *calc, Value a, Value b, CalcError *error) {
+    if (integer_sign(b) < 0) {
+        return value_binary(calc, '^', value_real(value_to_double(a)), value_real(value_to_double(b)), error);
+    }
+    if (a.type == CALC_INTEGER && a.integer >= -1 && a.integer <= 1) {
+        int odd = b.type == CALC_INTEGER ? (int)(b.integer & 1) : (int)(b.bigint->limbs[0] & 1);
+        if (a.integer == 0) return value_integer(integer_sign(b) == 0);
+        return value_integer(a.integer < 0 && odd ? -1 : 1);
+    }
+    int exponent;
+    double mantissa = integer_frexp(a, &exponent);
+    if (b.type == CALC_BIGINT || (log2(fabs(mantissa)) + exponent) * b.integer > BIGINT_MAX_LIMBS * 32.0) {
+        *error = CALC_ERROR_OVERFLOW;
+        return value_real(0);
+    }
+    
+    long long e = b.integer;
+    Value result = value_integer(1), square = value_retain(a);
+    while (*error == CALC_OK) {
+        if (e & 1) {
+            Value product = integer_binary(calc, '*', result, square, error);
+            value_release(&result);
+            result = product;
+        }
+        e >>= 1;
+        if (e == 0 || *error != CALC_OK) break;
+        Value next = integer_binary(calc, '*', square, square, error);
+        value_release(&square);
+        square = next;
+    }
+    value_release(&square);
+    if (*error != CALC_OK) value_release(&result);
+    return result;
+}
+
+// Arithmetic on two integer values, exact where described above
+Value integer_binary(Calculator *calc, char op, Value a, Value b, CalcError *error) {
+    if (a.type == CALC_INTEGER && b.type == CALC_INTEGER) {
+        long long x = a.integer, y = b.integer, r;
+        switch (op) {
+            case '+':
+                if (!__builtin_add_overflow(x, y, &r)) return value_integer(r);
+                break;
+            case '-':
+                if (!__builtin_sub_overflow(x, y, &r)) return value_integer(r);
+                break;
+            case '*':
+                if (!__builtin_mul_overflow(x, y, &r)) return value_integer(r);
+                break;
+            case '/':
+            case '%':
+                if (y == 0) {
+                    *error = CALC_ERROR_DIV_ZERO;
+                    return value_real(0);
+                }
+                if (y == -1) {
+                    if (op == '%') return value_integer(0);
+                    if (x != LLONG_MIN) return value_integer(-x);
+                    break;
+                }
+                if (op == '%') return value_integer(x % y);
+                if (x % y == 0) return value_integer(x / y);
+                return value_real((double)x / (double)y);
+        }
+    }
+    
+    IntegerView x, y;
+    integer_view(a, &x);
+    integer_view(b, &y);
+    switch (op) {
+        case '+': return integer_add(&x, &y, 0, error);
+        case '-': return integer_add(&x, &y, 1, error);
+        case '*': return integer_multiply(&x, &y, error);
+        case '/':
+        case '%': {
+            if (y.length == 0) {
+                *error = CALC_ERROR_DIV_ZERO;
+                return value_real(0);
+            }
+            Value quotient, remainder;
+            if (!integer_divide(&x, &y, &quotient, &remainder, error)) return value_real(0);
+            if (op == '%' || *error != CALC_OK) {
+                value_release(&quotient);
+                return remainder;
+            }
+            if (remainder.type == CALC_INTEGER && remainder.integer == 0) return quotient;
+            value_release(&quotient);
+            value_release(&remainder);
+            int ea, eb;
+            double ma = integer_frexp(a, &ea), mb = integer_frexp(b, &eb);
+            return value_real(ldexp(ma / mb, ea - eb));
+        }
+        case '^': return integer_power(calc, a, b, error);
+    }
+    *error = CALC_ERROR_SYNTAX;
+    return value_real(0);
+}
+
+// Greatest common divisor by Euclid's algorithm, in 64 bits once the
+// operands fit
+Value integer_gcd(Calculator *calc, Value a, Value b, CalcError *error) {
+    Value x = func_iabs(calc, &a, 1, error), y = func_iabs(calc, &b, 1, error);
+    while (*error == CALC_OK && integer_sign(y) != 0) {
+        if (x.type == CALC_INTEGER && y.type == CALC_INTEGER) {
+            x.integer = gcd(x.integer, y.integer);
+            break;
+        }
+        Value r = integer_binary(calc, '%', x, y, error);
+        value_release(&x);
+        x = y;
+        y = r;
+    }
+    value_release(&y);
+    if (*error != CALC_OK) value_release(&x);
+    return x;
+}
+
+// n (n - 1) ... (n - k + 1) for 0 <= k <= n: in 64 bits while the
+// product fits, then in place while the factors fit in one limb
+Value integer_falling(Calculator *calc, Value n, long long k, CalcError *error) {
+    long long product = 1, i = 0;
+    if (n.type == CALC_INTEGER) {
+        while (i < k && !__builtin_mul_overflow(product, n.integer - i, &product)) i++;
+        if (i == k) return value_integer(product);
+    }
+    if (n.type == CALC_INTEGER && n.integer <= UINT32_MAX) {
+        size_t capacity = 16, used = 1;
+        BigInt *b = bigint_new(capacity);
+        if (b == NULL) return value_bigint(NULL, error);
+        b->limbs[0] = 1;
+        for (i = 0; i < k; i++) {
+            uint64_t carry = 0;
+            for (size_t j = 0; j < used; j++) {
+                carry += (uint64_t)b->limbs[j] * (uint32_t)(n.integer - i);
+                b->limbs[j] = (uint32_t)carry;
+                carry >>= 32;
+            }
+            if (carry == 0) continue;
+            if (used == capacity) {
+                BigInt *grown = capacity > BIGINT_MAX_LIMBS ? NULL : realloc(b, sizeof(BigInt) + 2 * capacity * sizeof(uint32_t));
+                if (grown == NULL) {
+                    free(b);
+                    *error = capacity > BIGINT_MAX_LIMBS ? CALC_ERROR_OVERFLOW : CALC_ERROR_MEMORY;
+                    return value_real(0);
+                }
+                b = grown;
+                capacity *= 2;
+            }
+            b->limbs[used++] = (uint32_t)carry;
+        }
+        b->length = used;
+        return value_bigint(b, error);
+    }
+    
+    Value result = value_integer(1), factor = value_retain(n);
+    for (i = 0; i < k && *error == CALC_OK; i++) {
+        Value product = integer_binary(calc, '*', result, factor, error);
+        value_release(&result);
+        result = product;
+        Value next = integer_binary(calc, '-', factor, value_integer(1), error);
+        value_release(&factor);
+        factor = next;
+    }
+    value_release(&factor);
+    if (*error != CALC_OK) value_release(&result);
+    return result;
+}
+
+// Exact versions of the integer functions, called when every argument is
+// an integer value (see call_function)
+Value func_iabs(Calculator *calc, Value args[], int count, CalcError *error) {
+    if (integer_sign(args[0]) < 0) {
+        return integer_binary(calc, '-', value_integer(0), args[0], error);
+    }
+    return value_retain(args[0]);
+}
+
+// floor, ceil and round leave integers unchanged
+Value func_iround(Calculator *calc, Value args[], int count, CalcError *error) {
+    return value_retain(args[0]);
+}
+
+Value func_imin(Calculator *calc, Value args[], int count, CalcError *error) {
+    int best = 0;
+    for (int i = 1; i < count; i++) {
+        if (integer_compare(args[i], args[best]) < 0) best = i;
+    }
+    return value_retain(args[best]);
+}
+
+Value func_imax(Calculator *calc, Value args[], int count, CalcError *error) {
+    int best = 0;
+    for (int i = 1; i < count; i++) {
+        if (integer_compare(args[i], args[best]) > 0) best = i;
+    }
+    return value_retain(args[best]);
+}
+
+Value func_isum(Calculator *calc, Value args[], int count, CalcError *error) {
+    long long total = 0, next;
+    int i = 0;
+    // On overflow next holds the wrapped sum and total the one before it
+    while (i < count && args[i].type == CALC_INTEGER && !__builtin_add_overflow(total, args[i].integer, &next)) {
+        total = next;
+        i++;
+    }
+    Value sum = value_integer(total);
+    for (; i < count && *error == CALC_OK; i++) {
+        Value next = integer_binary(calc, '+', sum, args[i], error);
+        value_release(&sum);
+        sum = next;
+    }
+    return sum;
+}
+
+// n! for n up to the size limit, which the log-gamma estimate checks
+// before any multiplying
+Value func_ifactorial(Calculator *calc, Value args[], int count, CalcError *error) {
+    if (integer_sign(args[0]) < 0) {
+        *error = CALC_ERROR_UNDEFINED;
+        return value_real(0);
+    }
+    if (args[0].type == CALC_INTEGER && args[0].integer <= 20) {
+        long long product = 1;
+        for (long long i = 2; i <= args[0].integer; i++) product *= i;
+        return value_integer(product);
+    }
+    if (args[0].type == CALC_BIGINT || log_factorial((double)args[0].integer) * LOG2_E > BIGINT_MAX_LIMBS * 32.0) {
+        *error = CALC_ERROR_OVERFLOW;
+        return value_real(0);
+    }
+    return integer_falling(calc, args[0], args[0].integer, error);
+}
+
+Value func_igcd(Calculator *calc, Value args[], int count, CalcError *error) {
+    long long g = 0;
+    int i = 0;
+    for (; i < count && args[i].type == CALC_INTEGER && args[i].integer != LLONG_MIN; i++) {
+        g = gcd(g, args[i].integer);
+    }
+    Value result = value_integer(g);
+    for (; i < count && *error == CALC_OK; i++) {
+        Value next = integer_gcd(calc, result, args[i], error);
+        value_release(&result);
+        result = next;
+    }
+    return result;
+}
+
+// lcm(a, b) = |a / gcd(a, b) * b|, and 0 if either is 0
+Value func_ilcm(Calculator *calc, Value args[], int count, CalcError *error) {
+    long long m = 1, next;
+    int i = 0;
+    for (; i < count && args[i].type == CALC_INTEGER && args[i].integer != LLONG_MIN; i++) {
+        next = lcm(m, args[i].integer);
+        if (next < 0) break;
+        m = next;
+    }
+    Value result = value_integer(m);
+    for (; i < count && *error == CALC_OK; i++) {
+        if (integer_sign(args[i]) == 0) {
+            value_release(&result);
+            return value_integer(0);
+        }
+        Value g = integer_gcd(calc, result, args[i], error);
+        Value quotient = *error == CALC_OK ? integer_binary(calc, '/', result, g, error) : value_real(0);
+        Value product = *error == CALC_OK ? integer_binary(calc, '*', quotient, args[i], error) : value_real(0);
+        value_release(&result);
+        result = *error == CALC_OK ? func_iabs(calc, &product, 1, error) : value_real(0);
+        value_release(&g);
+        value_release(&quotient);
+        value_release(&product);
+    }
+    return result;
+}
+
+// log2 of n! / (n - k)!, to refuse results past the size limit up front.
+// lgamma loses the difference for huge n, where k log2(n) bounds it.
+double integer_falling_bits(double n, double k) {
+    if (n < 0x1p53) return (log_factorial(n) - log_factorial(n - k)) * LOG2_E;
+    return k * log2(n);
+}
+
+Value func_iperm(Calculator *calc, Value args[], int count, CalcError *error) {
+    Value n = args[0], k = args[1];
+    if (integer_sign(k) < 0 || integer_compare(k, n) > 0) {
+        *error = CALC_ERROR_UNDEFINED;
+        return value_real(0);
+    }
+    if (k.type == CALC_BIGINT || (k.integer > PRODUCT_STEP_LIMIT &&
+        integer_falling_bits(value_to_double(n), (double)k.integer) > BIGINT_MAX_LIMBS * 32.0)) {
+        *error = CALC_ERROR_OVERFLOW;
+        return value_real(0);
+    }
+    return integer_falling(calc, n, k.integer, error);
+}
+
+// C(n, k) by the product of (n - k + i) / i, where every quotient is exact
+Value func_icomb(Calculator *calc, Value args[], int count, CalcError *error) {
+    Value n = args[0];
+    if (integer_sign(args[1]) < 0 || integer_compare(args[1], n) > 0) {
+        *error = CALC_ERROR_UNDEFINED;
+        return value_real(0);
+    }
+    if (n.type == CALC_INTEGER && n.integer < BINOMIAL_TABLE_SIZE) {
+        pthread_once(&factorial_once, build_factorial_table);
+        return value_integer((long long)binomial_table[n.integer][args[1].integer]);
+    }
+    
+    // Use the smaller of k and n - k
+    Value k = integer_binary(calc, '-', n, args[1], error);
+    if (*error != CALC_OK) return value_real(0);
+    if (integer_compare(args[1], k) < 0) {
+        value_release(&k);
+        k = value_retain(args[1]);
+    }
+    if (k.type == CALC_BIGINT ||
+        integer_falling_bits(value_to_double(n), (double)k.integer) - log_factorial((double)k.integer) * LOG2_E > BIGINT_MAX_LIMBS * 32.0) {
+        value_release(&k);
+        *error = CALC_ERROR_OVERFLOW;
+        return value_real(0);
+    }
+    
+    Value result = value_integer(1);
+    Value factor = integer_binary(calc, '-', n, k, error);
+    for (long long i = 1; i <= k.integer && *error == CALC_OK; i++) {
+        Value next = integer_binary(calc, '+', factor, value_integer(1), error);
+        value_release(&factor);
+        factor = next;
+        Value product = *error == CALC_OK ? integer_binary(calc, '*', result, factor, error) : value_real(0);
+        value_release(&result);
+        result = *error == CALC_OK ? integer_binary(calc, '/', product, value_integer(i), error) : value_real(0);
+        value_release(&product);
+    }
+    value_release(&factor);
+    value_release(&k);
+    if (*error != CALC_OK) value_release(&result);
+    return result;
+}
+
+// Apply a binary operator to two values (operands are borrowed). Vector
+// operands are combined element-wise; division by zero inside a vector
+// follows IEEE rules instead of raising an error. Polynomials combine
+// with each other and with scalars (calc supplies FFT plans for long
+// products). Sparse matrices scale, add and multiply real vectors; dense
+// matrices also multiply each other. Integers stay exact with each other
+// (see integer_binary) and otherwise act as doubles.
+Value value_binary(Calculator *calc, char op, Value a, Value b, CalcError *error) {
+    if (value_is_integer(a) || value_is_integer(b)) {
+        if (value_is_integer(a) && value_is_integer(b)) {
+            return integer_binary(calc, op, a, b, error);
+        }
+        if (value_is_integer(a)) a = value_real(value_to_double(a));
+        if (value_is_integer(b)) b = value_real(value_to_double(b));
+    }
+    if (a.type == CALC_SPARSE || b.type == CALC_SPARSE) {
+        return sparse_binary(calc, op, a, b, error);
+    }
+    if (a.type == CALC_MATRIX || b.type == CALC_MATRIX) {
+        return matrix_binary(calc, op, a, b, error);
+    }
+    if (a.type == CALC_POLY || b.type == CALC_POLY) {
+        return poly_binary(calc, op, a, b, error);
+    }
+    if (a.type == CALC_VECTOR || b.type == CALC_VECTOR) {
+        return vector_binary(op, a, b, error);
+    }
+    
+    if (a.type == CALC_REAL && b.type == CALC_REAL) {
+        switch (op) {
+            case '+': return value_real(a.real + b.real);
+            case '-': return value_real(a.real - b.real);
+            case '*': return value_real(a.real * b.real);
+            case '/':
+            case '%':
+                if (b.real == 0) {
+                    *error = CALC_ERROR_DIV_ZERO;
+                    return value_real(0);
+                }
+                return value_real(op == '/' ? a.real / b.real : fmod(a.real, b.real));
+            case '^': {
+                double result = pow(a.real, b.real);
+                if (isnan(result)) {
+                    *error = CALC_ERROR_UNDEFINED;
+                } else if (isinf(result) && !isinf(a.real) && !isinf(b.real)) {
+                    *error = a.real == 0 ? CALC_ERROR_DIV_ZERO : CALC_ERROR_OVERFLOW;
+                }
+                return value_real(result);
+            }
+        }
+        *error = CALC_ERROR_SYNTAX;
+        return value_real(0);
+    }
+    
+    if ((a.type != CALC_REAL && a.type != CALC_COMPLEX) ||
+        (b.type != CALC_REAL && b.type != CALC_COMPLEX)) {
+        *error = CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    
+    ComplexNumber x = {a.type == CALC_COMPLEX ? a.complex_num.real : a.real,
+                       a.type == CALC_COMPLEX ? a.complex_num.imag : 0};
+    ComplexNumber y = {b.type == CALC_COMPLEX ? b.complex_num.real : b.real,
+                       b.type == CALC_COMPLEX ? b.complex_num.imag : 0};
+    ComplexNumber r;
+    long e;
+    switch (op) {
+        case '+': r = complex_add(x, y); break;
+        case '-': r = complex_sub(x, y); break;
+        case '*': r = complex_mul(x, y); break;
+        case '/':
+            if (y.real == 0 && y.imag == 0) {
+                *error = CALC_ERROR_DIV_ZERO;
+                return value_real(0);
+            }
+            r = complex_div(x, y);
+            break;
+        case '^':
+            r = value_small_integer(b, &e) ? complex_integer_power(x, e) : complex_pow(x, y);
+            break;
+        case '%':
+            *error = CALC_ERROR_COMPLEX_OP;
+            return value_real(0);
+        default:
+            *error = CALC_ERROR_SYNTAX;
+            return value_real(0);
+    }
+    return value_complex(r.real, r.imag);
+}
+
+// Does the order of two values (-1, 0, 1, or 2 when unordered) satisfy a
+// relational operator?
+ALWAYS_INLINE int order_satisfies(char op, int order) {
+    switch (op) {
+        case '<': return order == -1;
+        case 'l': return order == -1 || order == 0;
+        case '>': return order == 1;
+        case 'g': return order == 0 || order == 1;
+        case 'e': return order == 0;
+        default: return order != 0;
+    }
+}
+
+// Relational operators (op is a Token operator code) on scalars, giving
+// the integer 0 or 1. Integers compare exactly with each other and with
+// doubles; NaN is unordered, so only != holds for it. Complex values may
+// only be tested for equality.
+Value value_compare(char op, Value a, Value b, CalcError *error) {
+    int order;
+    if (a.type == CALC_COMPLEX || b.type == CALC_COMPLEX) {
+        Value pair[2] = {a, b};
+        ComplexNumber z[2];
+        for (int i = 0; i < 2; i++) {
+            if (pair[i].type != CALC_COMPLEX && pair[i].type != CALC_REAL && !value_is_integer(pair[i])) {
+                *error = CALC_ERROR_TYPE;
+                return value_real(0);
+            }
+            z[i].real = pair[i].type == CALC_COMPLEX ? pair[i].complex_num.real : value_to_double(pair[i]);
+            z[i].imag = pair[i].type == CALC_COMPLEX ? pair[i].complex_num.imag : 0;
+        }
+        if (op != 'e' && op != 'n') {
+            *error = CALC_ERROR_COMPLEX_OP;
+            return value_real(0);
+        }
+        order = z[0].real == z[1].real && z[0].imag == z[1].imag ? 0 : 2;
+    } else if (value_is_integer(a) && value_is_integer(b)) {
+        order = integer_compare(a, b);
+    } else if (value_is_integer(a) && b.type == CALC_REAL) {
+        order = integer_compare_real(a, b.real);
+    } else if (a.type == CALC_REAL && value_is_integer(b)) {
+        order = integer_compare_real(b, a.real);
+        if (order != 2) order = -order;
+    } else if (a.type == CALC_REAL && b.type == CALC_REAL) {
+        order = a.real < b.real ? -1 : a.real > b.real ? 1 : a.real == b.real ? 0 : 2;
+    } else {
+        *error = CALC_ERROR_TYPE;
+        return value_real(0);
+    }
+    return value_integer(order_satisfies(op, order));
+}
+
+// Truth of a condition: nonzero scalars are true, as in C (so NaN is
+// true). Other values are a type error.
+int value_truth(Value v, CalcError *error) {
+    switch (v.type) {
+        case CALC_REAL: return v.real != 0;
+        case CALC_INTEGER: return v.integer != 0;
+        case CALC_BIGINT: return 1;
+        case CALC_COMPLEX: return v.complex_num.real != 0 || v.complex_num.imag != 0;
+        default:
+            *error = CALC_ERROR_TYPE;
+            return 0;
+    }
+}
+
+// Units. A unit name after a number scales it to base units while
+// compiling (3 km is the constant 3000 with unit m), and every register
+// has a unit the compiler checks: + - % and comparisons need equal units,
+// * and / combine them, and ^ takes a constant integer power. Registers
+// hold no units at run time.
+typedef struct {
+    const char *name;
+    double scale;       // Size in base units
+    Unit unit;
+    int prefixed;       // Takes SI prefixes (km, ms, kPa)
+} UnitDef;
+
+const UnitDef unit_table[] = {
+    {"m", 1, UNIT(1, 0, 0, 0, 0, 0, 0), 1},
+    {"kg", 1, UNIT(0, 1, 0, 0, 0, 0, 0), 0},
+    {"g", 1e-3, UNIT(0, 1, 0, 0, 0, 0, 0), 1},
+    {"s", 1, UNIT(0, 0, 1, 0, 0, 0, 0), 1},
+    {"A", 1, UNIT(0, 0, 0, 1, 0, 0, 0), 1},
+    {"K", 1, UNIT(0, 0, 0, 0, 1, 0, 0), 1},
+    {"mol", 1, UNIT(0, 0, 0, 0, 0, 1, 0), 1},
+    {"cd", 1, UNIT(0, 0, 0, 0, 0, 0, 1), 1},
+    {"Hz", 1, UNIT(0, 0, -1, 0, 0, 0, 0), 1},
+    {"N", 1, UNIT(1, 1, -2, 0, 0, 0, 0), 1},
+    {"Pa", 1, UNIT(-1, 1, -2, 0, 0, 0, 0), 1},
+    {"J", 1, UNIT(2, 1, -2, 0, 0, 0, 0), 1},
+    {"W", 1, UNIT(2, 1, -3, 0, 0, 0, 0), 1},
+    {"C", 1, UNIT(0, 0, 1, 1, 0, 0, 0), 1},
+    {"V", 1, UNIT(2, 1, -3, -1, 0, 0, 0), 1},
+    {"ohm", 1, UNIT(2, 1, -3, -2, 0, 0, 0), 1},
+    {"F", 1, UNIT(-2, -1, 4, 2, 0, 0, 0), 1},
+    {"T", 1, UNIT(0, 1, -2, -1, 0, 0, 0), 1},
+    {"Wb", 1, UNIT(2, 1, -2, -1, 0, 0, 0), 1},
+    {"H", 1, UNIT(2, 1, -2, -2, 0, 0, 0), 1},
+    {"L", 1e-3, UNIT(3, 0, 0, 0, 0, 0, 0), 1},
+    {"eV", 1.602176634e-19, UNIT(2, 1, -2, 0, 0, 0, 0), 1},
+    {"Wh", 3600, UNIT(2, 1, -2, 0, 0, 0, 0), 1},
+    {"cal", 4.184, UNIT(2, 1, -2, 0, 0, 0, 0), 1},
+    {"min", 60, UNIT(0, 0, 1, 0, 0, 0, 0), 0},
+    {"h", 3600, UNIT(0, 0, 1, 0, 0, 0, 0), 0},
+    {"day", 86400, UNIT(0, 0, 1, 0, 0, 0, 0), 0},
+    {"in", 0.0254, UNIT(1, 0, 0, 0, 0, 0, 0), 0},
+    {"ft", 0.3048, UNIT(1, 0, 0, 0, 0, 0, 0), 0},
+    {"mi", 1609.344, UNIT(1, 0, 0, 0, 0, 0, 0), 0},
+    {"au", 149597870700.0, UNIT(1, 0, 0, 0, 0, 0, 0), 0},
+    {"lb", 0.45359237, UNIT(0, 1, 0, 0, 0, 0, 0), 0},
+    {"bar", 1e5, UNIT(-1, 1, -2, 0, 0, 0, 0), 0},
+    {"atm", 101325, UNIT(-1, 1, -2, 0, 0, 0, 0), 0},
+    {NULL, 0, 0, 0}
+};
+
+const char *const unit_base_names[UNIT_BASES] = {"m", "kg", "s", "A", "K", "mol", "cd"};
+
+// Scale and unit of a unit name, possibly with an SI prefix (P T G M k c
+// m u n p f); returns 0 if the name is not a unit
+int find_unit(const char *name, double *scale, Unit *unit) {
+    static const char prefixes[] = "PTGMkcmunpf";
+    static const double factors[] = {1e15, 1e12, 1e9, 1e6, 1e3, 1e-2, 1e-3, 1e-6, 1e-9, 1e-12, 1e-15};
+    for (const UnitDef *def = unit_table; def->name != NULL; def++) {
+        if (strcmp(def->name, name) == 0) {
+            *scale = def->scale;
+            *unit = def->unit;
+            return 1;
+        }
+    }
+    const char *prefix = name[0] != '\0' ? strchr(prefixes, name[0]) : NULL;
+    if (prefix == NULL) return 0;
+    for (const UnitDef *def = unit_table; def->name != NULL; def++) {
+        if (def->prefixed && strcmp(def->name, name + 1) == 0) {
+            *scale = factors[prefix - prefixes] * def->scale;
+            *unit = def->unit;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int unit_exponent(Unit unit, int base) {
+    int e = (unit >> (4 * base)) & 15;
+    return e >= 8 ? e - 16 : e;
+}
+
+// a * b^power, or CALC_ERROR_UNITS if an exponent leaves -8..7
+Unit unit_product(Unit a, Unit b, int power, CalcError *error) {
+    Unit result = 0;
+    for (int i = 0; i < UNIT_BASES; i++) {
+        long long e = unit_exponent(a, i) + (long long)power * unit_exponent(b, i);
+        if (e < -8 || e > 7) {
+            *error = CALC_ERROR_UNITS;
+            return 0;
+        }
+        result |= (Unit)(e & 15) << (4 * i);
+    }
+    return result;
+}
+
+// The unit whose n-th power is unit, or CALC_ERROR_UNITS if there is none
+Unit unit_root(Unit unit, int n, CalcError *error) {
+    Unit result = 0;
+    for (int i = 0; i < UNIT_BASES; i++) {
+        int e = unit_exponent(unit, i);
+        if (e % n != 0) {
+            *error = CALC_ERROR_UNITS;
+            return 0;
+        }
+        result |= (Unit)((e / n) & 15) << (4 * i);
+    }
+    return result;
+}
+
+// Print a unit as " m s^-2", a form the compiler reads back; nothing for
+// dimensionless values
+void fprint_unit(FILE *out, Unit unit) {
+    for (int i = 0; i < UNIT_BASES; i++) {
+        int e = unit_exponent(unit, i);
+        if (e == 1) {
+            fprintf(out, " %s", unit_base_names[i]);
+        } else if (e != 0) {
+            fprintf(out, " %s^%d", unit_base_names[i], e);
+        }
+    }
+}
+
+// Append an instruction, growing the code array (and in scripts the line
+// table) as needed
+int emit(Compiler *comp, OpCode op, int dst, int a, int b, int c) {
+    Program *prog = comp->prog;
+    if (prog->code_count == prog->code_capacity) {
+        int capacity = prog->code_capacity ? prog->code_capacity * 2 : 32;
+        Instruction *grown = realloc(prog->code, capacity * sizeof(Instruction));
+        if (grown == NULL) {
+            *comp->error = CALC_ERROR_MEMORY;
+            return -1;
+        }
+        prog->code = grown;
+        if (comp->script) {
+            int *lines = realloc(prog->lines, capacity * sizeof(int));
+            if (lines == NULL) {
+                *comp->error = CALC_ERROR_MEMORY;
+                return -1;
+            }
+            prog->lines = lines;
+        }
+        prog->code_capacity = capacity;
+    }
+    if (prog->lines != NULL) prog->lines[prog->code_count] = comp->line;
+    Instruction *ins = &prog->code[prog->code_count++];
+    ins->op = op;
+    ins->dst = dst;
+    ins->a = a;
+    ins->b = b;
+    ins->c = c;
+    if (dst + 1 > prog->register_count) {
+        prog->register_count = dst + 1;
+    }
+    return dst;
+}
+
+// Load a constant into register dst (takes over the value's reference)
+int emit_constant(Compiler *comp, int dst, Value value) {
+    Program *prog = comp->prog;
+    if (prog->const_count == prog->const_capacity) {
+        int capacity = prog->const_capacity ? prog->const_capacity * 2 : 16;
+        Value *grown = realloc(prog->constants, capacity * sizeof(Value));
+        if (grown == NULL) {
+            value_release(&value);
+            *comp->error = CALC_ERROR_MEMORY;
+            return -1;
+        }
+        prog->constants = grown;
+        prog->const_capacity = capacity;
+    }
+    prog->constants[prog->const_count] = value;
+    return emit(comp, OP_CONST, dst, prog->const_count++, 0, 0);
+}
+
+// Compiler.symbol_units entry of a variable the program has not assigned
+#define UNIT_UNASSIGNED ((Unit)-1)
+
+// Index of a variable name in the symbol table
+int add_symbol(Compiler *comp, const char *name) {
+    Program *prog = comp->prog;
+    for (int i = 0; i < prog->symbol_count; i++) {
+        if (strcmp(prog->symbols[i], name) == 0) return i;
+    }
+    if (prog->symbol_count == prog->symbol_capacity) {
+        int capacity = prog->symbol_capacity ? prog->symbol_capacity * 2 : 8;
+        char (*grown)[32] = realloc(prog->symbols, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            *comp->error = CALC_ERROR_MEMORY;
+            return -1;
+        }
+        prog->symbols = grown;
+        prog->symbol_capacity = capacity;
+        if (comp->symbol_units != NULL) {
+            Unit *units = realloc(comp->symbol_units, capacity * sizeof(Unit));
+            if (units == NULL) {
+                *comp->error = CALC_ERROR_MEMORY;
+                return -1;
+            }
+            comp->symbol_units = units;
+        }
+    }
+    if (comp->symbol_units != NULL) comp->symbol_units[prog->symbol_count] = UNIT_UNASSIGNED;
+    strcpy(prog->symbols[prog->symbol_count], name);
+    return prog->symbol_count++;
+}
+
+// Unit of register reg while compiling
+ALWAYS_INLINE Unit register_unit(const Compiler *comp, int reg) {
+    return reg < comp->unit_capacity ? comp->units[reg] : 0;
+}
+
+// Give register reg a unit. Nothing is stored until some register has a
+// unit, so programs without units pay only this check.
+int set_register_unit(Compiler *comp, int reg, Unit unit) {
+    if (reg >= comp->unit_capacity) {
+        if (unit == 0) return 1;
+        int capacity = comp->unit_capacity ? comp->unit_capacity : 16;
+        while (capacity <= reg) capacity *= 2;
+        Unit *grown = realloc(comp->units, capacity * sizeof(Unit));
+        if (grown == NULL) {
+            *comp->error = CALC_ERROR_MEMORY;
+            return 0;
+        }
+        memset(grown + comp->unit_capacity, 0, (capacity - comp->unit_capacity) * sizeof(Unit));
+        comp->units = grown;
+        comp->unit_capacity = capacity;
+    }
+    comp->units[reg] = unit;
+    return 1;
+}
+
+// Unit of a variable as the program being compiled reads it: that of its
+// last assignment compiled so far, else that of its current value
+Unit symbol_unit(Compiler *comp, int symbol) {
+    if (comp->symbol_units != NULL && comp->symbol_units[symbol] != UNIT_UNASSIGNED) {
+        return comp->symbol_units[symbol];
+    }
+    if (comp->calc->unit_count == 0) return 0;
+    Variable *var = find_variable(comp->calc, comp->prog->symbols[symbol]);
+    return var != NULL ? var->unit : 0;
+}
+
+void assign_symbol_unit(Compiler *comp, int symbol, Unit unit) {
+    Program *prog = comp->prog;
+    if (comp->symbol_units == NULL) {
+        if (unit == symbol_unit(comp, symbol)) return;
+        comp->symbol_units = malloc(prog->symbol_capacity * sizeof(Unit));
+        if (comp->symbol_units == NULL) {
+            *comp->error = CALC_ERROR_MEMORY;
+            return;
+        }
+        for (int i = 0; i < prog->symbol_count; i++) comp->symbol_units[i] = UNIT_UNASSIGNED;
+    }
+    comp->symbol_units[symbol] = unit;
+}
+
+// Is the most recent instruction a scalar constant load into reg?
+int is_constant_register(Compiler *comp, int back, int reg) {
+    Program *prog = comp->prog;
+    if (prog->code_count < back) return 0;
+    Instruction *ins = &prog->code[prog->code_count - back];
+    return ins->op == OP_CONST && ins->dst == reg &&
+           prog->constants[ins->a].type != CALC_VECTOR;
+}
+
+// Drop the last constant load (its constant is always the newest entry)
+void pop_constant(Compiler *comp) {
+    Program *prog = comp->prog;
+    prog->code_count--;
+    prog->const_count--;
+    value_release(&prog->constants[prog->const_count]);
+}
+
+// Unit of r[reg] op r[reg+1]. A power needs a constant integer exponent
+// unless the base is dimensionless, and a comparison with a literal 0
+// accepts any unit.
+Unit binary_unit(Compiler *comp, char op, int reg) {
+    Program *prog = comp->prog;
+    Unit left = register_unit(comp, reg), right = register_unit(comp, reg + 1);
+    if (left == 0 && right == 0) return 0;
+    
+    Value constant = value_real(NAN);
+    if (is_constant_register(comp, 1, reg + 1)) constant = prog->constants[prog->const_count - 1];
+    int integral = constant.type == CALC_INTEGER ||
+                   (constant.type == CALC_REAL && constant.real == floor(constant.real));
+    switch (op) {
+        case '*': return unit_product(left, right, 1, comp->error);
+        case '/': return unit_product(left, right, -1, comp->error);
+        case '^':
+            if (right == 0 && integral && fabs(value_to_double(constant)) <= 64) {
+                return unit_product(0, left, (int)value_to_double(constant), comp->error);
+            }
+            break;
+        case '+': case '-': case '%':
+            if (left == right) return left;
+            break;
+        default:
+            if (left == right || (right == 0 && integral && value_to_double(constant) == 0)) return 0;
+    }
+    *comp->error = CALC_ERROR_UNITS;
+    return 0;
+}
+
+// Emit r[reg] = r[reg] op r[reg+1], folding scalar constants
+int emit_binary(Compiler *comp, char op, int reg) {
+    static const char ops[] = "+-*/%^<l>gen";
+    static const OpCode codes[] = {OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_POW,
+                                   OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE};
+    int index = (int)(strchr(ops, op) - ops);
+    Unit unit = binary_unit(comp, op, reg);
+    if (!set_register_unit(comp, reg, unit)) return -1;
+    
+    if (is_constant_register(comp, 2, reg) && is_constant_register(comp, 1, reg + 1)) {
+        Program *prog = comp->prog;
+        CalcError fold_error = CALC_OK;
+        Value x = prog->constants[prog->const_count - 2], y = prog->constants[prog->const_count - 1];
+        Value folded = codes[index] >= OP_LT ? value_compare(op, x, y, &fold_error)
+                                             : value_binary(comp->calc, op, x, y, &fold_error);
+        if (fold_error == CALC_OK) {
+            pop_constant(comp);
+            pop_constant(comp);
+            comp->depth = reg + 1;
+            return emit_constant(comp, reg, folded);
+        }
+    }
+    
+    comp->depth = reg + 1;
+    return emit(comp, codes[index], reg, reg, reg + 1, 0);
+}
+
+// Scan the next token of a script into the lookahead slot token: scripts
+// also get newline tokens, and # starts a comment running to the end of
+// the line
+void next_script_token(Compiler *comp, Token *token) {
+    const char *p = comp->next;
+    int line = token > comp->lookahead ? token[-1].line + (token[-1].type == TOK_NEWLINE) : comp->line;
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\f' || *p == '\v') p++;
+    if (*p == '#') p += strcspn(p, "\n");
+    token->line = line;
+    if (*p == '\n') {
+        token->type = TOK_NEWLINE;
+        comp->next = p + 1;
+        return;
+    }
+    comp->next = next_token(p, token, comp->error);
+}
+
+// Look ahead k tokens (k < 3) without consuming them
+Token* peek_token(Compiler *comp, int k) {
+    while (comp->lookahead_count <= k) {
+        Token *token = &comp->lookahead[comp->lookahead_count++];
+        if (comp->script) {
+            next_script_token(comp, token);
+        } else {
+            comp->next = next_token(comp->next, token, comp->error);
+        }
+    }
+    return &comp->lookahead[k];
+}
+
+void advance_token(Compiler *comp) {
+    peek_token(comp, 0);
+    if (comp->script) {
+        comp->line = comp->lookahead[0].line + (comp->lookahead[0].type == TOK_NEWLINE);
+    }
+    comp->lookahead_count--;
+    memmove(comp->lookahead, comp->lookahead + 1, comp->lookahead_count * sizeof(Token));
+}
+
+// Load a number, imaginary literal or name into the next register
+int emit_operand(Compiler *comp, Token *token) {
+    int reg = comp->depth++;
+    if (!set_register_unit(comp, reg, 0)) return -1;
+    
+    if (token->type == TOK_NUMBER) {
+        if (token->digit_count > 0) {
+            Value value = integer_parse(token->digits, token->digit_count, comp->error);
+            if (*comp->error != CALC_OK) return -1;
+            return emit_constant(comp, reg, value);
+        }
+        return emit_constant(comp, reg, value_real(token->value));
+    }
+    if (token->type == TOK_IMAGINARY) {
+        return emit_constant(comp, reg, value_complex(0, token->value));
+    }
+    
+    // Parameters and for loop variables shadow constants and variables
+    for (int i = 0; i < comp->param_count; i++) {
+        if (strcmp(comp->params[i], token->name) == 0) {
+            return emit(comp, OP_PARAM, reg, i, 0, 0);
+        }
+    }
+    for (const LoopScope *loop = comp->loop; loop != NULL; loop = loop->outer) {
+        if (strcmp(loop->name, token->name) == 0) {
+            set_register_unit(comp, reg, register_unit(comp, loop->counter));
+            return emit(comp, OP_MOVE, reg, loop->counter, 0, 0);
+        }
+    }
+    
+    // Check if it's a constant
+    if (strcmp(token->name, "i") == 0) {
+        return emit_constant(comp, reg, value_complex(0, 1));
+    }
+    const NamedConstant *constant = find_constant(token->name);
+    if (constant != NULL) {
+        set_register_unit(comp, reg, constant->unit);
+        return emit_constant(comp, reg, value_real(constant->value));
+    }
+    
+    // Variables are resolved when the program runs; their units are
+    // those they have now
+    int symbol = add_symbol(comp, token->name);
+    if (symbol < 0) return -1;
+    set_register_unit(comp, reg, symbol_unit(comp, symbol));
+    return emit(comp, OP_LOAD, reg, symbol, 0, 0);
+}
+
+// Units after a number: names or name^n, separated by spaces, or by * or /
+// when a unit name follows (3 m/s^2, 5 kg m^2 s^-1; / applies to the next
+// name only). The number's constant, the newest one, is scaled to base
+// units and its register gets the unit.
+void parse_unit_suffix(Compiler *comp, int reg) {
+    Program *prog = comp->prog;
+    double scale = 1, factor_scale;
+    Unit unit = 0, factor;
+    
+    while (*comp->error == CALC_OK) {
+        Token *token = peek_token(comp, 0);
+        int power = 1;
+        if (token->type == TOK_OPERATOR && (token->name[0] == '*' || token->name[0] == '/') &&
+            peek_token(comp, 1)->type == TOK_IDENTIFIER && find_unit(peek_token(comp, 1)->name, &factor_scale, &factor)) {
+            power = token->name[0] == '/' ? -1 : 1;
+            advance_token(comp);
+        } else if (token->type != TOK_IDENTIFIER || !find_unit(token->name, &factor_scale, &factor)) {
+            break;
+        }
+        advance_token(comp);
+        
+        // An exponent must be an integer literal, possibly negative
+        if (peek_token(comp, 0)->type == TOK_OPERATOR && peek_token(comp, 0)->name[0] == '^') {
+            int negative = peek_token(comp, 1)->type == TOK_OPERATOR && peek_token(comp, 1)->name[0] == '-';
+            Token *exponent = peek_token(comp, 1 + negative);
+            if (exponent->type == TOK_NUMBER && exponent->value == floor(exponent->value) && exponent->value <= 8) {
+                power *= negative ? -(int)exponent->value : (int)exponent->value;
+                for (int i = 0; i < 2 + negative; i++) advance_token(comp);
+            }
+        }
+        scale *= pow(factor_scale, power);
+        unit = unit_product(unit, factor, power, comp->error);
+    }
+    
+    if (*comp->error != CALC_OK || !is_constant_register(comp, 1, reg)) return;
+    Value *constant = &prog->constants[prog->const_count - 1];
+    if (scale != 1) {
+        Value scaled = value_binary(comp->calc, '*', *constant, value_real(scale), comp->error);
+        value_release(constant);
+        *constant = scaled;
+    }
+    set_register_unit(comp, reg, unit);
+}
+
+// Pending entries of the expression parser's operator stack
+typedef enum {
+    FRAME_BINARY,   // Binary operator waiting for its right operand
+    FRAME_NEGATE,   // Unary minus
+    FRAME_NOT,      // Logical not
+    FRAME_GROUP,    // Open parenthesis
+    FRAME_CALL,     // Function call; arguments go to registers base...
+    FRAME_VECTOR    // Vector literal; elements go to registers base...
+} FrameKind;
+
+typedef struct {
+    FrameKind kind;
+    char op;
+    int base;
+    int count;      // Arguments so far; for && and || the jump past the right operand
+    int function;   // function_table index, or user function index
+    int user;
+} ParseFrame;
+
+// Binding power, as in C: || < && < == != < relations < + - < * / % <
+// unary minus and ! < ^ (right associative)
+int frame_precedence(const ParseFrame *frame) {
+    if (frame->kind == FRAME_NEGATE || frame->kind == FRAME_NOT) return 7;
+    switch (frame->op) {
+        case '|': return 1;
+        case '&': return 2;
+        case 'e': case 'n': return 3;
+        case '<': case '>': case 'l': case 'g': return 4;
+        case '+': case '-': return 5;
+        case '*': case '/': case '%': return 6;
+        default: return 8;
+    }
+}
+
+// Emit the code for an operator popped from the stack. The left operand
+// of && and || has already jumped past the right one if it decides the
+// result; otherwise the right operand's truth is the result.
+int reduce_frame(Compiler *comp, const ParseFrame *frame) {
+    if (frame->kind == FRAME_BINARY && (frame->op == '&' || frame->op == '|')) {
+        int reg = comp->depth - 2;
+        comp->depth = reg + 1;
+        set_register_unit(comp, reg, 0);
+        emit(comp, OP_BOOL, reg, reg + 1, 0, 0);
+        comp->prog->code[frame->count].b = comp->prog->code_count;
+        return reg;
+    }
+    if (frame->kind == FRAME_BINARY) {
+        return emit_binary(comp, frame->op, comp->depth - 2);
+    }
+    
+    int reg = comp->depth - 1;
+    if (frame->kind == FRAME_NOT) {
+        set_register_unit(comp, reg, 0);
+        return emit(comp, OP_NOT, reg, reg, 0, 0);
+    }
+    if (is_constant_register(comp, 1, reg)) {
+        Value *c = &comp->prog->constants[comp->prog->const_count - 1];
+        if (c->type == CALC_REAL) {
+            c->real = -c->real;
+            return reg;
+        }
+        if (c->type == CALC_INTEGER && c->integer != LLONG_MIN) {
+            c->integer = -c->integer;
+            return reg;
+        }
+    }
+    return emit(comp, OP_NEG, reg, reg, 0, 0);
+}
+
+// Unit of a call's or vector's result. The arguments must share a unit;
+// the functions listed keep it, sqrt and cbrt take its root, atan2 of
+// two like quantities is an angle and argsort and rank give positions.
+// The moving-window functions keep the unit of their data and take a
+// dimensionless window. Everything else, user functions included, takes
+// dimensionless arguments; a user function gives the unit its body has
+// with the variables' current units.
+Unit frame_unit(Compiler *comp, const ParseFrame *frame) {
+    static const char *const keep[] = {"abs", "floor", "ceil", "round", "min", "max", "sum", "mean", "median",
+                                       "real", "imag", "conj", "transpose", "full", "trace", "eigvals", "svd",
+                                       "fft", "ifft", "rfft", "sort", "unique", "cumsum", "diff", NULL};
+    static const char *const windowed[] = {"movmean", "movstd", "movmin", "movmax", NULL};
+    Unit unit = frame->count > 0 ? register_unit(comp, frame->base) : 0;
+    for (int i = 0; !frame->user && frame->kind != FRAME_VECTOR && windowed[i] != NULL; i++) {
+        if (strcmp(function_table[frame->function].name, windowed[i]) != 0) continue;
+        if (frame->count > 1 && register_unit(comp, frame->base + 1) != 0) *comp->error = CALC_ERROR_UNITS;
+        return unit;
+    }
+    for (int i = 1; i < frame->count; i++) {
+        if (register_unit(comp, frame->base + i) != unit) {
+            *comp->error = CALC_ERROR_UNITS;
+            return 0;
+        }
+    }
+    if (frame->user) {
+        if (unit != 0) *comp->error = CALC_ERROR_UNITS;
+        return user_function_unit(comp->calc, frame->function, comp->error);
+    }
+    if (unit == 0 || frame->kind == FRAME_VECTOR) return unit;
+    
+    const char *name = function_table[frame->function].name;
+    for (int i = 0; keep[i] != NULL; i++) {
+        if (strcmp(name, keep[i]) == 0) return unit;
+    }
+    if (strcmp(name, "sqrt") == 0) return unit_root(unit, 2, comp->error);
+    if (strcmp(name, "cbrt") == 0) return unit_root(unit, 3, comp->error);
+    if (strcmp(name, "atan2") == 0 || strcmp(name, "argsort") == 0 || strcmp(name, "rank") == 0) return 0;
+    *comp->error = CALC_ERROR_UNITS;
+    return 0;
+}
+
+// Emit a call or vector once its closing bracket has been read
+int close_frame(Compiler *comp, const ParseFrame *frame) {
+    comp->depth = frame->base + 1;
+    
+    // groupby's aggregate is written as a name (groupby(k, v, mean)); its
+    // load becomes the aggregate's code
+    Program *prog = comp->prog;
+    const Instruction *last = frame->count == 3 ? &prog->code[prog->code_count - 1] : NULL;
+    if (last != NULL && frame->kind == FRAME_CALL && !frame->user && last->op == OP_LOAD &&
+        last->dst == frame->base + 2 && function_table[frame->function].vfunc == func_groupby) {
+        int aggregate = group_aggregate(prog->symbols[last->a]);
+        if (aggregate >= 0) {
+            prog->code_count--;
+            set_register_unit(comp, frame->base + 2, 0);
+            emit_constant(comp, frame->base + 2, value_integer(aggregate));
+        }
+    }
+    if (!set_register_unit(comp, frame->base, frame_unit(comp, frame))) return -1;
+    if (frame->kind == FRAME_VECTOR) {
+        return emit(comp, OP_VECTOR, frame->base, frame->base, frame->count, 0);
+    }
+    if (frame->user) {
+        if (frame->count != comp->calc->functions[frame->function].param_count) {
+            *comp->error = CALC_ERROR_ARG_COUNT;
+            return -1;
+        }
+        return emit(comp, OP_UCALL, frame->base, frame->base, frame->count, frame->function);
+    }
+    const FunctionDef *func_def = &function_table[frame->function];
+    if (frame->count < func_def->min_args || (func_def->max_args > 0 && frame->count > func_def->max_args)) {
+        *comp->error = CALC_ERROR_ARG_COUNT;
+        return -1;
+    }
+    return emit(comp, OP_CALL, frame->base, frame->base, frame->count, frame->function);
+}
+
+// Parse an expression with an explicit operator stack (shunting-yard), so
+// nesting depth is bounded by memory rather than the C stack. Operands are
+// emitted as they are read and operators when their precedence allows,
+// which leaves every operand in the register given by its stack depth.
+// In scripts a newline ends the expression unless an operand or closing
+// bracket is still expected.
+int parse_expression(Compiler *comp) {
+    ParseFrame *stack = NULL;
+    int top = 0, capacity = 0;
+    int start = comp->depth;
+    int expect_operand = 1;
+    int brackets = 0;   // Open brackets on the stack
+    
+    while (*comp->error == CALC_OK) {
+        Token *token = peek_token(comp, 0);
+        ParseFrame frame = {FRAME_BINARY, 0, comp->depth, 0, 0, 0};
+        
+        if (token->type == TOK_NEWLINE) {
+            if (!expect_operand && brackets == 0) break;
+            advance_token(comp);
+            continue;
+        }
+        if (expect_operand) {
+            if (token->type == TOK_OPERATOR && token->name[0] == '+') {
+                advance_token(comp);
+                continue;
+            }
+            if (token->type == TOK_NUMBER || token->type == TOK_IMAGINARY || token->type == TOK_IDENTIFIER) {
+                int number = token->type != TOK_IDENTIFIER;
+                int reg = emit_operand(comp, token);
+                advance_token(comp);
+                if (number && reg >= 0 && peek_token(comp, 0)->type == TOK_IDENTIFIER) {
+                    parse_unit_suffix(comp, reg);
+                }
+                expect_operand = 0;
+                continue;
+            }
+            
+            if (token->type == TOK_OPERATOR && token->name[0] == '-') {
+                frame.kind = FRAME_NEGATE;
+            } else if (token->type == TOK_OPERATOR && token->name[0] == '!') {
+                frame.kind = FRAME_NOT;
+            } else if (token->type == TOK_LPAREN) {
+                frame.kind = FRAME_GROUP;
+            } else if (token->type == TOK_LBRACKET) {
+                frame.kind = FRAME_VECTOR;
+            } else if (token->type == TOK_FUNCTION) {
+                FunctionDef *func_def = find_function(token->name);
+                frame.kind = FRAME_CALL;
+                if (func_def != NULL) {
+                    frame.function = (int)(func_def - function_table);
+                } else {
+                    frame.function = find_user_function(comp->calc, token->name);
+                    frame.user = 1;
+                    if (frame.function < 0) {
+                        *comp->error = CALC_ERROR_UNKNOWN_FUNCTION;
+                        break;
+                    }
+                }
+                advance_token(comp); // The name; its '(' is consumed below
+            } else {
+                *comp->error = CALC_ERROR_SYNTAX;
+                break;
+            }
+            advance_token(comp);
+            
+            // f() has no arguments to wait for
+            if (frame.kind == FRAME_CALL && peek_token(comp, 0)->type == TOK_RPAREN) {
+                advance_token(comp);
+                close_frame(comp, &frame);
+                expect_operand = 0;
+                continue;
+            }
+        } else if (token->type == TOK_OPERATOR && token->name[0] == '!') {
+            int index = (int)(find_function("factorial") - function_table);
+            if (register_unit(comp, comp->depth - 1) != 0) *comp->error = CALC_ERROR_UNITS;
+            emit(comp, OP_CALL, comp->depth - 1, comp->depth - 1, 1, index);
+            advance_token(comp);
+            continue;
+        } else if (token->type == TOK_OPERATOR) {
+            frame.op = token->name[0];
+            int precedence = frame_precedence(&frame);
+            while (top > 0 && stack[top - 1].kind <= FRAME_NOT &&
+                   (frame_precedence(&stack[top - 1]) > precedence ||
+                    (frame_precedence(&stack[top - 1]) == precedence && frame.op != '^'))) {
+                reduce_frame(comp, &stack[--top]);
+            }
+            if (frame.op == '&' || frame.op == '|') {
+                frame.count = comp->prog->code_count;
+                emit(comp, frame.op == '&' ? OP_JUMP_FALSE : OP_JUMP_TRUE, comp->depth - 1, comp->depth - 1, -1, 0);
+            }
+            advance_token(comp);
+            expect_operand = 1;
+        } else if (token->type == TOK_COMMA || token->type == TOK_RPAREN || token->type == TOK_RBRACKET) {
+            while (top > 0 && stack[top - 1].kind <= FRAME_NOT) {
+                reduce_frame(comp, &stack[--top]);
+            }
+            if (top == 0) break; // Not ours: the caller reports it
+            
+            ParseFrame *open = &stack[top - 1];
+            int closes_call = token->type != TOK_RBRACKET && open->kind == FRAME_CALL;
+            if (token->type == TOK_COMMA) {
+                if (!closes_call && open->kind != FRAME_VECTOR) {
+                    *comp->error = CALC_ERROR_SYNTAX;
+                    break;
+                }
+                if (++open->count == MAX_FUNC_ARGS && open->kind == FRAME_CALL) {
+                    *comp->error = CALC_ERROR_ARG_COUNT;
+                    break;
+                }
+                expect_operand = 1;
+            } else if (token->type == TOK_RPAREN && open->kind == FRAME_GROUP) {
+                top--;
+                brackets--;
+            } else if (closes_call || (token->type == TOK_RBRACKET && open->kind == FRAME_VECTOR)) {
+                open->count++;
+                close_frame(comp, open);
+                top--;
+                brackets--;
+            } else {
+                *comp->error = CALC_ERROR_SYNTAX;
+                break;
+            }
+            advance_token(comp);
+            continue;
+        } else {
+            break;
+        }
+        
+        if (top == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            ParseFrame *grown = realloc(stack, capacity * sizeof(ParseFrame));
+            if (grown == NULL) {
+                *comp->error = CALC_ERROR_MEMORY;
+                break;
+            }
+            stack = grown;
+        }
+        if (frame.kind > FRAME_NOT) brackets++;
+        stack[top++] = frame;
+    }
+    
+    if (*comp->error == CALC_OK && expect_operand) {
+        *comp->error = CALC_ERROR_SYNTAX;
+    }
+    while (*comp->error == CALC_OK && top > 0) {
+        if (stack[top - 1].kind > FRAME_NOT) {
+            *comp->error = CALC_ERROR_SYNTAX; // Unclosed bracket
+            break;
+        }
+        reduce_frame(comp, &stack[--top]);
+    }
+    free(stack);
+    return *comp->error == CALC_OK ? start : -1;
+}
+
+// Parse assignment or expression
+int parse_assignment(Compiler *comp) {
+    int skip = 0;
+    int constant = 0;
+    
+    // Constant definition: const name = expr
+    if (peek_token(comp, 0)->type == TOK_IDENTIFIER && strcmp(peek_token(comp, 0)->name, "const") == 0 &&
+        peek_token(comp, 1)->type == TOK_IDENTIFIER && peek_token(comp, 2)->type == TOK_EQUAL) {
+        constant = 1;
+        skip = 1;
+    }
+    
+    // Check if this is an assignment; for loop variables are read-only
+    if (peek_token(comp, skip)->type == TOK_IDENTIFIER && peek_token(comp, skip + 1)->type == TOK_EQUAL) {
+        for (const LoopScope *loop = comp->loop; loop != NULL; loop = loop->outer) {
+            if (strcmp(loop->name, peek_token(comp, skip)->name) == 0) {
+                *comp->error = CALC_ERROR_SYNTAX;
+                return -1;
+            }
+        }
+        int symbol = add_symbol(comp, peek_token(comp, skip)->name);
+        if (symbol < 0) return -1;
+        for (int i = 0; i < skip + 2; i++) {
+            advance_token(comp); // Skip const, identifier and equals
+        }
+        
+        int reg = parse_expression(comp);
+        if (reg < 0) return -1;
+        Unit unit = register_unit(comp, reg);
+        assign_symbol_unit(comp, symbol, unit);
+        return emit(comp, OP_STORE, reg, symbol, reg, constant | (int)(unit << 1));
+    }
+    
+    // Regular expression
+    return parse_expression(comp);
+}
+
+// Compile an expression; identifiers listed in params become parameters
+// supplied to program_run. Time and memory are linear in the input.
+Program* compile_expression(Calculator *calc, const char *expr, const char *const params[], int param_count, CalcError *error) {
+    Program *prog = calloc(1, sizeof(Program));
+    if (prog == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    
+    Compiler comp = {calc, expr, {{0}}, 0, prog, 0, params, param_count, error};
+    prog->result = parse_assignment(&comp);
+    
+    // Check if we parsed the entire expression
+    if (*error == CALC_OK && peek_token(&comp, 0)->type != TOK_EOF) {
+        *error = CALC_ERROR_SYNTAX;
+    }
+    prog->unit = prog->result >= 0 ? register_unit(&comp, prog->result) : 0;
+    free(comp.units);
+    free(comp.symbol_units);
+    
+    if (*error != CALC_OK) {
+        program_free(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+// Scripts: statements separated by newlines or semicolons, compiled into
+// one program whose control flow is jumps.
+//     name = expression, name(a, b) = body, or any expression
+//     if condition { ... } else if condition { ... } else { ... }
+//     while condition { ... }
+//     for name = first..last { ... }
+//     break, continue
+//     print expression, ...
+// Blocks may span lines. A for loop evaluates its bounds once and counts
+// up by 1 while the variable is at most last; the variable is local to
+// the loop and read-only. Keywords followed by = are ordinary variables.
+#define SCRIPT_MAX_NESTING 256
+
+// Point a chain of unpatched jumps (see LoopScope) at target
+void patch_jumps(Program *prog, int chain, int target) {
+    while (chain >= 0) {
+        int next = prog->code[chain].a;
+        prog->code[chain].a = target;
+        chain = next;
+    }
+}
+
+// Emit a jump whose target is not yet known onto a chain
+void emit_jump(Compiler *comp, int *chain) {
+    int pc = comp->prog->code_count;
+    if (emit(comp, OP_JUMP, 0, *chain, 0, 0) >= 0) *chain = pc;
+}
+
+// Is the next token the statement keyword word?
+int at_keyword(Compiler *comp, const char *word) {
+    Token *token = peek_token(comp, 0);
+    return (token->type == TOK_IDENTIFIER || token->type == TOK_FUNCTION) &&
+           strcmp(token->name, word) == 0 && peek_token(comp, 1)->type != TOK_EQUAL;
+}
+
+int expect_token(Compiler *comp, TokenType type) {
+    if (peek_token(comp, 0)->type != type) {
+        if (*comp->error == CALC_OK) *comp->error = CALC_ERROR_SYNTAX;
+        return 0;
+    }
+    advance_token(comp);
+    return 1;
+}
+
+void skip_newlines(Compiler *comp) {
+    while (*comp->error == CALC_OK && peek_token(comp, 0)->type == TOK_NEWLINE) {
+        advance_token(comp);
+    }
+}
+
+// { statements }, which may open on the line after its keyword
+int parse_block(Compiler *comp) {
+    skip_newlines(comp);
+    if (!expect_token(comp, TOK_LBRACE)) return 0;
+    if (++comp->nesting > SCRIPT_MAX_NESTING) {
+        *comp->error = CALC_ERROR_SYNTAX;
+        return 0;
+    }
+    parse_statements(comp);
+    comp->nesting--;
+    return expect_token(comp, TOK_RBRACE);
+}
+
+// A condition followed by a jump, taken when it is false, whose target
+// the caller patches; returns the jump's index or -1
+int parse_condition(Compiler *comp) {
+    int reg = parse_expression(comp);
+    if (reg < 0) return -1;
+    int pc = comp->prog->code_count;
+    if (emit(comp, OP_JUMP_FALSE, reg, reg, -1, 0) < 0) return -1;
+    comp->depth = reg;
+    return pc;
+}
+
+void parse_if(Compiler *comp) {
+    Program *prog = comp->prog;
+    int exits = -1;
+    while (*comp->error == CALC_OK) {
+        advance_token(comp); // if
+        int skip = parse_condition(comp);
+        if (skip < 0 || !parse_block(comp)) return;
+        skip_newlines(comp);
+        if (!at_keyword(comp, "else")) {
+            prog->code[skip].b = prog->code_count;
+            break;
+        }
+        advance_token(comp);
+        emit_jump(comp, &exits);
+        prog->code[skip].b = prog->code_count;
+        if (!at_keyword(comp, "if")) {
+            parse_block(comp);
+            break;
+        }
+    }
+    if (*comp->error == CALC_OK) patch_jumps(prog, exits, prog->code_count);
+}
+
+void parse_while(Compiler *comp) {
+    Program *prog = comp->prog;
+    LoopScope loop = {"", 0, -1, -1, comp->loop};
+    int start = prog->code_count;
+    advance_token(comp); // while
+    int exit = parse_condition(comp);
+    if (exit < 0) return;
+    comp->loop = &loop;
+    parse_block(comp);
+    comp->loop = loop.outer;
+    if (*comp->error != CALC_OK) return;
+    patch_jumps(prog, loop.continue_chain, start);
+    emit(comp, OP_JUMP, 0, start, 0, 0);
+    prog->code[exit].b = prog->code_count;
+    patch_jumps(prog, loop.break_chain, prog->code_count);
+}
+
+// The counter and the last value occupy two registers for the whole
+// loop; the body reads the counter through OP_MOVE
+void parse_for(Compiler *comp) {
+    Program *prog = comp->prog;
+    LoopScope loop = {"", comp->depth, -1, -1, comp->loop};
+    advance_token(comp); // for
+    if (peek_token(comp, 0)->type != TOK_IDENTIFIER || peek_token(comp, 1)->type != TOK_EQUAL) {
+        *comp->error = CALC_ERROR_SYNTAX;
+        return;
+    }
+    strcpy(loop.name, peek_token(comp, 0)->name);
+    advance_token(comp);
+    advance_token(comp);
+    if (parse_expression(comp) < 0 || !expect_token(comp, TOK_RANGE) || parse_expression(comp) < 0) return;
+    if (register_unit(comp, loop.counter) != register_unit(comp, loop.counter + 1)) {
+        *comp->error = CALC_ERROR_UNITS;
+        return;
+    }
+    int prep = prog->code_count;
+    emit(comp, OP_FOR_PREP, loop.counter, loop.counter, loop.counter + 1, -1);
+    int body = prog->code_count;
+    comp->loop = &loop;
+    parse_block(comp);
+    comp->loop = loop.outer;
+    if (*comp->error != CALC_OK) return;
+    patch_jumps(prog, loop.continue_chain, prog->code_count);
+    emit(comp, OP_FOR_LOOP, loop.counter, loop.counter, loop.counter + 1, body);
+    prog->code[prep].c = prog->code_count;
+    patch_jumps(prog, loop.break_chain, prog->code_count);
+    comp->depth = loop.counter;
+}
+
+// print a, b or print(a, b); print alone writes an empty line
+void parse_print(Compiler *comp) {
+    int call = peek_token(comp, 0)->type == TOK_FUNCTION;
+    advance_token(comp); // print
+    if (call) advance_token(comp);
+    int base = comp->depth, count = 0;
+    TokenType next = peek_token(comp, 0)->type;
+    if (call ? next != TOK_RPAREN : next != TOK_NEWLINE && next != TOK_SEMICOLON && next != TOK_RBRACE && next != TOK_EOF) {
+        do {
+            if (count > 0) advance_token(comp); // ,
+            if (parse_expression(comp) < 0) return;
+            count++;
+        } while (peek_token(comp, 0)->type == TOK_COMMA);
+    }
+    if (call && !expect_token(comp, TOK_RPAREN)) return;
+    
+    // Values with units are written one instruction each, c holding the
+    // unit shifted left by 1, plus 1 for all but the last
+    int units = 0;
+    for (int i = 0; i < count; i++) units |= register_unit(comp, base + i) != 0;
+    if (!units) emit(comp, OP_PRINT, base, base, count, 0);
+    for (int i = 0; units && i < count; i++) {
+        emit(comp, OP_PRINT, base + i, base + i, 1, (int)(register_unit(comp, base + i) << 1) | (i < count - 1));
+    }
+    comp->depth = base;
+}
+
+// Parse one statement. Returns the register holding the value of an
+// expression or assignment, or -1 for other statements.
+int parse_statement(Compiler *comp) {
+    int base = comp->depth;
+    int reg = -1;
+    
+    if (peek_token(comp, 0)->type == TOK_LBRACE) {
+        parse_block(comp);
+        return -1;
+    }
+    if (at_keyword(comp, "if")) {
+        parse_if(comp);
+        return -1;
+    }
+    if (at_keyword(comp, "while")) {
+        parse_while(comp);
+        return -1;
+    }
+    if (at_keyword(comp, "for")) {
+        parse_for(comp);
+        return -1;
+    }
+    
+    // Function definitions take effect as they are compiled, so later
+    // statements can call them
+    Token *token = peek_token(comp, 0);
+    if ((token->type == TOK_IDENTIFIER || token->type == TOK_FUNCTION) &&
+        peek_token(comp, 1)->type == TOK_LPAREN && is_function_definition(token->start)) {
+        size_t length = strcspn(token->start, "\n;#}");
+        char *definition = strndup(token->start, length);
+        if (definition == NULL) {
+            *comp->error = CALC_ERROR_MEMORY;
+            return -1;
+        }
+        define_function(comp->calc, definition, comp->error);
+        if (*comp->error == CALC_OK) {
+            // Kept so that a cached script can make the same definitions
+            Program *prog = comp->prog;
+            size_t used = prog->definitions != NULL ? strlen(prog->definitions) : 0;
+            char *grown = realloc(prog->definitions, used + length + 2);
+            if (grown == NULL) {
+                *comp->error = CALC_ERROR_MEMORY;
+            } else {
+                memcpy(grown + used, definition, length);
+                memcpy(grown + used + length, "\n", 2);
+                prog->definitions = grown;
+            }
+            comp->next = token->start + length;
+            comp->lookahead_count = 0;
+        }
+        free(definition);
+    } else if (at_keyword(comp, "break") || at_keyword(comp, "continue")) {
+        LoopScope *loop = comp->loop;
+        if (loop == NULL) {
+            *comp->error = CALC_ERROR_SYNTAX;
+            return -1;
+        }
+        emit_jump(comp, peek_token(comp, 0)->name[0] == 'b' ? &loop->break_chain : &loop->continue_chain);
+        advance_token(comp);
+    } else if (at_keyword(comp, "print")) {
+        parse_print(comp);
+    } else {
+        reg = parse_assignment(comp);
+        comp->depth = base;
+    }
+    
+    // Simple statements end at a newline, semicolon or closing brace
+    TokenType next = peek_token(comp, 0)->type;
+    if (*comp->error == CALC_OK && next != TOK_NEWLINE && next != TOK_SEMICOLON &&
+        next != TOK_RBRACE && next != TOK_EOF) {
+        *comp->error = CALC_ERROR_SYNTAX;
+    }
+    return reg;
+}
+
+// Statements up to a closing brace or the end of the script. Returns the
+// register holding the value of the last one if it is an expression or
+// assignment, else -1.
+int parse_statements(Compiler *comp) {
+    int result = -1, end = -1;
+    while (*comp->error == CALC_OK) {
+        TokenType type = peek_token(comp, 0)->type;
+        if (type == TOK_NEWLINE || type == TOK_SEMICOLON) {
+            advance_token(comp);
+            continue;
+        }
+        if (type == TOK_RBRACE || type == TOK_EOF) break;
+        result = parse_statement(comp);
+        end = comp->prog->code_count;
+    }
+    return end == comp->prog->code_count ? result : -1;
+}
+
+// Compile a script. The program's result is the value of the final
+// statement when that is an expression or assignment. On a syntax error
+// *line is the line where compilation stopped.
+Program* compile_script(Calculator *calc, const char *source, int *line, CalcError *error) {
+    *line = 0;
+    Program *prog = calloc(1, sizeof(Program));
+    if (prog == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    
+    Compiler comp = {calc, source, {{0}}, 0, prog, 0, NULL, 0, error};
+    comp.script = 1;
+    comp.line = 1;
+    prog->result = parse_statements(&comp);
+    if (*error == CALC_OK && peek_token(&comp, 0)->type != TOK_EOF) {
+        *error = CALC_ERROR_SYNTAX; // Unmatched }
+    }
+    prog->unit = prog->result >= 0 ? register_unit(&comp, prog->result) : 0;
+    free(comp.units);
+    free(comp.symbol_units);
+    
+    if (*error != CALC_OK) {
+        *line = comp.lookahead_count > 0 ? comp.lookahead[0].line : comp.line;
+        program_free(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+// Read and compile a script file
+Program* load_script(Calculator *calc, const char *path, int *line, CalcError *error) {
+    *line = 0;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        *error = CALC_ERROR_IO;
+        return NULL;
+    }
+    char *text = NULL;
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+        text = malloc((size_t)size + 1);
+    }
+    if (text == NULL || fread(text, 1, (size_t)size, file) != (size_t)size) {
+        *error = text == NULL && size >= 0 ? CALC_ERROR_MEMORY : CALC_ERROR_IO;
+        free(text);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    text[size] = '\0';
+    
+    // A cache written for the same text skips compiling; a missing or stale
+    // one is (re)written after compiling, if the directory allows it
+    uint64_t hash = hash_bytes(text, (size_t)size);
+    char *cache_path = script_cache_path(path);
+    Program *prog = cache_path != NULL ? script_cache_load(calc, cache_path, hash, (size_t)size) : NULL;
+    if (prog == NULL) {
+        prog = compile_script(calc, text, line, error);
+        if (prog != NULL && cache_path != NULL) script_cache_save(calc, prog, cache_path, hash, (size_t)size);
+    }
+    free(cache_path);
+    free(text);
+    return prog;
+}
+
+// Does an input line start with a statement keyword, so that it must be
+// compiled as a script rather than an expression?
+int is_script_statement(const char *input) {
+    static const char *const keywords[] = {"if", "while", "for", "print", "{"};
+    while (isspace(*input)) input++;
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+        size_t n = strlen(keywords[i]);
+        if (strncmp(input, keywords[i], n) != 0) continue;
+        const char *p = input + n;
+        if (n > 1 && (isalnum(*p) || *p == '_')) continue;
+        while (isspace(*p)) p++;
+        return *p != '=' || p[1] == '=';
+    }
+    return 0;
+}
+
+void program_free(Program *prog) {
+    if (prog == NULL) return;
+    for (int i = 0; i < prog->const_count; i++) {
+        value_release(&prog->constants[i]);
+    }
+    free(prog->constants);
+    free(prog->code);
+    free(prog->lines);
+    free(prog->definitions);
+    free(prog->symbols);
+    free(prog);
+}
+
+// Build a vector from scalar registers, or a matrix from vector rows
+Value make_vector(Value elements[], int count, CalcError *error) {
+    if (count > 0 && elements[0].type == CALC_VECTOR) {
+        return make_matrix(elements, count, error);
+    }
+    int complex = 0;
+    for (int i = 0; i < count; i++) {
+        if (elements[i].type == CALC_COMPLEX) {
+            complex = 1;
+        } else if (elements[i].type != CALC_REAL && !value_is_integer(elements[i])) {
+            *error = CALC_ERROR_TYPE;
+            return value_real(0);
+        }
+    }
+    
+    Vector *vec = vector_new(count, complex);
+    if (vec == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    for (int i = 0; i < count; i++) {
+        int is_complex = elements[i].type == CALC_COMPLEX;
+        vec->re[i] = is_complex ? elements[i].complex_num.real : value_to_double(elements[i]);
+        if (complex) vec->im[i] = is_complex ? elements[i].complex_num.imag : 0;
+    }
+    return value_vector(vec);
+}
+
+// Operands of the inlined real arithmetic: two doubles, or a double and a
+// 64-bit integer
+ALWAYS_INLINE int real_operands(Value a, Value b, double *x, double *y) {
+    if (a.type == CALC_REAL && b.type == CALC_REAL) {
+        *x = a.real;
+        *y = b.real;
+        return 1;
+    }
+    if ((a.type == CALC_REAL && b.type == CALC_INTEGER) || (a.type == CALC_INTEGER && b.type == CALC_REAL)) {
+        *x = a.type == CALC_REAL ? a.real : (double)a.integer;
+        *y = b.type == CALC_REAL ? b.real : (double)b.integer;
+        return 1;
+    }
+    return 0;
+}
+
+// Inlined 64-bit +, - and *; on overflow the operands go on to
+// value_binary, which continues in a bigint
+ALWAYS_INLINE int integer_overflow(OpCode op, long long a, long long b, long long *result) {
+    switch (op) {
+        case OP_ADD: return __builtin_add_overflow(a, b, result);
+        case OP_SUB: return __builtin_sub_overflow(a, b, result);
+        default: return __builtin_mul_overflow(a, b, result);
+    }
+}
+
+// +, - and * on doubles and 64-bit integers without calling value_binary;
+// returns 0 for other operands and for integer overflow
+ALWAYS_INLINE int arithmetic_fast(OpCode op, Value a, Value b, Value *result) {
+    double x, y;
+    long long n;
+    if (real_operands(a, b, &x, &y)) {
+        *result = value_real(op == OP_ADD ? x + y : op == OP_SUB ? x - y : x * y);
+        return 1;
+    }
+    if (a.type == CALC_INTEGER && b.type == CALC_INTEGER && !integer_overflow(op, a.integer, b.integer, &n)) {
+        *result = value_integer(n);
+        return 1;
+    }
+    return 0;
+}
+
+// Order of two doubles or two 64-bit integers (-1, 0, 1, or 2 when
+// unordered); 3 for operands that need value_compare
+ALWAYS_INLINE int order_fast(Value a, Value b) {
+    if (a.type == CALC_REAL && b.type == CALC_REAL) {
+        return a.real < b.real ? -1 : a.real > b.real ? 1 : a.real == b.real ? 0 : 2;
+    }
+    if (a.type == CALC_INTEGER && b.type == CALC_INTEGER) {
+        return (a.integer > b.integer) - (a.integer < b.integer);
+    }
+    return 3;
+}
+
+// Is a for loop counter at most the last value? Counters and bounds are
+// real or integer scalars.
+ALWAYS_INLINE int loop_continues(Value counter, Value last, CalcError *error) {
+    int order = order_fast(counter, last);
+    if (order != 3) return order <= 0;
+    if ((counter.type != CALC_REAL && !value_is_integer(counter)) ||
+        (last.type != CALC_REAL && !value_is_integer(last))) {
+        *error = CALC_ERROR_TYPE;
+        return 0;
+    }
+    return value_compare('l', counter, last, error).integer;
+}
+
+// Instructions are dispatched by computed goto where the compiler has it:
+// each handler ends in its own indirect jump, which branch predictors
+// follow far better than the single jump of a switch. Each VM_CASE is
+// both a label and a case, so the switch serves other compilers.
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO 1
+#define VM_CASE(op) vm_##op: case op
+#define VM_DISPATCH() goto *vm_labels[ins->op]
+#else
+#define VM_COMPUTED_GOTO 0
+#define VM_CASE(op) case op
+#define VM_DISPATCH() goto vm_switch
+#endif
+#define VM_STORE(value) do { value_release(&r[ins->dst]); r[ins->dst] = (value); } while (0)
+#define VM_NEXT() do { if (++ins == end) goto vm_done; VM_DISPATCH(); } while (0)
+#define VM_JUMP(target) do { ins = prog->code + (target); if (ins == end) goto vm_done; VM_DISPATCH(); } while (0)
+#define VM_CHECK() do { if (*error != CALC_OK) goto vm_done; } while (0)
+
+// Execute a compiled program. Safe to call from several threads at once
+// as long as the program does not assign variables. Variables are looked
+// up by name on first use in a run and by index after that (indices are
+// stable while a program runs).
+Value program_run(Calculator *calc, const Program *prog, const Value params[], CalcError *error) {
+    static const char ops[] = "+-*/%^";
+    static const char relations[] = "<l>gen";
+#if VM_COMPUTED_GOTO
+    static const void *const vm_labels[] = {
+        &&vm_OP_CONST, &&vm_OP_LOAD, &&vm_OP_PARAM, &&vm_OP_NEG, &&vm_OP_ADD, &&vm_OP_SUB,
+        &&vm_OP_MUL, &&vm_OP_DIV, &&vm_OP_MOD, &&vm_OP_POW, &&vm_OP_CALL, &&vm_OP_UCALL,
+        &&vm_OP_VECTOR, &&vm_OP_STORE, &&vm_OP_LT, &&vm_OP_LE, &&vm_OP_GT, &&vm_OP_GE,
+        &&vm_OP_EQ, &&vm_OP_NE, &&vm_OP_NOT, &&vm_OP_BOOL, &&vm_OP_MOVE, &&vm_OP_JUMP,
+        &&vm_OP_JUMP_FALSE, &&vm_OP_JUMP_TRUE, &&vm_OP_FOR_PREP, &&vm_OP_FOR_LOOP, &&vm_OP_PRINT
+    };
+#endif
+    Value local[16];
+    int local_slots[16];
+    Value *r = prog->register_count <= 16 ? local : malloc(prog->register_count * sizeof(Value));
+    int *slots = prog->symbol_count <= 16 ? local_slots : malloc(prog->symbol_count * sizeof(int));
+    if (r == NULL || slots == NULL) {
+        if (r != local) free(r);
+        if (slots != local_slots) free(slots);
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    for (int i = 0; i < prog->register_count; i++) {
+        r[i] = value_real(0);
+    }
+    for (int i = 0; i < prog->symbol_count; i++) {
+        slots[i] = -1;
+    }
+    
+    const Instruction *ins = prog->code;
+    const Instruction *end = prog->code + prog->code_count;
+    Value result;
+    if (ins == end || *error != CALC_OK) goto vm_done;
+    VM_DISPATCH();
+    
+#if !VM_COMPUTED_GOTO
+vm_switch:
+#endif
+    switch (ins->op) {
+        VM_CASE(OP_CONST):
+            VM_STORE(value_retain(prog->constants[ins->a]));
+            VM_NEXT();
+        VM_CASE(OP_LOAD): {
+            int slot = slots[ins->a];
+            if (slot < 0) {
+                Variable *var = find_variable(calc, prog->symbols[ins->a]);
+                if (var == NULL) {
+                    *error = CALC_ERROR_UNKNOWN_VARIABLE;
+                    goto vm_done;
+                }
+                slot = slots[ins->a] = (int)(var - calc->variables);
+            }
+            if (calc->variables[slot].dirty && !refresh_variable(calc, slot, error)) goto vm_done;
+            VM_STORE(value_retain(calc->variables[slot].value));
+            VM_NEXT();
+        }
+        VM_CASE(OP_PARAM):
+            VM_STORE(value_retain(params[ins->a]));
+            VM_NEXT();
+        VM_CASE(OP_MOVE):
+            result = value_retain(r[ins->a]);
+            VM_STORE(result);
+            VM_NEXT();
+        VM_CASE(OP_NEG):
+            if (r[ins->a].type == CALC_REAL) {
+                result = value_real(-r[ins->a].real);
+            } else if (r[ins->a].type == CALC_INTEGER && r[ins->a].integer != LLONG_MIN) {
+                result = value_integer(-r[ins->a].integer);
+            } else {
+                Value zero = value_is_integer(r[ins->a]) ? value_integer(0) : value_real(0);
+                result = value_binary(calc, '-', zero, r[ins->a], error);
+            }
+            VM_STORE(result);
+            VM_CHECK();
+            VM_NEXT();
+        VM_CASE(OP_ADD):
+            if (!arithmetic_fast(OP_ADD, r[ins->a], r[ins->b], &result)) {
+                result = value_binary(calc, '+', r[ins->a], r[ins->b], error);
+            }
+            VM_STORE(result);
+            VM_CHECK();
+            VM_NEXT();
+        VM_CASE(OP_SUB):
+            if (!arithmetic_fast(OP_SUB, r[ins->a], r[ins->b], &result)) {
+                result = value_binary(calc, '-', r[ins->a], r[ins->b], error);
+            }
+            VM_STORE(result);
+            VM_CHECK();
+            VM_NEXT();
+        VM_CASE(OP_MUL):
+            if (!arithmetic_fast(OP_MUL, r[ins->a], r[ins->b], &result)) {
+                result = value_binary(calc, '*', r[ins->a], r[ins->b], error);
+            }
+            VM_STORE(result);
+            VM_CHECK();
+            VM_NEXT();
+        VM_CASE(OP_DIV):
+        VM_CASE(OP_MOD):
+        VM_CASE(OP_POW):
+            result = value_binary(calc, ops[ins->op - OP_ADD], r[ins->a], r[ins->b], error);
+            VM_STORE(result);
+            VM_CHECK();
+            VM_NEXT();
+        VM_CASE(OP_LT):
+        VM_CASE(OP_LE):
+        VM_CASE(OP_GT):
+        VM_CASE(OP_GE):
+        VM_CASE(OP_EQ):
+        VM_CASE(OP_NE): {
+            char op = relations[ins->op - OP_LT];
+            int order = order_fast(r[ins->a], r[ins->b]);
+            result = order != 3 ? value_integer(order_satisfies(op, order))
+                                : value_compare(op, r[ins->a], r[ins->b], error);
+            VM_STORE(result);
+            VM_CHECK();
+            VM_NEXT();
+        }
+        VM_CASE(OP_NOT):
+        VM_CASE(OP_BOOL): {
+            int truth = value_truth(r[ins->a], error);
+            VM_CHECK();
+            VM_STORE(value_integer(ins->op == OP_NOT ? !truth : truth));
+            VM_NEXT();
+        }
+        VM_CASE(OP_JUMP):
+            VM_JUMP(ins->a);
+        VM_CASE(OP_JUMP_FALSE):
+        VM_CASE(OP_JUMP_TRUE): {
+            int truth = value_truth(r[ins->a], error);
+            VM_CHECK();
+            VM_STORE(value_integer(truth));
+            if (truth == (ins->op == OP_JUMP_TRUE)) VM_JUMP(ins->b);
+            VM_NEXT();
+        }
+        VM_CASE(OP_FOR_PREP):
+            if (!loop_continues(r[ins->a], r[ins->b], error)) {
+                VM_CHECK();
+                VM_JUMP(ins->c);
+            }
+            VM_NEXT();
+        VM_CASE(OP_FOR_LOOP): {
+            Value *counter = &r[ins->a];
+            if (counter->type == CALC_INTEGER && r[ins->b].type == CALC_INTEGER) {
+                if (counter->integer < r[ins->b].integer) {
+                    counter->integer++;
+                    VM_JUMP(ins->c);
+                }
+                VM_NEXT();
+            }
+            result = value_binary(calc, '+', *counter, value_integer(1), error);
+            VM_STORE(result);
+            VM_CHECK();
+            if (loop_continues(*counter, r[ins->b], error)) VM_JUMP(ins->c);
+            VM_CHECK();
+            VM_NEXT();
+        }
+        VM_CASE(OP_CALL):
+            if (calc->profile != NULL) {
+                struct timespec start;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                result = call_function(calc, &function_table[ins->c], &r[ins->a], ins->b, error);
+                calc->profile->calls[ins->c]++;
+                calc->profile->call_ms[ins->c] += elapsed_ms(&start);
+            } else {
+                result = call_function(calc, &function_table[ins->c], &r[ins->a], ins->b, error);
+            }
+            VM_STORE(result);
+            VM_CHECK();
+            VM_NEXT();
+        VM_CASE(OP_UCALL): {
+            // Programs compiled before a redefinition may pass the
+            // old number of arguments
+            const UserFunction *fn = &calc->functions[ins->c];
+            if (ins->b != fn->param_count) {
+                *error = CALC_ERROR_ARG_COUNT;
+                goto vm_done;
+            }
+            if (calc->profile != NULL) {
+                struct timespec start;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                result = call_user_function(calc, ins->c, &r[ins->a], error);
+                calc->profile->user_calls[ins->c]++;
+                calc->profile->user_ms[ins->c] += elapsed_ms(&start);
+            } else {
+                result = call_user_function(calc, ins->c, &r[ins->a], error);
+            }
+            VM_STORE(result);
+            VM_CHECK();
+            VM_NEXT();
+        }
+        VM_CASE(OP_VECTOR):
+            result = make_vector(&r[ins->a], ins->b, error);
+            VM_STORE(result);
+            VM_CHECK();
+            VM_NEXT();
+        VM_CASE(OP_STORE): {
+            int slot = slots[ins->a];
+            if (slot < 0) {
+                Variable *var = find_variable(calc, prog->symbols[ins->a]);
+                slot = var != NULL ? (int)(var - calc->variables) : -1;
+            }
+            // Formulas reading the variable were compiled for its unit
+            Unit unit = (Unit)ins->c >> 1;
+            if (slot >= 0 && calc->variables[slot].unit != unit && calc->variables[slot].dependent_count > 0) {
+                *error = CALC_ERROR_UNITS;
+                goto vm_done;
+            }
+            int stored = slot >= 0 && !(ins->c & 1) ? assign_variable(calc, slot, r[ins->b])
+                                                    : set_variable_value(calc, prog->symbols[ins->a], r[ins->b], ins->c & 1);
+            if (!stored) {
+                *error = CALC_ERROR_MEMORY;
+                goto vm_done;
+            }
+            slots[ins->a] = slot >= 0 ? slot : calc->var_count - 1;
+            set_variable_unit(calc, slots[ins->a], unit);
+            result = value_retain(r[ins->b]);
+            VM_STORE(result);
+            VM_NEXT();
+        }
+        VM_CASE(OP_PRINT):
+            if (calc->output != NULL) {
+                for (int i = 0; i < ins->b; i++) {
+                    if (i > 0) fputc(' ', calc->output);
+                    fprint_value(calc->output, calc, r[ins->a + i]);
+                }
+                fprint_unit(calc->output, (Unit)ins->c >> 1);
+                fputc(ins->c & 1 ? ' ' : '\n', calc->output);
+            }
+            VM_NEXT();
+    }
+    *error = CALC_ERROR_SYNTAX; // Unknown instruction
+    
+vm_done:
+    if (*error != CALC_OK && prog->lines != NULL) {
+        calc->error_line = prog->lines[ins - prog->code];
+    }
+    result = value_real(0);
+    if (*error == CALC_OK && prog->result >= 0) {
+        result = r[prog->result];
+        r[prog->result] = value_real(0);
+    }
+    for (int i = 0; i < prog->register_count; i++) {
+        value_release(&r[i]);
+    }
+    if (r != local) free(r);
+    if (slots != local_slots) free(slots);
+    return result;
+}
+
+// Milliseconds elapsed since start
+double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Cache key: the expression with whitespace dropped except between two
+// word characters or operator characters that would join, so "x  +  1"
+// and "x+1" share a program while "const x=1" and "constx=1" stay distinct
+char* normalize_expression(const char *expr) {
+    char *key = malloc(strlen(expr) + 1);
+    if (key == NULL) return NULL;
+    
+    size_t n = 0;
+    for (const char *p = expr; *p; ) {
+        if (isspace(*p)) {
+            while (isspace(*p)) p++;
+            if (n > 0 && *p && (isalnum(key[n - 1]) || key[n - 1] == '_' || key[n - 1] == '.') &&
+                (isalnum(*p) || *p == '_' || *p == '.')) {
+                key[n++] = ' ';
+            } else if (n > 0 && strchr("<>=!&|", key[n - 1]) && strchr("=&|", *p)) {
+                key[n++] = ' '; // "< =" is not "<="
+            }
+            continue;
+        }
+        key[n++] = *p++;
+    }
+    key[n] = '\0';
+    return key;
+}
+
+// Approximate heap footprint of a compiled program
+size_t program_size(const Program *prog) {
+    size_t bytes = sizeof(Program) + prog->code_capacity * sizeof(Instruction) +
+                   prog->const_capacity * sizeof(Value) + prog->symbol_capacity * 32 +
+                   (prog->lines != NULL ? prog->code_capacity * sizeof(int) : 0);
+    for (int i = 0; i < prog->const_count; i++) {
+        if (prog->constants[i].type == CALC_VECTOR || prog->constants[i].type == CALC_POLY) {
+            Vector *vec = prog->constants[i].vector;
+            bytes += vec->length * (vec->im ? 2 : 1) * sizeof(double);
+        } else if (prog->constants[i].type == CALC_BIGINT) {
+            bytes += sizeof(BigInt) + prog->constants[i].bigint->length * sizeof(uint32_t);
+        }
+    }
+    return bytes;
+}
+
+void cache_unlink(ExprCache *cache, CacheEntry *entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else cache->lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else cache->lru_tail = entry->lru_prev;
+}
+
+void cache_push_front(ExprCache *cache, CacheEntry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->lru_prev = entry;
+    cache->lru_head = entry;
+    if (cache->lru_tail == NULL) cache->lru_tail = entry;
+}
+
+// Remove an entry from the table and the LRU list and free it
+void cache_remove(ExprCache *cache, CacheEntry *entry) {
+    CacheEntry **link = &cache->buckets[entry->hash % EXPR_CACHE_BUCKETS];
+    while (*link != entry) link = &(*link)->hash_next;
+    *link = entry->hash_next;
+    cache_unlink(cache, entry);
+    cache->entry_count--;
+    cache->bytes -= entry->bytes;
+    program_free(entry->prog);
+    free(entry->key);
+    free(entry);
+}
+
+void cache_clear(ExprCache *cache) {
+    while (cache->lru_head) {
+        cache_remove(cache, cache->lru_head);
+    }
+}
+
+// Look up a normalized key, marking the entry most recently used
+Program* cache_lookup(ExprCache *cache, const char *key, unsigned hash) {
+    for (CacheEntry *entry = cache->buckets[hash % EXPR_CACHE_BUCKETS]; entry; entry = entry->hash_next) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            cache_unlink(cache, entry);
+            cache_push_front(cache, entry);
+            return entry->prog;
+        }
+    }
+    return NULL;
+}
+
+// Insert a program (the cache takes ownership of key and program),
+// evicting least recently used entries to stay within the byte limit.
+// Returns 0 if the program alone exceeds the limit.
+int cache_insert(ExprCache *cache, char *key, unsigned hash, Program *prog) {
+    size_t bytes = sizeof(CacheEntry) + strlen(key) + 1 + program_size(prog);
+    if (bytes > cache->byte_limit) return 0;
+    
+    CacheEntry *entry = malloc(sizeof(CacheEntry));
+    if (entry == NULL) return 0;
+    while (cache->bytes + bytes > cache->byte_limit) {
+        cache_remove(cache, cache->lru_tail);
+        cache->evictions++;
+    }
+    
+    entry->key = key;
+    entry->hash = hash;
+    entry->prog = prog;
+    entry->bytes = bytes;
+    entry->hash_next = cache->buckets[hash % EXPR_CACHE_BUCKETS];
+    cache->buckets[hash % EXPR_CACHE_BUCKETS] = entry;
+    cache_push_front(cache, entry);
+    cache->entry_count++;
+    cache->bytes += bytes;
+    return 1;
+}
+
+// Memo cache. The slot and checksum both come from a hash of the tag and
+// argument bits (of doubles or 64-bit integers); words are accessed
+// atomically one at a time. Results are CALC_REAL or CALC_INTEGER, the
+// type being covered by the checksum. CALC_BIGINT results go to the
+// smaller locked table, slotted by the same hash; lookups only take its
+// lock once it exists.
+unsigned long long memo_hash(unsigned long long tag, const unsigned long long bits[], int count) {
+    unsigned long long h = tag * 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < count; i++) {
+        h = (h ^ bits[i]) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+    }
+    // Small integers have all-zero low mantissa bits; mix every input bit
+    // into the low bits that pick the slot
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+unsigned long long memo_check(unsigned long long hash, unsigned long long result) {
+    unsigned long long c = (hash ^ result) * 0xC4CEB9FE1A85EC53ULL;
+    return c ^ (c >> 29);
+}
+
+// Counters use plain atomic loads and stores rather than a locked add:
+// concurrent callers may lose an increment, which statistics can afford
+void memo_count(unsigned long *counter) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+int memo_lookup(Calculator *calc, unsigned long long tag, const unsigned long long key[], int count, Value *result) {
+    MemoEntry *entries = __atomic_load_n(&calc->memo.entries, __ATOMIC_ACQUIRE);
+    unsigned long long hash = memo_hash(tag, key, count);
+    
+    if (entries != NULL) {
+        MemoEntry *entry = &entries[hash & (MEMO_ENTRIES - 1)];
+        int match = __atomic_load_n(&entry->tag, __ATOMIC_RELAXED) == tag;
+        for (int i = 0; match && i < count; i++) {
+            match = __atomic_load_n(&entry->args[i], __ATOMIC_RELAXED) == key[i];
+        }
+        unsigned long long value = __atomic_load_n(&entry->result, __ATOMIC_RELAXED);
+        unsigned long long type = __atomic_load_n(&entry->type, __ATOMIC_RELAXED);
+        if (match && __atomic_load_n(&entry->check, __ATOMIC_RELAXED) == memo_check(hash ^ type, value)) {
+            if (type == CALC_INTEGER) {
+                *result = value_integer(0);
+                memcpy(&result->integer, &value, sizeof(value));
+            } else {
+                *result = value_real(0);
+                memcpy(&result->real, &value, sizeof(value));
+            }
+            memo_count(&calc->memo.hits);
+            return 1;
+        }
+    }
+    if (__atomic_load_n(&calc->memo.big, __ATOMIC_ACQUIRE) != NULL) {
+        pthread_mutex_lock(&calc->memo.big_lock);
+        const MemoBigEntry *entry = &calc->memo.big[hash & (MEMO_BIG_ENTRIES - 1)];
+        int match = entry->tag == tag && memcmp(entry->args, key, count * sizeof(key[0])) == 0;
+        if (match) *result = value_retain(entry->result);
+        pthread_mutex_unlock(&calc->memo.big_lock);
+        if (match) {
+            memo_count(&calc->memo.hits);
+            return 1;
+        }
+    }
+    memo_count(&calc->memo.misses);
+    return 0;
+}
+
+void memo_store_big(Calculator *calc, unsigned long long tag, const unsigned long long key[], int count, Value result) {
+    pthread_mutex_lock(&calc->memo.big_lock);
+    if (calc->memo.big == NULL) {
+        __atomic_store_n(&calc->memo.big, calloc(MEMO_BIG_ENTRIES, sizeof(MemoBigEntry)), __ATOMIC_RELEASE);
+    }
+    if (calc->memo.big != NULL) {
+        MemoBigEntry *entry = &calc->memo.big[memo_hash(tag, key, count) & (MEMO_BIG_ENTRIES - 1)];
+        value_release(&entry->result);
+        entry->tag = tag;
+        memset(entry->args, 0, sizeof(entry->args));
+        memcpy(entry->args, key, count * sizeof(key[0]));
+        entry->result = value_retain(result);
+    }
+    pthread_mutex_unlock(&calc->memo.big_lock);
+}
+
+void memo_store(Calculator *calc, unsigned long long tag, const unsigned long long key[], int count, Value result) {
+    if (result.type == CALC_BIGINT) {
+        memo_store_big(calc, tag, key, count, result);
+        return;
+    }
+    if (result.type != CALC_REAL && result.type != CALC_INTEGER) return;
+    MemoEntry *entries = __atomic_load_n(&calc->memo.entries, __ATOMIC_ACQUIRE);
+    if (entries == NULL) {
+        MemoEntry *fresh = calloc(MEMO_ENTRIES, sizeof(MemoEntry));
+        if (fresh == NULL) return;
+        if (__atomic_compare_exchange_n(&calc->memo.entries, &entries, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            entries = fresh;
+        } else {
+            free(fresh);  // Another thread allocated the table first
+        }
+    }
+    
+    unsigned long long value, type = result.type;
+    if (result.type == CALC_INTEGER) {
+        memcpy(&value, &result.integer, sizeof(value));
+    } else {
+        memcpy(&value, &result.real, sizeof(value));
+    }
+    unsigned long long hash = memo_hash(tag, key, count);
+    MemoEntry *entry = &entries[hash & (MEMO_ENTRIES - 1)];
+    __atomic_store_n(&entry->tag, tag, __ATOMIC_RELAXED);
+    for (int i = 0; i < MEMO_MAX_ARGS; i++) {
+        __atomic_store_n(&entry->args[i], i < count ? key[i] : 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&entry->result, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->type, type, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->check, memo_check(hash ^ type, value), __ATOMIC_RELAXED);
+}
+
+// Recompute which user functions are pure: their bodies load only
+// constants and call neither rand nor an impure user function. The memo
+// epoch advances, so results computed by earlier definitions are unused.
+void update_function_purity(Calculator *calc) {
+    for (int i = 0; i < calc->function_count; i++) {
+        calc->functions[i].pure = 1;
+    }
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (int i = 0; i < calc->function_count; i++) {
+            const Program *body = calc->functions[i].body;
+            if (!calc->functions[i].pure) continue;
+            for (int pc = 0; pc < body->code_count; pc++) {
+                const Instruction *ins = &body->code[pc];
+                Variable *var;
+                int impure = 0;
+                if (ins->op == OP_LOAD) {
+                    var = find_variable(calc, body->symbols[ins->a]);
+                    impure = var == NULL || !var->constant;
+                } else if (ins->op == OP_CALL) {
+                    impure = function_table[ins->c].vfunc == func_rand;
+                } else if (ins->op == OP_UCALL) {
+                    impure = !calc->functions[ins->c].pure;
+                }
+                if (impure) {
+                    calc->functions[i].pure = 0;
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+    }
+    calc->memo.epoch++;
+}
+
+// Run a user function, through the memo cache when it is pure and called
+// with real or 64-bit integer arguments. The key includes the angle mode,
+// which changes the meaning of trigonometric calls in the body, and which
+// arguments are integers, whose bits would otherwise match doubles'.
+Value call_user_function(Calculator *calc, int index, Value args[], CalcError *error) {
+    const UserFunction *fn = &calc->functions[index];
+    unsigned long long key[MEMO_MAX_ARGS];
+    unsigned long long integer_args = 0;
+    int memoize = fn->pure && fn->param_count <= MEMO_MAX_ARGS;
+    for (int i = 0; memoize && i < fn->param_count; i++) {
+        memoize = args[i].type == CALC_REAL || args[i].type == CALC_INTEGER;
+        if (args[i].type == CALC_INTEGER) {
+            integer_args |= 1ULL << i;
+            memcpy(&key[i], &args[i].integer, sizeof(key[i]));
+        } else {
+            memcpy(&key[i], &args[i].real, sizeof(key[i]));
+        }
+    }
+    if (!memoize) {
+        return program_run(calc, fn->body, args, error);
+    }
+    
+    unsigned long long tag = (1ULL << 63) | ((unsigned long long)calc->memo.epoch << 32) |
+                             ((unsigned long long)index << 8) | (calc->angle_mode << 7) |
+                             (integer_args << 3) | fn->param_count;
+    Value result;
+    if (memo_lookup(calc, tag, key, fn->param_count, &result)) {
+        return result;
+    }
+    result = program_run(calc, fn->body, args, error);
+    if (*error == CALC_OK) memo_store(calc, tag, key, fn->param_count, result);
+    return result;
+}
+
+// Unit of a user function's result. Its body was compiled for the units
+// variables had then; after one changes, the body is compiled again to
+// find the unit it gives now. The code does not depend on units, so only
+// the unit is kept.
+Unit user_function_unit(Calculator *calc, int index, CalcError *error) {
+    UserFunction *fn = &calc->functions[index];
+    if (fn->unit_epoch != calc->unit_epoch) {
+        const char *params[MAX_FUNC_ARGS];
+        for (int i = 0; i < fn->param_count; i++) params[i] = fn->params[i];
+        Program *body = compile_expression(calc, fn->source, params, fn->param_count, error);
+        if (body == NULL) return 0;
+        fn->body->unit = body->unit;
+        fn->unit_epoch = calc->unit_epoch;
+        program_free(body);
+    }
+    return fn->body->unit;
+}
+
+// Does the program call one of the flagged user functions?
+int program_calls(const Program *prog, const char *flagged) {
+    for (int pc = 0; pc < prog->code_count; pc++) {
+        if (prog->code[pc].op == OP_UCALL && flagged[prog->code[pc].c]) return 1;
+    }
+    return 0;
+}
+
+// A user function changed: drop cached programs that reach it, give
+// reactive formulas that reach it the inputs its new body reads and mark
+// them for recomputation. 0 if a formula would then depend on itself.
+int invalidate_function(Calculator *calc, int index, CalcError *error) {
+    // Flag every function that calls the changed one, directly or not
+    char *flagged = calloc(calc->function_count, 1);
+    if (flagged == NULL) {
+        cache_clear(&calc->cache);
+        *error = CALC_ERROR_MEMORY;
+        return 0;
+    }
+    flagged[index] = 1;
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (int i = 0; i < calc->function_count; i++) {
+            if (!flagged[i] && program_calls(calc->functions[i].body, flagged)) {
+                flagged[i] = changed = 1;
+            }
+        }
+    }
+    
+    CacheEntry *entry = calc->cache.lru_head;
+    while (entry) {
+        CacheEntry *next = entry->lru_next;
+        if (program_calls(entry->prog, flagged)) {
+            cache_remove(&calc->cache, entry);
+            calc->cache.invalidations++;
+        }
+        entry = next;
+    }
+    
+    for (int i = 0; i < calc->var_count && *error == CALC_OK; i++) {
+        Variable *var = &calc->variables[i];
+        if (var->definition && program_calls(var->definition, flagged) && redepend_variable(calc, i, error)) {
+            var->dirty = 1;
+            mark_dependents_dirty(calc, i);
+        }
+    }
+    free(flagged);
+    return *error == CALC_OK;
+}
+
+// Evaluate expression: look up or compile its bytecode, then run it. In
+// reactive mode an assignment whose right side reads other variables
+// keeps the compiled right side as the variable's formula.
+Value evaluate_expression(Calculator *calc, const char *expr, CalcError *error) {
+    ExprCache *cache = &calc->cache;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    calc->result_unit = 0;
+    
+    // Cached programs were compiled for the units variables had then
+    if (cache->unit_epoch != calc->unit_epoch) {
+        cache_clear(cache);
+        cache->unit_epoch = calc->unit_epoch;
+    }
+    
+    char *key = normalize_expression(expr);
+    if (key == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    unsigned hash = hash_name(key);
+    Program *prog = cache_lookup(cache, key, hash);
+    cache->lookups++;
+    cache->lookup_ms += elapsed_ms(&start);
+    
+    int owned = 0;
+    if (prog != NULL) {
+        cache->hits++;
+        free(key);
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        prog = compile_expression(calc, expr, NULL, 0, error);
+        cache->compile_ms += elapsed_ms(&start);
+        if (prog == NULL) {
+            free(key);
+            return value_real(0);
+        }
+        if (!cache_insert(cache, key, hash, prog)) {
+            free(key);
+            owned = 1;
+        }
+    }
+    
+    Instruction *last = &prog->code[prog->code_count - 1];
+    if (calc->reactive && last->op == OP_STORE && (last->c & 1) == 0) {
+        // The stored name is a symbol; the formula must read another one or
+        // call a user function, whose body may read them
+        int reads = 0, self = 0;
+        for (int pc = 0; pc < prog->code_count - 1; pc++) {
+            if (prog->code[pc].op == OP_LOAD) {
+                reads = 1;
+                if (prog->code[pc].a == last->a) self = 1;
+            }
+            if (prog->code[pc].op == OP_UCALL) reads = 1;
+        }
+        // x = x + 1 updates x's value instead of defining a cycle
+        if (reads && !self) {
+            char name[32];
+            strcpy(name, prog->symbols[last->a]);
+            
+            // The variable keeps a program of its own
+            if (!owned) {
+                prog = compile_expression(calc, expr, NULL, 0, error);
+                if (prog == NULL) return value_real(0);
+            }
+            prog->result = prog->code[prog->code_count - 1].b;
+            prog->code_count--;
+            
+            const char *formula = strchr(expr, '=') + 1;
+            while (isspace(*formula)) formula++;
+            if (!define_variable(calc, name, prog, formula, error)) {
+                return value_real(0);
+            }
+            calc->result_unit = find_variable(calc, name)->unit;
+            return value_retain(find_variable(calc, name)->value);
+        }
+    }
+    
+    Unit unit = prog->unit;
+    Value result = program_run(calc, prog, NULL, error);
+    if (owned) program_free(prog);
+    if (*error == CALC_OK) calc->result_unit = unit;
+    return result;
+}
+
+int find_user_function(Calculator *calc, const char *name) {
+    for (int i = 0; i < calc->function_count; i++) {
+        if (strcmp(calc->functions[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Quick check for "name(a, b) = body" before trying to evaluate input
+int is_function_definition(const char *input) {
+    const char *p = input;
+    while (isspace(*p)) p++;
+    if (!isalpha(*p) && *p != '_') return 0;
+    while (isalnum(*p) || *p == '_') p++;
+    while (isspace(*p)) p++;
+    if (*p++ != '(') return 0;
+    while (isalnum(*p) || *p == '_' || *p == ',' || isspace(*p)) p++;
+    if (*p++ != ')') return 0;
+    while (isspace(*p)) p++;
+    return p[0] == '=' && p[1] != '=';
+}
+
+// Define or replace a user function from "name(a, b) = body" and return
+// its index, or -1 on error. A function may not call itself, directly or
+// through other functions.
+int define_function(Calculator *calc, const char *input, CalcError *error) {
+    int token_count = 0;
+    Token *tokens = tokenize(input, &token_count, error);
+    if (*error != CALC_OK) return -1;
+    
+    UserFunction fn;
+    memset(&fn, 0, sizeof(UserFunction));
+    strcpy(fn.name, tokens[0].name);
+    
+    // Parameter list: distinct identifiers separated by commas
+    int pos = 2;
+    while (*error == CALC_OK && tokens[pos].type != TOK_RPAREN) {
+        if (fn.param_count > 0 && tokens[pos++].type != TOK_COMMA) {
+            *error = CALC_ERROR_SYNTAX;
+        } else if (tokens[pos].type != TOK_IDENTIFIER) {
+            *error = CALC_ERROR_SYNTAX;
+        } else if (fn.param_count == MAX_FUNC_ARGS) {
+            *error = CALC_ERROR_ARG_COUNT;
+        } else {
+            for (int i = 0; i < fn.param_count; i++) {
+                if (strcmp(fn.params[i], tokens[pos].name) == 0) *error = CALC_ERROR_SYNTAX;
+            }
+            strcpy(fn.params[fn.param_count++], tokens[pos++].name);
+        }
+    }
+    free(tokens);
+    
+    // Built-in functions cannot be replaced
+    if (*error == CALC_OK && find_function(fn.name) != NULL) {
+        *error = CALC_ERROR_SYNTAX;
+    }
+    if (*error != CALC_OK) return -1;
+    
+    const char *params[MAX_FUNC_ARGS];
+    for (int i = 0; i < fn.param_count; i++) params[i] = fn.params[i];
+    const char *body = strchr(strchr(input, ')'), '=') + 1;
+    while (isspace(*body)) body++;
+    fn.body = compile_expression(calc, body, params, fn.param_count, error);
+    if (fn.body == NULL) return -1;
+    
+    int index = find_user_function(calc, fn.name);
+    for (int pc = 0; pc < fn.body->code_count; pc++) {
+        if (fn.body->code[pc].op == OP_STORE) *error = CALC_ERROR_SYNTAX;
+    }
+    if (*error == CALC_OK && index >= 0) {
+        // The old definition is still in place, so a new body that reaches
+        // this function would call the old one; treat that as a cycle
+        char *flagged = calloc(calc->function_count, 1);
+        if (flagged == NULL) {
+            *error = CALC_ERROR_MEMORY;
+        } else {
+            flagged[index] = 1;
+            for (int changed = 1; changed; ) {
+                changed = 0;
+                for (int i = 0; i < calc->function_count; i++) {
+                    if (!flagged[i] && program_calls(calc->functions[i].body, flagged)) {
+                        flagged[i] = changed = 1;
+                    }
+                }
+            }
+            if (program_calls(fn.body, flagged)) *error = CALC_ERROR_CYCLE;
+            free(flagged);
+        }
+    }
+    fn.unit_epoch = calc->unit_epoch;
+    fn.source = *error == CALC_OK ? strdup(body) : NULL;
+    if (*error == CALC_OK && fn.source == NULL) *error = CALC_ERROR_MEMORY;
+    
+    if (*error == CALC_OK && index < 0 && calc->function_count == calc->function_capacity) {
+        int capacity = calc->function_capacity ? calc->function_capacity * 2 : 8;
+        UserFunction *grown = realloc(calc->functions, capacity * sizeof(UserFunction));
+        if (grown == NULL) {
+            *error = CALC_ERROR_MEMORY;
+        } else {
+            calc->functions = grown;
+            calc->function_capacity = capacity;
+        }
+    }
+    if (*error != CALC_OK) {
+        program_free(fn.body);
+        free(fn.source);
+        return -1;
+    }
+    
+    if (index < 0) {
+        index = calc->function_count++;
+        calc->functions[index] = fn;
+    } else {
+        // A body that makes a formula calling it read that formula's own
+        // variable is rejected, and the old body is put back
+        UserFunction old = calc->functions[index];
+        calc->functions[index] = fn;
+        if (!invalidate_function(calc, index, error)) {
+            calc->functions[index] = old;
+            CalcError restore = CALC_OK;
+            invalidate_function(calc, index, &restore);
+            program_free(fn.body);
+            free(fn.source);
+            return -1;
+        }
+        program_free(old.body);
+        free(old.source);
+    }
+    update_function_purity(calc);
+    return index;
+}
+
+// Worker thread: wait for a job generation, then pull tasks until none remain
+void* threadpool_worker(void *arg) {
+    ThreadPool *pool = arg;
+    unsigned long seen = 0;
+    int worker = -1;
+    
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < pool->thread_count; i++) {
+        if (pthread_equal(pool->threads[i], pthread_self())) worker = i;
+    }
+    while (1) {
+        while (!pool->shutdown && pool->generation == seen) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->shutdown) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        
+        size_t index;
+        while ((index = __atomic_fetch_add(&pool->next_task, 1, __ATOMIC_RELAXED)) < pool->task_count) {
+            pool->task(pool->arg, index, worker);
+        }
+        
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0) {
+            pthread_cond_signal(&pool->work_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Create a pool with thread_count workers besides the caller
+ThreadPool* threadpool_new(int thread_count) {
+    ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+    if (pool == NULL) return NULL;
+    pool->threads = calloc(thread_count > 0 ? thread_count : 1, sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    
+    // Hold the lock so workers see the complete thread list
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&pool->threads[i], NULL, threadpool_worker, pool) != 0) break;
+        pool->thread_count++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return pool;
+}
+
+// Run task(arg, i, worker) for i in [0, count) and wait for completion.
+// The caller runs tasks as worker thread_count. A pool that is already
+// busy (a task starting a nested job) runs the job on the caller alone.
+void threadpool_run(ThreadPool *pool, TaskFunc task, void *arg, size_t count) {
+    if (pool == NULL || pool->thread_count == 0 || count < 2 ||
+        __atomic_exchange_n(&pool->busy, 1, __ATOMIC_ACQUIRE)) {
+        int worker = pool ? pool->thread_count : 0;
+        for (size_t i = 0; i < count; i++) task(arg, i, worker);
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->task_count = count;
+    pool->next_task = 0;
+    pool->active = pool->thread_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    
+    size_t index;
+    while ((index = __atomic_fetch_add(&pool->next_task, 1, __ATOMIC_RELAXED)) < count) {
+        task(arg, index, pool->thread_count);
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active > 0) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    __atomic_store_n(&pool->busy, 0, __ATOMIC_RELEASE);
+}
+
+void threadpool_free(ThreadPool *pool) {
+    if (pool == NULL) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+    free(pool->threads);
+    free(pool);
+}
+
+// One pool, sized to the online CPUs, serves every calculator in the
+// process, so a daemon with a context per connection still runs one
+// worker per CPU. A calculator takes a reference on its first parallel
+// job and drops it when freed; the last reference frees the pool. Jobs
+// from contexts on different threads do not wait for each other: a pool
+// that is busy runs the later job on its caller alone.
+ThreadPool *shared_pool = NULL;
+int shared_pool_users = 0;
+pthread_mutex_t shared_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The calculator's pool, the shared one unless it was given its own.
+// Programs may run on several threads at once, so taking the reference is
+// under plan_lock.
+ThreadPool* calculator_pool(Calculator *calc) {
+    pthread_mutex_lock(&calc->plan_lock);
+    if (calc->pool == NULL) {
+        pthread_mutex_lock(&shared_pool_lock);
+        if (shared_pool == NULL) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            shared_pool = threadpool_new(cpus > 1 ? (int)cpus - 1 : 0);
+        }
+        if (shared_pool != NULL) shared_pool_users++;
+        calc->pool = shared_pool;
+        pthread_mutex_unlock(&shared_pool_lock);
+    }
+    ThreadPool *pool = calc->pool;
+    pthread_mutex_unlock(&calc->plan_lock);
+    return pool;
+}
+
+// Drop a calculator's pool: a reference to the shared pool, or a pool of
+// its own
+void calculator_pool_release(ThreadPool *pool) {
+    pthread_mutex_lock(&shared_pool_lock);
+    if (pool != NULL && pool == shared_pool) {
+        pool = --shared_pool_users == 0 ? shared_pool : NULL;
+        if (pool != NULL) shared_pool = NULL;
+    }
+    pthread_mutex_unlock(&shared_pool_lock);
+    threadpool_free(pool);
+}
+
+// Session snapshots. A snapshot is one file of fixed-size records that
+// refer to variable-length data (strings, vector elements, bytecode) by
+// file offset, so loading maps the file and copies records without
+// parsing any text. Built-in calls are stored as function_table indices,
+// so a snapshot is only read back by a build with the same table.
+#define SNAPSHOT_MAGIC "CALCSNAP"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_MAX_REGISTERS (1 << 20)
+
+typedef struct {
+    int32_t type;
+    int32_t complex;        // Vector has imaginary parts; bigint is negative
+    double re;              // Matrix rows
+    double im;              // Matrix columns
+    uint64_t length;        // Vector or dense matrix elements, sparse nonzeros or bigint limbs
+    uint64_t data;          // Offset of re[length], followed by im[length]; an integer's bits
+} SnapshotValue;
+
+typedef struct {
+    uint64_t code;          // Offset of Instruction[code_count]
+    uint64_t constants;     // Offset of SnapshotValue[const_count]
+    uint64_t symbols;       // Offset of char[symbol_count][32]
+    int32_t code_count;
+    int32_t const_count;
+    int32_t symbol_count;
+    int32_t register_count;
+    int32_t result;
+    uint32_t unit;
+} SnapshotProgram;
+
+typedef struct {
+    char name[32];
+    SnapshotValue value;
+    int32_t constant;
+    int32_t definition;     // Program index, -1 for none
+    uint64_t formula;       // String offset, 0 for none
+    uint32_t unit;
+    uint32_t reserved;
+} SnapshotVariable;
+
+typedef struct {
+    char name[32];
+    char params[MAX_FUNC_ARGS][32];
+    int32_t param_count;
+    int32_t body;           // Program index
+    uint64_t source;
+} SnapshotFunction;
+
+typedef struct {
+    uint64_t expression;
+    uint32_t unit;
+    uint32_t reserved;
+    SnapshotValue result;
+} SnapshotHistory;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t instruction_size;
+    uint32_t function_table_size;
+    int32_t angle_mode;
+    int32_t precision;
+    int32_t reactive;
+    uint64_t rng_state;
+    uint64_t size;
+    uint64_t var_count;
+    uint64_t function_count;
+    uint64_t history_count;
+    uint64_t program_count;
+    uint64_t variables;     // Offsets of the record arrays
+    uint64_t functions;
+    uint64_t history;
+    uint64_t programs;
+} SnapshotHeader;
+
+// Snapshot image under construction; offsets stay valid as it grows
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+    int failed;
+} SnapshotWriter;
+
+typedef struct {
+    const char *data;
+    size_t size;
+} SnapshotReader;
+
+int function_table_size(void) {
+    int count = 0;
+    while (function_table[count].name[0] != '\0') count++;
+    return count;
+}
+
+// Append zeroed, 8-byte aligned space; returns its offset
+uint64_t snapshot_reserve(SnapshotWriter *w, size_t bytes) {
+    size_t offset = (w->size + 7) & ~(size_t)7;
+    if (w->failed) return 0;
+    if (offset + bytes > w->capacity) {
+        size_t capacity = w->capacity ? w->capacity : 4096;
+        while (capacity < offset + bytes) capacity *= 2;
+        char *grown = realloc(w->data, capacity);
+        if (grown == NULL) {
+            w->failed = 1;
+            return 0;
+        }
+        w->data = grown;
+        w->capacity = capacity;
+    }
+    memset(w->data + w->size, 0, offset + bytes - w->size);
+    w->size = offset + bytes;
+    return offset;
+}
+
+uint64_t snapshot_append(SnapshotWriter *w, const void *src, size_t bytes) {
+    uint64_t offset = snapshot_reserve(w, bytes);
+    if (!w->failed && bytes > 0) memcpy(w->data + offset, src, bytes);
+    return offset;
+}
+
+// Copy a record into a reserved array slot
+void snapshot_store(SnapshotWriter *w, uint64_t offset, const void *record, size_t bytes) {
+    if (!w->failed) memcpy(w->data + offset, record, bytes);
+}
+
+uint64_t snapshot_string(SnapshotWriter *w, const char *text) {
+    return text ? snapshot_append(w, text, strlen(text) + 1) : 0;
+}
+
+// A sparse matrix is stored as uint64 row_start[rows + 1], then int32
+// col[nnz] padded to 8 bytes, then double values[nnz]
+void snapshot_sparse(SnapshotWriter *w, const SparseMatrix *m, SnapshotValue *record) {
+    size_t nnz = m->row_start[m->rows];
+    size_t starts = (m->rows + 1) * sizeof(uint64_t), cols = (nnz * sizeof(int32_t) + 7) & ~(size_t)7;
+    record->re = (double)m->rows;
+    record->im = (double)m->cols;
+    record->length = nnz;
+    record->data = snapshot_reserve(w, starts + cols + nnz * sizeof(double));
+    if (w->failed) return;
+    uint64_t *row_start = (uint64_t *)(w->data + record->data);
+    for (size_t r = 0; r <= m->rows; r++) row_start[r] = m->row_start[r];
+    snapshot_store(w, record->data + starts, m->col, nnz * sizeof(int32_t));
+    snapshot_store(w, record->data + starts + cols, m->values, nnz * sizeof(double));
+}
+
+SnapshotValue snapshot_value(SnapshotWriter *w, Value v) {
+    SnapshotValue record;
+    memset(&record, 0, sizeof(record));
+    record.type = v.type;
+    if (v.type == CALC_REAL) {
+        record.re = v.real;
+    } else if (v.type == CALC_COMPLEX) {
+        record.re = v.complex_num.real;
+        record.im = v.complex_num.imag;
+    } else if (v.type == CALC_VECTOR || v.type == CALC_POLY) {
+        size_t bytes = v.vector->length * sizeof(double);
+        record.complex = v.vector->im != NULL;
+        record.length = v.vector->length;
+        record.data = snapshot_reserve(w, record.complex ? 2 * bytes : bytes);
+        snapshot_store(w, record.data, v.vector->re, bytes);
+        if (record.complex) snapshot_store(w, record.data + bytes, v.vector->im, bytes);
+    } else if (v.type == CALC_SPARSE) {
+        snapshot_sparse(w, v.sparse, &record);
+    } else if (v.type == CALC_MATRIX) {
+        record.re = (double)v.matrix->rows;
+        record.im = (double)v.matrix->cols;
+        record.length = v.matrix->rows * v.matrix->cols;
+        record.data = snapshot_append(w, v.matrix->data, record.length * sizeof(double));
+    } else if (v.type == CALC_INTEGER) {
+        record.data = (uint64_t)v.integer;
+    } else if (v.type == CALC_BIGINT) {
+        record.complex = v.bigint->sign < 0;
+        record.length = v.bigint->length;
+        record.data = snapshot_append(w, v.bigint->limbs, record.length * sizeof(uint32_t));
+    }
+    return record;
+}
+
+SnapshotProgram snapshot_program(SnapshotWriter *w, const Program *prog) {
+    SnapshotProgram record;
+    memset(&record, 0, sizeof(record));
+    record.code_count = prog->code_count;
+    record.const_count = prog->const_count;
+    record.symbol_count = prog->symbol_count;
+    record.register_count = prog->register_count;
+    record.result = prog->result;
+    record.unit = prog->unit;
+    record.code = snapshot_append(w, prog->code, prog->code_count * sizeof(Instruction));
+    record.symbols = snapshot_append(w, prog->symbols, prog->symbol_count * sizeof(*prog->symbols));
+    record.constants = snapshot_reserve(w, prog->const_count * sizeof(SnapshotValue));
+    for (int i = 0; i < prog->const_count; i++) {
+        SnapshotValue value = snapshot_value(w, prog->constants[i]);
+        snapshot_store(w, record.constants + i * sizeof(SnapshotValue), &value, sizeof(value));
+    }
+    return record;
+}
+
+// Write a finished image next to path and rename it over path. The
+// temporary name includes the process id, so processes writing the same
+// file at once do not mix their output.
+int snapshot_write(const SnapshotWriter *w, const char *path) {
+    size_t path_len = strlen(path);
+    char *temp_path = malloc(path_len + 32);
+    FILE *out = NULL;
+    int ok = 0;
+    if (temp_path != NULL) {
+        snprintf(temp_path, path_len + 32, "%s.%ld.tmp", path, (long)getpid());
+        out = fopen(temp_path, "wb");
+    }
+    if (out != NULL) {
+        ok = fwrite(w->data, 1, w->size, out) == w->size;
+        ok = fclose(out) == 0 && ok;
+        ok = ok && rename(temp_path, path) == 0;
+        if (!ok) unlink(temp_path);
+    }
+    free(temp_path);
+    return ok;
+}
+
+// Write variables, user functions, history and settings to path. The file
+// is written next to path and renamed over it, so a failed save leaves
+// the previous snapshot intact.
+int session_save(Calculator *calc, const char *path, CalcError *error) {
+    SnapshotWriter w = {NULL, 0, 0, 0};
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.instruction_size = sizeof(Instruction);
+    header.function_table_size = function_table_size();
+    header.angle_mode = calc->angle_mode;
+    header.precision = calc->precision;
+    header.reactive = calc->reactive;
+    header.rng_state = calc->rng_state;
+    header.var_count = calc->var_count;
+    header.function_count = calc->function_count;
+    header.history_count = calc->history_count;
+    header.program_count = calc->function_count;
+    for (int i = 0; i < calc->var_count; i++) {
+        if (calc->variables[i].definition != NULL) header.program_count++;
+    }
+    
+    snapshot_reserve(&w, sizeof(header));
+    header.variables = snapshot_reserve(&w, header.var_count * sizeof(SnapshotVariable));
+    header.functions = snapshot_reserve(&w, header.function_count * sizeof(SnapshotFunction));
+    header.history = snapshot_reserve(&w, header.history_count * sizeof(SnapshotHistory));
+    header.programs = snapshot_reserve(&w, header.program_count * sizeof(SnapshotProgram));
+    int program_index = 0;
+    
+    for (int i = 0; i < calc->function_count; i++) {
+        const UserFunction *fn = &calc->functions[i];
+        SnapshotFunction record;
+        memset(&record, 0, sizeof(record));
+        memcpy(record.name, fn->name, sizeof(record.name));
+        memcpy(record.params, fn->params, sizeof(record.params));
+        record.param_count = fn->param_count;
+        record.body = program_index;
+        record.source = snapshot_string(&w, fn->source);
+        SnapshotProgram body = snapshot_program(&w, fn->body);
+        snapshot_store(&w, header.programs + program_index++ * sizeof(SnapshotProgram), &body, sizeof(body));
+        snapshot_store(&w, header.functions + i * sizeof(SnapshotFunction), &record, sizeof(record));
+    }
+    
+    for (int i = 0; i < calc->var_count; i++) {
+        const Variable *var = &calc->variables[i];
+        SnapshotVariable record;
+        memset(&record, 0, sizeof(record));
+        memcpy(record.name, var->name, sizeof(record.name));
+        record.value = snapshot_value(&w, var->value);
+        record.constant = var->constant;
+        record.unit = var->unit;
+        record.definition = -1;
+        if (var->definition != NULL) {
+            record.definition = program_index;
+            record.formula = snapshot_string(&w, var->formula);
+            SnapshotProgram definition = snapshot_program(&w, var->definition);
+            snapshot_store(&w, header.programs + program_index++ * sizeof(SnapshotProgram), &definition, sizeof(definition));
+        }
+        snapshot_store(&w, header.variables + i * sizeof(SnapshotVariable), &record, sizeof(record));
+    }
+    
+    // Oldest entry first, so loading replays add_history in order
+    int start = (calc->history_index - calc->history_count + HISTORY_SIZE) % HISTORY_SIZE;
+    for (int i = 0; i < calc->history_count; i++) {
+        const HistoryEntry *entry = &calc->history[(start + i) % HISTORY_SIZE];
+        SnapshotHistory record;
+        record.expression = snapshot_string(&w, entry->expression ? entry->expression : "");
+        record.unit = entry->unit;
+        record.reserved = 0;
+        record.result = snapshot_value(&w, entry->result);
+        snapshot_store(&w, header.history + i * sizeof(SnapshotHistory), &record, sizeof(record));
+    }
+    
+    header.size = w.size;
+    snapshot_store(&w, 0, &header, sizeof(header));
+    if (w.failed) {
+        free(w.data);
+        *error = CALC_ERROR_MEMORY;
+        return 0;
+    }
+    
+    int ok = snapshot_write(&w, path);
+    free(w.data);
+    if (!ok) *error = CALC_ERROR_IO;
+    return ok;
+}
+
+// Pointer to count records of size bytes at offset, or NULL if they do
+// not lie within the snapshot
+const void* snapshot_span(const SnapshotReader *r, uint64_t offset, uint64_t count, size_t size) {
+    if (offset > r->size || offset % 8 != 0) return NULL;
+    if (count > 0 && count > (r->size - offset) / size) return NULL;
+    return r->data + offset;
+}
+
+const char* snapshot_text(const SnapshotReader *r, uint64_t offset) {
+    if (offset == 0 || offset >= r->size) return NULL;
+    return memchr(r->data + offset, '\0', r->size - offset) ? r->data + offset : NULL;
+}
+
+// Rebuild a sparse matrix, checking that rows are in order and columns in
+// range so that products cannot index outside the arrays
+int restore_sparse(const SnapshotReader *r, const SnapshotValue *record, Value *out) {
+    if (!(record->re >= 0 && record->re <= INT_MAX && record->im >= 0 && record->im <= INT_MAX)) return 0;
+    size_t rows = (size_t)record->re, cols = (size_t)record->im, nnz = record->length;
+    if (rows != record->re || cols != record->im || nnz > r->size / sizeof(double)) return 0;
+    size_t col_words = (nnz * sizeof(int32_t) + 7) / 8;
+    const uint64_t *row_start = snapshot_span(r, record->data, rows + 1 + col_words + nnz, sizeof(uint64_t));
+    if (row_start == NULL || row_start[0] != 0 || row_start[rows] != nnz) return 0;
+    const int32_t *col = (const int32_t *)(row_start + rows + 1);
+    const double *values = (const double *)(row_start + rows + 1 + col_words);
+    
+    SparseMatrix *m = sparse_new(rows, cols, nnz);
+    if (m == NULL) return 0;
+    for (size_t i = 0; i < rows; i++) {
+        if (row_start[i + 1] < row_start[i]) {
+            sparse_release(m);
+            return 0;
+        }
+        m->row_start[i + 1] = row_start[i + 1];
+    }
+    for (size_t k = 0; k < nnz; k++) {
+        if (col[k] < 0 || (size_t)col[k] >= cols) {
+            sparse_release(m);
+            return 0;
+        }
+        m->col[k] = col[k];
+    }
+    memcpy(m->values, values, nnz * sizeof(double));
+    CalcError error = CALC_OK;
+    m = sparse_partition(m, &error);
+    if (m == NULL) return 0;
+    *out = value_sparse(m);
+    return 1;
+}
+
+int restore_value(const SnapshotReader *r, const SnapshotValue *record, Value *out) {
+    if (record->type == CALC_REAL) {
+        *out = value_real(record->re);
+    } else if (record->type == CALC_COMPLEX) {
+        *out = value_complex(record->re, record->im);
+    } else if (record->type == CALC_VECTOR || record->type == CALC_POLY) {
+        int complex = record->complex != 0;
+        if (record->length > r->size / sizeof(double)) return 0;
+        if (record->type == CALC_POLY && record->length == 0) return 0;
+        const double *data = snapshot_span(r, record->data, record->length * (complex ? 2 : 1), sizeof(double));
+        if (data == NULL) return 0;
+        Vector *v = vector_new(record->length, complex);
+        if (v == NULL) return 0;
+        memcpy(v->re, data, record->length * sizeof(double));
+        if (complex) memcpy(v->im, data + record->length, record->length * sizeof(double));
+        *out = record->type == CALC_POLY ? value_poly(v) : value_vector(v);
+    } else if (record->type == CALC_SPARSE) {
+        return restore_sparse(r, record, out);
+    } else if (record->type == CALC_MATRIX) {
+        size_t rows = (size_t)record->re, cols = (size_t)record->im;
+        if (!(record->re >= 0 && record->re <= INT_MAX && record->im >= 0 && record->im <= INT_MAX)) return 0;
+        if (rows != record->re || cols != record->im || record->length != (uint64_t)rows * cols) return 0;
+        const double *data = snapshot_span(r, record->data, record->length, sizeof(double));
+        if (data == NULL) return 0;
+        DenseMatrix *m = dense_new(rows, cols);
+        if (m == NULL) return 0;
+        memcpy(m->data, data, record->length * sizeof(double));
+        *out = value_matrix(m);
+    } else if (record->type == CALC_INTEGER) {
+        *out = value_integer((long long)record->data);
+    } else if (record->type == CALC_BIGINT) {
+        if (record->length == 0 || record->length > BIGINT_MAX_LIMBS) return 0;
+        const uint32_t *limbs = snapshot_span(r, record->data, record->length, sizeof(uint32_t));
+        if (limbs == NULL) return 0;
+        BigInt *b = bigint_new(record->length);
+        if (b == NULL) return 0;
+        memcpy(b->limbs, limbs, record->length * sizeof(uint32_t));
+        b->sign = record->complex ? -1 : 1;
+        CalcError error = CALC_OK;
+        *out = value_bigint(b, &error);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Rebuild a program, checking every operand so a damaged file cannot make
+// program_run read outside its tables
+Program* restore_program_record(const SnapshotReader *r, const SnapshotProgram *record, int param_count, int function_count) {
+    const Instruction *code = snapshot_span(r, record->code, record->code_count, sizeof(Instruction));
+    const SnapshotValue *constants = snapshot_span(r, record->constants, record->const_count, sizeof(SnapshotValue));
+    const char (*symbols)[32] = snapshot_span(r, record->symbols, record->symbol_count, 32);
+    int registers = record->register_count;
+    if (code == NULL || constants == NULL || symbols == NULL || record->code_count <= 0 ||
+        record->const_count < 0 || record->symbol_count < 0 || registers <= 0 ||
+        registers > SNAPSHOT_MAX_REGISTERS || record->result < -1 || record->result >= registers ||
+        record->unit >> (4 * UNIT_BASES) != 0) {
+        return NULL;
+    }
+    int table_size = function_table_size();
+    for (int pc = 0; pc < record->code_count; pc++) {
+        const Instruction *ins = &code[pc];
+        int ok = ins->dst >= 0 && ins->dst < registers;
+        switch (ins->op) {
+            case OP_CONST: ok = ok && ins->a >= 0 && ins->a < record->const_count; break;
+            case OP_LOAD: ok = ok && ins->a >= 0 && ins->a < record->symbol_count; break;
+            case OP_PARAM: ok = ok && ins->a >= 0 && ins->a < param_count; break;
+            case OP_NEG: case OP_NOT: case OP_BOOL: case OP_MOVE:
+                ok = ok && ins->a >= 0 && ins->a < registers;
+                break;
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: case OP_POW:
+            case OP_LT: case OP_LE: case OP_GT: case OP_GE: case OP_EQ: case OP_NE:
+                ok = ok && ins->a >= 0 && ins->a < registers && ins->b >= 0 && ins->b < registers;
+                break;
+            case OP_JUMP: ok = ok && ins->a >= 0 && ins->a <= record->code_count; break;
+            case OP_JUMP_FALSE: case OP_JUMP_TRUE:
+                ok = ok && ins->a >= 0 && ins->a < registers && ins->b >= 0 && ins->b <= record->code_count;
+                break;
+            case OP_FOR_PREP: case OP_FOR_LOOP:
+                ok = ok && ins->a >= 0 && ins->a < registers && ins->b >= 0 && ins->b < registers &&
+                     ins->c >= 0 && ins->c <= record->code_count;
+                break;
+            case OP_CALL: case OP_UCALL: case OP_VECTOR: case OP_PRINT:
+                ok = ok && ins->a >= 0 && ins->b >= 0 && ins->b <= registers - ins->a;
+                if (ins->op == OP_CALL) ok = ok && ins->c >= 0 && ins->c < table_size;
+                if (ins->op == OP_UCALL) ok = ok && ins->c >= 0 && ins->c < function_count;
+                if (ins->op == OP_PRINT) ok = ok && ins->c >= 0 && ins->c >> (4 * UNIT_BASES + 1) == 0;
+                break;
+            case OP_STORE:
+                ok = ok && ins->a >= 0 && ins->a < record->symbol_count && ins->b >= 0 && ins->b < registers &&
+                     ins->c >= 0 && ins->c >> (4 * UNIT_BASES + 1) == 0;
+                break;
+            default: ok = 0;
+        }
+        if (!ok) return NULL;
+    }
+    
+    Program *prog = calloc(1, sizeof(Program));
+    if (prog == NULL) return NULL;
+    prog->code = malloc(record->code_count * sizeof(Instruction));
+    prog->constants = malloc((record->const_count + 1) * sizeof(Value));
+    prog->symbols = malloc((record->symbol_count + 1) * sizeof(*prog->symbols));
+    if (prog->code == NULL || prog->constants == NULL || prog->symbols == NULL) {
+        program_free(prog);
+        return NULL;
+    }
+    memcpy(prog->code, code, record->code_count * sizeof(Instruction));
+    memcpy(prog->symbols, symbols, record->symbol_count * sizeof(*prog->symbols));
+    for (int i = 0; i < record->symbol_count; i++) prog->symbols[i][31] = '\0';
+    prog->code_count = prog->code_capacity = record->code_count;
+    prog->symbol_count = prog->symbol_capacity = record->symbol_count;
+    prog->const_capacity = record->const_count;
+    prog->register_count = registers;
+    prog->result = record->result;
+    prog->unit = record->unit;
+    for (int i = 0; i < record->const_count; i++) {
+        if (!restore_value(r, &constants[i], &prog->constants[i])) {
+            program_free(prog);
+            return NULL;
+        }
+        prog->const_count++;
+    }
+    return prog;
+}
+
+Program* restore_program(const SnapshotReader *r, const SnapshotHeader *header, int64_t index, int param_count, int function_count) {
+    if (index < 0 || (uint64_t)index >= header->program_count) return NULL;
+    const SnapshotProgram *record = (const SnapshotProgram *)(r->data + header->programs) + index;
+    return restore_program_record(r, record, param_count, function_count);
+}
+
+// Build a session from a mapped snapshot into a fresh calculator
+int restore_session(Calculator *calc, const SnapshotReader *r, CalcError *error) {
+    const SnapshotHeader *header = (const SnapshotHeader *)r->data;
+    const SnapshotVariable *vars = snapshot_span(r, header->variables, header->var_count, sizeof(SnapshotVariable));
+    const SnapshotFunction *functions = snapshot_span(r, header->functions, header->function_count, sizeof(SnapshotFunction));
+    const SnapshotHistory *history = snapshot_span(r, header->history, header->history_count, sizeof(SnapshotHistory));
+    if (vars == NULL || functions == NULL || history == NULL ||
+        snapshot_span(r, header->programs, header->program_count, sizeof(SnapshotProgram)) == NULL ||
+        header->var_count > INT_MAX / 2 || header->function_count > INT_MAX / 2 ||
+        header->history_count > HISTORY_SIZE) {
+        *error = CALC_ERROR_FORMAT;
+        return 0;
+    }
+    
+    calc->angle_mode = header->angle_mode != 0;
+    if (header->precision >= 0 && header->precision <= 15) calc->precision = header->precision;
+    calc->reactive = header->reactive != 0;
+    if (header->rng_state != 0) calc->rng_state = header->rng_state;
+    
+    // Functions go straight into the table so OP_UCALL indices keep
+    // meaning the same function
+    int function_count = (int)header->function_count;
+    if (function_count > 0) {
+        calc->functions = calloc(function_count, sizeof(UserFunction));
+        if (calc->functions == NULL) {
+            *error = CALC_ERROR_MEMORY;
+            return 0;
+        }
+        calc->function_capacity = function_count;
+    }
+    for (int i = 0; i < function_count; i++) {
+        const SnapshotFunction *record = &functions[i];
+        UserFunction *fn = &calc->functions[i];
+        const char *source = snapshot_text(r, record->source);
+        if (record->param_count < 0 || record->param_count > MAX_FUNC_ARGS || source == NULL) {
+            *error = CALC_ERROR_FORMAT;
+            return 0;
+        }
+        memcpy(fn->name, record->name, sizeof(fn->name));
+        memcpy(fn->params, record->params, sizeof(fn->params));
+        fn->name[31] = '\0';
+        for (int p = 0; p < MAX_FUNC_ARGS; p++) fn->params[p][31] = '\0';
+        fn->param_count = record->param_count;
+        fn->body = restore_program(r, header, record->body, record->param_count, function_count);
+        fn->source = strdup(source);
+        calc->function_count++;
+        if (fn->body == NULL || fn->source == NULL) {
+            *error = fn->body == NULL ? CALC_ERROR_FORMAT : CALC_ERROR_MEMORY;
+            return 0;
+        }
+    }
+    
+    // Size the variable array and index once for the whole table
+    int needed = calc->var_count + (int)header->var_count;
+    if (needed > calc->var_capacity) {
+        Variable *grown = realloc(calc->variables, needed * sizeof(Variable));
+        int table_size = calc->var_table_size ? calc->var_table_size : 16;
+        while (table_size < 2 * (needed + 1)) table_size *= 2;
+        if (grown == NULL) {
+            *error = CALC_ERROR_MEMORY;
+            return 0;
+        }
+        calc->variables = grown;
+        calc->var_capacity = needed;
+        if (!rebuild_variable_table(calc, table_size)) {
+            *error = CALC_ERROR_MEMORY;
+            return 0;
+        }
+    }
+    
+    // Values first, then formulas, whose inputs may come later in the table
+    for (uint64_t i = 0; i < header->var_count; i++) {
+        const SnapshotVariable *record = &vars[i];
+        char name[32];
+        memcpy(name, record->name, sizeof(name));
+        name[31] = '\0';
+        Variable *existing = find_variable(calc, name);
+        if (existing != NULL && existing->constant) continue;  // Built-in constant
+        
+        Value value;
+        if (record->unit >> (4 * UNIT_BASES) != 0 || !restore_value(r, &record->value, &value)) {
+            *error = CALC_ERROR_FORMAT;
+            return 0;
+        }
+        int ok = set_variable_value(calc, name, value, record->constant != 0);
+        value_release(&value);
+        if (!ok) {
+            *error = CALC_ERROR_MEMORY;
+            return 0;
+        }
+        set_variable_unit(calc, (int)(find_variable(calc, name) - calc->variables), record->unit);
+    }
+    for (uint64_t i = 0; i < header->var_count; i++) {
+        const SnapshotVariable *record = &vars[i];
+        if (record->definition < 0) continue;
+        const char *formula = snapshot_text(r, record->formula);
+        Program *definition = restore_program(r, header, record->definition, 0, function_count);
+        if (formula == NULL || definition == NULL) {
+            program_free(definition);
+            *error = CALC_ERROR_FORMAT;
+            return 0;
+        }
+        char name[32];
+        memcpy(name, record->name, sizeof(name));
+        name[31] = '\0';
+        int index = (int)(find_variable(calc, name) - calc->variables);
+        int depend_count = 0;
+        int *depends = collect_depends(calc, definition, &depend_count, error);
+        if (depends == NULL) {
+            program_free(definition);
+            return 0;
+        }
+        if (!attach_definition(calc, index, definition, formula, depends, depend_count, error)) return 0;
+    }
+    
+    for (uint64_t i = 0; i < header->history_count; i++) {
+        const char *expression = snapshot_text(r, history[i].expression);
+        Value result;
+        if (expression == NULL || history[i].unit >> (4 * UNIT_BASES) != 0 ||
+            !restore_value(r, &history[i].result, &result)) {
+            *error = CALC_ERROR_FORMAT;
+            return 0;
+        }
+        add_history(calc, expression, result, history[i].unit);
+        value_release(&result);
+    }
+    return 1;
+}
+
+// Replace the session (variables, user functions, history and settings)
+// with a snapshot. The file is mapped rather than read, and is checked in
+// full before the current session is touched.
+int session_load(Calculator *calc, const char *path, CalcError *error) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        *error = CALC_ERROR_IO;
+        return 0;
+    }
+    if ((size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        *error = CALC_ERROR_FORMAT;
+        return 0;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        *error = CALC_ERROR_IO;
+        return 0;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    
+    SnapshotReader reader = {map, st.st_size};
+    const SnapshotHeader *header = map;
+    int ok = 0;
+    Calculator *fresh = NULL;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0 || header->version != SNAPSHOT_VERSION ||
+        header->instruction_size != sizeof(Instruction) ||
+        header->function_table_size != (uint32_t)function_table_size() || header->size != (uint64_t)st.st_size) {
+        *error = CALC_ERROR_FORMAT;
+    } else if ((fresh = malloc(sizeof(Calculator))) == NULL) {
+        *error = CALC_ERROR_MEMORY;
+    } else {
+        init_calculator(fresh);
+        ok = restore_session(fresh, &reader, error);
+    }
+    munmap(map, st.st_size);
+    
+    if (ok) {
+        // Move the session over; calc keeps its plans and thread pool
+        free_session(calc);
+        cache_clear(&calc->cache);
+        calc->variables = fresh->variables;
+        calc->var_count = fresh->var_count;
+        calc->var_capacity = fresh->var_capacity;
+        calc->var_table = fresh->var_table;
+        calc->var_table_size = fresh->var_table_size;
+        calc->unit_count = fresh->unit_count;
+        calc->unit_epoch++;
+        calc->functions = fresh->functions;
+        calc->function_count = fresh->function_count;
+        calc->function_capacity = fresh->function_capacity;
+        memcpy(calc->history, fresh->history, sizeof(calc->history));
+        calc->history_index = fresh->history_index;
+        calc->history_count = fresh->history_count;
+        calc->angle_mode = fresh->angle_mode;
+        calc->precision = fresh->precision;
+        calc->reactive = fresh->reactive;
+        calc->rng_state = fresh->rng_state;
+        update_function_purity(calc);
+        fresh->variables = NULL;
+        fresh->var_table = NULL;
+        fresh->var_count = fresh->var_capacity = fresh->var_table_size = 0;
+        fresh->functions = NULL;
+        fresh->function_count = fresh->function_capacity = 0;
+        for (int i = 0; i < HISTORY_SIZE; i++) {
+            fresh->history[i].expression = NULL;
+            fresh->history[i].result = value_real(0);
+        }
+    }
+    if (fresh != NULL) {
+        free_calculator(fresh);
+        free(fresh);
+    }
+    return ok;
+}
+
+// Script caches. load_script keeps the compiled program of FILE.calc in
+// FILE.calcc: a snapshot-style image holding the bytecode, constants,
+// symbols and line table, keyed by a hash of the script's text. User
+// function calls are stored by name and bound again when the cache is
+// loaded, after the script's own definitions are replayed.
+#define SCRIPT_CACHE_MAGIC "CALCSCRC"
+#define SCRIPT_CACHE_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t instruction_size;
+    uint32_t function_table_size;
+    int32_t call_count;
+    uint64_t source_hash;   // hash_bytes of the script
+    uint64_t source_size;
+    uint64_t unit_hash;     // script_unit_hash when compiled
+    uint64_t size;
+    uint64_t lines;         // Offset of int32_t[code_count]
+    uint64_t calls;         // Offset of char[call_count][32], user functions by name
+    uint64_t definitions;   // String offset, 0 for none
+    SnapshotProgram program;
+} ScriptCacheHeader;
+
+// FILE.calc becomes FILE.calcc, anything else gets .calcc appended
+char* script_cache_path(const char *path) {
+    size_t len = strlen(path);
+    int calc_extension = len >= 5 && strcmp(path + len - 5, ".calc") == 0;
+    char *cache_path = malloc(len + 7);
+    if (cache_path == NULL) return NULL;
+    memcpy(cache_path, path, len);
+    strcpy(cache_path + len, calc_extension ? "c" : ".calcc");
+    return cache_path;
+}
+
+// Units of the variables a program reads, which its compiled units
+// depend on; 0 while none has a unit
+uint64_t script_unit_hash(Calculator *calc, const Program *prog) {
+    uint64_t hash = 0;
+    if (calc->unit_count == 0) return 0;
+    for (int i = 0; i < prog->symbol_count; i++) {
+        Variable *var = find_variable(calc, prog->symbols[i]);
+        if (var != NULL && var->unit != 0) {
+            hash = hash * 1099511628211ULL + ((uint64_t)i << 32 | var->unit);
+        }
+    }
+    return hash;
+}
+
+int script_cache_save(Calculator *calc, const Program *prog, const char *cache_path, uint64_t hash, size_t source_size) {
+    SnapshotWriter w = {NULL, 0, 0, 0};
+    ScriptCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCRIPT_CACHE_MAGIC, 8);
+    header.version = SCRIPT_CACHE_VERSION;
+    header.instruction_size = sizeof(Instruction);
+    header.function_table_size = function_table_size();
+    header.source_hash = hash;
+    header.source_size = source_size;
+    header.unit_hash = script_unit_hash(calc, prog);
+    snapshot_reserve(&w, sizeof(header));
+    
+    // Number the user functions the program calls in order of first use
+    int *call_index = malloc((calc->function_count + 1) * sizeof(int));
+    if (call_index == NULL) return 0;
+    for (int i = 0; i < calc->function_count; i++) call_index[i] = -1;
+    for (int pc = 0; pc < prog->code_count; pc++) {
+        const Instruction *ins = &prog->code[pc];
+        if (ins->op == OP_UCALL && call_index[ins->c] < 0) call_index[ins->c] = header.call_count++;
+    }
+    header.calls = snapshot_reserve(&w, header.call_count * 32);
+    for (int i = 0; i < calc->function_count; i++) {
+        if (call_index[i] >= 0) snapshot_store(&w, header.calls + call_index[i] * 32, calc->functions[i].name, 32);
+    }
+    
+    header.program = snapshot_program(&w, prog);
+    header.lines = snapshot_append(&w, prog->lines, prog->code_count * sizeof(int32_t));
+    if (prog->definitions != NULL) header.definitions = snapshot_string(&w, prog->definitions);
+    if (!w.failed) {
+        Instruction *code = (Instruction *)(w.data + header.program.code);
+        for (int pc = 0; pc < prog->code_count; pc++) {
+            if (code[pc].op == OP_UCALL) code[pc].c = call_index[code[pc].c];
+        }
+    }
+    free(call_index);
+    header.size = w.size;
+    snapshot_store(&w, 0, &header, sizeof(header));
+    int ok = !w.failed && snapshot_write(&w, cache_path);
+    free(w.data);
+    return ok;
+}
+
+// The cached program for a script of the given hash and size, or NULL if
+// the cache is missing, stale, damaged or calls a function that no longer
+// exists; the caller then compiles the script
+Program* script_cache_load(Calculator *calc, const char *cache_path, uint64_t hash, size_t source_size) {
+    int fd = open(cache_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ScriptCacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    
+    SnapshotReader reader = {map, st.st_size};
+    const ScriptCacheHeader *header = map;
+    Program *prog = NULL;
+    const int32_t *lines = NULL;
+    const char (*calls)[32] = NULL;
+    const char *definitions = NULL;
+    if (memcmp(header->magic, SCRIPT_CACHE_MAGIC, 8) == 0 && header->version == SCRIPT_CACHE_VERSION &&
+        header->instruction_size == sizeof(Instruction) &&
+        header->function_table_size == (uint32_t)function_table_size() && header->size == (uint64_t)st.st_size &&
+        header->source_hash == hash && header->source_size == source_size && header->call_count >= 0) {
+        prog = restore_program_record(&reader, &header->program, 0, header->call_count);
+        lines = snapshot_span(&reader, header->lines, header->program.code_count, sizeof(int32_t));
+        calls = snapshot_span(&reader, header->calls, header->call_count, 32);
+        definitions = header->definitions != 0 ? snapshot_text(&reader, header->definitions) : "";
+    }
+    int ok = prog != NULL && lines != NULL && calls != NULL && definitions != NULL &&
+             header->unit_hash == script_unit_hash(calc, prog);
+    if (ok) {
+        prog->lines = malloc(prog->code_count * sizeof(int));
+        prog->definitions = *definitions != '\0' ? strdup(definitions) : NULL;
+        ok = prog->lines != NULL && (*definitions == '\0' || prog->definitions != NULL);
+    }
+    if (ok) memcpy(prog->lines, lines, prog->code_count * sizeof(int));
+    
+    // Replay the script's function definitions, then bind its calls
+    for (const char *p = definitions; ok && *p != '\0'; p += strcspn(p, "\n") + 1) {
+        char *definition = strndup(p, strcspn(p, "\n"));
+        CalcError error = CALC_OK;
+        ok = definition != NULL && define_function(calc, definition, &error) >= 0;
+        free(definition);
+    }
+    int *bound = ok ? malloc((header->call_count + 1) * sizeof(int)) : NULL;
+    ok = ok && bound != NULL;
+    for (int i = 0; ok && i < header->call_count; i++) {
+        char name[32];
+        memcpy(name, calls[i], sizeof(name));
+        name[31] = '\0';
+        bound[i] = find_user_function(calc, name);
+        ok = bound[i] >= 0;
+    }
+    for (int pc = 0; ok && pc < prog->code_count; pc++) {
+        if (prog->code[pc].op == OP_UCALL) prog->code[pc].c = bound[prog->code[pc].c];
+    }
+    free(bound);
+    munmap(map, st.st_size);
+    if (!ok) {
+        program_free(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+// Public API (calc.h)
+
+struct CalcProgram {
+    Calculator *calc;
+    Program *prog;
+};
+
+CalcContext* calc_create(void) {
+    Calculator *calc = malloc(sizeof(Calculator));
+    if (calc != NULL) {
+        init_calculator(calc);
+    }
+    return calc;
+}
+
+void calc_destroy(CalcContext *ctx) {
+    if (ctx == NULL) return;
+    free_calculator(ctx);
+    free(ctx);
+}
+
+void calc_set_degrees(CalcContext *ctx, int degrees) {
+    ctx->angle_mode = degrees ? 1 : 0;
+}
+
+void calc_set_precision(CalcContext *ctx, int precision) {
+    if (precision >= 0 && precision <= 15) {
+        ctx->precision = precision;
+    }
+}
+
+void calc_set_integers(CalcContext *ctx, int exact) {
+    ctx->exact_integers = exact ? 1 : 0;
+}
+
+void calc_seed(CalcContext *ctx, unsigned long long seed) {
+    // xorshift needs a nonzero state
+    ctx->rng_state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+CalcProgram* calc_compile(CalcContext *ctx, const char *expr, const char *const params[], int param_count, CalcError *error) {
+    CalcProgram *program = malloc(sizeof(CalcProgram));
+    if (program == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return NULL;
+    }
+    program->calc = ctx;
+    program->prog = compile_expression(ctx, expr, params, param_count, error);
+    if (program->prog == NULL) {
+        free(program);
+        return NULL;
+    }
+    return program;
+}
+
+// A result as the embedder asked for it: integers become doubles unless
+// the context returns them exact
+CalcValue api_result(CalcContext *ctx, Value v, CalcError *error) {
+    if (ctx->exact_integers || (v.type != CALC_INTEGER && v.type != CALC_BIGINT)) return v;
+    double x = value_to_double(v);
+    value_release(&v);
+    if (isinf(x)) {
+        *error = CALC_ERROR_OVERFLOW;
+        return value_real(0);
+    }
+    return value_real(x);
+}
+
+CalcValue calc_eval(const CalcProgram *prog, const CalcValue bindings[], CalcError *error) {
+    return api_result(prog->calc, program_run(prog->calc, prog->prog, bindings, error), error);
+}
+
+void calc_program_free(CalcProgram *prog) {
+    if (prog == NULL) return;
+    program_free(prog->prog);
+    free(prog);
+}
+
+CalcValue calc_evaluate(CalcContext *ctx, const char *expr, CalcError *error) {
+    return api_result(ctx, evaluate_expression(ctx, expr, error), error);
+}
+
+CalcError calc_define(CalcContext *ctx, const char *definition) {
+    CalcError error = CALC_OK;
+    if (!is_function_definition(definition)) {
+        return CALC_ERROR_SYNTAX;
+    }
+    define_function(ctx, definition, &error);
+    return error;
+}
+
+CalcError calc_set(CalcContext *ctx, const char *name, CalcValue value) {
+    Variable *var = find_variable(ctx, name);
+    if (var != NULL && var->constant) {
+        return CALC_ERROR_ARG_RANGE;
+    }
+    if (var != NULL && var->unit != 0 && var->dependent_count > 0) {
+        return CALC_ERROR_UNITS;
+    }
+    if (!set_variable_value(ctx, name, value, 0)) return CALC_ERROR_MEMORY;
+    set_variable_unit(ctx, (int)(find_variable(ctx, name) - ctx->variables), 0);
+    return CALC_OK;
+}
+
+CalcValue calc_get(CalcContext *ctx, const char *name, CalcError *error) {
+    Variable *var = find_variable(ctx, name);
+    if (var == NULL) {
+        *error = CALC_ERROR_UNKNOWN_VARIABLE;
+        return value_real(0);
+    }
+    if (!refresh_variable(ctx, (int)(var - ctx->variables), error)) {
+        return value_real(0);
+    }
+    return api_result(ctx, value_retain(var->value), error);
+}
+
+CalcValue calc_real(double x) {
+    return value_real(x);
+}
+
+CalcValue calc_complex(double re, double im) {
+    return value_complex(re, im);
+}
+
+CalcValue calc_integer(long long x) {
+    return value_integer(x);
+}
+
+CalcValue calc_vector(const double *re, const double *im, size_t length, CalcError *error) {
+    Vector *vec = vector_new(length, im != NULL);
+    if (vec == NULL) {
+        *error = CALC_ERROR_MEMORY;
+        return value_real(0);
+    }
+    memcpy(vec->re, re, length * sizeof(double));
+    if (im != NULL) {
+        memcpy(vec->im, im, length * sizeof(double));
+    }
+    return value_vector(vec);
+}
+
+CalcValue calc_retain(CalcValue value) {
+    return value_retain(value);
+}
+
+void calc_release(CalcValue *value) {
+    value_release(value);
+}
+
+char* calc_format(CalcContext *ctx, CalcValue value) {
+    char *text = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&text, &size);
+    if (out == NULL) return NULL;
+    fprint_value(out, ctx, value);
+    fclose(out);
+    return text;
+}
+
+const char* calc_error_message(CalcError error) {
+    return error_message(error);
+}
+
+CalcError calc_save(CalcContext *ctx, const char *path) {
+    CalcError error = CALC_OK;
+    session_save(ctx, path, &error);
+    return error;
+}
+
+CalcError calc_load(CalcContext *ctx, const char *path) {
+    CalcError error = CALC_OK;
+    session_load(ctx, path, &error);
+    return error;
+}
+
+CalcError calc_load_sparse(CalcContext *ctx, const char *name, const char *path) {
+    CalcError error = CALC_OK;
+    SparseMatrix *m = sparse_load(path, &error);
+    if (m == NULL) return error;
+    Value v = value_sparse(m);
+    error = calc_set(ctx, name, v);
+    value_release(&v);
+    return error;
+}
+
+void calc_memo_stats(CalcContext *ctx, unsigned long *hits, unsigned long *misses) {
+    *hits = ctx->memo.hits;
+    *misses = ctx->memo.misses;
+}
@@ -0,0 +1,508 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "calc.h"
+
+// Regression tests for the library and the calculator front end. Each test
+// returns the number of checks that failed, after printing them. The grid
+// and session tests run the calculator binary (./calculator unless given):
+//   gcc -O2 -o tests tests.c libcalc.c -lm -pthread
+//   ./tests [CALCULATOR]
+
+const char *calculator_path = "./calculator";
+
+// Evaluate expr in a fresh context and compare its text with expected
+int check_format(const char *expr, const char *expected) {
+    CalcContext *ctx = calc_create();
+    calc_set_integers(ctx, 1);
+    CalcError error = CALC_OK;
+    CalcValue value = calc_evaluate(ctx, expr, &error);
+    char *text = error == CALC_OK ? calc_format(ctx, value) : NULL;
+    int failed = text == NULL || strcmp(text, expected) != 0;
+    if (failed) {
+        printf("FAIL %s: got %s, expected %s\n", expr, text != NULL ? text : calc_error_message(error), expected);
+    }
+    free(text);
+    calc_release(&value);
+    calc_destroy(ctx);
+    return failed;
+}
+
+// Feed lines of input to the calculator and compare its response to the
+// last of them with expected
+int check_session(const char *input, const char *expected) {
+    char path[64], command[512];
+    snprintf(path, sizeof(path), "/tmp/calc-tests-%ld.out", (long)getpid());
+    snprintf(command, sizeof(command), "%s > %s", calculator_path, path);
+    FILE *calculator = popen(command, "w");
+    if (calculator == NULL) {
+        printf("FAIL session: cannot run %s\n", calculator_path);
+        return 1;
+    }
+    fprintf(calculator, "%s\nquit\n", input);
+    pclose(calculator);
+
+    // Each response follows a prompt; the last one answers quit
+    char line[512], response[512] = "", last[512] = "";
+    FILE *in = fopen(path, "r");
+    while (in != NULL && fgets(line, sizeof(line), in) != NULL) {
+        if (strncmp(line, ">> ", 3) != 0) continue;
+        line[strcspn(line, "\n")] = '\0';
+        strcpy(response, last);
+        strcpy(last, line + 3);
+    }
+    if (in != NULL) fclose(in);
+    unlink(path);
+    int failed = strcmp(response, expected) != 0;
+    if (failed) {
+        const char *end = strrchr(input, '\n');
+        printf("FAIL %s: got \"%s\", expected \"%s\"\n", end != NULL ? end + 1 : input, response, expected);
+    }
+    return failed;
+}
+
+// Render expr with the calculator's grid command to a raw float file and
+// compare every pixel with calc_eval at the same point
+int check_grid(const char *expr) {
+    const int width = 70, height = 45;
+    const double x0 = -2, x1 = 1.5, y0 = -1.25, y1 = 1.25;
+    char path[64], command[512];
+    snprintf(path, sizeof(path), "/tmp/calc-tests-%ld.raw", (long)getpid());
+    snprintf(command, sizeof(command), "%s > /dev/null", calculator_path);
+    FILE *calculator = popen(command, "w");
+    if (calculator == NULL) {
+        printf("FAIL grid %s: cannot run %s\n", expr, calculator_path);
+        return 1;
+    }
+    fprintf(calculator, "grid size=%dx%d x=%g:%g y=%g:%g out=%s %s\nquit\n",
+            width, height, x0, x1, y0, y1, path, expr);
+    pclose(calculator);
+
+    float *pixels = malloc((size_t)width * height * sizeof(float));
+    FILE *in = fopen(path, "rb");
+    size_t read = in != NULL && pixels != NULL ? fread(pixels, sizeof(float), (size_t)width * height, in) : 0;
+    if (in != NULL) fclose(in);
+    unlink(path);
+    if (read != (size_t)width * height) {
+        printf("FAIL grid %s: no output\n", expr);
+        free(pixels);
+        return 1;
+    }
+
+    static const char *const params[] = {"x", "y", "z", "c"};
+    CalcContext *ctx = calc_create();
+    CalcError error = CALC_OK;
+    CalcProgram *prog = calc_compile(ctx, expr, params, 4, &error);
+    int failed = 0;
+    for (int j = 0; j < height && prog != NULL && !failed; j++) {
+        for (int i = 0; i < width && !failed; i++) {
+            double x = x0 + i * (x1 - x0) / (width - 1), y = y1 - j * (y1 - y0) / (height - 1);
+            CalcValue bindings[4] = {calc_real(x), calc_real(y), calc_complex(x, y), calc_complex(x, y)};
+            error = CALC_OK;
+            CalcValue value = calc_eval(prog, bindings, &error);
+            double expected = value.type == CALC_COMPLEX ? hypot(value.complex_num.real, value.complex_num.imag) :
+                              value.type == CALC_INTEGER ? (double)value.integer : value.real;
+            calc_release(&value);
+            float got = pixels[(size_t)j * width + i];
+            if (error != CALC_OK || fabsf(got - (float)expected) > 1e-6f * (1 + fabs(expected))) {
+                printf("FAIL grid %s at (%g, %g): got %g, expected %g\n", expr, x, y, got, expected);
+                failed = 1;
+            }
+        }
+    }
+    if (prog == NULL) {
+        printf("FAIL grid %s: %s\n", expr, calc_error_message(error));
+        failed = 1;
+    }
+    calc_program_free(prog);
+    calc_destroy(ctx);
+    free(pixels);
+    return failed;
+}
+
+// Store a real vector in a variable
+void set_vector(CalcContext *ctx, const char *name, const double *x, size_t n) {
+    CalcError error = CALC_OK;
+    CalcValue value = calc_vector(x, NULL, n, &error);
+    calc_set(ctx, name, value);
+    calc_release(&value);
+}
+
+// Largest difference between a vector result and the expected elements
+double vector_error(CalcValue value, const double *re, const double *im, size_t n) {
+    if (value.type != CALC_VECTOR || value.vector->length != n) return INFINITY;
+    double worst = 0;
+    for (size_t i = 0; i < n; i++) {
+        double dr = value.vector->re[i] - re[i];
+        double di = (value.vector->im != NULL ? value.vector->im[i] : 0) - (im != NULL ? im[i] : 0);
+        if (hypot(dr, di) > worst) worst = hypot(dr, di);
+    }
+    return worst;
+}
+
+// Tiles are evaluated as vectors, which must not change what functions
+// that reduce over their arguments see
+int test_grid(void) {
+    int failed = 0;
+    failed += check_grid("x^2 - y");
+    failed += check_grid("abs(z^2 + c)");
+    failed += check_grid("max(x, 0)");
+    failed += check_grid("min(x, y, 0.5)");
+    failed += check_grid("sum(x, y)");
+    failed += check_grid("mean(x, y, 1)");
+    failed += check_grid("x < y");
+    return failed;
+}
+
+// Exact integer sums at the edges of 64 bits, where they continue in a
+// bigint
+int test_integer_sum(void) {
+    int failed = 0;
+    failed += check_format("sum(2^62, 2^62)", "9223372036854775808");
+    failed += check_format("sum(2^63 - 1, 1)", "9223372036854775808");
+    failed += check_format("sum(2^62, 2^62, -1)", "9223372036854775807");
+    failed += check_format("sum(-2^62, -2^62)", "-9223372036854775808");
+    failed += check_format("sum(-2^62, -2^62, -1)", "-9223372036854775809");
+    failed += check_format("sum(2^63 - 1, 1, -2)", "9223372036854775806");
+    failed += check_format("sum(2^64, -2^63, -2^63)", "0");
+    return failed;
+}
+
+// diff of one element is empty and composes with the other kernels. The
+// windowed kernels match a direct pass over each window, including
+// windows wider than the vector
+int test_windows(void) {
+    static const size_t widths[] = {1, 2, 3, 10, 64, 300};
+    const size_t n = 257;
+    int failed = 0;
+    failed += check_format("diff([5])", "[]");
+    failed += check_format("cumsum(diff([5]))", "[]");
+    failed += check_format("fft(diff([5]))", "[]");
+    failed += check_format("diff([1, 4, 9])", "[3, 5]");
+    failed += check_format("cumsum([1, 2, 3])", "[1, 3, 6]");
+    failed += check_format("movmean([1, 2, 3, 4], 2)", "[1, 1.5, 2.5, 3.5]");
+    CalcContext *ctx = calc_create();
+    double *x = malloc(n * sizeof(double)), *lo = malloc(n * sizeof(double));
+    double *hi = malloc(n * sizeof(double)), *mean = malloc(n * sizeof(double));
+    for (size_t i = 0; i < n; i++) x[i] = sin(1.7 * i) * 100 + (i % 5);
+    set_vector(ctx, "v", x, n);
+    for (size_t k = 0; k < sizeof(widths) / sizeof(widths[0]); k++) {
+        size_t w = widths[k];
+        for (size_t i = 0; i < n; i++) {
+            // w / 2 elements before i and (w - 1) / 2 after, cut at the ends
+            size_t first = i < w / 2 ? 0 : i - w / 2, last = i + (w - 1) / 2 >= n ? n - 1 : i + (w - 1) / 2;
+            lo[i] = hi[i] = x[first];
+            mean[i] = 0;
+            for (size_t j = first; j <= last; j++) {
+                lo[i] = fmin(lo[i], x[j]);
+                hi[i] = fmax(hi[i], x[j]);
+                mean[i] += x[j] / (last - first + 1);
+            }
+        }
+        char expr[64];
+        CalcError error = CALC_OK;
+        snprintf(expr, sizeof(expr), "movmin(v, %zu)", w);
+        CalcValue min = calc_evaluate(ctx, expr, &error);
+        snprintf(expr, sizeof(expr), "movmax(v, %zu)", w);
+        CalcValue max = calc_evaluate(ctx, expr, &error);
+        snprintf(expr, sizeof(expr), "movmean(v, %zu)", w);
+        CalcValue avg = calc_evaluate(ctx, expr, &error);
+        if (error != CALC_OK || vector_error(min, lo, NULL, n) != 0 || vector_error(max, hi, NULL, n) != 0 ||
+            vector_error(avg, mean, NULL, n) > 1e-9) {
+            printf("FAIL movmin, movmax or movmean with window %zu\n", w);
+            failed++;
+        }
+        calc_release(&min);
+        calc_release(&max);
+        calc_release(&avg);
+    }
+    free(x);
+    free(lo);
+    free(hi);
+    free(mean);
+    calc_destroy(ctx);
+    return failed;
+}
+
+// Cached programs see the current values of variables and are dropped
+// when a function they call is redefined
+int test_cache(void) {
+    int failed = 0;
+    failed += check_session("z1 = 2\nz1 * 5\nz1 = 4\nz1 * 5", "= 20");
+    failed += check_session("f(t) = t\nf(2) + 1\nf(t) = t*3\nf(2) + 1", "= 7");
+    failed += check_session("f(t) = t\nf(2) + 1\ng(t) = t*3\nf(2) + 1", "= 3");
+    return failed;
+}
+
+// Reactive formulas recompute through chains of variables in order, an
+// assignment that would close a cycle is rejected and leaves the graph as
+// it was, and 'reactive off' keeps the current values
+int test_reactive(void) {
+    const char *chain = "reactive on\nbase = 2\nstep = base + 1\ntotal = step * base";
+    char input[512];
+    int failed = 0;
+    snprintf(input, sizeof(input), "%s\nbase = 10\ntotal", chain);
+    failed += check_session(input, "= 110");
+    snprintf(input, sizeof(input), "%s\nstep = 7\nbase = 3\ntotal", chain);
+    failed += check_session(input, "= 21");
+    snprintf(input, sizeof(input), "%s\nbase = total + 1", chain);
+    failed += check_session(input, "Error: Circular definition");
+    snprintf(input, sizeof(input), "%s\nbase = total + 1\nbase = 4\ntotal", chain);
+    failed += check_session(input, "= 20");
+    snprintf(input, sizeof(input), "%s\nreactive off\nbase = 100\ntotal", chain);
+    failed += check_session(input, "= 6");
+    return failed;
+}
+
+// Reactive formulas follow the variables read in the bodies of the
+// functions they call, and redefining a function recomputes them
+int test_reactive_functions(void) {
+    int failed = 0;
+    failed += check_session("reactive on\na = 2\ng(t) = t*a\nw = g(2)\na = 5\nw", "= 10");
+    failed += check_session("reactive on\na = 2\ng(t) = t*a\nw = g(2)\ng(t) = t*a*10\nw", "= 40");
+    failed += check_session("reactive on\na = 2\nb = 1\ng(t) = t*a\nw = g(2)\ng(t) = t*b\nb = 3\nw", "= 6");
+    failed += check_session("reactive on\na = 2\ng(t) = t*a\nw = g(2)\ng(t) = t*w", "Error: Circular definition");
+    return failed;
+}
+
+// A user function's unit follows the units of the variables its body
+// reads, not those they had when it was defined
+int test_units_functions(void) {
+    int failed = 0;
+    failed += check_session("x = 3 m\nf(t) = t*x\nf(2)", "= 6 m");
+    failed += check_session("x = 3 m\nf(t) = t*x\nx = 4 s\nf(2)", "= 8 s");
+    failed += check_session("x = 3 m\nf(t) = t*x\nx = 4 s\nf(2) + 1 s", "= 9 s");
+    failed += check_session("x = 3 m\nf(t) = t*x\nx = 4 s\nf(2) + 1 m", "Error: Incompatible units");
+    failed += check_session("x = 3 m\nf(t) = t*x\ng(t) = f(t)^2\nx = 2 kg\ng(1)", "= 4 kg^2");
+    return failed;
+}
+
+// A session saved by one calculator comes back whole in another:
+// variables with their units and reactive formulas, user functions and
+// vectors. A damaged snapshot is rejected and the current session kept
+int test_sessions(void) {
+    char path[64], input[512];
+    snprintf(path, sizeof(path), "/tmp/calc-tests-%ld.session", (long)getpid());
+    int failed = 0;
+    snprintf(input, sizeof(input), "reactive on\nn = 4\nlen = n * 3 m\nf(t) = t^2 + n\nv = [1, 2, 3]\nsave %s\nlen", path);
+    failed += check_session(input, "= 12 m");
+    snprintf(input, sizeof(input), "load %s\nlen", path);
+    failed += check_session(input, "= 12 m");
+    snprintf(input, sizeof(input), "load %s\nn = 5\nlen", path);
+    failed += check_session(input, "= 15 m");
+    snprintf(input, sizeof(input), "load %s\nf(2)", path);
+    failed += check_session(input, "= 8");
+    snprintf(input, sizeof(input), "load %s\nsum(v)", path);
+    failed += check_session(input, "= 6");
+    snprintf(input, sizeof(input), "load %s\nlen + 1 s", path);
+    failed += check_session(input, "Error: Incompatible units");
+    if (truncate(path, 100) == 0) {
+        snprintf(input, sizeof(input), "n = 9\nload %s\nn", path);
+        failed += check_session(input, "= 9");
+    }
+    unlink(path);
+    return failed;
+}
+
+// ifft(fft(v)) gives v back, rfft matches the first half of fft and conv
+// matches the direct sum, for smooth and Bluestein lengths; more lengths
+// than the plan cache holds are cycled through twice
+int test_fft(void) {
+    static const size_t lengths[] = {1, 2, 3, 4, 7, 12, 45, 97, 128, 1000, 1009, 4096};
+    CalcContext *ctx = calc_create();
+    int failed = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t n = 40; n < 80; n++) {
+            CalcError error = CALC_OK;
+            double *x = malloc(n * sizeof(double));
+            for (size_t i = 0; i < n; i++) x[i] = sin(0.3 * i) + 0.1 * i;
+            set_vector(ctx, "v", x, n);
+            CalcValue back = calc_evaluate(ctx, "ifft(fft(v))", &error);
+            if (error != CALC_OK || vector_error(back, x, NULL, n) > 1e-9) {
+                printf("FAIL ifft(fft(v)) for length %zu, pass %d\n", n, pass);
+                failed++;
+            }
+            calc_release(&back);
+            free(x);
+        }
+    }
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        size_t n = lengths[l], m = n + 40;
+        CalcError error = CALC_OK;
+        double *x = malloc(n * sizeof(double)), *y = malloc(40 * sizeof(double));
+        double *re = calloc(m, sizeof(double)), *im = calloc(m, sizeof(double));
+        for (size_t i = 0; i < n; i++) x[i] = cos(0.7 * i) - 0.01 * i;
+        for (size_t i = 0; i < 40; i++) y[i] = 1.0 / (i + 1);
+        set_vector(ctx, "v", x, n);
+        set_vector(ctx, "w", y, 40);
+
+        CalcValue back = calc_evaluate(ctx, "ifft(fft(v))", &error);
+        if (error != CALC_OK || vector_error(back, x, NULL, n) > 1e-9) {
+            printf("FAIL ifft(fft(v)) for length %zu\n", n);
+            failed++;
+        }
+        CalcValue full = calc_evaluate(ctx, "fft(v)", &error);
+        CalcValue half = calc_evaluate(ctx, "rfft(v)", &error);
+        if (error != CALC_OK || vector_error(half, full.vector->re, full.vector->im, n / 2 + 1) > 1e-9 * n) {
+            printf("FAIL rfft(v) for length %zu\n", n);
+            failed++;
+        }
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = 0; j < 40; j++) re[i + j] += x[i] * y[j];
+        }
+        CalcValue product = calc_evaluate(ctx, "conv(v, w)", &error);
+        if (error != CALC_OK || vector_error(product, re, im, m - 1) > 1e-9 * n) {
+            printf("FAIL conv(v, w) for length %zu\n", n);
+            failed++;
+        }
+        calc_release(&back);
+        calc_release(&full);
+        calc_release(&half);
+        calc_release(&product);
+        free(x);
+        free(y);
+        free(re);
+        free(im);
+    }
+    calc_destroy(ctx);
+    return failed;
+}
+
+// sort, argsort and rank agree with each other and with a direct check of
+// order and stability, both below and above the size where sorting
+// switches to the parallel radix sort
+int test_sort(void) {
+    static const size_t lengths[] = {5, 1000, 8191, 8192, 600000};
+    int failed = 0;
+    failed += check_format("sort([3, -0, 0, -1])", "[-1, 0, 0, 3]");
+    failed += check_format("argsort([2, 1, 2, 0])", "[4, 2, 1, 3]");
+    failed += check_format("rank([10, 20, 10])", "[1.5, 3, 1.5]");
+    failed += check_format("unique([3, 1, 3, 0, -0])", "[0, 1, 3]");
+    failed += check_format("median([4, 1, 3, 2])", "2.5");
+    CalcContext *ctx = calc_create();
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        size_t n = lengths[l];
+        CalcError error = CALC_OK;
+        double *x = malloc(n * sizeof(double));
+        for (size_t i = 0; i < n; i++) x[i] = (double)((i * 2654435761u) % 1000) - 500 + (i % 7 == 0 ? 0.25 : 0);
+        set_vector(ctx, "v", x, n);
+        CalcValue sorted = calc_evaluate(ctx, "sort(v)", &error);
+        CalcValue order = calc_evaluate(ctx, "argsort(v)", &error);
+        int bad = error != CALC_OK || sorted.type != CALC_VECTOR || order.type != CALC_VECTOR ||
+                  sorted.vector->length != n || order.vector->length != n;
+        for (size_t i = 0; i < n && !bad; i++) {
+            size_t at = (size_t)order.vector->re[i] - 1;
+            bad = at >= n || x[at] != sorted.vector->re[i] ||
+                  (i > 0 && (sorted.vector->re[i - 1] > sorted.vector->re[i] ||
+                             (sorted.vector->re[i - 1] == sorted.vector->re[i] && order.vector->re[i - 1] >= order.vector->re[i])));
+        }
+        if (bad) {
+            printf("FAIL sort(v) and argsort(v) for length %zu\n", n);
+            failed++;
+        }
+        calc_release(&sorted);
+        calc_release(&order);
+        free(x);
+    }
+    calc_destroy(ctx);
+    return failed;
+}
+
+// groupby and hist on small inputs, and groupby over rows enough for
+// several chunk tables against sums and counts taken directly
+int test_groupby(void) {
+    const size_t n = 100000, keys = 8;
+    int failed = 0;
+    failed += check_format("groupby([1, 2, 1, 3], [10, 20, 30, 40], mean)", "[[1, 20], [2, 20], [3, 40]]");
+    failed += check_format("groupby([2, 1, 2], [5, 7, 9], max)", "[[1, 7], [2, 9]]");
+    failed += check_format("hist([1, 2, 2, 3], [0, 2, 4])", "[[0, 2, 1], [2, 4, 3]]");
+    CalcContext *ctx = calc_create();
+    CalcError error = CALC_OK;
+    double *k = malloc(n * sizeof(double)), *v = malloc(n * sizeof(double));
+    double sums[8] = {0}, counts[8] = {0};
+    for (size_t i = 0; i < n; i++) {
+        size_t key = (i * 7919) % keys;
+        k[i] = (double)key * 2 - 30;
+        v[i] = (double)(i % 11);
+        sums[key] += v[i];
+        counts[key]++;
+    }
+    set_vector(ctx, "key", k, n);
+    set_vector(ctx, "v", v, n);
+    // Matrices are opaque, so the rows are compared as text
+    char *expected_sum = malloc(keys * 64), *expected_count = malloc(keys * 64);
+    size_t at_sum = 0, at_count = 0;
+    for (size_t key = 0; key < keys; key++) {
+        at_sum += sprintf(expected_sum + at_sum, "%s[%g, %g]", key > 0 ? ", " : "[", (double)key * 2 - 30, sums[key]);
+        at_count += sprintf(expected_count + at_count, "%s[%g, %g]", key > 0 ? ", " : "[", (double)key * 2 - 30, counts[key]);
+    }
+    strcpy(expected_sum + at_sum, "]");
+    strcpy(expected_count + at_count, "]");
+    CalcValue sum = calc_evaluate(ctx, "groupby(key, v, sum)", &error);
+    CalcValue count = calc_evaluate(ctx, "groupby(key, v, count)", &error);
+    char *got_sum = error == CALC_OK ? calc_format(ctx, sum) : NULL;
+    char *got_count = error == CALC_OK ? calc_format(ctx, count) : NULL;
+    if (got_sum == NULL || got_count == NULL || strcmp(got_sum, expected_sum) != 0 || strcmp(got_count, expected_count) != 0) {
+        printf("FAIL groupby(key, v, sum) and groupby(key, v, count) over %zu rows\n", n);
+        failed++;
+    }
+    free(expected_sum);
+    free(expected_count);
+    free(got_sum);
+    free(got_count);
+    calc_release(&sum);
+    calc_release(&count);
+    free(k);
+    free(v);
+    calc_destroy(ctx);
+    return failed;
+}
+
+// Without calc_set_integers the API returns integer results as doubles
+int test_api_integers(void) {
+    CalcContext *ctx = calc_create();
+    CalcError error = CALC_OK;
+    CalcValue small = calc_evaluate(ctx, "1 + 2", &error);
+    CalcValue large = calc_evaluate(ctx, "2^70", &error);
+    int failed = error != CALC_OK || small.type != CALC_REAL || small.real != 3 ||
+                 large.type != CALC_REAL || large.real != 0x1p70;
+    calc_set_integers(ctx, 1);
+    CalcValue exact = calc_evaluate(ctx, "1 + 2", &error);
+    failed += exact.type != CALC_INTEGER || exact.integer != 3;
+    if (failed) printf("FAIL integer results at the API\n");
+    calc_release(&large);
+    calc_destroy(ctx);
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) calculator_path = argv[1];
+
+    struct {
+        const char *name;
+        int (*run)(void);
+    } tests[] = {
+        {"integer sum", test_integer_sum},
+        {"api integers", test_api_integers},
+        {"groupby", test_groupby},
+        {"sort", test_sort},
+        {"windows", test_windows},
+        {"cache", test_cache},
+        {"reactive", test_reactive},
+        {"reactive functions", test_reactive_functions},
+        {"units in functions", test_units_functions},
+        {"fft", test_fft},
+        {"sessions", test_sessions},
+        {"grid", test_grid},
+    };
+    int count = (int)(sizeof(tests) / sizeof(tests[0])), failed = 0;
+    for (int i = 0; i < count; i++) {
+        int failures = tests[i].run();
+        printf("%-20s %s\n", tests[i].name, failures == 0 ? "ok" : "FAILED");
+        failed += failures > 0;
+    }
+    printf("%d of %d tests passed\n", count - failed, count);
+    return failed > 0;
+}